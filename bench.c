@@ -0,0 +1,1204 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "harness.h"
+#include "trace.h"
+
+//
+// Benchmarks of the note store
+//
+// Builds synthetic stores of 1k, 10k and 100k notes (or the counts given
+// on the command line) in a scratch directory and times save, load with a
+// warm and a cold page cache, lookup and delete for plain and compressed
+// loose files and for the pack store, followed by the line ending and
+// Unicode kernels, body compression, opening large notes, the edit
+// journal, the body cache, version history, the search index, archives,
+// the list order, the note registry and trace events. Results that do not check out are
+// reported on stderr and make hbench exit with 1, make test runs the
+// correctness checks of test.c.
+//
+// Usage: hbench [-d scratchdir] [-t trace.json] [-s stats.txt] [count...]
+//
+
+#define BENCH_DEFAULT_DIR "hbench-data"
+#define BENCH_LOOKUPS 1000000
+#define BENCH_BODY_READS 1000
+#define BENCH_SEARCH_NOTES 50000  // The store size the query budget of 1 ms is set for
+#define BENCH_REGISTRY_NOTES 100000
+
+static double Seconds() {
+  struct timespec ts;
+  timespec_get(&ts,TIME_UTC);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned int benchSeed = 12345;
+
+static unsigned int NextRandom() {
+  benchSeed = benchSeed * 1103515245u + 12345u;
+  return benchSeed >> 8;
+}
+
+static const char* BENCH_WORDS[] = {
+  "note","list","window","save","load","catalog","pack","record","header",
+  "text","line","error","warning","debug","request","retry","timeout","queue"
+};
+
+// Text of roughly size bytes in lines of words, with CRLF or LF breaks
+static size_t FillText(char* text, size_t size, int crlf) {
+  size_t len = 0, line = 0;
+  while(len + 16 < size) {
+    const char* word = BENCH_WORDS[NextRandom() % (sizeof(BENCH_WORDS) / sizeof(BENCH_WORDS[0]))];
+    size_t wordLength = strlen(word);
+    memcpy(text + len,word,wordLength);
+    len += wordLength;
+    line += wordLength;
+
+    if(line > 60 + NextRandom() % 40) {
+      if(crlf) text[len++] = '\r';
+      text[len++] = '\n';
+      line = 0;
+    }
+    else text[len++] = ' ';
+  }
+  text[len] = '\0';
+  return len;
+}
+
+// Log lines with timestamps and ids, what users paste into notes
+static size_t FillLog(char* text, size_t size) {
+  size_t len = 0;
+  while(len + 160 < size) {
+    unsigned int t = NextRandom();
+    len += sprintf(text + len,"2026-10-%02u %02u:%02u:%02u.%03u [worker-%u] %s %s %u: %s %s\n",
+                   1 + t % 28,t % 24,(t >> 5) % 60,(t >> 11) % 60,NextRandom() % 1000,NextRandom() % 8,
+                   BENCH_WORDS[NextRandom() % 18],BENCH_WORDS[NextRandom() % 18],NextRandom() % 100000,
+                   BENCH_WORDS[NextRandom() % 18],BENCH_WORDS[NextRandom() % 18]);
+  }
+  text[len] = '\0';
+  return len;
+}
+
+// Checks that fail are reported here, hbench exits with 1 if there were any
+static int benchFailures = 0;
+
+static void Mismatch(const char* format, ...) {
+  va_list args;
+  va_start(args,format);
+  vfprintf(stderr,format,args);
+  va_end(args);
+  benchFailures++;
+}
+
+static void Report(const char* store, size_t count, const char* what, double seconds, size_t operations) {
+  printf("%-6s %7zu  %-14s %9.1f ms  %9.0f ops/s\n",store,count,what,seconds * 1e3,seconds > 0 ? operations / seconds : 0.0);
+  fflush(stdout);
+}
+
+static int SumScratchFile(const char* name, unsigned long long size, unsigned long long mtime, void* context) {
+  *(unsigned long long*)context += size;
+  return 1;
+}
+
+// Loads the store twice, once as it is and once after dropping it out of
+// the page cache, the way the first start after a reboot finds it. The
+// directory entries stay cached, so the cold load is still a little warm.
+static void BenchLoad(const char* store, size_t count, const char* warm, const char* cold) {
+  for(int evict = 0; evict < 2; ++evict) {
+    if(evict && !EvictScratchDir()) {
+      printf("%-6s %7zu  %-14s page cache could not be dropped\n",store,count,cold);
+      break;
+    }
+
+    ResetNoteStore();
+    double start = Seconds();
+    size_t loaded = LoadAllNotes();
+    Report(store,count,evict ? cold : warm,Seconds() - start,loaded);
+    if(loaded != count) Mismatch("%s: loaded %zu of %zu notes\n",evict ? cold : warm,loaded,count);
+  }
+}
+
+static void BenchStore(const char* store, int packed, size_t count) {
+  ClearScratchDir(0);
+  ResetNoteStore();
+  if(packed && !CreatePack()) {
+    Mismatch("could not create a pack in %s\n",NOTESPATH);
+    return;
+  }
+
+  char* text = malloc(4096);
+  NoteId* ids = malloc(sizeof(NoteId) * count);
+  if(!text || !ids) exit(1);
+
+  // Save: every note written once through the background writer
+  StartSaveWriter();
+  double start = Seconds();
+  for(size_t i = 0; i < count; ++i) {
+    size_t len = FillText(text,128 + NextRandom() % 3000,0);
+    ids[i] = SaveTestNote((Note){.x = 10, .y = 10, .width = 300, .height = 300, .catalogSlot = -1},"",i,text,len)->id;
+  }
+  WaitForAllSaves();
+  Report(store,count,"save",Seconds() - start,count);
+  DrainSaveQueue(NULL,NULL,WAIT_FOREVER);
+
+  // Load: from scratch, then again with a catalog that matches the files,
+  // each from the page cache and from the disk
+  ResetNoteStore();
+  if(!packed) {
+    char path[MAX_PATH + 1];
+    snprintf(path,sizeof(path),"%s" PATH_SEPARATOR "catalog.hcat",NOTESPATH);
+    FileDelete(path);
+  }
+
+  if(packed) BenchLoad(store,count,"load","load (cold)");
+  else BenchLoad(store,count,"load (probe)","cold (probe)");
+
+  if(!packed) {
+    StartSaveWriter();
+    SyncCatalog();
+    DrainSaveQueue(NULL,NULL,WAIT_FOREVER);
+    BenchLoad(store,count,"load (catalog)","cold (catalog)");
+  }
+
+  // Lookup: registry handles, then whole bodies from disk
+  size_t slots = noteRegistry.slotCount;
+  for(size_t i = 0; i < count && i < slots; ++i) ids[i] = NoteAtSlot(i) ? NoteAtSlot(i)->id : INVALID_NOTEID;
+
+  start = Seconds();
+  size_t found = 0;
+  for(size_t i = 0; i < BENCH_LOOKUPS; ++i) found += Find(ids[NextRandom() % count]) != NULL;
+  Report(store,count,"lookup",Seconds() - start,BENCH_LOOKUPS);
+  if(found != BENCH_LOOKUPS) Mismatch("found %zu of %d lookups\n",found,BENCH_LOOKUPS);
+
+  start = Seconds();
+  for(size_t i = 0; i < BENCH_BODY_READS; ++i) {
+    Note* note = Find(ids[NextRandom() % count]);
+    long length = 0;
+    free(note ? ReadNoteBody(note->filename,&length) : NULL);
+  }
+  Report(store,count,"read body",Seconds() - start,BENCH_BODY_READS);
+
+  // Delete: half of the notes one by one, the rest as one batch
+  StartSaveWriter();
+  size_t half = count / 2;
+  start = Seconds();
+  for(size_t i = 0; i < half; ++i) {
+    Note* note = Find(ids[i]);
+    if(!note) continue;
+
+    DeleteNoteFromDisk(NOTESPATH,note);
+    Remove(note->id);
+  }
+  WaitForAllSaves();
+  Report(store,count,"delete",Seconds() - start,half);
+
+  Note** batch = malloc(sizeof(Note*) * (count - half + 1));
+  if(!batch) exit(1);
+
+  start = Seconds();
+  size_t batchCount = 0;
+  for(size_t i = half; i < count; ++i)
+    if(Find(ids[i])) batch[batchCount++] = Find(ids[i]);
+  DeleteNotesFromDisk(NOTESPATH,batch,batchCount);
+  for(size_t i = 0; i < batchCount; ++i) Remove(batch[i]->id);
+  WaitForAllSaves();
+  Report(store,count,"delete (batch)",Seconds() - start,batchCount);
+  DrainSaveQueue(NULL,NULL,WAIT_FOREVER);
+  free(batch);
+
+  size_t left = CountNoteFiles();
+  if(left) Mismatch("%zu note files left after deleting\n",left);
+
+  free(ids);
+  free(text);
+}
+
+// A store of the flat layout, a hundredth of it under names too long for
+// the store, is moved into shards by the first load, the second load finds
+// the notes there
+static void BenchShards(size_t count) {
+  ClearScratchDir(0);
+  ResetNoteStore();
+
+  char* text = malloc(4096);
+  if(!text) exit(1);
+
+  char path[MAX_PATH + 1];
+  unsigned long long mtime;
+  for(size_t i = 0; i < count; ++i) {
+    size_t len = FillText(text,128 + NextRandom() % 3000,0);
+    NoteHeader header = {.magic = NOTE_MAGIC, .version = NOTE_VERSION_PLAIN, .headerSize = sizeof(NoteHeader),
+                         .x = 10, .y = 10, .width = 300, .height = 300, .bodyLength = (unsigned int)len};
+    if(i % 100) snprintf(path,sizeof(path),"%s" PATH_SEPARATOR "%08zu" NOTE_EXTENSION,NOTESPATH,i);
+    else snprintf(path,sizeof(path),"%s" PATH_SEPARATOR "long note name %08zu" NOTE_EXTENSION,NOTESPATH,i);
+    if(!WriteNoteFileAtomically(path,&header,text,&mtime)) exit(1);
+  }
+  free(text);
+
+  double start = Seconds();
+  size_t loaded = LoadAllNotes();
+  Report("shards",count,"migrate + load",Seconds() - start,loaded);
+  if(loaded != count) Mismatch("loaded %zu of %zu notes after migrating\n",loaded,count);
+
+  StartSaveWriter();
+  SyncCatalog();
+  DrainSaveQueue(NULL,NULL,WAIT_FOREVER);
+  ResetNoteStore();
+
+  start = Seconds();
+  loaded = LoadAllNotes();
+  Report("shards",count,"load (catalog)",Seconds() - start,loaded);
+  if(loaded != count) Mismatch("loaded %zu of %zu notes from shards\n",loaded,count);
+  ResetNoteStore();
+}
+
+static void BenchLineEndings() {
+  size_t size = 16 << 20;
+  char* crlf = malloc(size + 1);
+  char* lf = malloc(size + 1);
+  char* back = malloc(size * 2 + 1);
+  if(!crlf || !lf || !back) exit(1);
+
+  size_t len = FillText(crlf,size,1);
+  double mb = len / 1048576.0;
+
+  double start = Seconds();
+  size_t lfLength = CrlfToLf(lf,crlf,len);
+  double seconds = Seconds() - start;
+  printf("eol    %5.0f MB  %-14s %9.1f ms  %9.0f MB/s\n",mb,"crlf to lf",seconds * 1e3,mb / seconds);
+
+  start = Seconds();
+  size_t lone = CountLoneLf(lf,lfLength);
+  size_t backLength = LfToCrlf(back,lf,lfLength);
+  seconds = Seconds() - start;
+  printf("eol    %5.0f MB  %-14s %9.1f ms  %9.0f MB/s\n",mb,"lf to crlf",seconds * 1e3,mb / seconds);
+
+  if(backLength != lfLength + lone || backLength != len || memcmp(back,crlf,len) != 0)
+    Mismatch("line endings did not round trip\n");
+
+  free(back);
+  free(lf);
+  free(crlf);
+}
+
+// Words of several scripts, 1 to 4 bytes a character in UTF-8
+static const char* BENCH_UNICODE_WORDS[] = {
+  "note","window","save","заметка","сохранить","σημείωση","笔记","保存","ノート",
+  "メモ","메모","저장","नोट","ملاحظة","café","naïve","✓","😀"
+};
+
+// Like FillText, with the words of BENCH_UNICODE_WORDS
+static size_t FillUnicodeText(char* text, size_t size) {
+  size_t len = 0, line = 0;
+  while(len + 16 < size) {
+    const char* word = BENCH_UNICODE_WORDS[NextRandom() % (sizeof(BENCH_UNICODE_WORDS) / sizeof(BENCH_UNICODE_WORDS[0]))];
+    size_t wordLength = strlen(word);
+    memcpy(text + len,word,wordLength);
+    len += wordLength;
+    line += wordLength;
+
+    if(line > 60 + NextRandom() % 40) {
+      text[len++] = '\n';
+      line = 0;
+    }
+    else text[len++] = ' ';
+  }
+  text[len] = '\0';
+  return len;
+}
+
+// UTF-8 validation and both conversions on English and on mixed script
+// text, then what converting for the window adds to opening and saving a
+// large note
+static void BenchUnicode() {
+  size_t size = 16 << 20;
+  char* text = malloc(size + 1);
+  char* back = malloc(3 * size + 1);
+  unsigned short* wide = malloc(size * sizeof(unsigned short));
+  if(!text || !back || !wide) exit(1);
+
+  // Touched once so the kernels are timed rather than page faults
+  memset(back,0,3 * size + 1);
+  memset(wide,0,size * sizeof(unsigned short));
+
+  for(int mixed = 0; mixed < 2; ++mixed) {
+    const char* script = mixed ? "mixed" : "ascii";
+    char what[32];
+    size_t len = mixed ? FillUnicodeText(text,size) : FillText(text,size,0);
+    double mb = len / 1048576.0;
+
+    double start = Seconds();
+    int valid = IsValidUtf8(text,len);
+    double seconds = Seconds() - start;
+    snprintf(what,sizeof(what),"%s check",script);
+    printf("utf8   %5.0f MB  %-14s %9.1f ms  %9.0f MB/s\n",mb,what,seconds * 1e3,mb / seconds);
+
+    start = Seconds();
+    size_t units = Utf8ToUtf16(wide,text,len);
+    seconds = Seconds() - start;
+    snprintf(what,sizeof(what),"%s to utf16",script);
+    printf("utf8   %5.0f MB  %-14s %9.1f ms  %9.0f MB/s\n",mb,what,seconds * 1e3,mb / seconds);
+
+    start = Seconds();
+    size_t backLength = units == (size_t)-1 ? 0 : Utf16ToUtf8(back,wide,units);
+    seconds = Seconds() - start;
+    snprintf(what,sizeof(what),"%s to utf8",script);
+    printf("utf8   %5.0f MB  %-14s %9.1f ms  %9.0f MB/s\n",mb,what,seconds * 1e3,mb / seconds);
+
+    if(!valid || backLength != len || memcmp(back,text,len) != 0)
+      Mismatch("%s text did not round trip\n",script);
+  }
+
+  // Opening reads the note and converts it for the edit, saving converts
+  // the edit's text back and writes it
+  ClearScratchDir(0);
+  ResetNoteStore();
+
+  size_t len = FillUnicodeText(text,size);
+  double mb = len / 1048576.0;
+  Note* note = Insert((Note){.catalogSlot = -1});
+  snprintf(note->filename,sizeof(note->filename),"unicode" NOTE_EXTENSION);
+
+  char* body = malloc(len + 1);
+  if(!body) exit(1);
+  memcpy(body,text,len + 1);
+  double start = Seconds();
+  SaveNote(note,body,len);
+  WaitForAllSaves();
+  double save = Seconds() - start;
+
+  start = Seconds();
+  size_t units = Utf8ToUtf16(wide,text,len);
+  size_t backLength = Utf16ToUtf8(back,wide,units);
+  double saveConvert = Seconds() - start;
+
+  BODYCACHEBYTES = 0;
+  start = Seconds();
+  long length = 0;
+  body = ReadNoteText(note,&length);
+  body = body ? ToEditText(body,length) : NULL;
+  double open = Seconds() - start;
+  if(!body) exit(1);
+
+  start = Seconds();
+  units = Utf8ToUtf16(wide,body,strlen(body));
+  double openConvert = Seconds() - start;
+  BODYCACHEBYTES = BODY_CACHE_BYTES;
+
+  // saveConvert timed both directions, the save pays for one
+  saveConvert /= 2;
+  printf("utf8   %5.0f MB  %-14s %9.1f ms  %+8.1f %%\n",mb,"open note",(open + openConvert) * 1e3,openConvert / open * 100);
+  printf("utf8   %5.0f MB  %-14s %9.1f ms  %+8.1f %%\n",mb,"save note",(save + saveConvert) * 1e3,saveConvert / save * 100);
+
+  if(units == (size_t)-1 || backLength != len) Mismatch("large note did not convert\n");
+
+  free(body);
+  free(wide);
+  free(back);
+  free(text);
+}
+
+// Typing into a large note: small edits through the journal against
+// rewriting the whole note for each, a replay of what is on disk, then
+// edits the way the window of a large note hands them over
+static void BenchJournal(size_t size, size_t edits) {
+  ClearScratchDir(0);
+  ResetNoteStore();
+  StartSaveWriter();
+  BODYCACHEBYTES = 0;  // Replay reads the journal, not a cached body
+
+  char* text = malloc(size + edits * 16 + 1);
+  char* before = malloc(size + edits * 16 + 1);
+  if(!text || !before) exit(1);
+
+  size_t len = FillText(text,size,0);
+  Note* note = Insert((Note){.catalogSlot = -1});
+  snprintf(note->filename,sizeof(note->filename),"journal" NOTE_EXTENSION);
+  JournalNoteEdit(note,NULL,0,text,len);
+  WaitForAllSaves();
+
+  double mb = len / 1048576.0;
+  double start = Seconds();
+  for(size_t i = 0; i < edits; ++i) {
+    memcpy(before,text,len);
+    size_t at = NextRandom() % len;
+    memmove(text + at + 5,text + at,len - at);
+    memcpy(text + at,"edit ",5);
+    len += 5;
+    JournalNoteEdit(note,before,len - 5,text,len);
+    WaitForAllSaves();
+  }
+  double seconds = Seconds() - start;
+  printf("journal %4.0f MB  %-14s %9.1f ms  %9.0f ops/s\n",mb,"edit",seconds * 1e3,edits / seconds);
+
+  start = Seconds();
+  for(size_t i = 0; i < edits / 50; ++i) {
+    char* body = malloc(len + 1);
+    if(!body) exit(1);
+    memcpy(body,text,len + 1);
+    SaveNote(note,body,len);
+    WaitForAllSaves();
+  }
+  seconds = Seconds() - start;
+  printf("journal %4.0f MB  %-14s %9.1f ms  %9.0f ops/s\n",mb,"full save",seconds * 1e3,(edits / 50) / seconds);
+
+  // Leave a journal behind and read it back
+  for(size_t i = 0; i < 100; ++i) {
+    memcpy(before,text,len);
+    size_t at = NextRandom() % len;
+    text[at] = 'x';
+    JournalNoteEdit(note,before,len,text,len);
+  }
+  WaitForAllSaves();
+
+  start = Seconds();
+  long length = 0;
+  char* replayed = ReadNoteText(note,&length);
+  seconds = Seconds() - start;
+  printf("journal %4.0f MB  %-14s %9.1f ms  %9d records\n",mb,"replay",seconds * 1e3,note->journalRecords);
+  if(!replayed || (size_t)length != len || memcmp(replayed,text,len) != 0)
+    Mismatch("journal replay does not match the edited text\n");
+
+  free(replayed);
+
+  // What a window this large does when typing pauses: a copy of its text
+  // for the writer, which finds the change against what it wrote last.
+  // The tick is the time taken on the UI thread.
+  double ticks = 0;
+  start = Seconds();
+  for(size_t i = 0; i < edits; ++i) {
+    size_t at = NextRandom() % len;
+    memmove(text + at + 5,text + at,len - at + 1);
+    memcpy(text + at,"typed",5);
+    len += 5;
+
+    double tick = Seconds();
+    char* copy = malloc(len + 1);
+    if(!copy) exit(1);
+    memcpy(copy,text,len + 1);
+    JournalNoteText(note,copy,len);
+    ticks += Seconds() - tick;
+    WaitForAllSaves();
+  }
+  seconds = Seconds() - start;
+  printf("journal %4.0f MB  %-14s %9.3f ms per tick  %9.0f ops/s\n",mb,"window tick",ticks * 1e3 / edits,edits / seconds);
+
+  replayed = ReadNoteText(note,&length);
+  if(!replayed || (size_t)length != len || memcmp(replayed,text,len) != 0)
+    Mismatch("journal of the window does not match the edited text\n");
+
+  free(replayed);
+  DrainSaveQueue(NULL,NULL,WAIT_FOREVER);
+  free(before);
+  free(text);
+  BODYCACHEBYTES = BODY_CACHE_BYTES;
+}
+
+// Block compression of a large log against storing it plain: ratio and
+// codec speed, then reading the note back both ways
+static void BenchCompression() {
+  size_t size = 16 << 20;
+  char* text = malloc(size + 1);
+  if(!text) exit(1);
+
+  size_t len = FillLog(text,size);
+  double mb = len / 1048576.0;
+
+  size_t packedLength = 0;
+  double start = Seconds();
+  char* packed = CompressNoteBody(text,len,&packedLength);
+  double seconds = Seconds() - start;
+  if(!packed) {
+    Mismatch("log did not compress\n");
+    free(text);
+    return;
+  }
+  printf("lz     %5.0f MB  %-14s %9.1f ms  %9.0f MB/s  ratio %.2f\n",mb,"compress",seconds * 1e3,mb / seconds,(double)len / packedLength);
+  free(packed);
+
+  for(int compressed = 0; compressed < 2; ++compressed) {
+    ClearScratchDir(0);
+    ResetNoteStore();
+    COMPRESSNOTES = compressed;
+
+    Note* note = SaveTestNote((Note){.catalogSlot = -1},"log",0,text,len);
+    char* body = NULL;
+
+    start = Seconds();
+    long length = 0;
+    for(int i = 0; i < 10; ++i) {
+      free(body);
+      body = ReadNoteBody(note->filename,&length);
+    }
+    seconds = (Seconds() - start) / 10;
+    printf("lz     %5.0f MB  %-14s %9.1f ms  %9.0f MB/s\n",mb,compressed ? "read packed" : "read plain",seconds * 1e3,mb / seconds);
+
+    if(!body || (size_t)length != len || memcmp(body,text,len) != 0) Mismatch("log did not read back intact\n");
+    free(body);
+  }
+
+  COMPRESSNOTES = 1;
+  free(text);
+}
+
+// Opening a large note: reading and converting all of it before the
+// first paint against mapping it and converting only the first chunk,
+// which is what the note window streams with
+#define BENCH_STREAM_CHUNK (256 * 1024)
+
+static void BenchFirstPaint() {
+  COMPRESSNOTES = 0;
+  BODYCACHEBYTES = 0;  // Every open reads the file
+
+  for(size_t size = 1 << 20; size <= 64 << 20; size *= 4) {
+    ClearScratchDir(0);
+    ResetNoteStore();
+
+    char* text = malloc(size + 1);
+    if(!text) exit(1);
+    size_t len = FillLog(text,size);
+
+    Note* note = Insert((Note){.catalogSlot = -1});
+    snprintf(note->filename,sizeof(note->filename),"large" NOTE_EXTENSION);
+    SaveNote(note,text,len);
+    double mb = len / 1048576.0;
+
+    double start = Seconds();
+    long length = 0;
+    char* body = ReadNoteText(note,&length);
+    body = body ? ToEditText(body,length) : NULL;
+    double seconds = Seconds() - start;
+    printf("open   %5.0f MB  %-14s %9.1f ms\n",mb,"read all",seconds * 1e3);
+    free(body);
+
+    char* chunk = malloc(2 * BENCH_STREAM_CHUNK + 3);
+    if(!chunk) exit(1);
+
+    start = Seconds();
+    NoteMapping map;
+    size_t mappedLength = 0;
+    const char* mapped = MapNoteBody(note,&mappedLength,&map);
+    size_t at = mapped ? NextEditChunk(mapped,mappedLength,0,BENCH_STREAM_CHUNK,chunk) : 0;
+    seconds = Seconds() - start;
+    printf("open   %5.0f MB  %-14s %9.1f ms\n",mb,"first chunk",seconds * 1e3);
+
+    while(mapped && at < mappedLength) at += NextEditChunk(mapped,mappedLength,at,BENCH_STREAM_CHUNK,chunk);
+    seconds = Seconds() - start;
+    printf("open   %5.0f MB  %-14s %9.1f ms\n",mb,"all chunks",seconds * 1e3);
+
+    if(!mapped || mappedLength != len) Mismatch("large note could not be mapped\n");
+    else UnmapNoteBody(&map);
+    free(chunk);
+  }
+
+  COMPRESSNOTES = 1;
+  BODYCACHEBYTES = BODY_CACHE_BYTES;
+}
+
+// Flips between a few large compressed notes the way a user flips
+// between reference notes, without and with the body cache
+static void BenchBodyCache(size_t notes, size_t size, size_t opens) {
+  ClearScratchDir(0);
+  ResetNoteStore();
+  StartSaveWriter();
+
+  Note** open = malloc(sizeof(Note*) * notes);
+  if(!open) exit(1);
+
+  for(size_t i = 0; i < notes; ++i) {
+    char* text = malloc(size + 1);
+    if(!text) exit(1);
+
+    open[i] = Insert((Note){.catalogSlot = -1});
+    snprintf(open[i]->filename,sizeof(open[i]->filename),"ref%zu" NOTE_EXTENSION,i);
+    SaveNote(open[i],text,FillLog(text,size));
+  }
+  WaitForAllSaves();
+
+  double mb = size / 1048576.0;
+  for(int cached = 0; cached < 2; ++cached) {
+    BODYCACHEBYTES = cached ? BODY_CACHE_BYTES : 0;
+    for(size_t i = 0; i < notes; ++i) DropCachedBody(open[i]);
+
+    double start = Seconds();
+    for(size_t i = 0; i < opens; ++i) {
+      long length = 0;
+      free(ReadNoteText(open[i % notes],&length));
+    }
+    double seconds = Seconds() - start;
+    printf("cache  %3.0f MB x%zu %-14s %9.1f ms  %9.0f ops/s\n",mb,notes,cached ? "open cached" : "open uncached",seconds * 1e3,opens / seconds);
+  }
+
+  // A note rewritten by someone else is read again
+  char path[MAX_PATH + 1];
+  NotePath(path,sizeof(path),open[0]->filename,"");
+  FILE* f = fopen(path,"ab");
+  if(f) {
+    fputc('\n',f);
+    fclose(f);
+  }
+  long length = 0;
+  free(ReadNoteText(open[0],&length));
+
+  BodyCacheStats stats;
+  GetBodyCacheStats(&stats);
+  printf("cache  %3.0f MB x%zu %lu hits, %lu misses, %lu stale, %lu evicted, %zu bodies in %.1f MB\n",
+         mb,notes,stats.hits,stats.misses,stats.stale,stats.evictions,stats.entries,stats.bytes / 1048576.0);
+
+  DrainSaveQueue(NULL,NULL,WAIT_FOREVER);
+  free(open);
+}
+
+// Small edits to a note, each followed by a full save that keeps a version
+static void BenchHistory(size_t size, size_t versions) {
+  ClearScratchDir(0);
+  ResetNoteStore();
+  StartSaveWriter();
+
+  // Chunking alone
+  size_t streamSize = 64 << 20;
+  char* stream = malloc(streamSize + 1);
+  if(!stream) exit(1);
+  size_t streamLength = FillLog(stream,streamSize);
+
+  size_t chunks = 0;
+  double start = Seconds();
+  for(size_t at = 0; at < streamLength; chunks++) at += NextChunkCut(stream + at,streamLength - at);
+  double seconds = Seconds() - start;
+  printf("history %3.0f MB  %-14s %9.1f ms  %9.0f MB/s  %zu B average chunk\n",streamLength / 1048576.0,"chunking",
+         seconds * 1e3,streamLength / 1048576.0 / seconds,streamLength / chunks);
+  free(stream);
+
+  size_t capacity = size + versions * 16 + 1;
+  char* text = malloc(capacity);
+  char* first = malloc(capacity);
+  if(!text || !first) exit(1);
+
+  size_t len = FillText(text,size,0);
+  memcpy(first,text,len + 1);
+  size_t firstLength = len;
+
+  Note* note = Insert((Note){.catalogSlot = -1});
+  snprintf(note->filename,sizeof(note->filename),"history" NOTE_EXTENSION);
+
+  double mb = len / 1048576.0;
+  unsigned long long logical = 0;
+  for(int keep = 0; keep < 2; ++keep) {
+    KEEPHISTORY = keep;
+    start = Seconds();
+    for(size_t i = 0; i < versions; ++i) {
+      // An insert, an overwrite and a delete somewhere in the note
+      size_t at = NextRandom() % len;
+      memmove(text + at + 5,text + at,len - at + 1);
+      memcpy(text + at,"edit ",5);
+      len += 5;
+      text[NextRandom() % len] = 'x';
+      at = NextRandom() % (len - 3);
+      memmove(text + at,text + at + 3,len - at - 2);
+      len -= 3;
+
+      char* body = malloc(len + 1);
+      if(!body) exit(1);
+      memcpy(body,text,len + 1);
+      SaveNote(note,body,len);
+      WaitForAllSaves();
+      logical += keep ? len : 0;
+    }
+    seconds = Seconds() - start;
+    printf("history %3.1f MB  %-14s %9.1f ms  %9.0f ops/s\n",mb,keep ? "save+version" : "save",seconds * 1e3,versions / seconds);
+  }
+
+  char dir[MAX_PATH + 1];
+  snprintf(dir,sizeof(dir),"%s" PATH_SEPARATOR "history",NOTESPATH);
+  unsigned long long stored = 0;
+  DirList(dir,"",SumScratchFile,&stored);
+  printf("history %3.1f MB  %zu versions, %.1f MB of text in %.2f MB, %.2f%% of the text\n",mb,versions,
+         logical / 1048576.0,stored / 1048576.0,100.0 * stored / logical);
+
+  NoteVersion* list;
+  size_t count = ListNoteVersions(note->filename,&list);
+  if(count != versions) Mismatch("history lists %zu versions, %zu were saved\n",count,versions);
+
+  start = Seconds();
+  for(size_t i = 0; i < count; ++i) {
+    long length = 0;
+    char* restored = ReadNoteVersion(note->filename,list[NextRandom() % count].number,&length);
+    if(!restored) Mismatch("history version could not be restored\n");
+    free(restored);
+  }
+  seconds = Seconds() - start;
+  printf("history %3.1f MB  %-14s %9.1f ms  %9.0f ops/s\n",mb,"restore",seconds * 1e3,count / seconds);
+
+  long length = 0;
+  char* newest = count ? ReadNoteVersion(note->filename,list[count - 1].number,&length) : NULL;
+  if(!newest || (size_t)length != len || memcmp(newest,text,len) != 0)
+    Mismatch("history newest version does not match the saved text\n");
+  free(newest);
+
+  // A second note sharing the first text keeps its chunks alive through
+  // the collection after the first note is deleted
+  Note* copy = SaveTestNote((Note){.catalogSlot = -1},"copy",0,first,firstLength);
+  DeleteNoteFromDisk(NOTESPATH,note);
+  DrainSaveQueue(NULL,NULL,WAIT_FOREVER);
+
+  unsigned long long freed = 0;
+  start = Seconds();
+  int collected = CollectHistoryGarbage(&freed);
+  seconds = Seconds() - start;
+  printf("history %3.1f MB  %-14s %9.1f ms  %9.2f MB freed\n",mb,"collect",seconds * 1e3,freed / 1048576.0);
+
+  char* kept = collected ? ReadNoteVersion(copy->filename,1,&length) : NULL;
+  if(!kept || (size_t)length != firstLength || memcmp(kept,first,firstLength) != 0)
+    Mismatch("history lost a version still referred to\n");
+
+  free(kept);
+  free(list);
+  free(first);
+  free(text);
+  KEEPHISTORY = 0;
+}
+
+// Whole store into one archive and back, into loose files and into a pack
+static void BenchArchive(size_t count) {
+  ClearScratchDir(0);
+  ResetNoteStore();
+  StartSaveWriter();
+
+  char* text = malloc(4096);
+  char* first = malloc(4096);
+  if(!text || !first) exit(1);
+
+  unsigned long long bytes = 0;
+  for(size_t i = 0; i < count; ++i) {
+    size_t len = FillText(text,128 + NextRandom() % 3000,0);
+    if(i == 0) memcpy(first,text,len + 1);
+    bytes += len;
+    SaveTestNote((Note){.x = 10 + (int)i % 500, .y = 20, .width = 300, .height = 300, .catalogSlot = -1},"",i,text,len);
+  }
+  DrainSaveQueue(NULL,NULL,WAIT_FOREVER);
+  ResetNoteStore();
+
+  char path[MAX_PATH + 1];
+  snprintf(path,sizeof(path),"%s.harc",NOTESPATH);
+
+  unsigned long exported = 0, imported = 0, skipped = 0;
+  double start = Seconds();
+  int ok = ExportArchive(path,&exported);
+  double seconds = Seconds() - start;
+
+  unsigned long long size = 0, mtime;
+  FileStamp(path,&size,&mtime);
+  printf("archive %7zu  %-14s %9.1f ms  %9.0f MB/s  %.1f MB in %.1f MB\n",count,"export",seconds * 1e3,
+         bytes / 1048576.0 / seconds,bytes / 1048576.0,size / 1048576.0);
+  if(!ok || exported != count) Mismatch("archive export wrote %lu of %zu notes\n",exported,count);
+
+  for(int packed = 0; packed < 2; ++packed) {
+    ClearScratchDir(0);
+    ResetNoteStore();
+    if(packed) CreatePack();
+
+    start = Seconds();
+    ok = ImportArchive(path,&imported,&skipped);
+    seconds = Seconds() - start;
+    printf("archive %7zu  %-14s %9.1f ms  %9.0f MB/s\n",count,packed ? "import pack" : "import files",seconds * 1e3,bytes / 1048576.0 / seconds);
+    if(!ok || imported != count) Mismatch("archive import wrote %lu of %zu notes\n",imported,count);
+  }
+
+  // Everything is there already
+  start = Seconds();
+  ok = ImportArchive(path,&imported,&skipped);
+  seconds = Seconds() - start;
+  printf("archive %7zu  %-14s %9.1f ms  %9.0f MB/s\n",count,"import again",seconds * 1e3,bytes / 1048576.0 / seconds);
+  if(!ok || imported || skipped != count) Mismatch("archive import again wrote %lu and skipped %lu notes\n",imported,skipped);
+
+  ResetNoteStore();
+  size_t loaded = LoadAllNotes();
+  Note* note = FindByFilename("00000000" NOTE_EXTENSION);
+
+  long length = 0;
+  char* body = note ? ReadNoteBody(note->filename,&length) : NULL;
+  if(loaded != count || !body || strcmp(body,first) != 0 || note->x != 10 || note->y != 20)
+    Mismatch("archive did not bring back the notes as they were\n");
+
+  free(body);
+  free(first);
+  free(text);
+  FileDelete(path);
+}
+
+// Cost of recording a timed event, which also wraps the ring and folds it
+// into the histograms many times, against the two clock reads it takes, an
+// instant event and a counter
+static void BenchTrace() {
+  const size_t events = 10000000;
+
+  unsigned long long ticks = 0;
+  double start = Seconds();
+  for(size_t i = 0; i < events; ++i) ticks += TraceTicks();
+  Report("trace",events,"clock",Seconds() - start,events);
+  if(!ticks) Mismatch("the trace clock did not move\n");
+
+  start = Seconds();
+  for(size_t i = 0; i < events; ++i) {
+    TRACE_BEGIN(eventStart);
+    TRACE_END(TRACE_SEARCH_QUERY,eventStart,i,0);
+  }
+  Report("trace",events,"record",Seconds() - start,events);
+
+  start = Seconds();
+  for(size_t i = 0; i < events; ++i) TRACE_MARK(TRACE_SEARCH_QUERY,i,0);
+  Report("trace",events,"mark",Seconds() - start,events);
+
+  start = Seconds();
+  for(size_t i = 0; i < events; ++i) TRACE_COUNT(TRACE_LIST_MESSAGES,1);
+  Report("trace",events,"count",Seconds() - start,events);
+}
+
+static void BenchSearch(size_t count) {
+  ClearScratchDir(0);
+  ResetNoteStore();
+
+  char* text = malloc(4096);
+  if(!text) exit(1);
+
+  StartSaveWriter();
+  for(size_t i = 0; i < count; ++i) {
+    size_t len = FillText(text,128 + NextRandom() % 3000,0);
+    SaveTestNote((Note){.catalogSlot = -1},"",i,text,len);
+  }
+  DrainSaveQueue(NULL,NULL,WAIT_FOREVER);
+
+  // Built from the files the way the first start builds it
+  ResetNoteStore();
+  LoadAllNotes();
+  double start = Seconds();
+  IndexAllNotes();
+  Report("search",count,"index",Seconds() - start,count);
+
+  // Every word is in nearly every note, so words match the whole store and
+  // the check rejects about half of the candidates of the phrase. A query
+  // returns candidates, the list shows them at once and the check reads
+  // the notes on its own thread, its time is that of all of them.
+  static const struct { const char* name; const char* check; const char* queries[3]; } groups[] = {
+    {"query word","check word",{"timeout","debug","warn"}},
+    {"query phrase","check phrase",{"catalog retry"}},
+    {"query short",NULL,{"ti","e"}}
+  };
+
+  for(size_t g = 0; g < sizeof(groups) / sizeof(groups[0]); ++g) {
+    size_t kinds = 0, matches = 0;
+    while(kinds < 3 && groups[g].queries[kinds]) kinds++;
+
+    start = Seconds();
+    for(size_t i = 0; i < 300; ++i) {
+      NoteId* ids;
+      matches += QuerySearchIndex(groups[g].queries[i % kinds],&ids);
+      free(ids);
+    }
+    double seconds = Seconds() - start;
+    printf("search %7zu  %-14s %9.3f ms per query  %5.1f %% of notes match\n",count,groups[g].name,
+           seconds * 1e3 / 300,100.0 * matches / 300 / count);
+    if(!groups[g].check) continue;
+
+    matches = 0;
+    start = Seconds();
+    for(size_t i = 0; i < kinds; ++i) {
+      NoteId* ids;
+      matches += QueryAndCheck(groups[g].queries[i],&ids);
+      free(ids);
+    }
+    seconds = Seconds() - start;
+    printf("search %7zu  %-14s %9.1f ms per query  %5.1f %% of notes match\n",count,groups[g].check,
+           seconds * 1e3 / kinds,100.0 * matches / kinds / count);
+  }
+
+  free(text);
+  ResetNoteStore();
+  ClearScratchDir(0);
+}
+
+// Indexing a single large note, what the writer does after saving it
+static void BenchIndexNote(size_t size) {
+  ResetNoteStore();
+
+  char* text = malloc(size + 1);
+  if(!text) exit(1);
+  size_t len = FillLog(text,size);
+  Note* note = Insert((Note){.catalogSlot = -1});
+
+  double start = Seconds();
+  IndexNoteText(note->id,text,len);
+  double seconds = Seconds() - start;
+  printf("search %5.0f MB  %-14s %9.1f ms  %9.0f MB/s\n",len / 1048576.0,"index note",seconds * 1e3,len / 1048576.0 / seconds);
+
+  NoteId* ids;
+  if(QuerySearchIndex("worker-3",&ids) != 1) Mismatch("large note is not found by its trigrams\n");
+  free(ids);
+  free(text);
+  ResetNoteStore();
+}
+
+// Tiling a set of open notes: every window moved, written as records of
+// the geometry table, then the same again, which writes nothing, then as
+// full saves of every note the way moves used to be written
+static void BenchGeometry(size_t count) {
+  ClearScratchDir(0);
+  ResetNoteStore();
+
+  char* text = malloc(4096);
+  if(!text) exit(1);
+
+  StartSaveWriter();
+  for(size_t i = 0; i < count; ++i) {
+    size_t len = FillText(text,128 + NextRandom() % 3000,0);
+    SaveTestNote((Note){.opened = 1, .x = 10, .y = 10, .width = 300, .height = 300, .catalogSlot = -1},"",i,text,len);
+  }
+  WaitForAllSaves();
+
+  char path[MAX_PATH + 1];
+  snprintf(path,sizeof(path),"%s" PATH_SEPARATOR "geometry.hgeo",NOTESPATH);
+
+  for(int pass = 0; pass < 2; ++pass) {
+    double start = Seconds();
+    for(size_t i = 0; i < noteRegistry.slotCount; ++i) {
+      Note* note = NoteAtSlot(i);
+      note->x = (int)(i % 20) * 60;
+      note->y = (int)(i / 20 % 20) * 40;
+      SaveNoteGeometry(note);
+    }
+    WaitForAllSaves();
+    double seconds = Seconds() - start;
+
+    unsigned long long size = 0, mtime;
+    FileStamp(path,&size,&mtime);
+    printf("geometry %6zu  %-14s %9.1f ms  %9.0f ops/s  %.1f KB table\n",count,pass ? "arrange again" : "arrange",
+           seconds * 1e3,count / seconds,size / 1024.0);
+  }
+  DrainSaveQueue(NULL,NULL,WAIT_FOREVER);
+
+  // The table wins over the headers, which still say 10,10
+  ResetNoteStore();
+  size_t loaded = LoadAllNotes(), placed = 0;
+  for(size_t i = 0; i < noteRegistry.slotCount; ++i) {
+    Note* note = NoteAtSlot(i);
+    size_t n = strtoul(note->filename,NULL,10);
+    placed += note->x == (int)(n % 20) * 60 && note->y == (int)(n / 20 % 20) * 40;
+  }
+  if(loaded != count || placed != count) Mismatch("geometry of %zu of %zu notes restored\n",placed,count);
+
+  StartSaveWriter();
+  unsigned long long bytes = 0;
+  double start = Seconds();
+  for(size_t i = 0; i < noteRegistry.slotCount; ++i) {
+    Note* note = NoteAtSlot(i);
+    size_t len = FillText(text,128 + NextRandom() % 3000,0);
+    bytes += sizeof(NoteHeader) + len;
+
+    char* body = malloc(len + 1);
+    if(!body) exit(1);
+    memcpy(body,text,len + 1);
+    note->x += 5;
+    SaveNote(note,body,(long)len);
+  }
+  WaitForAllSaves();
+  double seconds = Seconds() - start;
+  printf("geometry %6zu  %-14s %9.1f ms  %9.0f ops/s  %.1f KB bodies\n",count,"arrange (saves)",seconds * 1e3,count / seconds,bytes / 1024.0);
+  DrainSaveQueue(NULL,NULL,WAIT_FOREVER);
+
+  free(text);
+  ResetNoteStore();
+}
+
+static int CompareModified(const void* a, const void* b) {
+  const Note* x = *(Note* const*)a;
+  const Note* y = *(Note* const*)b;
+  return (x->modified < y->modified) - (x->modified > y->modified);
+}
+
+// Keeping the list sorted while notes are saved: moving one note per save
+// against sorting the whole list again, then drawing rows, filtering and
+// switching the order
+static void BenchOrder(size_t count) {
+  ResetNoteStore();
+  SetNoteOrder(NOTE_ORDER_MODIFIED);
+
+  double start = Seconds();
+  for(size_t i = 0; i < count; ++i) {
+    Note* note = Insert((Note){.catalogSlot = -1, .bodyLength = NextRandom() % 100000, .created = 1700000000 + NextRandom() % 100000000});
+    snprintf(note->preview,sizeof(note->preview),"%s %s",BENCH_WORDS[NextRandom() % (sizeof(BENCH_WORDS) / sizeof(BENCH_WORDS[0]))],BENCH_WORDS[NextRandom() % (sizeof(BENCH_WORDS) / sizeof(BENCH_WORDS[0]))]);
+    TouchNote(note);
+    ListNote(note,1);
+    OrderNote(note);
+  }
+  Report("order",count,"insert",Seconds() - start,count);
+
+  // A save of a random note moves it to the top, the list asks where from
+  size_t saves = 100000, misplaced = 0;
+  start = Seconds();
+  for(size_t i = 0; i < saves; ++i) {
+    Note* note = NoteAtSlot(NextRandom() % count);
+    int from = NoteRow(note);
+    TouchNote(note);
+    misplaced += from < 0 || NoteRow(note) != 0;
+  }
+  Report("order",count,"save",Seconds() - start,saves);
+  if(misplaced) Mismatch("%zu saved notes did not move to the top row\n",misplaced);
+
+  Note** sorted = malloc(sizeof(Note*) * count);
+  if(!sorted) exit(1);
+  size_t resorts = count >= 100000 ? 10 : 100;
+  start = Seconds();
+  for(size_t i = 0; i < resorts; ++i) {
+    // The stamp may only change while the note is out of the order
+    Note* note = NoteAtSlot(NextRandom() % count);
+    UnorderNote(note);
+    note->modified++;
+    OrderNote(note);
+    for(size_t j = 0; j < count; ++j) sorted[j] = NoteAtSlot(j);
+    qsort(sorted,count,sizeof(Note*),CompareModified);
+  }
+  Report("order",count,"save resort",Seconds() - start,resorts);
+  free(sorted);
+
+  // Drawing a screen of rows at random scroll positions
+  size_t found = 0;
+  start = Seconds();
+  for(size_t i = 0; i < saves; ++i) {
+    int row = (int)(NextRandom() % count);
+    found += NoteRow(NoteAtRow(row)) == row;
+  }
+  Report("order",count,"row lookup",Seconds() - start,saves);
+  if(found != saves) Mismatch("%zu of %zu rows do not hold the note of their row\n",saves - found,saves);
+
+  start = Seconds();
+  for(size_t i = 0; i < count; ++i) ListNote(NoteAtSlot(i),i % 3 == 0);
+  Report("order",count,"filter",Seconds() - start,count);
+  if(ListedNoteCount() != (count + 2) / 3) Mismatch("%zu notes listed after the filter, %zu expected\n",ListedNoteCount(),(count + 2) / 3);
+
+  static const char* orders[] = {"by created","by title","by size","by modified"};
+  static const int keys[] = {NOTE_ORDER_CREATED,NOTE_ORDER_TITLE,NOTE_ORDER_SIZE,NOTE_ORDER_MODIFIED};
+  for(size_t i = 0; i < 4; ++i) {
+    start = Seconds();
+    SetNoteOrder(keys[i]);
+    Report("order",count,orders[i],Seconds() - start,count);
+  }
+
+}
+
+// The slot map on its own, without the list order or a store: inserting,
+// finding, removing a note and inserting another in its slot at a steady
+// count, and removing them all
+static void BenchRegistry(size_t count) {
+  ResetNoteStore();
+  NoteId* ids = malloc(sizeof(NoteId) * count);
+  if(!ids) exit(1);
+
+  double start = Seconds();
+  for(size_t i = 0; i < count; ++i) ids[i] = Insert((Note){.catalogSlot = -1, .x = (int)i})->id;
+  Report("registry",count,"insert",Seconds() - start,count);
+
+  size_t found = 0;
+  start = Seconds();
+  for(size_t i = 0; i < BENCH_LOOKUPS; ++i) {
+    size_t k = NextRandom() % count;
+    Note* note = Find(ids[k]);
+    found += note && note->x == (int)k;
+  }
+  Report("registry",count,"find",Seconds() - start,BENCH_LOOKUPS);
+  if(found != BENCH_LOOKUPS) Mismatch("%zu of %d ids did not find their note\n",BENCH_LOOKUPS - found,BENCH_LOOKUPS);
+
+  // The id of a removed note must not find the note that took its slot
+  size_t stale = 0;
+  start = Seconds();
+  for(size_t i = 0; i < BENCH_LOOKUPS; ++i) {
+    size_t k = NextRandom() % count;
+    NoteId removed = ids[k];
+    Remove(removed);
+    ids[k] = Insert((Note){.catalogSlot = -1, .x = (int)k})->id;
+    stale += Find(removed) != NULL;
+  }
+  Report("registry",count,"remove+insert",Seconds() - start,BENCH_LOOKUPS);
+  if(stale) Mismatch("%zu ids of removed notes still resolved\n",stale);
+
+  start = Seconds();
+  for(size_t i = 0; i < count; ++i) Remove(ids[i]);
+  Report("registry",count,"remove",Seconds() - start,count);
+  if(noteRegistry.size) Mismatch("%zu notes left in the registry after removing\n",noteRegistry.size);
+
+  free(ids);
+  ResetNoteStore();
+}
+
+int main(int argc, char** argv) {
+  const char* dir = BENCH_DEFAULT_DIR;
+  const char* tracePath = NULL;
+  const char* statsPath = NULL;
+  size_t counts[16];
+  size_t countCount = 0;
+
+  for(int i = 1; i < argc; ++i) {
+    if(strcmp(argv[i],"-d") == 0 && i + 1 < argc) dir = argv[++i];
+    else if(strcmp(argv[i],"-t") == 0 && i + 1 < argc) tracePath = argv[++i];
+    else if(strcmp(argv[i],"-s") == 0 && i + 1 < argc) statsPath = argv[++i];
+    else if(countCount < sizeof(counts) / sizeof(counts[0])) counts[countCount++] = strtoul(argv[i],NULL,10);
+  }
+  if(!countCount) {
+    counts[0] = 1000;
+    counts[1] = 10000;
+    counts[2] = 100000;
+    countCount = 3;
+  }
+
+  snprintf(NOTESPATH,sizeof(NOTESPATH),"%s",dir);
+  if(!DirCreate(NOTESPATH) || !PrepareNoteShards()) {
+    fprintf(stderr,"could not create %s\n",NOTESPATH);
+    return 1;
+  }
+
+  InitNoteStore();
+  KEEPHISTORY = 0;  // Only BenchHistory pays for versions
+  if(tracePath) TraceDumpOnCrash(tracePath);
+  InitHarness();
+
+  for(size_t i = 0; i < countCount; ++i) {
+    if(!counts[i]) continue;
+    COMPRESSNOTES = 0;
+    BenchStore("plain",0,counts[i]);
+    COMPRESSNOTES = 1;
+    BenchStore("files",0,counts[i]);
+    BenchStore("pack",1,counts[i]);
+    BenchShards(counts[i]);
+  }
+
+  BenchLineEndings();
+  BenchUnicode();
+  BenchCompression();
+  BenchFirstPaint();
+  BenchJournal(4 << 20,500);
+  BenchBodyCache(6,2 << 20,600);
+  BenchHistory(256 << 10,500);
+  for(size_t i = 0; i < countCount; ++i)
+    if(counts[i]) BenchSearch(counts[i]);
+  BenchSearch(BENCH_SEARCH_NOTES);
+  BenchIndexNote(32 << 20);
+  for(size_t i = 0; i < countCount; ++i)
+    if(counts[i]) BenchArchive(counts[i]);
+  for(size_t i = 0; i < countCount; ++i)
+    if(counts[i]) BenchOrder(counts[i]);
+  BenchRegistry(BENCH_REGISTRY_NOTES);
+  BenchGeometry(1000);
+
+  // Dumped before the trace bench floods the ring of this thread
+  if(tracePath && TraceDump(tracePath) < 0) Mismatch("could not write %s\n",tracePath);
+  if(statsPath && TraceStatsDump(statsPath) < 0) Mismatch("could not write %s\n",statsPath);
+  BenchTrace();
+
+  ResetNoteStore();
+  ClearScratchDir(1);
+  remove(NOTESPATH);
+  if(benchFailures) fprintf(stderr,"%d checks failed\n",benchFailures);
+  return benchFailures ? 1 : 0;
+}
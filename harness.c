@@ -0,0 +1,208 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "harness.h"
+
+//
+// Scratch directory
+//
+
+static size_t evictFailures = 0;
+
+static int DeleteScratchFile(const char* name, unsigned long long size, unsigned long long mtime, void* context) {
+  char path[MAX_PATH + 1];
+  snprintf(path,sizeof(path),"%s" PATH_SEPARATOR "%s",(const char*)context,name);
+  FileDelete(path);
+  return 1;
+}
+
+static int CountScratchFile(const char* name, unsigned long long size, unsigned long long mtime, void* context) {
+  (*(size_t*)context)++;
+  return 1;
+}
+
+void ClearScratchDir(int removeShards) {
+  char dir[MAX_PATH + 1];
+  static const char* subdirs[] = {"history","export"};
+  for(size_t i = 0; i < sizeof(subdirs) / sizeof(subdirs[0]); ++i) {
+    snprintf(dir,sizeof(dir),"%s" PATH_SEPARATOR "%s",NOTESPATH,subdirs[i]);
+    DirList(dir,"",DeleteScratchFile,dir);
+    remove(dir);
+  }
+  for(unsigned int shard = 0; shard < NOTE_SHARD_COUNT; ++shard) {
+    snprintf(dir,sizeof(dir),"%s" PATH_SEPARATOR "%02x",NOTESPATH,shard);
+    DirList(dir,"",DeleteScratchFile,dir);
+    if(removeShards) remove(dir);
+  }
+  DirList(NOTESPATH,"",DeleteScratchFile,NOTESPATH);
+}
+
+size_t CountNoteFiles() {
+  size_t count = 0;
+  char dir[MAX_PATH + 1];
+  for(unsigned int shard = 0; shard < NOTE_SHARD_COUNT; ++shard) {
+    snprintf(dir,sizeof(dir),"%s" PATH_SEPARATOR "%02x",NOTESPATH,shard);
+    DirList(dir,NOTE_EXTENSION,CountScratchFile,&count);
+  }
+  return count;
+}
+
+static int EvictScratchFile(const char* name, unsigned long long size, unsigned long long mtime, void* context) {
+  char path[MAX_PATH + 1];
+  snprintf(path,sizeof(path),"%s" PATH_SEPARATOR "%s",(const char*)context,name);
+  if(!FileEvict(path)) evictFailures++;
+  return 1;
+}
+
+int EvictScratchDir() {
+  evictFailures = 0;
+  char dir[MAX_PATH + 1];
+  snprintf(dir,sizeof(dir),"%s" PATH_SEPARATOR "history",NOTESPATH);
+  DirList(dir,"",EvictScratchFile,dir);
+  for(unsigned int shard = 0; shard < NOTE_SHARD_COUNT; ++shard) {
+    snprintf(dir,sizeof(dir),"%s" PATH_SEPARATOR "%02x",NOTESPATH,shard);
+    DirList(dir,"",EvictScratchFile,dir);
+  }
+  DirList(NOTESPATH,"",EvictScratchFile,NOTESPATH);
+  return !evictFailures;
+}
+
+//
+// Notes
+//
+
+void TestNoteName(char* filename, const char* prefix, size_t i) {
+  snprintf(filename,FILENAME_SIZE + 1,"%s%0*zu" NOTE_EXTENSION,prefix,(int)(8 - strlen(prefix)),i);
+}
+
+Note* FindByFilename(const char* filename) {
+  for(size_t i = 0; i < noteRegistry.slotCount; ++i) {
+    Note* note = NoteAtSlot(i);
+    if(note && strcmp(note->filename,filename) == 0) return note;
+  }
+  return NULL;
+}
+
+Note* SaveTestNote(Note note, const char* prefix, size_t i, const char* text, size_t length) {
+  Note* saved = Insert(note);
+  TestNoteName(saved->filename,prefix,i);
+  if(length) snprintf(saved->preview,sizeof(saved->preview),"%.*s",(int)length,text);
+  else snprintf(saved->preview,sizeof(saved->preview),"%s",EMPTYNOTE_STRING);
+
+  char* body = malloc(length + 1);
+  if(!body) exit(1);
+  memcpy(body,text,length);
+  body[length] = '\0';
+  SaveNote(saved,body,(long)length);
+  return saved;
+}
+
+//
+// Loading and indexing
+//
+
+static struct HarnessLoad {
+  Lock* lock;
+  Condition* done;
+  LoadBatch* batches;
+  int finished;
+  int indexed;
+  NoteId* rejected;
+  size_t rejectedCount, rejectedCapacity;
+  int checked;
+} harnessLoad = {0};
+
+void InitHarness() {
+  harnessLoad.lock = NewLock();
+  harnessLoad.done = NewCondition();
+}
+
+static void CollectBatch(LoadBatch* batch, void* context) {
+  AcquireLock(harnessLoad.lock);
+  if(batch) {
+    batch->next = harnessLoad.batches;
+    harnessLoad.batches = batch;
+  }
+  else harnessLoad.finished = 1;
+  WakeAllCondition(harnessLoad.done);
+  ReleaseLock(harnessLoad.lock);
+}
+
+size_t LoadAllNotes() {
+  harnessLoad.batches = NULL;
+  harnessLoad.finished = 0;
+  StartLoadingNotes(CollectBatch,NULL);
+
+  size_t loaded = 0;
+  AcquireLock(harnessLoad.lock);
+  for(;;) {
+    while(harnessLoad.batches) {
+      LoadBatch* batch = harnessLoad.batches;
+      harnessLoad.batches = batch->next;
+
+      for(size_t i = 0; i < batch->count; ++i)
+        if(batch->notes[i].valid && InitNoteFromLoaded(&batch->notes[i])) loaded++;
+      free(batch);
+    }
+    if(harnessLoad.finished) break;
+    WaitCondition(harnessLoad.done,harnessLoad.lock,WAIT_FOREVER);
+  }
+  ReleaseLock(harnessLoad.lock);
+  return loaded;
+}
+
+static void IndexReady(void* context) {
+  AcquireLock(harnessLoad.lock);
+  harnessLoad.indexed = 1;
+  WakeAllCondition(harnessLoad.done);
+  ReleaseLock(harnessLoad.lock);
+}
+
+void IndexAllNotes() {
+  harnessLoad.indexed = 0;
+  StartSearchIndexing(IndexReady,NULL);
+
+  AcquireLock(harnessLoad.lock);
+  while(!harnessLoad.indexed) WaitCondition(harnessLoad.done,harnessLoad.lock,WAIT_FOREVER);
+  ReleaseLock(harnessLoad.lock);
+}
+
+static void CollectRejects(SearchRejects* rejects, void* context) {
+  AcquireLock(harnessLoad.lock);
+  if(harnessLoad.rejectedCount + rejects->count > harnessLoad.rejectedCapacity) {
+    harnessLoad.rejectedCapacity = (harnessLoad.rejectedCount + rejects->count) * 2;
+    harnessLoad.rejected = realloc(harnessLoad.rejected,sizeof(NoteId) * harnessLoad.rejectedCapacity);
+    if(!harnessLoad.rejected) exit(1);
+  }
+  memcpy(harnessLoad.rejected + harnessLoad.rejectedCount,rejects->ids,sizeof(NoteId) * rejects->count);
+  harnessLoad.rejectedCount += rejects->count;
+  harnessLoad.checked = rejects->done;
+  WakeAllCondition(harnessLoad.done);
+  ReleaseLock(harnessLoad.lock);
+  free(rejects);
+}
+
+static int CompareIds(const void* a, const void* b) {
+  NoteId x = *(const NoteId*)a, y = *(const NoteId*)b;
+  return (x > y) - (x < y);
+}
+
+size_t QueryAndCheck(const char* query, NoteId** ids) {
+  size_t count = QuerySearchIndex(query,ids);
+
+  harnessLoad.rejectedCount = 0;
+  harnessLoad.checked = 0;
+  if(CheckSearchResults(query,*ids,count,CollectRejects,NULL)) {
+    AcquireLock(harnessLoad.lock);
+    while(!harnessLoad.checked) WaitCondition(harnessLoad.done,harnessLoad.lock,WAIT_FOREVER);
+    ReleaseLock(harnessLoad.lock);
+  }
+
+  qsort(harnessLoad.rejected,harnessLoad.rejectedCount,sizeof(NoteId),CompareIds);
+  size_t kept = 0;
+  for(size_t i = 0; i < count; ++i)
+    if(!harnessLoad.rejectedCount || !bsearch(&(*ids)[i],harnessLoad.rejected,harnessLoad.rejectedCount,sizeof(NoteId),CompareIds))
+      (*ids)[kept++] = (*ids)[i];
+  return kept;
+}
@@ -0,0 +1,45 @@
+#ifndef HARNESS_H
+#define HARNESS_H
+
+//
+// Harness
+//
+// What htest and hbench both need around the note store: a scratch
+// directory under NOTESPATH, notes saved under numbered names, and
+// loading and indexing run to completion the way the UI drives them.
+//
+
+#include "hnote.h"
+
+// Creates the locks of the harness, once after InitNoteStore
+void InitHarness();
+
+// Scratch directory
+void ClearScratchDir(int removeShards);
+size_t CountNoteFiles();
+
+// Drops the notes, shards, catalog, pack and history out of the page cache.
+// Directory entries stay cached. Returns 0 if a file could not be dropped.
+int EvictScratchDir();
+
+// Notes named prefix followed by i, eight characters in all
+void TestNoteName(char* filename, const char* prefix, size_t i);
+Note* FindByFilename(const char* filename);
+
+// Inserts note under the name of i and saves a copy of text through the
+// writer, with its start as the preview
+Note* SaveTestNote(Note note, const char* prefix, size_t i, const char* text, size_t length);
+
+// Loads every note into the registry, batches are merged here the way
+// the UI merges them. Returns the number of notes loaded.
+size_t LoadAllNotes();
+
+// Builds the search index of the loaded notes and waits until it is ready
+void IndexAllNotes();
+
+// Queries the index and checks the notes it turned up the way the search
+// box does, waiting for the check. Returns the number of ids written to
+// *ids, which the caller frees.
+size_t QueryAndCheck(const char* query, NoteId** ids);
+
+#endif
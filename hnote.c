@@ -0,0 +1,6030 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hnote.h"
+#include "trace.h"
+
+char NOTESPATH[MAX_PATH + 1] = {0};
+int COMPRESSNOTES = 1;
+int TEXTKERNEL = TEXT_KERNEL_AVX2;
+
+struct NoteRegistry noteRegistry = {0};
+
+// 
+// Registry and .hnote format
+// 
+
+static inline NoteSlot* SlotAt(size_t slot) {
+  return &noteRegistry.pages[slot >> NOTE_PAGE_BITS][slot & (NOTE_PAGE_SIZE - 1)];
+}
+
+// Live note in the given slot, NULL if the slot is free. Used to iterate
+// all notes: for(size_t i = 0; i < noteRegistry.slotCount; ++i)
+Note* NoteAtSlot(size_t slot) {
+  if(slot >= noteRegistry.slotCount) return NULL;
+
+  NoteSlot* s = SlotAt(slot);
+  return s->live ? &s->note : NULL;
+}
+
+Note* Insert(Note n) {
+  size_t slot;
+
+  if(noteRegistry.freeHead) {
+    slot = noteRegistry.freeHead - 1;
+    noteRegistry.freeHead = SlotAt(slot)->nextFree;
+  }
+  else {
+    if(noteRegistry.slotCount > NOTE_SLOT_MASK) return NULL;
+
+    slot = noteRegistry.slotCount;
+    if((slot >> NOTE_PAGE_BITS) >= noteRegistry.pageCount) {
+      if(noteRegistry.pageCount >= noteRegistry.pageCapacity) {
+        size_t capacity = noteRegistry.pageCapacity ? noteRegistry.pageCapacity * 2 : 8;
+        NoteSlot** pages = realloc(noteRegistry.pages,sizeof(NoteSlot*) * capacity);
+        if(!pages) return NULL;
+
+        noteRegistry.pages = pages;
+        noteRegistry.pageCapacity = capacity;
+      }
+
+      NoteSlot* page = calloc(NOTE_PAGE_SIZE,sizeof(NoteSlot));
+      if(!page) return NULL;
+      noteRegistry.pages[noteRegistry.pageCount++] = page;
+    }
+
+    noteRegistry.slotCount++;
+    SlotAt(slot)->generation = 1;
+  }
+
+  NoteSlot* s = SlotAt(slot);
+  s->live = 1;
+  s->nextFree = 0;
+  s->note = n;
+  s->note.id = (s->generation << NOTE_SLOT_BITS) | (NoteId)slot;
+
+  noteRegistry.size++;
+  return &s->note;
+}
+
+void Remove(NoteId id) {
+  size_t slot = id & NOTE_SLOT_MASK;
+  if(slot >= noteRegistry.slotCount) return;
+
+  NoteSlot* s = SlotAt(slot);
+  if(!s->live || s->generation != id >> NOTE_SLOT_BITS) return;
+  UnorderNote(&s->note);
+
+  s->live = 0;
+  noteRegistry.size--;
+
+  // A slot whose generation ran out is retired instead of starting over at
+  // 1, where it would hand out the ids of its first notes again. Generation
+  // 0 is never used, so no handle ever equals INVALID_NOTEID.
+  if(s->generation == NOTE_GENERATION_MASK) {
+    noteRegistry.retired++;
+    return;
+  }
+  s->generation++;
+  s->nextFree = noteRegistry.freeHead;
+  noteRegistry.freeHead = slot + 1;
+}
+
+Note* Find(NoteId id) {
+  size_t slot = id & NOTE_SLOT_MASK;
+  if(slot >= noteRegistry.slotCount) return NULL;
+
+  NoteSlot* s = SlotAt(slot);
+  if(!s->live || s->generation != id >> NOTE_SLOT_BITS) return NULL;
+  return &s->note;
+}
+
+// Parses the start of a note file into a current version header. Legacy
+// separator-based configs are accepted and reported with their own body
+// offset, they get upgraded the next time the note is written.
+// Returns the body offset or -1 if the data is not a note.
+long ParseNoteHeader(const unsigned char* data, size_t size, long fileSize, NoteHeader* header) {
+  if(size >= sizeof(NoteHeader) && ((const NoteHeader*)data)->magic == NOTE_MAGIC) {
+    memcpy(header,data,sizeof(NoteHeader));
+    if(header->version > NOTE_VERSION || header->headerSize < sizeof(NoteHeader)) return -1;
+    if(header->headerSize > fileSize) return -1;
+
+    // Never trust the length beyond what is actually on disk
+    if(header->bodyLength > fileSize - header->headerSize)
+      header->bodyLength = fileSize - header->headerSize;
+    return header->headerSize;
+  }
+
+  if(size > LEGACY_CONFIG_SIZE && data[LEGACY_CONFIG_SIZE] == CONFIG_SEPARATOR) {
+    *header = (NoteHeader){
+      .magic = NOTE_MAGIC,
+      .version = 0,
+      .headerSize = LEGACY_CONFIG_SIZE + 1,
+      .opened = data[0]
+    };
+    memcpy(&header->x,data + 1,sizeof(int));
+    memcpy(&header->y,data + 1 + sizeof(int),sizeof(int));
+    memcpy(&header->width,data + 1 + sizeof(int) * 2,sizeof(int));
+    memcpy(&header->height,data + 1 + sizeof(int) * 3,sizeof(int));
+    header->bodyLength = fileSize - header->headerSize;
+    return header->headerSize;
+  }
+
+  return -1;
+}
+
+
+// Reads header and preview of a note in one bounded read. Touches no
+// shared state and is safe to call from any thread.
+int ReadNoteProbe(FILE* f, LoadedNote* loaded) {
+  unsigned char probe[NOTE_PROBE_SIZE];
+  size_t read = fread(probe,1,NOTE_PROBE_SIZE,f);
+  TRACE_COUNT(TRACE_BYTES_READ,read);
+
+  loaded->bodyOffset = ParseNoteHeader(probe,read,loaded->fileSize,&loaded->header);
+  if(loaded->bodyOffset < 0) return 0;
+
+  // Read and set preview of note
+  size_t available = (long)read > loaded->bodyOffset ? read - loaded->bodyOffset : 0;
+  SetNotePreview(loaded->preview,&loaded->header,(const char*)probe + loaded->bodyOffset,available);
+  return 1;
+}
+
+static const char createdDigits[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+
+// Creation time a new note name carries, 0 for names of older builds.
+// Names are "c" and the time in seconds as seven base 36 digits.
+static unsigned long long CreatedFromFilename(const char* filename) {
+  if(strlen(filename) != FILENAME_SIZE || filename[0] != 'c' || strcmp(filename + 8,NOTE_EXTENSION) != 0) return 0;
+
+  unsigned long long created = 0;
+  for(int i = 1; i < 8; ++i) {
+    const char* digit = memchr(createdDigits,filename[i],36);
+    if(!digit) return 0;
+    created = created * 36 + (digit - createdDigits);
+  }
+  return created;
+}
+
+Note* InitNoteFromLoaded(const LoadedNote* loaded) {
+  Note* note = Insert((Note){
+    .opened = loaded->header.opened != 0, 
+    .changes = 0, 
+    .x = loaded->header.x,
+    .y = loaded->header.y,
+    .width = loaded->header.width,
+    .height = loaded->header.height,
+    .catalogSlot = loaded->catalogSlot,
+    .bodyOffset = loaded->bodyOffset,
+    .bodyLength = loaded->header.bodyLength,
+    .created = CreatedFromFilename(loaded->filename),
+    .modified = loaded->mtime
+  });
+  if(!note) return NULL;
+
+  memcpy(note->filename,loaded->filename,sizeof(note->filename));
+  memcpy(note->preview,loaded->preview,sizeof(note->preview));
+  MatchNoteGeometry(note);
+  TRACE_COUNT(TRACE_NOTES_LOADED,1);
+  return note;
+}
+
+
+// 
+// Line endings
+// 
+// Notes are stored with LF line endings while the EDIT control wants
+// CRLF. Both directions run in one pass over 16 or 32 byte blocks, using
+// AVX2 where the CPU has it, SSE2 otherwise and plain C as a fallback.
+// Blocks without a line break are copied whole.
+// 
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#define TEXT_SIMD 1
+#endif
+
+// Copies src[from, to) to dst, dropping every CR followed by an LF whose
+// bit is set in mask (bit 0 is src[from]). Returns bytes written.
+static inline size_t DropMarkedCr(char* dst, const char* src, size_t from, size_t to, unsigned int mask) {
+  size_t written = 0, start = from;
+  while(mask) {
+    size_t at = from + __builtin_ctz(mask);
+    memmove(dst + written,src + start,at - start);
+    written += at - start;
+    start = at + 1;
+    mask &= mask - 1;
+  }
+  memmove(dst + written,src + start,to - start);
+  return written + (to - start);
+}
+
+// Copies src[from, to) to dst, putting a CR before every LF whose bit is
+// set in mask. Returns bytes written.
+static inline size_t InsertMarkedCr(char* dst, const char* src, size_t from, size_t to, unsigned int mask) {
+  size_t written = 0, start = from;
+  while(mask) {
+    size_t at = from + __builtin_ctz(mask);
+    memcpy(dst + written,src + start,at - start);
+    written += at - start;
+    dst[written++] = '\r';
+    start = at;
+    mask &= mask - 1;
+  }
+  memcpy(dst + written,src + start,to - start);
+  return written + (to - start);
+}
+
+static size_t CrlfToLfScalar(char* dst, const char* src, size_t i, size_t len, size_t j) {
+  for(; i < len; ++i) {
+    if(src[i] == '\r' && i + 1 < len && src[i + 1] == '\n') continue;
+    dst[j++] = src[i];
+  }
+  return j;
+}
+
+static size_t CountLoneLfScalar(const char* src, size_t i, size_t len) {
+  size_t count = 0;
+  for(; i < len; ++i) count += src[i] == '\n' && (i == 0 || src[i - 1] != '\r');
+  return count;
+}
+
+static size_t LfToCrlfScalar(char* dst, const char* src, size_t i, size_t len, size_t j) {
+  for(; i < len; ++i) {
+    if(src[i] == '\n' && (i == 0 || src[i - 1] != '\r')) dst[j++] = '\r';
+    dst[j++] = src[i];
+  }
+  return j;
+}
+
+#ifdef TEXT_SIMD
+#include <emmintrin.h>
+#include <immintrin.h>
+
+static size_t CrlfToLfSse2(char* dst, const char* src, size_t len) {
+  const __m128i cr = _mm_set1_epi8('\r'), lf = _mm_set1_epi8('\n');
+  size_t i = 0, j = 0;
+
+  // The look-ahead load needs one byte past the block
+  for(; i + 17 <= len; i += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i*)(src + i));
+    __m128i next = _mm_loadu_si128((const __m128i*)(src + i + 1));
+    unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block,cr),_mm_cmpeq_epi8(next,lf)));
+
+    if(!mask) {
+      _mm_storeu_si128((__m128i*)(dst + j),block);
+      j += 16;
+    }
+    else j += DropMarkedCr(dst + j,src,i,i + 16,mask);
+  }
+
+  return CrlfToLfScalar(dst,src,i,len,j);
+}
+
+// Marks every LF in the block at src + i not preceded by a CR, i >= 1
+static inline unsigned int LoneLfMaskSse2(const char* src, size_t i) {
+  __m128i block = _mm_loadu_si128((const __m128i*)(src + i));
+  __m128i prev = _mm_loadu_si128((const __m128i*)(src + i - 1));
+  return _mm_movemask_epi8(_mm_andnot_si128(_mm_cmpeq_epi8(prev,_mm_set1_epi8('\r')),_mm_cmpeq_epi8(block,_mm_set1_epi8('\n'))));
+}
+
+static size_t CountLoneLfSse2(const char* src, size_t len) {
+  size_t count = CountLoneLfScalar(src,0,len < 1 ? len : 1), i = 1;
+  for(; i + 16 <= len; i += 16) count += __builtin_popcount(LoneLfMaskSse2(src,i));
+  return count + CountLoneLfScalar(src,i,len);
+}
+
+static size_t LfToCrlfSse2(char* dst, const char* src, size_t len) {
+  size_t j = LfToCrlfScalar(dst,src,0,len < 1 ? len : 1,0), i = 1;
+
+  for(; i + 16 <= len; i += 16) {
+    unsigned int mask = LoneLfMaskSse2(src,i);
+    if(!mask) {
+      _mm_storeu_si128((__m128i*)(dst + j),_mm_loadu_si128((const __m128i*)(src + i)));
+      j += 16;
+    }
+    else j += InsertMarkedCr(dst + j,src,i,i + 16,mask);
+  }
+
+  return LfToCrlfScalar(dst,src,i,len,j);
+}
+
+__attribute__((target("avx2")))
+static size_t CrlfToLfAvx2(char* dst, const char* src, size_t len) {
+  const __m256i cr = _mm256_set1_epi8('\r'), lf = _mm256_set1_epi8('\n');
+  size_t i = 0, j = 0;
+
+  for(; i + 33 <= len; i += 32) {
+    __m256i block = _mm256_loadu_si256((const __m256i*)(src + i));
+    __m256i next = _mm256_loadu_si256((const __m256i*)(src + i + 1));
+    unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(block,cr),_mm256_cmpeq_epi8(next,lf)));
+
+    if(!mask) {
+      _mm256_storeu_si256((__m256i*)(dst + j),block);
+      j += 32;
+    }
+    else j += DropMarkedCr(dst + j,src,i,i + 32,mask);
+  }
+
+  return CrlfToLfScalar(dst,src,i,len,j);
+}
+
+__attribute__((target("avx2")))
+static inline unsigned int LoneLfMaskAvx2(const char* src, size_t i) {
+  __m256i block = _mm256_loadu_si256((const __m256i*)(src + i));
+  __m256i prev = _mm256_loadu_si256((const __m256i*)(src + i - 1));
+  return _mm256_movemask_epi8(_mm256_andnot_si256(_mm256_cmpeq_epi8(prev,_mm256_set1_epi8('\r')),_mm256_cmpeq_epi8(block,_mm256_set1_epi8('\n'))));
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t CountLoneLfAvx2(const char* src, size_t len) {
+  size_t count = CountLoneLfScalar(src,0,len < 1 ? len : 1), i = 1;
+  for(; i + 32 <= len; i += 32) count += __builtin_popcount(LoneLfMaskAvx2(src,i));
+  return count + CountLoneLfScalar(src,i,len);
+}
+
+__attribute__((target("avx2")))
+static size_t LfToCrlfAvx2(char* dst, const char* src, size_t len) {
+  size_t j = LfToCrlfScalar(dst,src,0,len < 1 ? len : 1,0), i = 1;
+
+  for(; i + 32 <= len; i += 32) {
+    unsigned int mask = LoneLfMaskAvx2(src,i);
+    if(!mask) {
+      _mm256_storeu_si256((__m256i*)(dst + j),_mm256_loadu_si256((const __m256i*)(src + i)));
+      j += 32;
+    }
+    else j += InsertMarkedCr(dst + j,src,i,i + 32,mask);
+  }
+
+  return LfToCrlfScalar(dst,src,i,len,j);
+}
+
+// The best kernel the CPU has, unless TEXTKERNEL asks for a plainer one
+static int TextKernel() {
+  static int avx2 = -1;
+  if(avx2 < 0) {
+    __builtin_cpu_init();
+    avx2 = __builtin_cpu_supports("avx2") != 0;
+  }
+  if(TEXTKERNEL >= TEXT_KERNEL_AVX2 && avx2) return TEXT_KERNEL_AVX2;
+  return TEXTKERNEL >= TEXT_KERNEL_SSE2 ? TEXT_KERNEL_SSE2 : TEXT_KERNEL_SCALAR;
+}
+#endif
+
+// Removes the CR of every CRLF pair. dst may be src. Returns the new length.
+size_t CrlfToLf(char* dst, const char* src, size_t len) {
+#ifdef TEXT_SIMD
+  int kernel = TextKernel();
+  if(kernel == TEXT_KERNEL_AVX2) return CrlfToLfAvx2(dst,src,len);
+  if(kernel == TEXT_KERNEL_SSE2) return CrlfToLfSse2(dst,src,len);
+#endif
+  return CrlfToLfScalar(dst,src,0,len,0);
+}
+
+// Number of LFs not already preceded by a CR, LfToCrlf writes len plus this
+size_t CountLoneLf(const char* src, size_t len) {
+#ifdef TEXT_SIMD
+  int kernel = TextKernel();
+  if(kernel == TEXT_KERNEL_AVX2) return CountLoneLfAvx2(src,len);
+  if(kernel == TEXT_KERNEL_SSE2) return CountLoneLfSse2(src,len);
+#endif
+  return CountLoneLfScalar(src,0,len);
+}
+
+// Puts a CR before every lone LF. dst must not overlap src and must have
+// room for len + CountLoneLf(src,len) bytes. Returns the new length.
+size_t LfToCrlf(char* dst, const char* src, size_t len) {
+#ifdef TEXT_SIMD
+  int kernel = TextKernel();
+  if(kernel == TEXT_KERNEL_AVX2) return LfToCrlfAvx2(dst,src,len);
+  if(kernel == TEXT_KERNEL_SSE2) return LfToCrlfSse2(dst,src,len);
+#endif
+  return LfToCrlfScalar(dst,src,0,len,0);
+}
+
+// Converts LF text for an EDIT control, NUL terminated. Takes ownership
+// of text and returns it unchanged if there is nothing to convert.
+char* ToEditText(char* text, size_t len) {
+  size_t lone = CountLoneLf(text,len);
+  if(!lone) return text;
+
+  char* converted = malloc(len + lone + 1);
+  if(!converted) return text;
+
+  converted[LfToCrlf(converted,text,len)] = '\0';
+  free(text);
+  return converted;
+}
+
+// Converts the piece of an LF body at offset at, about chunk bytes long
+// and never ending between a CR and its LF or inside a character, for an
+// EDIT control into out, NUL terminated. out needs room for 2 * chunk + 3
+// bytes. Returns the body bytes consumed.
+size_t NextEditChunk(const char* body, size_t length, size_t at, size_t chunk, char* out) {
+  size_t size = length - at < chunk ? length - at : chunk;
+  if(size && at + size < length && body[at + size - 1] == '\r' && body[at + size] == '\n') size++;
+  else if(at + size < length) {
+    size_t whole = Utf8Prefix(body + at,size);
+    if(whole) size = whole;
+  }
+
+  out[LfToCrlf(out,body + at,size)] = '\0';
+  return size;
+}
+
+// 
+// Unicode
+// 
+// Note text is UTF-8 on disk and UTF-16 in the window. Validation takes
+// 32 byte blocks with AVX2 and classifies every byte against the one
+// before it with three table lookups, checking the bytes two and three
+// back for the rest (Keiser and Lemire). The conversions widen or narrow
+// blocks of ASCII whole. Other blocks are decoded as if every byte began
+// a character, or encoded as if every unit took 3 bytes, then shuffled
+// together by a mask of where characters begin or how long they are.
+// Without AVX2, SSE2 handles ASCII blocks and the rest goes a character
+// at a time.
+// 
+
+// Bytes in the sequence the byte starts, 0 if it cannot start one
+static inline size_t Utf8SequenceLength(unsigned char lead) {
+  if(lead < 0x80) return 1;
+  if(lead < 0xC2) return 0;
+  if(lead < 0xE0) return 2;
+  if(lead < 0xF0) return 3;
+  return lead < 0xF5 ? 4 : 0;
+}
+
+// Length of the well formed character at src + i, 0 if there is none.
+// The second byte's range rules out overlong forms, surrogates and code
+// points past U+10FFFF.
+static inline size_t Utf8SequenceAt(const unsigned char* src, size_t i, size_t len) {
+  size_t n = Utf8SequenceLength(src[i]);
+  if(n < 2) return n;
+  if(len - i < n) return 0;
+
+  unsigned char lead = src[i], second = src[i + 1];
+  unsigned char low = lead == 0xE0 ? 0xA0 : lead == 0xF0 ? 0x90 : 0x80;
+  unsigned char high = lead == 0xED ? 0x9F : lead == 0xF4 ? 0x8F : 0xBF;
+  if(second < low || second > high) return 0;
+
+  for(size_t k = 2; k < n; ++k)
+    if((src[i + k] & 0xC0) != 0x80) return 0;
+  return n;
+}
+
+static int IsValidUtf8Scalar(const unsigned char* src, size_t i, size_t len) {
+  while(i < len) {
+    size_t n = Utf8SequenceAt(src,i,len);
+    if(!n) return 0;
+    i += n;
+  }
+  return 1;
+}
+
+// Decodes the character at src + *at of valid UTF-8 and moves past it.
+// Returns the units written, 2 for a surrogate pair.
+static inline size_t DecodeUtf8(unsigned short* dst, const unsigned char* src, size_t* at) {
+  size_t i = *at;
+  unsigned int c = src[i];
+
+  if(c < 0x80) {
+    *at = i + 1;
+    dst[0] = c;
+    return 1;
+  }
+  if(c < 0xE0) {
+    *at = i + 2;
+    dst[0] = (c & 0x1F) << 6 | (src[i + 1] & 0x3F);
+    return 1;
+  }
+  if(c < 0xF0) {
+    *at = i + 3;
+    dst[0] = (c & 0x0F) << 12 | (src[i + 1] & 0x3F) << 6 | (src[i + 2] & 0x3F);
+    return 1;
+  }
+
+  *at = i + 4;
+  c = ((c & 0x07) << 18 | (src[i + 1] & 0x3F) << 12 | (src[i + 2] & 0x3F) << 6 | (src[i + 3] & 0x3F)) - 0x10000;
+  dst[0] = 0xD800 | c >> 10;
+  dst[1] = 0xDC00 | (c & 0x3FF);
+  return 2;
+}
+
+// Encodes the character at src + *at and moves past it, a surrogate
+// without its other half becomes U+FFFD. Returns the bytes written.
+static inline size_t EncodeUtf8(char* dst, const unsigned short* src, size_t* at, size_t len) {
+  size_t i = *at;
+  unsigned int c = src[i];
+  *at = i + 1;
+
+  if(c < 0x80) {
+    dst[0] = c;
+    return 1;
+  }
+  if(c < 0x800) {
+    dst[0] = 0xC0 | c >> 6;
+    dst[1] = 0x80 | (c & 0x3F);
+    return 2;
+  }
+  if(c >= 0xD800 && c <= 0xDFFF) {
+    if(c <= 0xDBFF && i + 1 < len && src[i + 1] >= 0xDC00 && src[i + 1] <= 0xDFFF) {
+      c = 0x10000 + ((c - 0xD800) << 10) + (src[i + 1] - 0xDC00);
+      *at = i + 2;
+      dst[0] = 0xF0 | c >> 18;
+      dst[1] = 0x80 | (c >> 12 & 0x3F);
+      dst[2] = 0x80 | (c >> 6 & 0x3F);
+      dst[3] = 0x80 | (c & 0x3F);
+      return 4;
+    }
+    c = 0xFFFD;
+  }
+  dst[0] = 0xE0 | c >> 12;
+  dst[1] = 0x80 | (c >> 6 & 0x3F);
+  dst[2] = 0x80 | (c & 0x3F);
+  return 3;
+}
+
+static size_t Utf8ToUtf16Scalar(unsigned short* dst, const unsigned char* src, size_t i, size_t len, size_t j) {
+  while(i < len) j += DecodeUtf8(dst + j,src,&i);
+  return j;
+}
+
+static size_t Utf16ToUtf8Scalar(char* dst, const unsigned short* src, size_t i, size_t len, size_t j) {
+  while(i < len) j += EncodeUtf8(dst + j,src,&i,len);
+  return j;
+}
+
+#ifdef TEXT_SIMD
+// Decodes the character of valid UTF-8 starting at src without a branch.
+// Reads 4 bytes at src and writes 2 units at dst, returns the units that
+// count.
+static inline size_t DecodeUtf8At(unsigned short* dst, const unsigned char* src) {
+  static const unsigned char lengths[16] = {1,1,1,1,1,1,1,1,1,1,1,1,2,2,3,4};
+  static const unsigned char leadMasks[5] = {0,0x7F,0x1F,0x0F,0x07};
+  size_t n = lengths[src[0] >> 4];
+
+  unsigned int c = (src[0] & leadMasks[n]) << 18 | (src[1] & 0x3F) << 12 | (src[2] & 0x3F) << 6 | (src[3] & 0x3F);
+  c >>= 6 * (4 - n);
+
+  unsigned int pair = c >= 0x10000, high = c - 0x10000;
+  dst[0] = pair ? 0xD800 | high >> 10 : c;
+  dst[1] = 0xDC00 | (high & 0x3FF);
+  return 1 + pair;
+}
+
+// EncodeUtf8 picking between the 1, 2 and 3 byte forms without a branch.
+// Writes 4 bytes at dst.
+static inline size_t EncodeUtf8Branchless(char* dst, const unsigned short* src, size_t* at, size_t len) {
+  unsigned int c = src[*at];
+  if(c - 0xD800 < 0x800) return EncodeUtf8(dst,src,at,len);
+
+  size_t n = 1 + (c >= 0x80) + (c >= 0x800);
+  unsigned int two = (0xC0 | c >> 6) | (0x80 | (c & 0x3F)) << 8;
+  unsigned int three = (0xE0 | c >> 12) | (0x80 | (c >> 6 & 0x3F)) << 8 | (0x80 | (c & 0x3F)) << 16;
+  unsigned int bytes = n == 1 ? c : n == 2 ? two : three;
+
+  memcpy(dst,&bytes,4);
+  *at += 1;
+  return n;
+}
+
+// Shuffles for _mm_shuffle_epi8. utf16Compaction packs the 16 bit lanes
+// set in a mask of 8. utf8Compaction packs 8 lanes of lead and
+// continuation byte pairs into characters of 2 bytes where a mask is set
+// and of 1 byte where it is not. utf8Compaction3 packs 4 lanes of 3 bytes
+// into characters of 1 to 3 bytes, the low 4 bits of the mask set for
+// more than 1 and the high 4 for 3.
+static unsigned char utf16Compaction[256][16];
+static unsigned char utf8Compaction[256][16];
+static unsigned char utf8Compaction3[256][16];
+static unsigned char utf8Compaction3Length[256];
+
+static void InitCompactionTables() {
+  for(int mask = 0; mask < 256; ++mask) {
+    memset(utf16Compaction[mask],0x80,16);
+    memset(utf8Compaction[mask],0x80,16);
+    memset(utf8Compaction3[mask],0x80,16);
+
+    for(int lane = 0, packed = 0, bytes = 0; lane < 8; ++lane) {
+      int set = mask >> lane & 1;
+      if(set) {
+        utf16Compaction[mask][packed++] = 2 * lane;
+        utf16Compaction[mask][packed++] = 2 * lane + 1;
+      }
+      utf8Compaction[mask][bytes++] = 2 * lane;
+      if(set) utf8Compaction[mask][bytes++] = 2 * lane + 1;
+    }
+
+    int bytes = 0;
+    for(int lane = 0; lane < 4; ++lane) {
+      int length = 1 + (mask >> lane & 1) + (mask >> (lane + 4) & 1);
+      for(int k = 0; k < length; ++k) utf8Compaction3[mask][bytes++] = 4 * lane + k;
+    }
+    utf8Compaction3Length[mask] = bytes;
+  }
+}
+
+static int IsValidUtf8Sse2(const unsigned char* src, size_t len) {
+  size_t i = 0;
+  while(i + 16 <= len) {
+    if(!_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)(src + i)))) {
+      i += 16;
+      continue;
+    }
+
+    // Checks characters until one ends at or past the block
+    for(size_t end = i + 16; i < end;) {
+      size_t n = Utf8SequenceAt(src,i,len);
+      if(!n) return 0;
+      i += n;
+    }
+  }
+  return IsValidUtf8Scalar(src,i,len);
+}
+
+// A block with other than ASCII is decoded from each of its bytes that
+// starts a character, found by a compare instead of by the length of the
+// character before. Those may read 3 bytes past the block.
+static size_t Utf8ToUtf16Sse2(unsigned short* dst, const unsigned char* src, size_t len) {
+  const __m128i zero = _mm_setzero_si128(), lastContinuation = _mm_set1_epi8((char)0xBF);
+  size_t i = 0, j = 0;
+
+  for(; i + 16 + 3 <= len; i += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i*)(src + i));
+    if(!_mm_movemask_epi8(block)) {
+      _mm_storeu_si128((__m128i*)(dst + j),_mm_unpacklo_epi8(block,zero));
+      _mm_storeu_si128((__m128i*)(dst + j + 8),_mm_unpackhi_epi8(block,zero));
+      j += 16;
+      continue;
+    }
+
+    for(unsigned int starts = _mm_movemask_epi8(_mm_cmpgt_epi8(block,lastContinuation)); starts; starts &= starts - 1)
+      j += DecodeUtf8At(dst + j,src + i + __builtin_ctz(starts));
+  }
+
+  // The last block may end inside a character it has already decoded
+  while(i < len && (src[i] & 0xC0) == 0x80) i++;
+  return Utf8ToUtf16Scalar(dst,src,i,len,j);
+}
+
+static size_t Utf16ToUtf8Sse2(char* dst, const unsigned short* src, size_t len) {
+  const __m128i notAscii = _mm_set1_epi16((short)0xFF80), zero = _mm_setzero_si128();
+  size_t i = 0, j = 0;
+
+  while(i + 16 + 3 <= len) {
+    __m128i low = _mm_loadu_si128((const __m128i*)(src + i));
+    __m128i high = _mm_loadu_si128((const __m128i*)(src + i + 8));
+    __m128i wide = _mm_and_si128(_mm_or_si128(low,high),notAscii);
+
+    if(_mm_movemask_epi8(_mm_cmpeq_epi16(wide,zero)) == 0xFFFF) {
+      _mm_storeu_si128((__m128i*)(dst + j),_mm_packus_epi16(low,high));
+      i += 16;
+      j += 16;
+    }
+    else for(size_t end = i + 16; i < end;) j += EncodeUtf8Branchless(dst + j,src,&i,len);
+  }
+
+  return Utf16ToUtf8Scalar(dst,src,i,len,j);
+}
+
+// Flags of the Keiser-Lemire lookup, set in all three tables only for a
+// pair of bytes that cannot follow each other
+enum {
+  UTF8_TOO_SHORT = 1 << 0,      // Lead or ASCII where a continuation is due
+  UTF8_TOO_LONG = 1 << 1,       // Continuation after ASCII
+  UTF8_OVERLONG_3 = 1 << 2,
+  UTF8_TOO_LARGE = 1 << 3,
+  UTF8_SURROGATE = 1 << 4,
+  UTF8_OVERLONG_2 = 1 << 5,
+  UTF8_TOO_LARGE_1000 = 1 << 6,
+  UTF8_OVERLONG_4 = 1 << 6,
+  UTF8_TWO_CONTS = 1 << 7,      // Continuation after a continuation, fine in 3 and 4 byte characters
+  UTF8_CARRY = UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS
+};
+
+// A table for _mm256_shuffle_epi8, the same 16 entries in both lanes
+#define UTF8_TABLE(...) _mm256_setr_epi8(__VA_ARGS__,__VA_ARGS__)
+
+// The block shifted back by n bytes, the first n taken from the end of prev
+#define UTF8_PREV(block,prev,n) _mm256_alignr_epi8(block,_mm256_permute2x128_si256(prev,block,0x21),16 - (n))
+
+__attribute__((target("avx2")))
+static inline __m256i Utf8BlockErrorsAvx2(__m256i block, __m256i prev) {
+  const __m256i nibble = _mm256_set1_epi8(0x0F);
+  __m256i prev1 = UTF8_PREV(block,prev,1);
+
+  __m256i byte1High = _mm256_shuffle_epi8(UTF8_TABLE(
+    UTF8_TOO_LONG,UTF8_TOO_LONG,UTF8_TOO_LONG,UTF8_TOO_LONG,
+    UTF8_TOO_LONG,UTF8_TOO_LONG,UTF8_TOO_LONG,UTF8_TOO_LONG,
+    UTF8_TWO_CONTS,UTF8_TWO_CONTS,UTF8_TWO_CONTS,UTF8_TWO_CONTS,
+    UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+    UTF8_TOO_SHORT,
+    UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+    UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4
+  ),_mm256_and_si256(_mm256_srli_epi16(prev1,4),nibble));
+
+  __m256i byte1Low = _mm256_shuffle_epi8(UTF8_TABLE(
+    UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4,
+    UTF8_CARRY | UTF8_OVERLONG_2,
+    UTF8_CARRY,
+    UTF8_CARRY,
+    UTF8_CARRY | UTF8_TOO_LARGE,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000
+  ),_mm256_and_si256(prev1,nibble));
+
+  __m256i byte2High = _mm256_shuffle_epi8(UTF8_TABLE(
+    UTF8_TOO_SHORT,UTF8_TOO_SHORT,UTF8_TOO_SHORT,UTF8_TOO_SHORT,
+    UTF8_TOO_SHORT,UTF8_TOO_SHORT,UTF8_TOO_SHORT,UTF8_TOO_SHORT,
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE,
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE,
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE,
+    UTF8_TOO_SHORT,UTF8_TOO_SHORT,UTF8_TOO_SHORT,UTF8_TOO_SHORT
+  ),_mm256_and_si256(_mm256_srli_epi16(block,4),nibble));
+
+  __m256i special = _mm256_and_si256(_mm256_and_si256(byte1High,byte1Low),byte2High);
+
+  // Continuations two or three bytes after a 3 or 4 byte lead are the
+  // only TWO_CONTS allowed, and they must be there
+  __m256i third = _mm256_subs_epu8(UTF8_PREV(block,prev,2),_mm256_set1_epi8(0xE0 - 0x80));
+  __m256i fourth = _mm256_subs_epu8(UTF8_PREV(block,prev,3),_mm256_set1_epi8(0xF0 - 0x80));
+  __m256i expected = _mm256_and_si256(_mm256_or_si256(third,fourth),_mm256_set1_epi8((char)0x80));
+  return _mm256_xor_si256(expected,special);
+}
+
+__attribute__((target("avx2")))
+static int IsValidUtf8Avx2(const unsigned char* src, size_t len) {
+  __m256i errors = _mm256_setzero_si256(), prev = errors, incomplete = errors;
+  // A lead in the last three bytes of a block that needs more than is left
+  const __m256i lastLeads = _mm256_setr_epi8(
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,(char)(0xF0 - 1),(char)(0xE0 - 1),(char)(0xC0 - 1));
+  size_t i = 0;
+
+  for(; i + 32 <= len; i += 32) {
+    __m256i block = _mm256_loadu_si256((const __m256i*)(src + i));
+    if(!_mm256_movemask_epi8(block)) errors = _mm256_or_si256(errors,incomplete);
+    else {
+      errors = _mm256_or_si256(errors,Utf8BlockErrorsAvx2(block,prev));
+      incomplete = _mm256_subs_epu8(block,lastLeads);
+    }
+    prev = block;
+  }
+  if(!_mm256_testz_si256(errors,errors)) return 0;
+
+  // The tail is checked from the start of the character the blocks end in
+  size_t from = i;
+  while(from > 0 && i - from < 3 && (src[from - 1] & 0xC0) == 0x80) from--;
+  if(from > 0 && src[from - 1] >= 0xC0) from--;
+  return IsValidUtf8Scalar(src,from,len);
+}
+
+// Decodes 16 bytes of valid UTF-8 without 4 byte characters as if every
+// byte started a character, into 16 bit lanes, then packs the lanes of
+// the bytes that do. Reads 2 bytes past the block and writes up to 16
+// units. Returns the units that count.
+__attribute__((target("avx2")))
+static inline size_t DecodeUtf8BlockAvx2(unsigned short* dst, const unsigned char* src, unsigned int starts) {
+  __m256i lead = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)src));
+  __m256i second = _mm256_and_si256(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(src + 1))),_mm256_set1_epi16(0x3F));
+  __m256i third = _mm256_and_si256(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(src + 2))),_mm256_set1_epi16(0x3F));
+
+  __m256i two = _mm256_or_si256(_mm256_slli_epi16(_mm256_and_si256(lead,_mm256_set1_epi16(0x1F)),6),second);
+  __m256i three = _mm256_or_si256(_mm256_slli_epi16(lead,12),_mm256_or_si256(_mm256_slli_epi16(second,6),third));
+  __m256i units = _mm256_blendv_epi8(lead,two,_mm256_cmpgt_epi16(lead,_mm256_set1_epi16(0xBF)));
+  units = _mm256_blendv_epi8(units,three,_mm256_cmpgt_epi16(lead,_mm256_set1_epi16(0xDF)));
+
+  unsigned int low = starts & 0xFF, high = starts >> 8 & 0xFF;
+  _mm_storeu_si128((__m128i*)dst,_mm_shuffle_epi8(_mm256_castsi256_si128(units),_mm_loadu_si128((const __m128i*)utf16Compaction[low])));
+  dst += __builtin_popcount(low);
+  _mm_storeu_si128((__m128i*)dst,_mm_shuffle_epi8(_mm256_extracti128_si256(units,1),_mm_loadu_si128((const __m128i*)utf16Compaction[high])));
+  return __builtin_popcount(low) + __builtin_popcount(high);
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t Utf8ToUtf16Avx2(unsigned short* dst, const unsigned char* src, size_t len) {
+  const __m256i lastContinuation = _mm256_set1_epi8((char)0xBF), lastThreeByteLead = _mm256_set1_epi8((char)0xEF);
+  size_t i = 0, j = 0;
+
+  for(; i + 32 + 3 <= len; i += 32) {
+    __m256i block = _mm256_loadu_si256((const __m256i*)(src + i));
+    if(!_mm256_movemask_epi8(block)) {
+      _mm256_storeu_si256((__m256i*)(dst + j),_mm256_cvtepu8_epi16(_mm256_castsi256_si128(block)));
+      _mm256_storeu_si256((__m256i*)(dst + j + 16),_mm256_cvtepu8_epi16(_mm256_extracti128_si256(block,1)));
+      j += 32;
+      continue;
+    }
+
+    unsigned int starts = _mm256_movemask_epi8(_mm256_cmpgt_epi8(block,lastContinuation));
+    __m256i fourByteLeads = _mm256_subs_epu8(block,lastThreeByteLead);
+    if(_mm256_testz_si256(fourByteLeads,fourByteLeads)) {
+      j += DecodeUtf8BlockAvx2(dst + j,src + i,starts & 0xFFFF);
+      j += DecodeUtf8BlockAvx2(dst + j,src + i + 16,starts >> 16);
+      continue;
+    }
+
+    for(; starts; starts &= starts - 1) j += DecodeUtf8At(dst + j,src + i + __builtin_ctz(starts));
+  }
+
+  while(i < len && (src[i] & 0xC0) == 0x80) i++;
+  return Utf8ToUtf16Scalar(dst,src,i,len,j);
+}
+
+// Encodes 8 units below U+0800 as lead and continuation byte pairs in 16
+// bit lanes, then packs each pair into the 1 or 2 bytes of its character.
+// Writes 16 bytes, returns the bytes that count.
+__attribute__((target("avx2,popcnt")))
+static inline size_t EncodeUtf8BlockAvx2(char* dst, __m128i units) {
+  __m128i wide = _mm_cmpeq_epi16(_mm_subs_epu16(units,_mm_set1_epi16(0x7F)),_mm_setzero_si128());
+  unsigned int twoBytes = ~_mm_movemask_epi8(_mm_packs_epi16(wide,wide)) & 0xFF;
+
+  __m128i lead = _mm_blendv_epi8(_mm_or_si128(_mm_srli_epi16(units,6),_mm_set1_epi16(0xC0)),units,wide);
+  __m128i continuation = _mm_or_si128(_mm_and_si128(units,_mm_set1_epi16(0x3F)),_mm_set1_epi16(0x80));
+  __m128i pairs = _mm_or_si128(lead,_mm_slli_epi16(continuation,8));
+
+  _mm_storeu_si128((__m128i*)dst,_mm_shuffle_epi8(pairs,_mm_loadu_si128((const __m128i*)utf8Compaction[twoBytes])));
+  return 8 + __builtin_popcount(twoBytes);
+}
+
+// Encodes 4 units of the BMP other than surrogates, in the low half of
+// units, as 3 bytes in 32 bit lanes, then packs each into the 1 to 3
+// bytes of its character. Writes 16 bytes, returns the bytes that count.
+__attribute__((target("avx2")))
+static inline size_t EncodeUtf8Block3Avx2(char* dst, __m128i units) {
+  __m128i wide = _mm_cvtepu16_epi32(units);
+  __m128i continuation = _mm_or_si128(_mm_and_si128(wide,_mm_set1_epi32(0x3F)),_mm_set1_epi32(0x80));
+  __m128i middle = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(wide,6),_mm_set1_epi32(0x3F)),_mm_set1_epi32(0x80));
+
+  __m128i two = _mm_or_si128(_mm_or_si128(_mm_srli_epi32(wide,6),_mm_set1_epi32(0xC0)),_mm_slli_epi32(continuation,8));
+  __m128i three = _mm_or_si128(_mm_or_si128(_mm_srli_epi32(wide,12),_mm_set1_epi32(0xE0)),
+                               _mm_or_si128(_mm_slli_epi32(middle,8),_mm_slli_epi32(continuation,16)));
+
+  __m128i isTwo = _mm_cmpgt_epi32(wide,_mm_set1_epi32(0x7F)), isThree = _mm_cmpgt_epi32(wide,_mm_set1_epi32(0x7FF));
+  __m128i bytes = _mm_blendv_epi8(_mm_blendv_epi8(wide,two,isTwo),three,isThree);
+
+  unsigned int mask = _mm_movemask_ps(_mm_castsi128_ps(isTwo)) | _mm_movemask_ps(_mm_castsi128_ps(isThree)) << 4;
+  _mm_storeu_si128((__m128i*)dst,_mm_shuffle_epi8(bytes,_mm_loadu_si128((const __m128i*)utf8Compaction3[mask])));
+  return utf8Compaction3Length[mask];
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t Utf16ToUtf8Avx2(char* dst, const unsigned short* src, size_t len) {
+  const __m256i notAscii = _mm256_set1_epi16((short)0xFF80);
+  const __m128i lastTwoByte = _mm_set1_epi16(0x7FF), surrogateBits = _mm_set1_epi16((short)0xF800), surrogate = _mm_set1_epi16((short)0xD800);
+  size_t i = 0, j = 0;
+
+  // Groups of 8 read and write past the block of 32
+  while(i + 32 + 8 <= len) {
+    __m256i low = _mm256_loadu_si256((const __m256i*)(src + i));
+    __m256i high = _mm256_loadu_si256((const __m256i*)(src + i + 16));
+
+    if(_mm256_testz_si256(_mm256_or_si256(low,high),notAscii)) {
+      // Packing works per lane, the permute puts the quarters back in order
+      __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(low,high),0xD8);
+      _mm256_storeu_si256((__m256i*)(dst + j),packed);
+      i += 32;
+      j += 32;
+      continue;
+    }
+
+    // Groups of 8 units below U+0800 at once, of the rest of the BMP 4 at
+    // a time, surrogates by the unit
+    for(size_t end = i + 32; i < end;) {
+      __m128i units = _mm_loadu_si128((const __m128i*)(src + i));
+      __m128i above = _mm_subs_epu16(units,lastTwoByte);
+      __m128i surrogates = _mm_cmpeq_epi16(_mm_and_si128(units,surrogateBits),surrogate);
+
+      if(_mm_testz_si128(above,above)) {
+        j += EncodeUtf8BlockAvx2(dst + j,units);
+        i += 8;
+      }
+      else if(_mm_testz_si128(surrogates,surrogates)) {
+        j += EncodeUtf8Block3Avx2(dst + j,units);
+        j += EncodeUtf8Block3Avx2(dst + j,_mm_srli_si128(units,8));
+        i += 8;
+      }
+      else for(size_t run = i + 8; i < run;) j += EncodeUtf8Branchless(dst + j,src,&i,len);
+    }
+  }
+
+  return Utf16ToUtf8Scalar(dst,src,i,len,j);
+}
+#endif
+
+// 1 if the text is well formed UTF-8
+int IsValidUtf8(const char* src, size_t len) {
+#ifdef TEXT_SIMD
+  int kernel = TextKernel();
+  if(kernel == TEXT_KERNEL_AVX2) return IsValidUtf8Avx2((const unsigned char*)src,len);
+  if(kernel == TEXT_KERNEL_SSE2) return IsValidUtf8Sse2((const unsigned char*)src,len);
+#endif
+  return IsValidUtf8Scalar((const unsigned char*)src,0,len);
+}
+
+// Converts UTF-8 to UTF-16. dst needs room for len units. Returns the
+// units written, or (size_t)-1 without writing if src is not UTF-8.
+size_t Utf8ToUtf16(unsigned short* dst, const char* src, size_t len) {
+  if(!IsValidUtf8(src,len)) return (size_t)-1;
+#ifdef TEXT_SIMD
+  int kernel = TextKernel();
+  if(kernel == TEXT_KERNEL_AVX2) return Utf8ToUtf16Avx2(dst,(const unsigned char*)src,len);
+  if(kernel == TEXT_KERNEL_SSE2) return Utf8ToUtf16Sse2(dst,(const unsigned char*)src,len);
+#endif
+  return Utf8ToUtf16Scalar(dst,(const unsigned char*)src,0,len,0);
+}
+
+// Converts UTF-16 to UTF-8. dst needs room for 3 * len bytes. Returns the
+// bytes written.
+size_t Utf16ToUtf8(char* dst, const unsigned short* src, size_t len) {
+#ifdef TEXT_SIMD
+  int kernel = TextKernel();
+  if(kernel == TEXT_KERNEL_AVX2) return Utf16ToUtf8Avx2(dst,src,len);
+  if(kernel == TEXT_KERNEL_SSE2) return Utf16ToUtf8Sse2(dst,src,len);
+#endif
+  return Utf16ToUtf8Scalar(dst,src,0,len,0);
+}
+
+// Length of the first len bytes of UTF-8 text without a character cut
+// off at their end
+size_t Utf8Prefix(const char* text, size_t len) {
+  for(size_t back = 1; back <= 4 && back <= len; ++back) {
+    unsigned char c = text[len - back];
+    if((c & 0xC0) == 0x80) continue;
+    return Utf8SequenceLength(c) > back ? len - back : len;
+  }
+  return len;
+}
+
+// 
+// Body compression
+// 
+// Bodies of NOTE_COMPRESS_MIN_SIZE bytes or more are stored compressed
+// when that saves at least an eighth, marked by NOTE_FLAG_COMPRESSED. Such
+// a body is a BodyStream followed by blocks of up to BODY_BLOCK_SIZE bytes
+// of text, each compressed on its own with a byte oriented LZ77 in the
+// manner of LZ4. The preview decodes from the start of the first block,
+// a full read decodes every block as soon as it has been read.
+// 
+// A block is a run of sequences: a token with the literal count in the
+// high and the match length minus LZ_MIN_MATCH in the low nibble (15
+// continues in bytes of up to 255), the literals, then a two byte offset
+// back into the output. The last sequence has literals only.
+// 
+
+#define BODY_BLOCK_SIZE (64 * 1024)
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 14
+#define LZ_LAST_LITERALS 5
+#define LZ_MATCH_LIMIT 12     // No match starts closer than this to the end
+
+typedef struct BodyStream {
+  unsigned int rawLength;
+  unsigned int blockCount;
+} BodyStream;
+
+typedef struct BodyBlock {
+  unsigned int rawLength;
+  unsigned int packedLength;            // Equal to rawLength if stored as is
+} BodyBlock;
+
+static inline unsigned int LzRead32(const unsigned char* p) {
+  unsigned int value;
+  memcpy(&value,p,sizeof(value));
+  return value;
+}
+
+static inline unsigned int LzHash(unsigned int value) {
+  return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static inline unsigned char* LzPutLength(unsigned char* op, size_t length) {
+  for(; length >= 255; length -= 255) *op++ = 255;
+  *op++ = (unsigned char)length;
+  return op;
+}
+
+// Returns the compressed size, 0 if it does not fit in capacity
+static size_t LzCompressBlock(const unsigned char* src, size_t len, unsigned char* dst, size_t capacity) {
+  unsigned short table[1 << LZ_HASH_BITS] = {0};
+  const unsigned char *ip = src, *anchor = src, *end = src + len;
+  const unsigned char* matchLimit = len > LZ_MATCH_LIMIT ? end - LZ_MATCH_LIMIT : src;
+  unsigned char *op = dst, *opEnd = dst + capacity;
+
+  while(ip < matchLimit) {
+    unsigned int hash = LzHash(LzRead32(ip));
+    const unsigned char* ref = src + table[hash];
+    table[hash] = (unsigned short)(ip - src);
+
+    if(ref >= ip || LzRead32(ref) != LzRead32(ip)) {
+      ip += 1 + ((ip - anchor) >> 6);   // Skip faster through data that does not match
+      continue;
+    }
+
+    const unsigned char* matchEnd = ip + LZ_MIN_MATCH;
+    ref += LZ_MIN_MATCH;
+    while(matchEnd < end - LZ_LAST_LITERALS && *matchEnd == *ref) {
+      matchEnd++;
+      ref++;
+    }
+
+    size_t literals = ip - anchor, matchLength = matchEnd - ip - LZ_MIN_MATCH;
+    if((size_t)(opEnd - op) < literals + literals / 255 + matchLength / 255 + 6) return 0;
+
+    unsigned char* token = op++;
+    *token = (literals < 15 ? literals : 15) << 4 | (matchLength < 15 ? matchLength : 15);
+    if(literals >= 15) op = LzPutLength(op,literals - 15);
+    memcpy(op,anchor,literals);
+    op += literals;
+
+    unsigned int offset = (unsigned int)(matchEnd - ref);
+    *op++ = offset & 0xFF;
+    *op++ = offset >> 8;
+    if(matchLength >= 15) op = LzPutLength(op,matchLength - 15);
+
+    ip = anchor = matchEnd;
+  }
+
+  size_t literals = end - anchor;
+  if((size_t)(opEnd - op) < literals + literals / 255 + 2) return 0;
+
+  *op++ = (literals < 15 ? literals : 15) << 4;
+  if(literals >= 15) op = LzPutLength(op,literals - 15);
+  memcpy(op,anchor,literals);
+  return op + literals - dst;
+}
+
+// Decodes at most limit bytes of a block into out and returns how many it
+// wrote. Stops early at the end of src or at anything malformed, so a
+// caller wanting the whole block compares the result to its length.
+static size_t LzDecodeBlock(const unsigned char* src, size_t len, unsigned char* out, size_t limit) {
+  const unsigned char *ip = src, *end = src + len;
+  size_t o = 0;
+
+  while(ip < end && o < limit) {
+    unsigned int token = *ip++;
+
+    size_t literals = token >> 4;
+    if(literals == 15) {
+      unsigned int more;
+      do {
+        if(ip >= end) return o;
+        literals += more = *ip++;
+      } while(more == 255);
+    }
+
+    size_t copy = literals;
+    if(copy > (size_t)(end - ip)) copy = end - ip;
+    if(copy > limit - o) copy = limit - o;
+    if(copy + 8 <= (size_t)(end - ip) && copy + 8 <= limit - o)
+      for(size_t i = 0; i < copy; i += 8) memcpy(out + o + i,ip + i,8);
+    else memcpy(out + o,ip,copy);
+    ip += copy;
+    o += copy;
+    if(copy < literals || end - ip < 2) return o;
+
+    size_t offset = ip[0] | ip[1] << 8;
+    ip += 2;
+    if(!offset || offset > o) return o;
+
+    size_t matchLength = (token & 15) + LZ_MIN_MATCH;
+    if((token & 15) == 15) {
+      unsigned int more;
+      do {
+        if(ip >= end) return o;
+        matchLength += more = *ip++;
+      } while(more == 255);
+    }
+    if(matchLength > limit - o) matchLength = limit - o;
+
+    // Copies run in 8 byte steps where there is room to overshoot. An
+    // offset shorter than that repeats the bytes it covers one by one.
+    const unsigned char* match = out + o - offset;
+    if(offset >= 8 && matchLength + 8 <= limit - o)
+      for(size_t i = 0; i < matchLength; i += 8) memcpy(out + o + i,match + i,8);
+    else for(size_t i = 0; i < matchLength; ++i) out[o + i] = match[i];
+    o += matchLength;
+  }
+  return o;
+}
+
+// Compresses a body into a BodyStream and its blocks. Returns NULL if the
+// body is too short or would not shrink by an eighth.
+char* CompressNoteBody(const char* body, size_t length, size_t* packedLength) {
+  if(length < NOTE_COMPRESS_MIN_SIZE || length > UINT_MAX) return NULL;
+
+  size_t blockCount = (length + BODY_BLOCK_SIZE - 1) / BODY_BLOCK_SIZE;
+  size_t limit = length - length / 8;
+  if(sizeof(BodyStream) + blockCount * sizeof(BodyBlock) >= limit) return NULL;
+
+  char* packed = malloc(limit);
+  if(!packed) return NULL;
+
+  BodyStream stream = {.rawLength = length, .blockCount = blockCount};
+  memcpy(packed,&stream,sizeof(stream));
+  size_t at = sizeof(stream);
+
+  for(size_t done = 0; done < length;) {
+    BodyBlock block = {.rawLength = length - done < BODY_BLOCK_SIZE ? length - done : BODY_BLOCK_SIZE};
+    if(limit - at < sizeof(block)) break;
+
+    size_t room = limit - at - sizeof(block);
+    unsigned char* data = (unsigned char*)packed + at + sizeof(block);
+    block.packedLength = LzCompressBlock((const unsigned char*)body + done,block.rawLength,data,room);
+
+    if(!block.packedLength || block.packedLength >= block.rawLength) {
+      if(room < block.rawLength) break;
+      memcpy(data,body + done,block.rawLength);
+      block.packedLength = block.rawLength;
+    }
+
+    memcpy(packed + at,&block,sizeof(block));
+    at += sizeof(block) + block.packedLength;
+    done += block.rawLength;
+    if(done == length) {
+      *packedLength = at;
+      return packed;
+    }
+  }
+
+  free(packed);
+  return NULL;
+}
+
+// Compresses body for storage when COMPRESSNOTES is on and it pays off,
+// updating header to match. Returns NULL to store body as it is.
+static char* CompressForStore(NoteHeader* header, const char* body) {
+  size_t packedLength;
+  char* packed = COMPRESSNOTES ? CompressNoteBody(body,header->bodyLength,&packedLength) : NULL;
+  if(packed) {
+    header->version = NOTE_VERSION;
+    header->flags |= NOTE_FLAG_COMPRESSED;
+    header->bodyLength = packedLength;
+  }
+  return packed;
+}
+
+// Reads the body stored at offset of file, decoding a compressed one block
+// by block as it is read. Returns it NUL terminated, NULL if it is corrupt.
+static char* ReadBodyAt(FileHandle file, unsigned long long offset, const NoteHeader* header, long* length) {
+  if(!(header->flags & NOTE_FLAG_COMPRESSED)) {
+    char* body = malloc(header->bodyLength + 1);
+    if(body && FileReadAt(file,offset,body,header->bodyLength)) {
+      body[header->bodyLength] = '\0';
+      *length = header->bodyLength;
+      return body;
+    }
+    free(body);
+    return NULL;
+  }
+
+  BodyStream stream;
+  if(header->bodyLength < sizeof(stream) || !FileReadAt(file,offset,&stream,sizeof(stream)) || stream.rawLength > INT_MAX)
+    return NULL;
+
+  char* body = malloc(stream.rawLength + 1);
+  unsigned char* scratch = malloc(BODY_BLOCK_SIZE);
+  unsigned long long at = offset + sizeof(stream), end = offset + header->bodyLength;
+  size_t produced = 0;
+
+  for(unsigned int i = 0; body && scratch && i < stream.blockCount; ++i) {
+    BodyBlock block;
+    if(end - at < sizeof(block) || !FileReadAt(file,at,&block,sizeof(block))) break;
+    at += sizeof(block);
+
+    if(block.rawLength > BODY_BLOCK_SIZE || block.rawLength > stream.rawLength - produced ||
+       block.packedLength > block.rawLength || block.packedLength > end - at)
+      break;
+
+    if(block.packedLength == block.rawLength) {
+      if(!FileReadAt(file,at,body + produced,block.rawLength)) break;
+    }
+    else if(!FileReadAt(file,at,scratch,block.packedLength) ||
+            LzDecodeBlock(scratch,block.packedLength,(unsigned char*)body + produced,block.rawLength) != block.rawLength)
+      break;
+
+    at += block.packedLength;
+    produced += block.rawLength;
+  }
+  free(scratch);
+
+  if(!body || produced != stream.rawLength) {
+    free(body);
+    return NULL;
+  }
+  body[produced] = '\0';
+  *length = produced;
+  return body;
+}
+
+// Decodes a stored body that is in memory already, NUL terminated. NULL
+// if it is corrupt.
+static char* DecodeBody(const NoteHeader* header, const char* stored, long* length) {
+  if(!(header->flags & NOTE_FLAG_COMPRESSED)) {
+    char* body = malloc((size_t)header->bodyLength + 1);
+    if(!body) return NULL;
+
+    memcpy(body,stored,header->bodyLength);
+    body[header->bodyLength] = '\0';
+    *length = header->bodyLength;
+    return body;
+  }
+
+  BodyStream stream;
+  if(header->bodyLength < sizeof(stream)) return NULL;
+  memcpy(&stream,stored,sizeof(stream));
+  if(stream.rawLength > INT_MAX) return NULL;
+
+  char* body = malloc((size_t)stream.rawLength + 1);
+  size_t at = sizeof(stream), end = header->bodyLength, produced = 0;
+
+  for(unsigned int i = 0; body && i < stream.blockCount; ++i) {
+    BodyBlock block;
+    if(end - at < sizeof(block)) break;
+    memcpy(&block,stored + at,sizeof(block));
+    at += sizeof(block);
+
+    if(block.rawLength > BODY_BLOCK_SIZE || block.rawLength > stream.rawLength - produced ||
+       block.packedLength > block.rawLength || block.packedLength > end - at)
+      break;
+
+    if(block.packedLength == block.rawLength) memcpy(body + produced,stored + at,block.rawLength);
+    else if(LzDecodeBlock((const unsigned char*)stored + at,block.packedLength,(unsigned char*)body + produced,block.rawLength) != block.rawLength)
+      break;
+
+    at += block.packedLength;
+    produced += block.rawLength;
+  }
+
+  if(!body || produced != stream.rawLength) {
+    free(body);
+    return NULL;
+  }
+  body[produced] = '\0';
+  *length = produced;
+  return body;
+}
+
+// Sets the preview from the start of a stored body, of which available
+// bytes are at hand, cut before a character that does not fit. A
+// compressed one needs only the start of its first block.
+void SetNotePreview(char* preview, const NoteHeader* header, const char* body, size_t available) {
+  size_t length = 0;
+  if(available > header->bodyLength) available = header->bodyLength;
+
+  if(!(header->flags & NOTE_FLAG_COMPRESSED)) {
+    length = available < PREVIEW_SIZE ? available : PREVIEW_SIZE;
+    memcpy(preview,body,length);
+  }
+  else if(available >= sizeof(BodyStream) + sizeof(BodyBlock)) {
+    BodyBlock block;
+    memcpy(&block,body + sizeof(BodyStream),sizeof(block));
+    const unsigned char* data = (const unsigned char*)body + sizeof(BodyStream) + sizeof(block);
+
+    size_t limit = block.rawLength < PREVIEW_SIZE ? block.rawLength : PREVIEW_SIZE;
+    size_t size = available - sizeof(BodyStream) - sizeof(block);
+    if(size > block.packedLength) size = block.packedLength;
+
+    if(block.packedLength != block.rawLength) length = LzDecodeBlock(data,size,(unsigned char*)preview,limit);
+    else {
+      length = size < limit ? size : limit;
+      memcpy(preview,data,length);
+    }
+  }
+
+  if(length < header->bodyLength) length = Utf8Prefix(preview,length);
+  if(!length) memcpy(preview,EMPTYNOTE_STRING,sizeof(EMPTYNOTE_STRING));
+  else preview[length] = '\0';
+}
+
+// 
+// Record tables
+// 
+// The catalog and the geometry table are files of fixed size records, one
+// per note, each starting with the note's file name. At startup the whole
+// file is read with one read and indexed by name, and the records no note
+// claimed are freed once loading is done. After that the writer thread
+// keeps the file current with one positioned write per changed record,
+// and rewrites it whole when it did not match the records in memory.
+// 
+
+#define RECORD_MAX_SIZE 128
+
+typedef struct RecordTableHeader {
+  unsigned int magic;
+  unsigned short version;
+  unsigned short recordSize;
+  unsigned int reserved[2];
+} RecordTableHeader;
+
+static_assert(sizeof(RecordTableHeader) == 16, "record table header must stay fixed size");
+
+typedef struct RecordTable {
+  const char* filename;                 // In NOTESPATH
+  unsigned int magic;
+  unsigned short version;
+  unsigned short recordSize;            // Records start with char filename[FILENAME_SIZE + 2]
+  Lock* lock;
+  unsigned char* records;
+  size_t count, capacity;
+  unsigned int* freeSlots;
+  size_t freeCount, freeCapacity;
+  int* index;                           // Filename -> slot + 1, only while loading
+  size_t indexSize;
+  unsigned char* seen;                  // Slots claimed by a note while loading
+  size_t seenCount;
+  int dirty;                            // Records differ from the file
+  FileHandle file;                      // Writer thread only
+} RecordTable;
+
+unsigned int HashString(const char* s) {
+  unsigned int hash = 2166136261u;
+  while(*s) hash = (hash ^ (unsigned char)*s++) * 16777619u;
+  return hash;
+}
+
+static void TablePath(const RecordTable* table, char* buffer, size_t size, const char* suffix) {
+  snprintf(buffer,size,"%s" PATH_SEPARATOR "%s%s",NOTESPATH,table->filename,suffix);
+}
+
+static inline void* TableRecord(const RecordTable* table, size_t slot) {
+  return table->records + slot * table->recordSize;
+}
+
+static int PushFreeTableSlot(RecordTable* table, unsigned int slot) {
+  if(table->freeCount >= table->freeCapacity) {
+    size_t capacity = table->freeCapacity ? table->freeCapacity * 2 : 64;
+    unsigned int* slots = realloc(table->freeSlots,sizeof(unsigned int) * capacity);
+    if(!slots) return 0;
+
+    table->freeSlots = slots;
+    table->freeCapacity = capacity;
+  }
+  table->freeSlots[table->freeCount++] = slot;
+  return 1;
+}
+
+// Reads the whole file with one read and indexes it by file name. Returns
+// 0 if there is no usable file, the table stays empty then.
+static int LoadRecordTable(RecordTable* table) {
+  table->file = NULL;
+
+  char path[MAX_PATH + 1];
+  TablePath(table,path,sizeof(path),"");
+
+  FileHandle file = FileOpen(path,FILE_READ);
+  if(!file) return 0;
+
+  unsigned long long size = FileSize(file);
+  unsigned char* data = NULL;
+  size_t read = 0;
+  if(size >= sizeof(RecordTableHeader) && size < INT_MAX) {
+    data = malloc((size_t)size);
+    if(data && FileReadAt(file,0,data,(size_t)size)) read = (size_t)size;
+  }
+  FileClose(file);
+
+  const RecordTableHeader* header = (const RecordTableHeader*)data;
+  if(read < sizeof(RecordTableHeader) || header->magic != table->magic ||
+     header->version != table->version || header->recordSize != table->recordSize) {
+    free(data);
+    table->dirty = 1;
+    return 0;
+  }
+
+  size_t count = (read - sizeof(RecordTableHeader)) / table->recordSize;
+  table->records = malloc(table->recordSize * (count ? count : 1));
+  table->seen = calloc(count ? count : 1,1);
+  table->indexSize = 16;
+  while(table->indexSize < count * 2) table->indexSize *= 2;
+  table->index = calloc(table->indexSize,sizeof(int));
+
+  if(!table->records || !table->seen || !table->index) {
+    free(table->records); free(table->seen); free(table->index); free(data);
+    table->records = NULL; table->seen = NULL; table->index = NULL;
+    table->dirty = 1;
+    return 0;
+  }
+
+  memcpy(table->records,data + sizeof(RecordTableHeader),table->recordSize * count);
+  table->count = table->capacity = table->seenCount = count;
+  free(data);
+
+  // A second record of the same name is never found, FinishTableMatching
+  // frees it
+  for(size_t i = 0; i < count; ++i) {
+    char* filename = TableRecord(table,i);
+    filename[FILENAME_SIZE + 1] = '\0';
+
+    if(!filename[0]) {
+      PushFreeTableSlot(table,i);
+      continue;
+    }
+
+    size_t mask = table->indexSize - 1;
+    size_t h = HashString(filename) & mask;
+    while(table->index[h]) h = (h + 1) & mask;
+    table->index[h] = (int)i + 1;
+  }
+  return 1;
+}
+
+// Slot of the record of a note, which counts as claimed from now on. -1
+// if there is none. With the lock held, while loading.
+static int FindTableRecord(RecordTable* table, const char* filename) {
+  if(!table->index) return -1;
+
+  size_t mask = table->indexSize - 1;
+  for(size_t h = HashString(filename) & mask; table->index[h]; h = (h + 1) & mask) {
+    int slot = table->index[h] - 1;
+    if(strcmp(TableRecord(table,slot),filename) == 0) {
+      table->seen[slot] = 1;
+      return slot;
+    }
+  }
+  return -1;
+}
+
+// Frees the records no note claimed, once loading is done
+static void FinishTableMatching(RecordTable* table) {
+  if(!table->index) return;
+
+  AcquireLock(table->lock);
+  for(size_t i = 0; i < table->seenCount; ++i) {
+    char* filename = TableRecord(table,i);
+    if(table->seen[i] || !filename[0]) continue;
+
+    memset(filename,0,table->recordSize);
+    PushFreeTableSlot(table,i);
+    table->dirty = 1;
+  }
+
+  free(table->index);
+  free(table->seen);
+  table->index = NULL;
+  table->seen = NULL;
+  ReleaseLock(table->lock);
+}
+
+// A zeroed record for a new note, -1 if there is no memory. With the lock
+// held.
+static int TakeTableSlot(RecordTable* table) {
+  int slot;
+  if(table->freeCount) slot = table->freeSlots[--table->freeCount];
+  else {
+    if(table->count >= table->capacity) {
+      size_t capacity = table->capacity ? table->capacity * 2 : 64;
+      unsigned char* records = realloc(table->records,table->recordSize * capacity);
+      if(!records) return -1;
+
+      table->records = records;
+      table->capacity = capacity;
+    }
+    slot = (int)table->count++;
+  }
+  memset(TableRecord(table,slot),0,table->recordSize);
+  return slot;
+}
+
+// Empties a record and frees its slot. With the lock held.
+static void ClearTableRecord(RecordTable* table, int slot) {
+  memset(TableRecord(table,slot),0,table->recordSize);
+  PushFreeTableSlot(table,slot);
+}
+
+static int OpenTableFile(RecordTable* table) {
+  if(table->file) return 1;
+
+  char path[MAX_PATH + 1];
+  TablePath(table,path,sizeof(path),"");
+
+  table->file = FileOpen(path,FILE_READWRITE);
+  if(!table->file) return 0;
+
+  RecordTableHeader header = {.magic = table->magic, .version = table->version, .recordSize = table->recordSize};
+  return FileWriteAt(table->file,0,&header,sizeof(header));
+}
+
+// Writer thread: writes one record in place, whatever it holds by now
+static int WriteTableRecord(RecordTable* table, int slot) {
+  if(slot < 0 || !OpenTableFile(table)) return 0;
+
+  unsigned char record[RECORD_MAX_SIZE];
+  AcquireLock(table->lock);
+  memcpy(record,TableRecord(table,slot),table->recordSize);
+  ReleaseLock(table->lock);
+
+  return FileWriteAt(table->file,sizeof(RecordTableHeader) + (unsigned long long)slot * table->recordSize,record,table->recordSize);
+}
+
+static int TableIsDirty(RecordTable* table) {
+  AcquireLock(table->lock);
+  int dirty = table->dirty;
+  ReleaseLock(table->lock);
+  return dirty;
+}
+
+// Writer thread: replaces the file with the records in memory
+static void RewriteRecordTable(RecordTable* table) {
+  char path[MAX_PATH + 1], tmppath[MAX_PATH + 1];
+  TablePath(table,path,sizeof(path),"");
+  TablePath(table,tmppath,sizeof(tmppath),".tmp");
+
+  FileClose(table->file);
+  table->file = NULL;
+
+  FileHandle file = FileOpen(tmppath,FILE_CREATE);
+  if(!file) return;
+
+  RecordTableHeader header = {.magic = table->magic, .version = table->version, .recordSize = table->recordSize};
+  int ok = FileWriteAt(file,0,&header,sizeof(header));
+
+  AcquireLock(table->lock);
+  if(ok && table->count)
+    ok = FileWriteAt(file,sizeof(header),table->records,table->recordSize * table->count);
+  table->dirty = 0;
+  ReleaseLock(table->lock);
+
+  if(ok) ok = FileFlush(file);
+  FileClose(file);
+
+  if(!ok || !FileReplace(tmppath,path))
+    FileDelete(tmppath);
+}
+
+// Drops all records, the table keeps its file format and lock
+static void ResetRecordTable(RecordTable* table) {
+  FileClose(table->file);
+  free(table->records);
+  free(table->freeSlots);
+  free(table->index);
+  free(table->seen);
+  *table = (RecordTable){.filename = table->filename, .magic = table->magic, .version = table->version,
+                         .recordSize = table->recordSize, .lock = table->lock};
+}
+
+// 
+// Catalog
+// 
+// catalog.hcat keeps one record per note with everything the list needs.
+// At startup a note whose size and last write time still match its
+// record is listed without opening its file. The writer thread keeps the
+// file current with one positioned write per save or delete.
+// 
+
+#define CATALOG_FILENAME "catalog.hcat"
+#define CATALOG_MAGIC 0x54414348 // "HCAT"
+#define CATALOG_VERSION 1
+
+typedef struct CatalogRecord {
+  char filename[FILENAME_SIZE + 2];     // Empty if the slot is free
+  unsigned long long mtime;             // Last write time of the note file
+  unsigned int fileSize;
+  unsigned int bodyOffset;
+  NoteHeader header;
+  char preview[PREVIEW_SIZE + 4];
+} CatalogRecord;
+
+static_assert(sizeof(CatalogRecord) == 104, "catalog record must stay fixed size");
+static_assert(sizeof(CatalogRecord) <= RECORD_MAX_SIZE, "catalog record must fit a table record");
+
+static RecordTable catalog = {
+  .filename = CATALOG_FILENAME,
+  .magic = CATALOG_MAGIC,
+  .version = CATALOG_VERSION,
+  .recordSize = sizeof(CatalogRecord)
+};
+
+// Reads the whole catalog and indexes it by file name. Called by
+// StartLoadingNotes before the notes directory is enumerated.
+void LoadCatalog() {
+  if(!LoadRecordTable(&catalog)) {
+    catalog.dirty = 1;
+    return;
+  }
+
+  for(size_t i = 0; i < catalog.count; ++i) {
+    CatalogRecord* record = TableRecord(&catalog,i);
+    record->preview[PREVIEW_SIZE] = '\0';
+  }
+}
+
+// Looks up the record of a file found while loading. On a match the note is
+// filled from the record and 1 is returned, otherwise the slot to refresh
+// (or -1) is left in loaded->catalogSlot.
+int MatchCatalogRecord(LoadedNote* loaded) {
+  loaded->catalogSlot = -1;
+  if(!catalog.index) return 0;
+
+  AcquireLock(catalog.lock);
+  int slot = FindTableRecord(&catalog,loaded->filename);
+
+  int matched = 0;
+  if(slot >= 0) {
+    const CatalogRecord* record = TableRecord(&catalog,slot);
+    loaded->catalogSlot = slot;
+
+    if(record->fileSize == (unsigned int)loaded->fileSize && record->mtime == loaded->mtime) {
+      loaded->header = record->header;
+      loaded->bodyOffset = record->bodyOffset;
+      memcpy(loaded->preview,record->preview,sizeof(loaded->preview));
+      loaded->valid = 1;
+      matched = 1;
+    }
+  }
+  if(!matched) catalog.dirty = 1;
+
+  ReleaseLock(catalog.lock);
+  return matched;
+}
+
+// Frees the records of notes that no longer exist, once enumeration is done
+void FinishCatalogMatching() {
+  FinishTableMatching(&catalog);
+}
+
+int AllocateCatalogSlot() {
+  AcquireLock(catalog.lock);
+  int slot = TakeTableSlot(&catalog);
+  ReleaseLock(catalog.lock);
+  return slot;
+}
+
+// Stores a record in memory only, written out later by the writer thread
+void SetCatalogRecord(int slot, const char* filename, unsigned int fileSize, unsigned long long mtime, const NoteHeader* header, long bodyOffset, const char* preview) {
+  if(slot < 0) return;
+
+  AcquireLock(catalog.lock);
+  CatalogRecord* record = TableRecord(&catalog,slot);
+  memset(record,0,sizeof(CatalogRecord));
+  snprintf(record->filename,sizeof(record->filename),"%s",filename);
+  record->mtime = mtime;
+  record->fileSize = fileSize;
+  record->bodyOffset = bodyOffset;
+  record->header = *header;
+  snprintf(record->preview,sizeof(record->preview),"%s",preview);
+  ReleaseLock(catalog.lock);
+}
+
+// Writer thread: writes one record in place
+void WriteCatalogRecord(int slot) {
+  WriteTableRecord(&catalog,slot);
+}
+
+// Forgets a record found to be invalid while loading
+void DropCatalogRecord(int slot) {
+  if(slot < 0) return;
+
+  AcquireLock(catalog.lock);
+  ClearTableRecord(&catalog,slot);
+  catalog.dirty = 1;
+  ReleaseLock(catalog.lock);
+}
+
+int CatalogIsDirty() {
+  return TableIsDirty(&catalog);
+}
+
+// Writer thread: clears the record of a deleted note and frees its slot
+// once the cleared record is written
+void FreeCatalogSlot(int slot) {
+  if(slot < 0) return;
+
+  AcquireLock(catalog.lock);
+  memset(TableRecord(&catalog,slot),0,sizeof(CatalogRecord));
+  ReleaseLock(catalog.lock);
+
+  WriteCatalogRecord(slot);
+
+  AcquireLock(catalog.lock);
+  PushFreeTableSlot(&catalog,slot);
+  ReleaseLock(catalog.lock);
+}
+
+// Writer thread: replaces the catalog file with the records in memory
+void RewriteCatalog() {
+  RewriteRecordTable(&catalog);
+}
+
+// Writes to a temporary file next to the target and renames it over the
+// target only once the data is flushed, a crash leaves the old note intact.
+// The last write time is set explicitly so the catalog knows it.
+int WriteNoteFileAtomically(const char* filepath, const NoteHeader* header, const char* body, unsigned long long* mtime) {
+  char tmppath[MAX_PATH + 8];
+  snprintf(tmppath,sizeof(tmppath),"%s.tmp",filepath);
+
+  FileHandle file = FileOpen(tmppath,FILE_CREATE);
+  if(!file) return 0;
+
+  int ok = FileWriteAt(file,0,header,sizeof(NoteHeader));
+  if(ok && header->bodyLength)
+    ok = FileWriteAt(file,sizeof(NoteHeader),body,header->bodyLength);
+  if(ok) {
+    *mtime = FileTouch(file);
+    ok = *mtime && FileFlush(file);
+  }
+  FileClose(file);
+
+  if(ok) ok = FileReplace(tmppath,filepath);
+  if(!ok) FileDelete(tmppath);
+  return ok;
+}
+
+// 
+// Geometry table
+// 
+// geometry.hgeo keeps the window of every note, whether it is open and
+// how open windows are stacked, in a record table apart from the note
+// files. Moving a window or opening a note costs one positioned write of
+// its record, and nothing at all when the record already says the same.
+// A record overrides the geometry in the header of the note, which saves
+// still fill in for older builds.
+// 
+
+#define GEOMETRY_FILENAME "geometry.hgeo"
+#define GEOMETRY_MAGIC 0x4F454748 // "HGEO"
+#define GEOMETRY_VERSION 1
+
+typedef struct GeometryRecord {
+  char filename[FILENAME_SIZE + 2];     // Empty if the slot is free
+  int opened;
+  int x,y,width,height;
+  unsigned int zOrder;
+} GeometryRecord;
+
+static_assert(sizeof(GeometryRecord) == 40, "geometry record must stay fixed size");
+static_assert(sizeof(GeometryRecord) <= RECORD_MAX_SIZE, "geometry record must fit a table record");
+
+static RecordTable geometry = {
+  .filename = GEOMETRY_FILENAME,
+  .magic = GEOMETRY_MAGIC,
+  .version = GEOMETRY_VERSION,
+  .recordSize = sizeof(GeometryRecord)
+};
+static unsigned int topZOrder = 0;      // Highest stacking handed out, UI thread only
+
+// Reads the whole table and indexes it by file name. Called by
+// StartLoadingNotes, notes pick up their records as they are merged.
+void LoadGeometry() {
+  if(!LoadRecordTable(&geometry)) return;
+
+  for(size_t i = 0; i < geometry.count; ++i) {
+    const GeometryRecord* record = TableRecord(&geometry,i);
+    if(record->zOrder > topZOrder) topZOrder = record->zOrder;
+  }
+}
+
+// Gives a loaded note the window of its record, if it has one
+void MatchNoteGeometry(Note* note) {
+  if(!geometry.index) return;
+
+  AcquireLock(geometry.lock);
+  int slot = FindTableRecord(&geometry,note->filename);
+  if(slot >= 0) {
+    const GeometryRecord* record = TableRecord(&geometry,slot);
+    note->geometryRecord = slot + 1;
+    note->opened = record->opened;
+    note->x = record->x;
+    note->y = record->y;
+    note->width = record->width;
+    note->height = record->height;
+    note->zOrder = record->zOrder;
+  }
+  ReleaseLock(geometry.lock);
+}
+
+// Frees the records of notes that no longer exist, once loading is done
+void FinishGeometryMatching() {
+  FinishTableMatching(&geometry);
+}
+
+// Puts the window of a note into its record, in memory only. Returns the
+// slot to write, or -1 if the record says the same already.
+static int StoreNoteGeometry(Note* note) {
+  GeometryRecord record = {
+    .opened = note->opened,
+    .x = note->x,
+    .y = note->y,
+    .width = note->width,
+    .height = note->height,
+    .zOrder = note->zOrder
+  };
+  snprintf(record.filename,sizeof(record.filename),"%s",note->filename);
+
+  AcquireLock(geometry.lock);
+  int slot = note->geometryRecord - 1;
+  if(slot >= 0 && memcmp(TableRecord(&geometry,slot),&record,sizeof(record)) == 0) slot = -1;
+  else {
+    if(slot < 0 && (slot = TakeTableSlot(&geometry)) >= 0) note->geometryRecord = slot + 1;
+    if(slot >= 0) memcpy(TableRecord(&geometry,slot),&record,sizeof(record));
+  }
+  ReleaseLock(geometry.lock);
+  return slot;
+}
+
+// Frees the record of a deleted note in memory. Returns the slot to write,
+// -1 if the note had no record.
+static int ClearNoteGeometry(Note* note) {
+  int slot = note->geometryRecord - 1;
+  if(slot < 0) return -1;
+
+  AcquireLock(geometry.lock);
+  ClearTableRecord(&geometry,slot);
+  ReleaseLock(geometry.lock);
+
+  note->geometryRecord = 0;
+  return slot;
+}
+
+// Puts the window of a note in front of all others in the stacking kept
+// by the table
+void RaiseNote(Note* note) {
+  if(note->zOrder != topZOrder || !note->zOrder) note->zOrder = ++topZOrder;
+}
+
+// Writer thread: writes one record in place, whatever it holds by now
+int WriteGeometryRecord(int slot) {
+  return WriteTableRecord(&geometry,slot);
+}
+
+int GeometryIsDirty() {
+  return TableIsDirty(&geometry);
+}
+
+// Writer thread: replaces the table file with the records in memory
+void RewriteGeometry() {
+  RewriteRecordTable(&geometry);
+}
+
+// The one-off conversions run before the UI starts read the table
+// themselves, from BeginGeometryLookups to EndGeometryLookups
+static void BeginGeometryLookups() {
+  ResetRecordTable(&geometry);
+  topZOrder = 0;
+  LoadGeometry();
+}
+
+// Puts the window a note is shown with into its header, from its record
+// if it has one. Returns the stacking of the window, 0 without a record.
+static unsigned int ApplyStoredGeometry(const char* filename, NoteHeader* header) {
+  AcquireLock(geometry.lock);
+  int slot = FindTableRecord(&geometry,filename);
+  GeometryRecord record = {0};
+  if(slot >= 0) record = *(const GeometryRecord*)TableRecord(&geometry,slot);
+  ReleaseLock(geometry.lock);
+  if(slot < 0) return 0;
+
+  header->opened = record.opened;
+  header->x = record.x;
+  header->y = record.y;
+  header->width = record.width;
+  header->height = record.height;
+  return record.zOrder;
+}
+
+// Gives an imported note the window from its header, stacked zOrder above
+// the windows of the store. Kept in memory until EndGeometryLookups.
+static void SetStoredGeometry(const char* filename, const NoteHeader* header, unsigned int zOrder) {
+  GeometryRecord record = {
+    .opened = header->opened,
+    .x = header->x,
+    .y = header->y,
+    .width = header->width,
+    .height = header->height,
+    .zOrder = zOrder
+  };
+  snprintf(record.filename,sizeof(record.filename),"%s",filename);
+
+  AcquireLock(geometry.lock);
+  int slot = FindTableRecord(&geometry,filename);
+  if(slot < 0) slot = TakeTableSlot(&geometry);
+  if(slot >= 0) memcpy(TableRecord(&geometry,slot),&record,sizeof(record));
+  geometry.dirty = 1;
+  ReleaseLock(geometry.lock);
+}
+
+// Writes the table if an import changed it and drops it again
+static void EndGeometryLookups() {
+  if(TableIsDirty(&geometry)) RewriteGeometry();
+  ResetRecordTable(&geometry);
+  topZOrder = 0;
+}
+
+// 
+// Note files
+// 
+// Loose notes are spread over NOTE_SHARD_COUNT subdirectories of NOTESPATH,
+// named by two hex digits of a hash of the note's file name, so no single
+// directory grows with the store. A note's journal sits next to it. Stores
+// from before the shards keep their notes in NOTESPATH itself, they are
+// moved into their shards at the next start. That move is one rename per
+// file, so a move that is cut short simply goes on the next time. Names
+// longer than FILENAME_SIZE, which the catalog, pack and archive formats
+// cannot hold, get a new name on the way, and so does such a file found
+// in a shard when the shard is listed.
+// 
+
+static inline unsigned int NoteShard(const char* filename) {
+  return HashString(filename) & (NOTE_SHARD_COUNT - 1);
+}
+
+static void ShardPath(char* buffer, size_t size, const char* dir, unsigned int shard) {
+  snprintf(buffer,size,"%s" PATH_SEPARATOR "%02x",dir,shard);
+}
+
+static void NotePathIn(char* buffer, size_t size, const char* dir, const char* filename, const char* suffix) {
+  snprintf(buffer,size,"%s" PATH_SEPARATOR "%02x" PATH_SEPARATOR "%s%s",dir,NoteShard(filename),filename,suffix);
+}
+
+// Path of the loose file of a note, with suffix appended
+void NotePath(char* buffer, size_t size, const char* filename, const char* suffix) {
+  NotePathIn(buffer,size,NOTESPATH,filename,suffix);
+}
+
+// Creates the shard directories, before anything is saved. Shards are made
+// in order, so once the last one exists there is nothing left to do.
+int PrepareNoteShards() {
+  char path[MAX_PATH + 1];
+  unsigned long long size, mtime;
+  ShardPath(path,sizeof(path),NOTESPATH,NOTE_SHARD_COUNT - 1);
+  if(FileStamp(path,&size,&mtime)) return 1;
+
+  for(unsigned int shard = 0; shard < NOTE_SHARD_COUNT; ++shard) {
+    ShardPath(path,sizeof(path),NOTESPATH,shard);
+    if(!DirCreate(path)) return 0;
+  }
+  return 1;
+}
+
+// Name for a note whose own name does not fit or is taken in its shard:
+// "m" and seven base 36 digits of a hash of the old name, counted up
+// until it is free, and until it falls into shard unless that is -1. The
+// "c" names of new notes never collide with these.
+static void MigratedFilename(char* filename, const char* old, int shard) {
+  unsigned long long value = HashString(old) % 78364164096ull;  // 36^7
+
+  for(;; value = (value + 1) % 78364164096ull) {
+    unsigned long long rest = value;
+    filename[0] = 'm';
+    for(int i = 7; i >= 1; --i) {
+      filename[i] = createdDigits[rest % 36];
+      rest /= 36;
+    }
+    memcpy(filename + 8,NOTE_EXTENSION,sizeof(NOTE_EXTENSION));
+    if(shard >= 0 && NoteShard(filename) != (unsigned int)shard) continue;
+
+    char path[MAX_PATH + 1];
+    unsigned long long size, mtime;
+    NotePath(path,sizeof(path),filename,"");
+    if(!FileStamp(path,&size,&mtime)) return;
+  }
+}
+
+// Moves a note of the flat layout into its shard, its journal first so a
+// note in a shard always has its journal with it
+static int MoveFlatNote(const char* name, unsigned long long size, unsigned long long mtime, void* context) {
+  char from[MAX_PATH + 1], to[MAX_PATH + 1], filename[FILENAME_SIZE + 1];
+  unsigned long long existingSize, existingMtime;
+
+  snprintf(filename,sizeof(filename),"%s",name);
+  NotePath(to,sizeof(to),filename,"");
+  int renamed = strlen(name) > FILENAME_SIZE || FileStamp(to,&existingSize,&existingMtime);
+  if(renamed) {
+    // Never listed or shadowed by a note of the same name, so it has no
+    // journal or history that would have to follow it
+    MigratedFilename(filename,name,-1);
+    NotePath(to,sizeof(to),filename,"");
+  }
+  else {
+    char journal[MAX_PATH + 1];
+    snprintf(from,sizeof(from),"%s" PATH_SEPARATOR "%s" JOURNAL_EXTENSION,NOTESPATH,name);
+    NotePath(journal,sizeof(journal),filename,JOURNAL_EXTENSION);
+    if(FileStamp(from,&existingSize,&existingMtime) && !FileReplace(from,journal)) return 1;
+  }
+
+  snprintf(from,sizeof(from),"%s" PATH_SEPARATOR "%s",NOTESPATH,name);
+  if(FileReplace(from,to) && renamed) TRACE_COUNT(TRACE_NOTES_RENAMED,1);
+  (*(size_t*)context)++;
+  return 1;
+}
+
+// Moves whatever is left of the flat layout into the shards. Returns the
+// number of notes moved.
+static size_t MigrateFlatNotes() {
+  size_t moved = 0;
+  if(PrepareNoteShards()) DirList(NOTESPATH,NOTE_EXTENSION,MoveFlatNote,&moved);
+  return moved;
+}
+
+typedef struct ShardListing {
+  int (*visit)(const char* name, unsigned long long size, unsigned long long mtime, void* context);
+  void* context;
+  unsigned int shard;
+  int longNames;                        // Seen a name longer than FILENAME_SIZE
+} ShardListing;
+
+// A name too long for the store only gets into a shard when the file is
+// copied there by hand. It is given a migrated name in the shard it was
+// found in once the shard has been listed, so the listing neither misses
+// the note nor comes across it twice, and visited under that name.
+static int RenameLongNoteFile(const char* name, unsigned long long size, unsigned long long mtime, void* context) {
+  ShardListing* listing = context;
+  if(strlen(name) <= FILENAME_SIZE) return 1;
+
+  char from[MAX_PATH + 1], to[MAX_PATH + 1], filename[FILENAME_SIZE + 1];
+  snprintf(from,sizeof(from),"%s" PATH_SEPARATOR "%02x" PATH_SEPARATOR "%s",NOTESPATH,listing->shard,name);
+  MigratedFilename(filename,name,(int)listing->shard);
+  NotePath(to,sizeof(to),filename,"");
+  if(!FileReplace(from,to)) return 1;
+
+  TRACE_COUNT(TRACE_NOTES_RENAMED,1);
+  return listing->visit(filename,size,mtime,listing->context);
+}
+
+// A file that was copied into the wrong shard is not where NotePath looks,
+// it is left alone like any other stray file
+static int VisitShardFile(const char* name, unsigned long long size, unsigned long long mtime, void* context) {
+  ShardListing* listing = context;
+  if(strlen(name) > FILENAME_SIZE) listing->longNames = 1;
+  else if(NoteShard(name) == listing->shard) return listing->visit(name,size,mtime,listing->context);
+  return 1;
+}
+
+// Calls visit with the name of every loose note file, shard by shard. The
+// names always fit FILENAME_SIZE.
+static int ListNoteFiles(int (*visit)(const char* name, unsigned long long size, unsigned long long mtime, void* context), void* context) {
+  MigrateFlatNotes();
+
+  char path[MAX_PATH + 1];
+  ShardListing listing = {visit,context,0,0};
+  for(; listing.shard < NOTE_SHARD_COUNT; ++listing.shard) {
+    ShardPath(path,sizeof(path),NOTESPATH,listing.shard);
+    if(!DirList(path,NOTE_EXTENSION,VisitShardFile,&listing)) return 0;
+    if(listing.longNames && !DirList(path,NOTE_EXTENSION,RenameLongNoteFile,&listing)) return 0;
+    listing.longNames = 0;
+  }
+  return 1;
+}
+
+// 
+// Pack store
+// 
+// Optional single file backend, used when notes.hpack exists. Notes are
+// appended to the pack as records, a rewrite or delete supersedes the
+// previous record. On a clean exit an index of all live records is
+// appended as a trailer, so the next start maps the pack once and reads
+// everything from memory. Without a valid trailer the records are scanned.
+// Dead records are reclaimed by rewriting the pack on the writer thread.
+// 
+
+#define PACK_FILENAME "notes.hpack"
+#define PACK_MAGIC 0x4B415048 // "HPAK"
+#define PACK_TRAILER_MAGIC 0x58444948 // "HIDX"
+#define PACK_VERSION 1
+
+enum { PACK_PUT = 1, PACK_TOMBSTONE, PACK_TRAILER };
+
+typedef struct PackHeader {
+  unsigned int magic;
+  unsigned int version;
+} PackHeader;
+
+// Precedes every record. A PUT carries a NoteHeader and the body, a
+// TRAILER an array of PackIndexEntry followed by a PackTrailer.
+typedef struct PackRecord {
+  unsigned int magic;
+  unsigned int kind;
+  unsigned int length;                  // Bytes following this struct
+  unsigned int checksum;                // Of the bytes following this struct
+  char filename[FILENAME_SIZE + 2];
+} PackRecord;
+
+typedef struct PackIndexEntry {
+  char filename[FILENAME_SIZE + 2];
+  unsigned long long offset;            // Of the PUT record
+} PackIndexEntry;
+
+typedef struct PackTrailer {
+  unsigned int magic;
+  unsigned int count;
+  unsigned long long recordOffset;      // Of the TRAILER record itself
+} PackTrailer;
+
+static_assert(sizeof(PackRecord) == 32, "pack record must stay fixed size");
+static_assert(sizeof(PackIndexEntry) == 24, "pack index entry must stay fixed size");
+static_assert(sizeof(PackTrailer) == 16, "pack trailer must stay fixed size");
+
+typedef struct PackEntry {
+  char filename[FILENAME_SIZE + 2];
+  unsigned long long offset;
+  unsigned int bodyLength;
+  int state;                            // 0 empty, 1 used, 2 removed
+} PackEntry;
+
+static struct PackStore {
+  int enabled;
+  int needsTrailer;                     // Index changed since the last trailer
+  Lock* lock;                // Guards the index and the file swap
+  PackEntry* entries;                   // Open addressing, filename -> record
+  size_t entryCount, entryCapacity, removedCount;
+  unsigned long long end;               // Where the next record goes
+  unsigned long long liveBytes;         // Bytes of records still referenced
+  FileHandle file;                          // Writer thread only
+} packStore = {0};
+
+static unsigned int PackChecksum(const void* data, size_t size) {
+  const unsigned char* bytes = data;
+  unsigned int hash = 2166136261u;
+  for(size_t i = 0; i < size; ++i) hash = (hash ^ bytes[i]) * 16777619u;
+  return hash;
+}
+
+static void PackPath(char* buffer, size_t size, const char* suffix) {
+  snprintf(buffer,size,"%s" PATH_SEPARATOR PACK_FILENAME "%s",NOTESPATH,suffix);
+}
+
+static PackEntry* FindPackSlot(PackEntry* entries, size_t capacity, const char* filename, int forInsert) {
+  size_t mask = capacity - 1;
+  PackEntry* reusable = NULL;
+
+  for(size_t h = HashString(filename) & mask;; h = (h + 1) & mask) {
+    PackEntry* entry = &entries[h];
+    if(entry->state == 0) return forInsert && reusable ? reusable : entry;
+    if(entry->state == 2) {
+      if(!reusable) reusable = entry;
+    }
+    else if(strcmp(entry->filename,filename) == 0) return entry;
+  }
+}
+
+static int GrowPackIndex() {
+  size_t capacity = packStore.entryCapacity ? packStore.entryCapacity : 64;
+  while((packStore.entryCount + 1) * 4 >= capacity * 3) capacity *= 2;
+
+  PackEntry* entries = calloc(capacity,sizeof(PackEntry));
+  if(!entries) return 0;
+
+  for(size_t i = 0; i < packStore.entryCapacity; ++i) {
+    if(packStore.entries[i].state != 1) continue;
+    *FindPackSlot(entries,capacity,packStore.entries[i].filename,1) = packStore.entries[i];
+  }
+
+  free(packStore.entries);
+  packStore.entries = entries;
+  packStore.entryCapacity = capacity;
+  packStore.removedCount = 0;
+  return 1;
+}
+
+// Points filename at a new PUT record, returns the size of the record it
+// replaced (0 if none). Caller holds the lock.
+static unsigned long long SetPackEntry(const char* filename, unsigned long long offset, unsigned int bodyLength) {
+  if((packStore.entryCount + packStore.removedCount + 1) * 4 >= packStore.entryCapacity * 3 && !GrowPackIndex())
+    return 0;
+
+  PackEntry* entry = FindPackSlot(packStore.entries,packStore.entryCapacity,filename,1);
+  unsigned long long replaced = 0;
+
+  if(entry->state == 1) replaced = sizeof(PackRecord) + sizeof(NoteHeader) + entry->bodyLength;
+  else {
+    if(entry->state == 2) packStore.removedCount--;
+    packStore.entryCount++;
+  }
+
+  snprintf(entry->filename,sizeof(entry->filename),"%s",filename);
+  entry->offset = offset;
+  entry->bodyLength = bodyLength;
+  entry->state = 1;
+
+  packStore.liveBytes += sizeof(PackRecord) + sizeof(NoteHeader) + bodyLength;
+  packStore.liveBytes -= replaced;
+  return replaced;
+}
+
+// Caller holds the lock
+static void RemovePackEntry(const char* filename) {
+  if(!packStore.entryCapacity) return;
+
+  PackEntry* entry = FindPackSlot(packStore.entries,packStore.entryCapacity,filename,0);
+  if(entry->state != 1) return;
+
+  packStore.liveBytes -= sizeof(PackRecord) + sizeof(NoteHeader) + entry->bodyLength;
+  entry->state = 2;
+  packStore.entryCount--;
+  packStore.removedCount++;
+}
+
+// Validates the record at offset of a mapped pack and copies out its
+// header (and note header for a PUT), returns its total size or 0 if it is
+// torn or not a record. Records are packed back to back, so nothing in the
+// mapping is aligned and everything is read through memcpy.
+static size_t PackRecordAt(const unsigned char* data, unsigned long long size, unsigned long long offset, PackRecord* record, NoteHeader* header) {
+  if(offset + sizeof(PackRecord) > size) return 0;
+
+  memcpy(record,data + offset,sizeof(PackRecord));
+  if(record->magic != PACK_MAGIC || record->length > size - offset - sizeof(PackRecord)) return 0;
+
+  const unsigned char* payload = data + offset + sizeof(PackRecord);
+  if(record->kind == PACK_PUT) {
+    if(record->length < sizeof(NoteHeader)) return 0;
+    memcpy(header,payload,sizeof(NoteHeader));
+    if(record->length - sizeof(NoteHeader) != header->bodyLength) return 0;
+  }
+  if(PackChecksum(payload,record->length) != record->checksum) return 0;
+
+  return sizeof(PackRecord) + record->length;
+}
+
+// Builds the index from the trailer of a mapped pack, falls back to scanning
+// every record when the trailer is missing or does not end the file
+static void IndexPack(const unsigned char* data, unsigned long long size) {
+  packStore.end = sizeof(PackHeader);
+
+  PackRecord record;
+  NoteHeader header;
+
+  if(size >= sizeof(PackHeader) + sizeof(PackRecord) + sizeof(PackTrailer)) {
+    PackTrailer trailer;
+    memcpy(&trailer,data + size - sizeof(PackTrailer),sizeof(PackTrailer));
+
+    if(trailer.magic == PACK_TRAILER_MAGIC && trailer.recordOffset < size &&
+       PackRecordAt(data,size,trailer.recordOffset,&record,&header) == size - trailer.recordOffset &&
+       record.kind == PACK_TRAILER &&
+       record.length == trailer.count * sizeof(PackIndexEntry) + sizeof(PackTrailer)) {
+      const unsigned char* index = data + trailer.recordOffset + sizeof(PackRecord);
+      int valid = 1;
+
+      for(unsigned int i = 0; i < trailer.count && valid; ++i) {
+        PackIndexEntry entry;
+        memcpy(&entry,index + i * sizeof(PackIndexEntry),sizeof(PackIndexEntry));
+
+        valid = PackRecordAt(data,size,entry.offset,&record,&header) && record.kind == PACK_PUT;
+        if(valid) SetPackEntry(record.filename,entry.offset,header.bodyLength);
+      }
+
+      if(valid) {
+        packStore.end = size;
+        packStore.needsTrailer = 0;
+        return;
+      }
+
+      // Trailer points at garbage, forget it and scan instead
+      free(packStore.entries);
+      packStore.entries = NULL;
+      packStore.entryCount = packStore.entryCapacity = packStore.removedCount = 0;
+      packStore.liveBytes = 0;
+    }
+  }
+
+  unsigned long long offset = sizeof(PackHeader);
+  size_t length;
+
+  while((length = PackRecordAt(data,size,offset,&record,&header))) {
+    if(record.kind == PACK_PUT)
+      SetPackEntry(record.filename,offset,header.bodyLength);
+    else if(record.kind == PACK_TOMBSTONE)
+      RemovePackEntry(record.filename);
+    offset += length;
+  }
+
+  // Anything after the last intact record is a torn write, it gets overwritten
+  packStore.end = offset;
+  packStore.needsTrailer = 1;
+}
+
+// Maps the pack, indexes it and calls visit for every live note with its
+// header and body in memory. Returns 0 if there is no usable pack.
+int OpenPack(void (*visit)(const char* filename, const NoteHeader* header, const char* body, unsigned long long offset, void* context), void* context) {
+  char path[MAX_PATH + 1];
+  PackPath(path,sizeof(path),"");
+
+  unsigned long long size;
+  void* mapping;
+  const unsigned char* data = FileMap(path,&size,&mapping);
+  if(!data && !size) {
+    // Either there is no pack or its creation was cut short
+    FileHandle file = FileOpen(path,FILE_READ);
+    if(!file) return 0;
+    FileClose(file);
+  }
+
+  packStore.file = NULL;
+  packStore.enabled = 1;
+
+  free(packStore.entries);
+  packStore.entries = NULL;
+  packStore.entryCount = packStore.entryCapacity = packStore.removedCount = 0;
+  packStore.liveBytes = 0;
+
+  int usable = 1;
+  if(data && size >= sizeof(PackHeader) &&
+     ((const PackHeader*)data)->magic == PACK_MAGIC && ((const PackHeader*)data)->version == PACK_VERSION) {
+    IndexPack(data,size);
+
+    for(size_t i = 0; visit && i < packStore.entryCapacity; ++i) {
+      const PackEntry* entry = &packStore.entries[i];
+      if(entry->state != 1) continue;
+
+      const unsigned char* record = data + entry->offset + sizeof(PackRecord);
+      NoteHeader header;
+      memcpy(&header,record,sizeof(NoteHeader));
+      visit(entry->filename,&header,(const char*)record + sizeof(NoteHeader),entry->offset,context);
+    }
+  }
+  else if(size == 0) packStore.end = 0; // Creation was cut short, start it over
+  else usable = 0;                      // Not a pack we understand, leave it alone
+
+  FileUnmap(data,size,mapping);
+
+  packStore.enabled = usable;
+  return usable;
+}
+
+// Creates an empty pack, which also makes it the active backend
+int CreatePack() {
+  char path[MAX_PATH + 1];
+  PackPath(path,sizeof(path),"");
+
+  FileHandle file = FileOpen(path,FILE_CREATE);
+  if(!file) return 0;
+
+  PackHeader header = {.magic = PACK_MAGIC, .version = PACK_VERSION};
+  int ok = FileWriteAt(file,0,&header,sizeof(header));
+  FileClose(file);
+  return ok && OpenPack(NULL,NULL);
+}
+
+int PackStoreEnabled() {
+  return packStore.enabled;
+}
+
+static int OpenPackForAppend() {
+  if(packStore.file) return 1;
+
+  char path[MAX_PATH + 1];
+  PackPath(path,sizeof(path),"");
+
+  packStore.file = FileOpen(path,FILE_READWRITE);
+  if(!packStore.file) return 0;
+
+  if(packStore.end < sizeof(PackHeader)) {
+    PackHeader header = {.magic = PACK_MAGIC, .version = PACK_VERSION};
+    if(!FileWriteAt(packStore.file,0,&header,sizeof(header))) return 0;
+    packStore.end = sizeof(PackHeader);
+  }
+
+  // Cut off a torn record left behind by a crash
+  return FileTruncate(packStore.file,packStore.end);
+}
+
+// Appends one record of up to two parts at the end of the pack
+static int AppendPackRecord(FileHandle file, unsigned long long* end, unsigned int kind, const char* filename, const void* first, size_t firstSize, const void* second, size_t secondSize) {
+  PackRecord record = {.magic = PACK_MAGIC, .kind = kind, .length = firstSize + secondSize};
+  snprintf(record.filename,sizeof(record.filename),"%s",filename);
+
+  // Checksum over both parts as if they were one buffer
+  unsigned int hash = 2166136261u;
+  for(size_t i = 0; i < firstSize; ++i) hash = (hash ^ ((const unsigned char*)first)[i]) * 16777619u;
+  for(size_t i = 0; i < secondSize; ++i) hash = (hash ^ ((const unsigned char*)second)[i]) * 16777619u;
+  record.checksum = hash;
+
+  unsigned long long offset = *end;
+  if(!FileWriteAt(file,offset,&record,sizeof(record))) return 0;
+  if(firstSize && !FileWriteAt(file,offset + sizeof(record),first,firstSize)) return 0;
+  if(secondSize && !FileWriteAt(file,offset + sizeof(record) + firstSize,second,secondSize)) return 0;
+
+  *end = offset + sizeof(record) + firstSize + secondSize;
+  return 1;
+}
+
+static int AppendPackTrailer(FileHandle file, unsigned long long* end) {
+  PackIndexEntry* index = malloc(sizeof(PackIndexEntry) * (packStore.entryCount + 1));
+  if(!index) return 0;
+
+  unsigned int count = 0;
+  for(size_t i = 0; i < packStore.entryCapacity; ++i) {
+    const PackEntry* entry = &packStore.entries[i];
+    if(entry->state != 1) continue;
+
+    memcpy(index[count].filename,entry->filename,sizeof(index[count].filename));
+    index[count++].offset = entry->offset;
+  }
+
+  PackTrailer trailer = {.magic = PACK_TRAILER_MAGIC, .count = count, .recordOffset = *end};
+  int ok = AppendPackRecord(file,end,PACK_TRAILER,"",index,sizeof(PackIndexEntry) * count,&trailer,sizeof(trailer));
+  free(index);
+  return ok;
+}
+
+// Writer thread: rewrites the pack with only the live records and a trailer,
+// then swaps it in while readers are held off
+static void CompactPack() {
+  char path[MAX_PATH + 1], tmppath[MAX_PATH + 1];
+  PackPath(path,sizeof(path),"");
+  PackPath(tmppath,sizeof(tmppath),".tmp");
+
+  FileHandle file = FileOpen(tmppath,FILE_CREATE);
+  if(!file) return;
+
+  PackHeader header = {.magic = PACK_MAGIC, .version = PACK_VERSION};
+  unsigned long long end = sizeof(PackHeader);
+  int ok = FileWriteAt(file,0,&header,sizeof(header));
+
+  // Only the writer changes the index, so it can be walked without the lock
+  unsigned long long* offsets = malloc(sizeof(unsigned long long) * (packStore.entryCapacity + 1));
+  char* buffer = NULL;
+  size_t bufferSize = 0;
+  ok = ok && offsets;
+
+  for(size_t i = 0; ok && i < packStore.entryCapacity; ++i) {
+    const PackEntry* entry = &packStore.entries[i];
+    if(entry->state != 1) continue;
+
+    size_t size = sizeof(PackRecord) + sizeof(NoteHeader) + entry->bodyLength;
+    if(size > bufferSize) {
+      char* grown = realloc(buffer,size);
+      if(!grown) { ok = 0; break; }
+      buffer = grown;
+      bufferSize = size;
+    }
+
+    ok = FileReadAt(packStore.file,entry->offset,buffer,size) && FileWriteAt(file,end,buffer,size);
+    offsets[i] = end;
+    end += size;
+  }
+  free(buffer);
+
+  if(ok) {
+    // Swap the new offsets in, offsets keeps the old ones in case the
+    // rename fails and the old pack stays in use
+    AcquireLock(packStore.lock);
+    for(size_t i = 0; i < packStore.entryCapacity; ++i) {
+      if(packStore.entries[i].state != 1) continue;
+
+      unsigned long long old = packStore.entries[i].offset;
+      packStore.entries[i].offset = offsets[i];
+      offsets[i] = old;
+    }
+
+    ok = AppendPackTrailer(file,&end) && FileFlush(file);
+    FileClose(file);
+    file = NULL;
+
+    FileClose(packStore.file);
+    packStore.file = NULL;
+
+    if(ok) ok = FileReplace(tmppath,path);
+    if(ok) {
+      packStore.end = end;
+      packStore.needsTrailer = 0;
+    }
+    else {
+      for(size_t i = 0; i < packStore.entryCapacity; ++i)
+        if(packStore.entries[i].state == 1) packStore.entries[i].offset = offsets[i];
+    }
+    ReleaseLock(packStore.lock);
+  }
+
+  free(offsets);
+  if(file != NULL) FileClose(file);
+  if(!ok) FileDelete(tmppath);
+}
+
+static void MaybeCompactPack() {
+  unsigned long long dead = packStore.end - sizeof(PackHeader) - packStore.liveBytes;
+  if(dead > PACK_COMPACT_MIN_BYTES && dead > packStore.liveBytes) CompactPack();
+}
+
+// Appends a new version of a note and makes it current without flushing,
+// for callers writing many at once
+static int AppendNoteToPack(const char* filename, const NoteHeader* header, const char* body) {
+  if(!OpenPackForAppend()) return 0;
+
+  unsigned long long offset = packStore.end, end = packStore.end;
+  if(!AppendPackRecord(packStore.file,&end,PACK_PUT,filename,header,sizeof(NoteHeader),body,header->bodyLength))
+    return 0;
+
+  AcquireLock(packStore.lock);
+  SetPackEntry(filename,offset,header->bodyLength);
+  packStore.end = end;
+  packStore.needsTrailer = 1;
+  ReleaseLock(packStore.lock);
+  return 1;
+}
+
+// Writer thread: appends a new version of a note and makes it current
+int WriteNoteToPack(const char* filename, const NoteHeader* header, const char* body) {
+  if(!AppendNoteToPack(filename,header,body) || !FileFlush(packStore.file)) return 0;
+
+  MaybeCompactPack();
+  return 1;
+}
+
+// Writer thread: appends a tombstone for a deleted note
+// Appends a tombstone for each note and flushes once for all of them
+int DeleteNotesFromPack(const char* const* filenames, size_t count) {
+  if(!OpenPackForAppend()) return 0;
+
+  unsigned long long end = packStore.end;
+  for(size_t i = 0; i < count; ++i)
+    if(!AppendPackRecord(packStore.file,&end,PACK_TOMBSTONE,filenames[i],NULL,0,NULL,0)) return 0;
+  if(!FileFlush(packStore.file)) return 0;
+
+  AcquireLock(packStore.lock);
+  for(size_t i = 0; i < count; ++i) RemovePackEntry(filenames[i]);
+  packStore.end = end;
+  packStore.needsTrailer = 1;
+  ReleaseLock(packStore.lock);
+
+  MaybeCompactPack();
+  return 1;
+}
+
+int DeleteNoteFromPack(const char* filename) {
+  return DeleteNotesFromPack(&filename,1);
+}
+
+// Writer thread: appends the index so the next start needs no scan
+void ClosePack() {
+  if(!packStore.enabled) return;
+
+  if(packStore.needsTrailer && OpenPackForAppend()) {
+    unsigned long long end = packStore.end;
+    if(AppendPackTrailer(packStore.file,&end) && FileFlush(packStore.file)) {
+      packStore.end = end;
+      packStore.needsTrailer = 0;
+    }
+  }
+
+  if(packStore.file != NULL) {
+    FileClose(packStore.file);
+    packStore.file = NULL;
+  }
+}
+
+// Reads the current body of a note, NUL terminated. Holds the lock so a
+// compaction cannot swap the file in between lookup and read.
+char* ReadPackBody(const char* filename, long* length) {
+  char* body = NULL;
+
+  AcquireLock(packStore.lock);
+  PackEntry* entry = packStore.entryCapacity ? FindPackSlot(packStore.entries,packStore.entryCapacity,filename,0) : NULL;
+
+  if(entry && entry->state == 1) {
+    char path[MAX_PATH + 1];
+    PackPath(path,sizeof(path),"");
+
+    FileHandle file = FileOpen(path,FILE_READ);
+    NoteHeader header;
+    if(file && FileReadAt(file,entry->offset + sizeof(PackRecord),&header,sizeof(header)))
+      body = ReadBodyAt(file,entry->offset + sizeof(PackRecord) + sizeof(NoteHeader),&header,length);
+    FileClose(file);
+  }
+
+  ReleaseLock(packStore.lock);
+  return body;
+}
+
+// Names of the loose files that went into the pack, only those are deleted
+typedef struct ImportedNotes {
+  char (*names)[FILENAME_SIZE + 1];
+  size_t count, capacity;
+} ImportedNotes;
+
+static int ImportNoteFile(const char* name, unsigned long long size, unsigned long long mtime, void* context) {
+  ImportedNotes* imported = context;
+  if(imported->count == imported->capacity) {
+    size_t capacity = imported->capacity ? imported->capacity * 2 : 256;
+    void* grown = realloc(imported->names,capacity * sizeof(*imported->names));
+    if(!grown) return 0;
+    imported->names = grown;
+    imported->capacity = capacity;
+  }
+
+  char fullpath[MAX_PATH + 1];
+  NotePath(fullpath,sizeof(fullpath),name,"");
+
+  FILE* f = fopen(fullpath,"rb");
+  if(!f) return 1;
+
+  unsigned char* data = malloc(size + 1);
+  size_t read = data ? fread(data,1,size,f) : 0;
+  fclose(f);
+  TRACE_COUNT(TRACE_FILES_OPENED,1);
+  TRACE_COUNT(TRACE_BYTES_READ,read);
+
+  int ok = 1;
+  NoteHeader header;
+  long bodyOffset = data ? ParseNoteHeader(data,read,(long)read,&header) : -1;
+  if(bodyOffset >= 0) {
+    header.version = header.flags & NOTE_FLAG_COMPRESSED ? NOTE_VERSION : NOTE_VERSION_PLAIN;
+    header.headerSize = sizeof(NoteHeader);
+    ApplyStoredGeometry(name,&header);
+    ok = AppendNoteToPack(name,&header,(const char*)data + bodyOffset);
+    if(ok) strcpy(imported->names[imported->count++],name);
+  }
+  free(data);
+  return ok;
+}
+
+// Moves every .hnote file into a new pack, run before the UI starts. A
+// file that cannot be read stays where it is.
+int ImportNotesToPack() {
+  if(!CreatePack()) return 0;
+
+  ImportedNotes imported = {0};
+  BeginGeometryLookups();
+  int ok = ListNoteFiles(ImportNoteFile,&imported) && (!packStore.file || FileFlush(packStore.file));
+  EndGeometryLookups();
+  ClosePack();
+
+  // The imported files are in the pack now, they would only shadow it
+  char fullpath[MAX_PATH + 1];
+  for(size_t i = 0; ok && i < imported.count; ++i) {
+    NotePath(fullpath,sizeof(fullpath),imported.names[i],"");
+    FileDelete(fullpath);
+  }
+  free(imported.names);
+  if(!ok) return 0;
+
+  snprintf(fullpath,sizeof(fullpath),"%s" PATH_SEPARATOR CATALOG_FILENAME,NOTESPATH);
+  FileDelete(fullpath);
+  return 1;
+}
+
+static void ExportPackedNote(const char* filename, const NoteHeader* stored, const char* body, unsigned long long offset, void* context) {
+  char fullpath[MAX_PATH + 1];
+  NotePath(fullpath,sizeof(fullpath),filename,"");
+
+  NoteHeader header = *stored;
+  ApplyStoredGeometry(filename,&header);
+
+  unsigned long long mtime;
+  if(!WriteNoteFileAtomically(fullpath,&header,body,&mtime)) *(int*)context = 0;
+}
+
+// Writes every note of the pack back as a .hnote file and removes the pack
+int ExportPackToNotes() {
+  int ok = PrepareNoteShards();
+  if(!ok) return 0;
+
+  BeginGeometryLookups();
+  int opened = OpenPack(ExportPackedNote,&ok);
+  EndGeometryLookups();
+  if(!opened) return 0;
+
+  packStore.enabled = 0;
+  if(!ok) return 0;
+
+  char path[MAX_PATH + 1];
+  PackPath(path,sizeof(path),"");
+  return FileDelete(path);
+}
+
+// 
+// Body cache
+// 
+// Decoded text of recently read notes, most recently used first, within
+// BODYCACHEBYTES. An entry remembers the stamp of the stored body it came
+// from and is dropped once that no longer matches, so a note changed by
+// another program is read again. A save replaces the entry with the saved
+// text, which takes its stamp from the catalog once the writer stored it.
+// UI thread only, like ReadNoteText.
+// 
+
+size_t BODYCACHEBYTES = BODY_CACHE_BYTES;
+
+typedef struct CachedBody {
+  struct CachedBody *newer, *older;
+  NoteId id;
+  unsigned long long stamp[2];          // As GetNoteStamp, 0 while a save of it is pending
+  long journalLength;
+  int journalRecords;
+  long length;
+  char text[];
+} CachedBody;
+
+#define CACHED_BODY_SIZE(length) (sizeof(CachedBody) + (size_t)(length) + 1)
+
+static struct BodyCache {
+  CachedBody *newest, *oldest;
+  BodyCacheStats stats;
+} bodyCache = {0};
+
+// Identifies the stored version of a note: record offset and length in a
+// pack, last write time and size from the catalog otherwise
+static void GetNoteStamp(const char* filename, int catalogSlot, unsigned long long stamp[2]) {
+  stamp[0] = stamp[1] = 0;
+
+  if(packStore.enabled) {
+    AcquireLock(packStore.lock);
+    PackEntry* entry = packStore.entryCapacity ? FindPackSlot(packStore.entries,packStore.entryCapacity,filename,0) : NULL;
+    if(entry && entry->state == 1) {
+      stamp[0] = entry->offset;
+      stamp[1] = entry->bodyLength;
+    }
+    ReleaseLock(packStore.lock);
+  }
+  else if(catalogSlot >= 0) {
+    AcquireLock(catalog.lock);
+    const CatalogRecord* record = (size_t)catalogSlot < catalog.count ? TableRecord(&catalog,catalogSlot) : NULL;
+    if(record && strcmp(record->filename,filename) == 0) {
+      stamp[0] = record->mtime;
+      stamp[1] = record->fileSize;
+    }
+    ReleaseLock(catalog.lock);
+  }
+}
+
+// Stamp of the stored body as it is now: last write time and size of the
+// file for a loose note, from its metadata alone, or its pack record
+static int CurrentNoteStamp(const Note* note, unsigned long long stamp[2]) {
+  if(packStore.enabled) {
+    GetNoteStamp(note->filename,-1,stamp);
+    return stamp[0] || stamp[1];
+  }
+
+  char path[MAX_PATH + 1];
+  NotePath(path,sizeof(path),note->filename,"");
+  return FileStamp(path,&stamp[1],&stamp[0]);
+}
+
+static void LinkCachedBody(CachedBody* entry) {
+  entry->newer = NULL;
+  entry->older = bodyCache.newest;
+  if(bodyCache.newest) bodyCache.newest->newer = entry;
+  else bodyCache.oldest = entry;
+  bodyCache.newest = entry;
+}
+
+static void UnlinkCachedBody(CachedBody* entry) {
+  if(entry->newer) entry->newer->older = entry->older;
+  else bodyCache.newest = entry->older;
+  if(entry->older) entry->older->newer = entry->newer;
+  else bodyCache.oldest = entry->newer;
+}
+
+static void FreeCachedBody(CachedBody* entry) {
+  UnlinkCachedBody(entry);
+
+  Note* note = Find(entry->id);
+  if(note && note->cached == entry) note->cached = NULL;
+
+  bodyCache.stats.entries--;
+  bodyCache.stats.bytes -= CACHED_BODY_SIZE(entry->length);
+  free(entry);
+}
+
+void DropCachedBody(Note* note) {
+  if(note->cached) FreeCachedBody(note->cached);
+}
+
+// Keeps a copy of text as the body of note along with the journal state
+// of the note, evicting the least recently used bodies to make room.
+// stamp is NULL for text that was just handed to the writer.
+static void CacheNoteBody(Note* note, const char* text, long length, const unsigned long long stamp[2]) {
+  DropCachedBody(note);
+
+  // One note never takes more than a quarter of the cache
+  size_t size = CACHED_BODY_SIZE(length);
+  if(size > BODYCACHEBYTES / 4) return;
+
+  while(bodyCache.oldest && bodyCache.stats.bytes + size > BODYCACHEBYTES) {
+    FreeCachedBody(bodyCache.oldest);
+    bodyCache.stats.evictions++;
+  }
+
+  CachedBody* entry = malloc(size);
+  if(!entry) return;
+
+  entry->id = note->id;
+  entry->stamp[0] = stamp ? stamp[0] : 0;
+  entry->stamp[1] = stamp ? stamp[1] : 0;
+  entry->journalLength = note->journalLength;
+  entry->journalRecords = note->journalRecords;
+  entry->length = length;
+  memcpy(entry->text,text,length);
+  entry->text[length] = '\0';
+
+  LinkCachedBody(entry);
+  note->cached = entry;
+  bodyCache.stats.entries++;
+  bodyCache.stats.bytes += size;
+}
+
+// Copy of the cached body of note if it still matches what is stored,
+// NULL otherwise
+static char* ReadCachedBody(Note* note, long* length) {
+  CachedBody* entry = note->cached;
+  if(!entry) {
+    bodyCache.stats.misses++;
+    return NULL;
+  }
+
+  unsigned long long now[2];
+  int known = CurrentNoteStamp(note,now);
+
+  // Saved since it was cached, it is current if the file is what the writer stored
+  if(known && !entry->stamp[0] && !entry->stamp[1]) {
+    unsigned long long stored[2];
+    GetNoteStamp(note->filename,note->catalogSlot,stored);
+    if(stored[0] == now[0] && stored[1] == now[1]) {
+      entry->stamp[0] = now[0];
+      entry->stamp[1] = now[1];
+    }
+  }
+
+  if(!known || entry->stamp[0] != now[0] || entry->stamp[1] != now[1]) {
+    FreeCachedBody(entry);
+    bodyCache.stats.stale++;
+    bodyCache.stats.misses++;
+    return NULL;
+  }
+
+  char* body = malloc(entry->length + 1);
+  if(!body) return NULL;
+
+  memcpy(body,entry->text,entry->length + 1);
+  *length = entry->length;
+  note->journalLength = entry->journalLength;
+  note->journalRecords = entry->journalRecords;
+
+  UnlinkCachedBody(entry);
+  LinkCachedBody(entry);
+  bodyCache.stats.hits++;
+  return body;
+}
+
+void GetBodyCacheStats(BodyCacheStats* stats) {
+  *stats = bodyCache.stats;
+}
+
+// 
+// Edit journal
+// 
+// While a note is open its edits are appended to <filename>.hjnl, each
+// record replacing one byte range of the LF text, and flushed right away,
+// so a crash loses at most the last moment of typing instead of all of it.
+// The journal names the body it applies to by length and checksum, which
+// makes one left behind by a completed save harmless. A full save of the
+// note deletes it, JournalNoteEdit folds it into one when it grows large.
+// 
+
+#define JOURNAL_MAGIC 0x4C4E4A48 // "HJNL"
+#define JOURNAL_RECORD_MAGIC 0x54494445 // "EDIT"
+#define JOURNAL_VERSION 1
+
+typedef struct JournalHeader {
+  unsigned int magic;
+  unsigned int version;
+  unsigned int baseLength;              // Stored body the records apply to
+  unsigned int baseChecksum;
+} JournalHeader;
+
+// Replaces removed bytes at offset with the insertedLength bytes following
+typedef struct JournalRecord {
+  unsigned int magic;
+  unsigned int offset;
+  unsigned int removed;
+  unsigned int insertedLength;
+  unsigned int checksum;                // Of the fields above and the inserted bytes
+} JournalRecord;
+
+static_assert(sizeof(JournalHeader) == 16, "journal header must stay fixed size");
+static_assert(sizeof(JournalRecord) == 20, "journal record must stay fixed size");
+
+static void JournalPath(char* buffer, size_t size, const char* filename) {
+  NotePath(buffer,size,filename,JOURNAL_EXTENSION);
+}
+
+static unsigned int JournalChecksum(const JournalRecord* record, const char* inserted) {
+  return PackChecksum(record,offsetof(JournalRecord,checksum)) ^ PackChecksum(inserted,record->insertedLength);
+}
+
+// Lengths of the common start and end of before and after, which never
+// overlap. Returns that of the start.
+static size_t MatchTextEnds(const char* before, size_t beforeLength, const char* after, size_t afterLength, size_t* suffix) {
+  size_t limit = beforeLength < afterLength ? beforeLength : afterLength;
+  size_t prefix = 0;
+  *suffix = 0;
+
+  while(prefix + 64 <= limit && memcmp(before + prefix,after + prefix,64) == 0) prefix += 64;
+  while(prefix < limit && before[prefix] == after[prefix]) prefix++;
+
+  limit -= prefix;
+  while(*suffix + 64 <= limit && memcmp(before + beforeLength - *suffix - 64,after + afterLength - *suffix - 64,64) == 0) *suffix += 64;
+  while(*suffix < limit && before[beforeLength - *suffix - 1] == after[afterLength - *suffix - 1]) (*suffix)++;
+  return prefix;
+}
+
+// Bytes a record inserting insertedLength bytes adds to a journal of
+// journalLength bytes, the header included when it starts the journal
+static size_t JournalEditSize(long journalLength, size_t insertedLength) {
+  return (journalLength ? 0 : sizeof(JournalHeader)) + sizeof(JournalRecord) + insertedLength;
+}
+
+// Whether a record of size bytes would grow the journal past what is
+// worth replaying for a text of textLength bytes
+static int JournalIsFull(long journalLength, int journalRecords, size_t size, size_t textLength) {
+  size_t foldBytes = textLength / 2 > JOURNAL_FOLD_MIN_BYTES ? textLength / 2 : JOURNAL_FOLD_MIN_BYTES;
+  return journalLength + size > foldBytes || journalRecords >= JOURNAL_FOLD_RECORDS;
+}
+
+// The size bytes appended to a journal of journalLength bytes that replace
+// the range of before between prefix and suffix with that of after
+static char* BuildJournalEdit(const char* before, size_t beforeLength, const char* after, size_t afterLength, size_t prefix, size_t suffix, long journalLength, size_t size) {
+  char* data = malloc(size);
+  if(!data) return NULL;
+
+  char* at = data;
+  if(!journalLength) {
+    JournalHeader header = {
+      .magic = JOURNAL_MAGIC,
+      .version = JOURNAL_VERSION,
+      .baseLength = beforeLength,
+      .baseChecksum = PackChecksum(before,beforeLength)
+    };
+    memcpy(at,&header,sizeof(header));
+    at += sizeof(header);
+  }
+
+  JournalRecord record = {
+    .magic = JOURNAL_RECORD_MAGIC,
+    .offset = prefix,
+    .removed = beforeLength - prefix - suffix,
+    .insertedLength = afterLength - prefix - suffix
+  };
+  record.checksum = JournalChecksum(&record,after + prefix);
+  memcpy(at,&record,sizeof(record));
+  memcpy(at + sizeof(record),after + prefix,record.insertedLength);
+  return data;
+}
+
+// Writer thread: writes journal bytes at offset and flushes them. The
+// first record of a journal starts the file over.
+static int AppendNoteJournal(const char* path, unsigned long long offset, const char* data, size_t size) {
+  FileHandle file = FileOpen(path,offset ? FILE_READWRITE : FILE_CREATE);
+  if(!file) return 0;
+
+  int ok = FileWriteAt(file,offset,data,size) && FileFlush(file);
+  FileClose(file);
+  return ok;
+}
+
+// Writer thread: drops the journal once a full save contains its edits
+static void DeleteNoteJournal(const char* filename) {
+  char path[MAX_PATH + 1];
+  JournalPath(path,sizeof(path),filename);
+  FileDelete(path);
+}
+
+// Applies the journal of filename to body, which is reallocated as it
+// grows. Stops at the first torn record. Returns the journal bytes used,
+// 0 if there is no journal or it belongs to another version of the body.
+static long ReplayNoteJournal(const char* filename, char** body, long* length, int* records) {
+  *records = 0;
+
+  char path[MAX_PATH + 1];
+  JournalPath(path,sizeof(path),filename);
+
+  FileHandle file = FileOpen(path,FILE_READ);
+  if(!file) return 0;
+
+  unsigned long long size = FileSize(file);
+  char* journal = size >= sizeof(JournalHeader) && size < LONG_MAX ? malloc(size) : NULL;
+  int ok = journal && FileReadAt(file,0,journal,size);
+  FileClose(file);
+
+  JournalHeader header;
+  if(ok) memcpy(&header,journal,sizeof(header));
+  if(!ok || header.magic != JOURNAL_MAGIC || header.version != JOURNAL_VERSION ||
+     header.baseLength != (unsigned long)*length || header.baseChecksum != PackChecksum(*body,*length)) {
+    free(journal);
+    return 0;
+  }
+
+  size_t used = sizeof(JournalHeader);
+  size_t capacity = *length + 1;
+
+  while(used + sizeof(JournalRecord) <= size) {
+    JournalRecord record;
+    memcpy(&record,journal + used,sizeof(record));
+    const char* inserted = journal + used + sizeof(record);
+
+    if(record.magic != JOURNAL_RECORD_MAGIC || record.insertedLength > size - used - sizeof(record)) break;
+    if(record.offset > (unsigned long)*length || record.removed > *length - record.offset) break;
+    if(JournalChecksum(&record,inserted) != record.checksum) break;
+
+    size_t newLength = *length - record.removed + record.insertedLength;
+    if(newLength + 1 > capacity) {
+      size_t grown = capacity * 2 > newLength + 1 ? capacity * 2 : newLength + 1;
+      char* larger = realloc(*body,grown);
+      if(!larger) break;
+      *body = larger;
+      capacity = grown;
+    }
+
+    size_t tail = record.offset + record.removed;
+    memmove(*body + record.offset + record.insertedLength,*body + tail,*length - tail + 1);
+    memcpy(*body + record.offset,inserted,record.insertedLength);
+    *length = newLength;
+
+    used += sizeof(record) + record.insertedLength;
+    (*records)++;
+  }
+
+  free(journal);
+  return used;
+}
+
+// The header is read again rather than trusted from the registry, the
+// file may have been rewritten in another format since it was listed
+static char* ReadStoredBody(const char* filename, long* length) {
+  if(packStore.enabled) return ReadPackBody(filename,length);
+
+  char fullpath[MAX_PATH + 1];
+  NotePath(fullpath,sizeof(fullpath),filename,"");
+
+  FileHandle file = FileOpen(fullpath,FILE_READ);
+  if(!file) return NULL;
+
+  unsigned long long fileSize = FileSize(file);
+  unsigned char probe[sizeof(NoteHeader)];
+  size_t read = fileSize < sizeof(probe) ? fileSize : sizeof(probe);
+
+  NoteHeader header;
+  long bodyOffset = fileSize < LONG_MAX && FileReadAt(file,0,probe,read) ? ParseNoteHeader(probe,read,(long)fileSize,&header) : -1;
+  char* body = bodyOffset >= 0 ? ReadBodyAt(file,bodyOffset,&header,length) : NULL;
+
+  FileClose(file);
+  return body;
+}
+
+// Reads the current text of a note, NUL terminated, from the pack or from
+// its own file. Safe to call from any thread.
+char* ReadNoteBody(const char* filename, long* length) {
+  char* body = ReadStoredBody(filename,length);
+  int records;
+  if(body) ReplayNoteJournal(filename,&body,length,&records);
+  return body;
+}
+
+// Maps the stored body of a note to show it without reading it into
+// memory. Only a plain body in its own file with no journal to replay can
+// be used as it is, NULL otherwise. UI thread only.
+const char* MapNoteBody(Note* note, size_t* length, NoteMapping* map) {
+  if(packStore.enabled) return NULL;
+
+  char path[MAX_PATH + 1];
+  JournalPath(path,sizeof(path),note->filename);
+  FileHandle journal = FileOpen(path,FILE_READ);
+  if(journal) {
+    FileClose(journal);
+    return NULL;
+  }
+
+  NotePath(path,sizeof(path),note->filename,"");
+  map->data = FileMap(path,&map->size,&map->handle);
+  if(!map->data) return NULL;
+
+  NoteHeader header;
+  long bodyOffset = map->size < LONG_MAX ? ParseNoteHeader(map->data,map->size,(long)map->size,&header) : -1;
+  if(bodyOffset < 0 || header.flags & NOTE_FLAG_COMPRESSED) {
+    UnmapNoteBody(map);
+    return NULL;
+  }
+
+  note->journalLength = 0;
+  note->journalRecords = 0;
+  *length = header.bodyLength;
+  return (const char*)map->data + bodyOffset;
+}
+
+void UnmapNoteBody(NoteMapping* map) {
+  FileUnmap(map->data,map->size,map->handle);
+  map->data = NULL;
+}
+
+// Reads a note that is about to be edited, UI thread only
+char* ReadNoteText(Note* note, long* length) {
+  TRACE_BEGIN(start);
+  char* body = ReadCachedBody(note,length);
+
+  if(!body) {
+    unsigned long long stamp[2];
+    int known = BODYCACHEBYTES && CurrentNoteStamp(note,stamp);
+    body = ReadStoredBody(note->filename,length);
+
+    note->journalLength = 0;
+    note->journalRecords = 0;
+    if(body) {
+      note->journalLength = ReplayNoteJournal(note->filename,&body,length,&note->journalRecords);
+      if(known) CacheNoteBody(note,body,*length,stamp);
+    }
+  }
+
+  TRACE_END(TRACE_READ_BODY,start,note->id,body ? *length : 0);
+  return body;
+}
+
+// 
+// Note loading
+// 
+// FindNotesFromDisk runs on its own threads, which take the shards of
+// NOTESPATH one at a time and hand batches of file names to a pool of
+// workers as they enumerate them. Notes matching their catalog
+// record are complete already, idle workers take whichever batch is next,
+// read headers and previews of the rest, and deliver the finished batch,
+// which the UI merges into the registry and the list.
+// 
+
+static struct NoteLoader {
+  Lock* lock;
+  Condition* available;
+  LoadBatch *first, *last;    // Batches waiting for a worker
+  int discoveryDone;
+  volatile long activeWorkers;
+  volatile long activeFinders;
+  volatile long shardsLeft;   // Counted down as finders take shards
+  void (*deliver)(LoadBatch* batch, void* context);
+  void* context;
+  unsigned long long started; // TraceTicks when loading started
+  size_t found;               // Note files or packed notes seen so far
+} noteLoader = {0};
+
+static void QueueLoadBatch(LoadBatch* batch) {
+  AcquireLock(noteLoader.lock);
+  if(noteLoader.last) noteLoader.last->next = batch;
+  else noteLoader.first = batch;
+  noteLoader.last = batch;
+  WakeCondition(noteLoader.available);
+  ReleaseLock(noteLoader.lock);
+}
+
+static int NoteLoaderWorker(void* param) {
+  char fullpath[MAX_PATH + 1];
+
+  for(;;) {
+    AcquireLock(noteLoader.lock);
+    while(!noteLoader.first && !noteLoader.discoveryDone)
+      WaitCondition(noteLoader.available,noteLoader.lock,WAIT_FOREVER);
+
+    LoadBatch* batch = noteLoader.first;
+    if(batch) {
+      noteLoader.first = batch->next;
+      if(!noteLoader.first) noteLoader.last = NULL;
+    }
+    ReleaseLock(noteLoader.lock);
+
+    if(!batch) break;
+
+    TRACE_BEGIN(batchStart);
+    size_t read = 0;
+
+    for(size_t i = 0; i < batch->count; ++i) {
+      LoadedNote* loaded = &batch->notes[i];
+      if(loaded->valid) continue; // Taken from the catalog
+
+      NotePath(fullpath,sizeof(fullpath),loaded->filename,"");
+
+      TRACE_BEGIN(parseStart);
+      FILE* file = fopen(fullpath,"rb");
+      if(file) {
+        TRACE_COUNT(TRACE_FILES_OPENED,1);
+        loaded->valid = ReadNoteProbe(file,loaded);
+        fclose(file);
+      }
+      TRACE_END(TRACE_PARSE_NOTE,parseStart,loaded->valid,loaded->fileSize);
+      read++;
+
+      if(!loaded->valid) {
+        DropCatalogRecord(loaded->catalogSlot);
+        loaded->catalogSlot = -1;
+        continue;
+      }
+
+      if(loaded->catalogSlot < 0) loaded->catalogSlot = AllocateCatalogSlot();
+      SetCatalogRecord(loaded->catalogSlot,loaded->filename,loaded->fileSize,loaded->mtime,&loaded->header,loaded->bodyOffset,loaded->preview);
+    }
+
+    TRACE_END(TRACE_LOAD_BATCH,batchStart,batch->count,read);
+
+    batch->next = NULL;
+    noteLoader.deliver(batch,noteLoader.context);
+  }
+
+  if(AtomicDecrement(&noteLoader.activeWorkers) == 0) {
+    TRACE_END(TRACE_LOAD_NOTES,noteLoader.started,noteLoader.found,0);
+    noteLoader.deliver(NULL,noteLoader.context);
+  }
+  return 0;
+}
+
+// What one finder thread has enumerated and not queued yet
+typedef struct NoteFinder {
+  LoadBatch* batch;
+  unsigned int shard;
+  size_t found;
+  int longNames;                        // Seen a name longer than FILENAME_SIZE
+} NoteFinder;
+
+static int FoundNoteFile(const char* name, unsigned long long size, unsigned long long mtime, void* context) {
+  NoteFinder* finder = context;
+  size_t len = strlen(name);
+  if(len > FILENAME_SIZE) {
+    finder->longNames = 1;
+    return 1;
+  }
+  if(NoteShard(name) != finder->shard) return 1; // Only NotePath finds it where it is
+
+  LoadBatch* batch = finder->batch;
+  if(!batch && !(batch = finder->batch = calloc(1,sizeof(LoadBatch)))) return 0;
+
+  LoadedNote* loaded = &batch->notes[batch->count++];
+  finder->found++;
+  memcpy(loaded->filename,name,len + 1);
+  loaded->fileSize = (long)size;
+  loaded->mtime = mtime;
+  MatchCatalogRecord(loaded);
+
+  if(batch->count == LOAD_BATCH_SIZE) {
+    QueueLoadBatch(batch);
+    finder->batch = NULL;
+  }
+  return 1;
+}
+
+static int FindNotesInShards(void* param) {
+  NoteFinder finder = {0};
+  char path[MAX_PATH + 1];
+
+  long shard;
+  while((shard = AtomicDecrement(&noteLoader.shardsLeft)) >= 0) {
+    finder.shard = (unsigned int)shard;
+    ShardPath(path,sizeof(path),NOTESPATH,finder.shard);
+    DirList(path,NOTE_EXTENSION,FoundNoteFile,&finder);
+    if(finder.longNames) {
+      ShardListing listing = {FoundNoteFile,&finder,finder.shard,0};
+      DirList(path,NOTE_EXTENSION,RenameLongNoteFile,&listing);
+      finder.longNames = 0;
+    }
+  }
+  if(finder.batch) QueueLoadBatch(finder.batch);
+
+  AcquireLock(noteLoader.lock);
+  noteLoader.found += finder.found;
+  ReleaseLock(noteLoader.lock);
+
+  if(AtomicDecrement(&noteLoader.activeFinders) == 0) {
+    FinishCatalogMatching();
+    TRACE_END(TRACE_FIND_NOTES,noteLoader.started,noteLoader.found,0);
+
+    AcquireLock(noteLoader.lock);
+    noteLoader.discoveryDone = 1;
+    WakeAllCondition(noteLoader.available);
+    ReleaseLock(noteLoader.lock);
+  }
+  return 0;
+}
+
+// Moves a flat store into shards first, then enumerates the shards on up
+// to LOAD_MAX_FINDERS threads including this one
+static int FindNotesFromDisk(void* param) {
+  MigrateFlatNotes();
+
+  long finders = ProcessorCount();
+  if(finders < 1) finders = 1;
+  if(finders > LOAD_MAX_FINDERS) finders = LOAD_MAX_FINDERS;
+
+  noteLoader.shardsLeft = NOTE_SHARD_COUNT;
+  noteLoader.activeFinders = finders;
+  for(long i = 1; i < finders; ++i) {
+    Thread* thread = StartThread(FindNotesInShards,NULL);
+    if(thread) DetachThread(thread);
+    else AtomicDecrement(&noteLoader.activeFinders);
+  }
+  return FindNotesInShards(NULL);
+}
+
+static void VisitPackedNote(const char* filename, const NoteHeader* header, const char* body, unsigned long long offset, void* context) {
+  LoadBatch** batch = context;
+  if(!*batch && !(*batch = calloc(1,sizeof(LoadBatch)))) return;
+
+  LoadedNote* loaded = &(*batch)->notes[(*batch)->count++];
+  noteLoader.found++;
+  snprintf(loaded->filename,sizeof(loaded->filename),"%s",filename);
+  loaded->header = *header;
+  loaded->bodyOffset = offset;
+  loaded->catalogSlot = -1;
+  loaded->mtime = offset; // Records are appended as notes are written
+  loaded->valid = 1;
+
+  SetNotePreview(loaded->preview,header,body,header->bodyLength);
+
+  if((*batch)->count == LOAD_BATCH_SIZE) {
+    noteLoader.deliver(*batch,noteLoader.context);
+    *batch = NULL;
+  }
+}
+
+// Starts loading all notes in the background, see hnote.h for how the
+// results arrive
+void StartLoadingNotes(void (*deliver)(LoadBatch* batch, void* context), void* context) {
+  noteLoader.deliver = deliver;
+  noteLoader.context = context;
+  noteLoader.first = noteLoader.last = NULL;
+  noteLoader.discoveryDone = 0;
+  noteLoader.started = TraceTicks();
+  noteLoader.found = 0;
+  LoadGeometry();
+
+  // A pack is read in one go from a single mapping
+  LoadBatch* batch = NULL;
+  if(OpenPack(VisitPackedNote,&batch)) {
+    if(batch) deliver(batch,context);
+    TRACE_END(TRACE_LOAD_NOTES,noteLoader.started,noteLoader.found,0);
+    deliver(NULL,context);
+    return;
+  }
+
+  TRACE_BEGIN(catalogStart);
+  LoadCatalog();
+  TRACE_END(TRACE_LOAD_CATALOG,catalogStart,catalog.count,0);
+
+  long workers = ProcessorCount();
+  if(workers < 1) workers = 1;
+  if(workers > LOAD_MAX_WORKERS) workers = LOAD_MAX_WORKERS;
+
+  noteLoader.activeWorkers = workers;
+  for(long i = 0; i < workers; ++i) {
+    Thread* thread = StartThread(NoteLoaderWorker,NULL);
+    if(thread) DetachThread(thread);
+    else if(AtomicDecrement(&noteLoader.activeWorkers) == 0) {
+      // No worker could be started, load everything right here
+      noteLoader.activeWorkers = 1;
+      FindNotesFromDisk(NULL);
+      NoteLoaderWorker(NULL);
+      return;
+    }
+  }
+
+  Thread* thread = StartThread(FindNotesFromDisk,NULL);
+  if(thread) DetachThread(thread);
+  else FindNotesFromDisk(NULL);
+}
+
+// 
+// Version history
+// 
+// Every full save of a note adds a version to history/<filename>.hver, a
+// list of chunks kept in history/chunks.hchk, which all notes share. A
+// body is cut into chunks of 2 to 64 KB wherever a Gear rolling hash of
+// the bytes just before hits a pattern, so the cuts follow the content:
+// an edit changes the chunks around it and the rest are found in the
+// store by their content hash. A version costs its record plus the
+// chunks no earlier version had. Chunks are stored LZ compressed when
+// that saves an eighth. Chunks no version refers to any more stay until
+// CollectHistoryGarbage rewrites the store.
+// 
+
+#define HISTORY_DIR "history"
+#define CHUNK_STORE_FILENAME "chunks.hchk"
+#define VERSION_EXTENSION ".hver"
+#define CHUNK_STORE_MAGIC 0x4B484348 // "HCHK"
+#define CHUNK_MAGIC 0x4B4E4843 // "CHNK"
+#define VERSION_MAGIC 0x52455648 // "HVER"
+#define CHUNK_STORE_VERSION 1
+
+// Below the average size a cut needs 15 zero bits of the hash, above it
+// 11, which keeps most chunks close to the average. A chunk is at most as
+// large as an LZ block.
+#define CHUNK_MIN_SIZE (2 * 1024)
+#define CHUNK_AVG_SIZE (8 * 1024)
+#define CHUNK_MAX_SIZE BODY_BLOCK_SIZE
+#define CHUNK_MASK_HARD (~0ull << (64 - 15))
+#define CHUNK_MASK_EASY (~0ull << (64 - 11))
+
+typedef struct ChunkStoreHeader {
+  unsigned int magic;
+  unsigned int version;
+} ChunkStoreHeader;
+
+// Precedes the stored bytes of every chunk
+typedef struct ChunkRecord {
+  unsigned int magic;
+  unsigned int rawLength;
+  unsigned int storedLength;            // Less than rawLength if compressed
+  unsigned int checksum;                // Of the stored bytes
+  unsigned long long hash[2];           // Of the raw bytes
+} ChunkRecord;
+
+// One per version, followed by the hashes of its chunks in order
+typedef struct VersionRecord {
+  unsigned int magic;
+  unsigned int number;                  // Counts up from 1 for each note
+  unsigned long long time;              // Seconds since 1970
+  unsigned int rawLength;
+  unsigned int chunkCount;
+  unsigned int checksum;                // Of the record and the hashes
+  unsigned int reserved;
+} VersionRecord;
+
+static_assert(sizeof(ChunkRecord) == 32, "chunk record must stay fixed size");
+static_assert(sizeof(VersionRecord) == 32, "version record must stay fixed size");
+
+typedef struct HistoryChunk {
+  unsigned long long hash[2];           // 0, 0 marks an empty slot
+  unsigned long long offset;            // Of the ChunkRecord
+  unsigned int rawLength, storedLength;
+} HistoryChunk;
+
+typedef struct ChunkSet {
+  HistoryChunk* chunks;                 // Open addressing by hash
+  size_t count, capacity;
+} ChunkSet;
+
+static struct History {
+  Lock* lock;                           // Guards everything below and the files
+  FileHandle file;                      // Chunk store, NULL until first used
+  unsigned long long end;               // Where the next chunk goes
+  ChunkSet index;                       // Every chunk in the store
+} history = {0};
+
+int KEEPHISTORY = 1;
+
+static unsigned long long gearTable[256];
+
+static inline unsigned long long SplitMix64(unsigned long long* state) {
+  unsigned long long z = (*state += 0x9E3779B97F4A7C15ull);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+  return z ^ (z >> 31);
+}
+
+// The table must never change, or new cuts would stop matching the
+// chunks already stored
+static void InitGearTable() {
+  unsigned long long state = 0x686F7365; // "hose"
+  for(int i = 0; i < 256; ++i) gearTable[i] = SplitMix64(&state);
+}
+
+// Length of the chunk at the start of data, of which length bytes remain.
+// Each byte shifts the hash left, so its top bits depend on the last 64
+// bytes only and a cut is found again after an edit further back.
+size_t NextChunkCut(const char* data, size_t length) {
+  if(length <= CHUNK_MIN_SIZE) return length;
+
+  const unsigned char* bytes = (const unsigned char*)data;
+  size_t normal = length < CHUNK_AVG_SIZE ? length : CHUNK_AVG_SIZE;
+  size_t limit = length < CHUNK_MAX_SIZE ? length : CHUNK_MAX_SIZE;
+  unsigned long long hash = 0;
+  size_t i = CHUNK_MIN_SIZE;
+
+  for(; i < normal; ++i) {
+    hash = (hash << 1) + gearTable[bytes[i]];
+    if(!(hash & CHUNK_MASK_HARD)) return i + 1;
+  }
+  for(; i < limit; ++i) {
+    hash = (hash << 1) + gearTable[bytes[i]];
+    if(!(hash & CHUNK_MASK_EASY)) return i + 1;
+  }
+  return limit;
+}
+
+static inline unsigned long long Mix64(unsigned long long x) {
+  x = (x ^ (x >> 33)) * 0xFF51AFD7ED558CCDull;
+  x = (x ^ (x >> 33)) * 0xC4CEB9FE1A85EC53ull;
+  return x ^ (x >> 33);
+}
+
+// 128 bit name of a chunk from two independent 64 bit lanes. Not
+// cryptographic, two chunks sharing one would have to be crafted.
+static void HashChunk(const char* data, size_t length, unsigned long long hash[2]) {
+  unsigned long long a = 0x9E3779B97F4A7C15ull ^ length, b = 0xC2B2AE3D27D4EB4Full + length;
+  size_t i = 0;
+
+  for(; i + 8 <= length; i += 8) {
+    unsigned long long word;
+    memcpy(&word,data + i,8);
+    a ^= word * 0x87C37B91114253D5ull;
+    a = ((a << 31) | (a >> 33)) * 0x4CF5AD432745937Full;
+    b = (b ^ word) * 0x9FB21C651E98DF25ull;
+    b ^= b >> 32;
+  }
+
+  unsigned long long tail = 0;
+  memcpy(&tail,data + i,length - i);
+  a ^= tail * 0x87C37B91114253D5ull;
+  b = (b ^ tail) * 0x9FB21C651E98DF25ull;
+
+  hash[0] = Mix64(a);
+  hash[1] = Mix64(b ^ hash[0]);
+  if(!hash[0] && !hash[1]) hash[1] = 1;
+}
+
+static inline int IsEmptyChunk(const HistoryChunk* chunk) {
+  return !chunk->hash[0] && !chunk->hash[1];
+}
+
+static HistoryChunk* FindHistoryChunk(HistoryChunk* chunks, size_t capacity, const unsigned long long hash[2]) {
+  size_t mask = capacity - 1;
+  for(size_t h = hash[0] & mask;; h = (h + 1) & mask) {
+    HistoryChunk* chunk = &chunks[h];
+    if(IsEmptyChunk(chunk) || (chunk->hash[0] == hash[0] && chunk->hash[1] == hash[1])) return chunk;
+  }
+}
+
+// The chunk named hash in set, NULL if it is not there
+static HistoryChunk* ChunkSetFind(const ChunkSet* set, const unsigned long long hash[2]) {
+  if(!set->capacity) return NULL;
+  HistoryChunk* chunk = FindHistoryChunk(set->chunks,set->capacity,hash);
+  return IsEmptyChunk(chunk) ? NULL : chunk;
+}
+
+// Slot of hash in set, an empty one if it is not there yet, NULL if out of
+// memory. A caller filling the slot counts it.
+static HistoryChunk* ChunkSetSlot(ChunkSet* set, const unsigned long long hash[2]) {
+  if((set->count + 1) * 4 >= set->capacity * 3) {
+    size_t capacity = set->capacity ? set->capacity * 2 : 256;
+    HistoryChunk* chunks = calloc(capacity,sizeof(HistoryChunk));
+    if(!chunks) return NULL;
+
+    for(size_t i = 0; i < set->capacity; ++i)
+      if(!IsEmptyChunk(&set->chunks[i])) *FindHistoryChunk(chunks,capacity,set->chunks[i].hash) = set->chunks[i];
+
+    free(set->chunks);
+    set->chunks = chunks;
+    set->capacity = capacity;
+  }
+  return FindHistoryChunk(set->chunks,set->capacity,hash);
+}
+
+static void HistoryPath(char* buffer, size_t size, const char* name, const char* suffix) {
+  snprintf(buffer,size,"%s" PATH_SEPARATOR HISTORY_DIR PATH_SEPARATOR "%s%s",NOTESPATH,name,suffix);
+}
+
+static unsigned int VersionChecksum(const VersionRecord* record, const void* hashes) {
+  VersionRecord copy = *record;
+  copy.checksum = 0;
+
+  unsigned int hash = 2166136261u;
+  for(size_t i = 0; i < sizeof(copy); ++i) hash = (hash ^ ((const unsigned char*)&copy)[i]) * 16777619u;
+  for(size_t i = 0; i < copy.chunkCount * sizeof(unsigned long long[2]); ++i) hash = (hash ^ ((const unsigned char*)hashes)[i]) * 16777619u;
+  return hash;
+}
+
+// Validates the chunk record at offset of a mapped store, returns its size
+// with the stored bytes or 0 if it is torn or not a record
+static size_t ChunkRecordAt(const unsigned char* data, unsigned long long size, unsigned long long offset, ChunkRecord* record) {
+  if(size - offset < sizeof(ChunkRecord)) return 0;
+  memcpy(record,data + offset,sizeof(*record));
+
+  if(record->magic != CHUNK_MAGIC || !record->rawLength || record->rawLength > CHUNK_MAX_SIZE) return 0;
+  if(record->storedLength > record->rawLength || size - offset - sizeof(ChunkRecord) < record->storedLength) return 0;
+  if(PackChecksum(data + offset + sizeof(ChunkRecord),record->storedLength) != record->checksum) return 0;
+  return sizeof(ChunkRecord) + record->storedLength;
+}
+
+// Validates the version record at offset, returns its size with the
+// hashes or 0 if it is torn or not a record
+static size_t VersionRecordAt(const unsigned char* data, size_t size, size_t offset, VersionRecord* record) {
+  if(size - offset < sizeof(VersionRecord)) return 0;
+  memcpy(record,data + offset,sizeof(*record));
+
+  size_t available = size - offset - sizeof(VersionRecord);
+  if(record->magic != VERSION_MAGIC || record->chunkCount > available / sizeof(unsigned long long[2])) return 0;
+  if(VersionChecksum(record,data + offset + sizeof(VersionRecord)) != record->checksum) return 0;
+  return sizeof(VersionRecord) + record->chunkCount * sizeof(unsigned long long[2]);
+}
+
+// Reads the versions of a note, NULL if it has none. *size is set to the
+// end of the last whole record, where the next one goes.
+static unsigned char* ReadVersionFile(const char* filename, size_t* size) {
+  *size = 0;
+
+  char path[MAX_PATH + 1];
+  HistoryPath(path,sizeof(path),filename,VERSION_EXTENSION);
+
+  FileHandle file = FileOpen(path,FILE_READ);
+  if(!file) return NULL;
+
+  unsigned long long fileSize = FileSize(file);
+  unsigned char* data = fileSize < LONG_MAX ? malloc(fileSize ? fileSize : 1) : NULL;
+  if(data && !FileReadAt(file,0,data,fileSize)) {
+    free(data);
+    data = NULL;
+  }
+  FileClose(file);
+  if(!data) return NULL;
+
+  VersionRecord record;
+  size_t at = 0;
+  for(size_t recordSize; (recordSize = VersionRecordAt(data,fileSize,at,&record)); at += recordSize);
+  *size = at;
+  return data;
+}
+
+// Indexes the chunk store, creating it if there is none, and opens it for
+// appending. Caller holds the lock.
+static int OpenChunkStore() {
+  if(history.file) return 1;
+
+  char path[MAX_PATH + 1];
+  snprintf(path,sizeof(path),"%s" PATH_SEPARATOR HISTORY_DIR,NOTESPATH);
+  if(!DirCreate(path)) return 0;
+  HistoryPath(path,sizeof(path),CHUNK_STORE_FILENAME,"");
+
+  unsigned long long size, end = 0;
+  void* mapping;
+  const unsigned char* data = FileMap(path,&size,&mapping);
+  if(data) {
+    ChunkStoreHeader header = {0};
+    if(size >= sizeof(header)) memcpy(&header,data,sizeof(header));
+    if(header.magic == CHUNK_STORE_MAGIC && header.version == CHUNK_STORE_VERSION) end = sizeof(header);
+
+    ChunkRecord record;
+    for(size_t recordSize; end && (recordSize = ChunkRecordAt(data,size,end,&record)); end += recordSize) {
+      HistoryChunk* chunk = ChunkSetSlot(&history.index,record.hash);
+      if(!chunk) {
+        FileUnmap(data,size,mapping);
+        return 0;
+      }
+      if(!IsEmptyChunk(chunk)) continue;
+
+      *chunk = (HistoryChunk){.hash = {record.hash[0],record.hash[1]}, .offset = end, .rawLength = record.rawLength, .storedLength = record.storedLength};
+      history.index.count++;
+    }
+    FileUnmap(data,size,mapping);
+  }
+
+  history.file = FileOpen(path,FILE_READWRITE);
+  if(!history.file) return 0;
+
+  if(end < sizeof(ChunkStoreHeader)) {
+    ChunkStoreHeader header = {.magic = CHUNK_STORE_MAGIC, .version = CHUNK_STORE_VERSION};
+    end = sizeof(header);
+    if(!FileWriteAt(history.file,0,&header,sizeof(header))) return 0;
+  }
+  history.end = end;
+
+  // Cut off a torn chunk left behind by a crash
+  return FileTruncate(history.file,end);
+}
+
+// Caller holds the lock
+static void CloseChunkStore() {
+  FileClose(history.file);
+  history.file = NULL;
+  free(history.index.chunks);
+  memset(&history.index,0,sizeof(history.index));
+}
+
+// Appends a chunk to the store and fills its empty index slot. packed is
+// room for CHUNK_MAX_SIZE bytes. Caller holds the lock.
+static int AppendChunk(const char* data, size_t length, const unsigned long long hash[2], unsigned char* packed, HistoryChunk* slot) {
+  ChunkRecord record = {.magic = CHUNK_MAGIC, .rawLength = length, .storedLength = length, .hash = {hash[0],hash[1]}};
+  const void* stored = data;
+
+  size_t packedLength = LzCompressBlock((const unsigned char*)data,length,packed,length - length / 8);
+  if(packedLength && packedLength < length) {
+    stored = packed;
+    record.storedLength = packedLength;
+  }
+  record.checksum = PackChecksum(stored,record.storedLength);
+
+  if(!FileWriteAt(history.file,history.end,&record,sizeof(record))) return 0;
+  if(!FileWriteAt(history.file,history.end + sizeof(record),stored,record.storedLength)) return 0;
+
+  *slot = (HistoryChunk){.hash = {hash[0],hash[1]}, .offset = history.end, .rawLength = length, .storedLength = record.storedLength};
+  history.index.count++;
+  history.end += sizeof(record) + record.storedLength;
+  return 1;
+}
+
+// Writer thread: adds body as the newest version of a note unless it is
+// the same as the newest one already
+static int RecordNoteVersion(const char* filename, const char* body, size_t length) {
+  if(length > UINT_MAX) return 0;
+
+  // Cut and hash before taking the lock, every chunk but the last is at
+  // least CHUNK_MIN_SIZE long
+  size_t capacity = length / CHUNK_MIN_SIZE + 1;
+  unsigned long long (*hashes)[2] = malloc(sizeof(*hashes) * capacity);
+  size_t* lengths = malloc(sizeof(size_t) * capacity);
+  unsigned char* packed = malloc(CHUNK_MAX_SIZE);
+  int ok = hashes && lengths && packed;
+
+  size_t count = 0;
+  for(size_t at = 0; ok && at < length; at += lengths[count++]) {
+    lengths[count] = NextChunkCut(body + at,length - at);
+    HashChunk(body + at,lengths[count],hashes[count]);
+  }
+
+  AcquireLock(history.lock);
+
+  size_t size = 0;
+  unsigned char* versions = ok ? ReadVersionFile(filename,&size) : NULL;
+  VersionRecord record, last = {0};
+  const unsigned char* lastHashes = NULL;
+  for(size_t at = 0, recordSize; (recordSize = VersionRecordAt(versions,size,at,&record)); at += recordSize) {
+    last = record;
+    lastHashes = versions + at + sizeof(VersionRecord);
+  }
+
+  int unchanged = lastHashes && last.rawLength == length && last.chunkCount == count &&
+                  memcmp(lastHashes,hashes,sizeof(*hashes) * count) == 0;
+
+  if(ok && !unchanged) {
+    ok = OpenChunkStore();
+
+    size_t stored = 0;
+    for(size_t i = 0, at = 0; ok && i < count; at += lengths[i++]) {
+      HistoryChunk* chunk = ChunkSetSlot(&history.index,hashes[i]);
+      if(!chunk) ok = 0;
+      else if(IsEmptyChunk(chunk)) {
+        ok = AppendChunk(body + at,lengths[i],hashes[i],packed,chunk);
+        stored++;
+      }
+    }
+
+    // The chunks are on disk before any version refers to them
+    if(ok && stored) ok = FileFlush(history.file);
+
+    if(ok) {
+      VersionRecord version = {
+        .magic = VERSION_MAGIC,
+        .number = lastHashes ? last.number + 1 : 1,
+        .time = (unsigned long long)time(NULL),
+        .rawLength = length,
+        .chunkCount = count
+      };
+      version.checksum = VersionChecksum(&version,hashes);
+
+      char path[MAX_PATH + 1];
+      HistoryPath(path,sizeof(path),filename,VERSION_EXTENSION);
+
+      // Written where the last whole record ends, over a torn one
+      FileHandle file = FileOpen(path,FILE_READWRITE);
+      ok = file && FileWriteAt(file,size,&version,sizeof(version)) &&
+           (!count || FileWriteAt(file,size + sizeof(version),hashes,sizeof(*hashes) * count)) &&
+           FileTruncate(file,size + sizeof(version) + sizeof(*hashes) * count) && FileFlush(file);
+      FileClose(file);
+    }
+  }
+
+  ReleaseLock(history.lock);
+  free(versions);
+  free(hashes);
+  free(lengths);
+  free(packed);
+  return ok;
+}
+
+// Writer thread: forgets the versions of a deleted note, its chunks are
+// left to CollectHistoryGarbage
+static void DeleteNoteHistory(const char* filename) {
+  char path[MAX_PATH + 1];
+  HistoryPath(path,sizeof(path),filename,VERSION_EXTENSION);
+
+  AcquireLock(history.lock);
+  FileDelete(path);
+  ReleaseLock(history.lock);
+}
+
+// Versions of a note, oldest first. Returns how many and sets *versions to
+// an array the caller frees. Safe to call from any thread.
+size_t ListNoteVersions(const char* filename, NoteVersion** versions) {
+  *versions = NULL;
+
+  AcquireLock(history.lock);
+  size_t size;
+  unsigned char* data = ReadVersionFile(filename,&size);
+  ReleaseLock(history.lock);
+
+  VersionRecord record;
+  size_t count = 0;
+  for(size_t at = 0, recordSize; (recordSize = VersionRecordAt(data,size,at,&record)); at += recordSize) count++;
+
+  *versions = count ? malloc(sizeof(NoteVersion) * count) : NULL;
+  if(!*versions) count = 0;
+
+  size_t i = 0;
+  for(size_t at = 0, recordSize; i < count && (recordSize = VersionRecordAt(data,size,at,&record)); at += recordSize)
+    (*versions)[i++] = (NoteVersion){.number = record.number, .length = record.rawLength, .time = record.time};
+
+  free(data);
+  return count;
+}
+
+// Puts a version together from its chunks. Caller holds the lock.
+static char* AssembleVersion(const VersionRecord* version, const unsigned char* hashes) {
+  if(!OpenChunkStore()) return NULL;
+
+  char* text = malloc((size_t)version->rawLength + 1);
+  unsigned char* packed = malloc(CHUNK_MAX_SIZE);
+  int ok = text && packed;
+
+  size_t at = 0;
+  for(unsigned int i = 0; ok && i < version->chunkCount; ++i) {
+    unsigned long long hash[2];
+    memcpy(hash,hashes + i * sizeof(hash),sizeof(hash));
+
+    const HistoryChunk* chunk = ChunkSetFind(&history.index,hash);
+    if(!chunk || chunk->rawLength > version->rawLength - at) {
+      ok = 0;
+      break;
+    }
+
+    unsigned long long offset = chunk->offset + sizeof(ChunkRecord);
+    if(chunk->storedLength == chunk->rawLength)
+      ok = FileReadAt(history.file,offset,text + at,chunk->rawLength);
+    else
+      ok = FileReadAt(history.file,offset,packed,chunk->storedLength) &&
+           LzDecodeBlock(packed,chunk->storedLength,(unsigned char*)text + at,chunk->rawLength) == chunk->rawLength;
+    at += chunk->rawLength;
+  }
+  free(packed);
+
+  if(!ok || at != version->rawLength) {
+    free(text);
+    return NULL;
+  }
+  text[at] = '\0';
+  return text;
+}
+
+// LF text of one version of a note, NUL terminated. NULL if there is no
+// such version or a chunk of it is missing. Safe to call from any thread.
+char* ReadNoteVersion(const char* filename, unsigned int number, long* length) {
+  AcquireLock(history.lock);
+
+  size_t size;
+  unsigned char* data = ReadVersionFile(filename,&size);
+  char* text = NULL;
+
+  VersionRecord record;
+  for(size_t at = 0, recordSize; (recordSize = VersionRecordAt(data,size,at,&record)); at += recordSize) {
+    if(record.number != number) continue;
+
+    text = AssembleVersion(&record,data + at + sizeof(VersionRecord));
+    if(text) *length = record.rawLength;
+    break;
+  }
+
+  ReleaseLock(history.lock);
+  free(data);
+  return text;
+}
+
+static int MarkVersionChunks(const char* name, unsigned long long size, unsigned long long mtime, void* context) {
+  ChunkSet* live = context;
+
+  char filename[MAX_PATH + 1];
+  snprintf(filename,sizeof(filename),"%.*s",(int)(strlen(name) - (sizeof(VERSION_EXTENSION) - 1)),name);
+
+  size_t validSize;
+  unsigned char* data = ReadVersionFile(filename,&validSize);
+
+  VersionRecord record;
+  for(size_t at = 0, recordSize; (recordSize = VersionRecordAt(data,validSize,at,&record)); at += recordSize) {
+    for(unsigned int i = 0; i < record.chunkCount; ++i) {
+      unsigned long long hash[2];
+      memcpy(hash,data + at + sizeof(VersionRecord) + i * sizeof(hash),sizeof(hash));
+
+      HistoryChunk* chunk = ChunkSetSlot(live,hash);
+      if(!chunk) {
+        free(data);
+        return 0;
+      }
+      if(IsEmptyChunk(chunk)) {
+        chunk->hash[0] = hash[0];
+        chunk->hash[1] = hash[1];
+        live->count++;
+      }
+    }
+  }
+
+  free(data);
+  return 1;
+}
+
+// Rewrites the chunk store with only the chunks that some version still
+// refers to, keeping their order. Run while nothing else uses the
+// history, before the writer starts. Returns 0 if it failed, the old
+// store is then left as it was.
+int CollectHistoryGarbage(unsigned long long* freed) {
+  char dir[MAX_PATH + 1], path[MAX_PATH + 1], tmppath[MAX_PATH + 1];
+  snprintf(dir,sizeof(dir),"%s" PATH_SEPARATOR HISTORY_DIR,NOTESPATH);
+  HistoryPath(path,sizeof(path),CHUNK_STORE_FILENAME,"");
+  HistoryPath(tmppath,sizeof(tmppath),CHUNK_STORE_FILENAME,".tmp");
+  *freed = 0;
+
+  AcquireLock(history.lock);
+  CloseChunkStore();
+
+  ChunkSet live = {0};
+  int ok = DirList(dir,VERSION_EXTENSION,MarkVersionChunks,&live);
+
+  unsigned long long size = 0;
+  void* mapping;
+  const unsigned char* data = ok ? FileMap(path,&size,&mapping) : NULL;
+  if(data) {
+    ChunkStoreHeader header = {0};
+    if(size >= sizeof(header)) memcpy(&header,data,sizeof(header));
+    ok = header.magic == CHUNK_STORE_MAGIC && header.version == CHUNK_STORE_VERSION;
+
+    FileHandle file = ok ? FileOpen(tmppath,FILE_CREATE) : NULL;
+    unsigned long long end = sizeof(header);
+    ok = file && FileWriteAt(file,0,&header,sizeof(header));
+
+    ChunkRecord record;
+    for(size_t at = sizeof(header), recordSize; ok && (recordSize = ChunkRecordAt(data,size,at,&record)); at += recordSize) {
+      if(!ChunkSetFind(&live,record.hash)) continue;
+
+      ok = FileWriteAt(file,end,data + at,recordSize);
+      end += recordSize;
+    }
+
+    ok = ok && FileFlush(file);
+    FileClose(file);
+    FileUnmap(data,size,mapping);
+
+    if(ok) ok = FileReplace(tmppath,path);
+    if(ok) *freed = size - end;
+    else FileDelete(tmppath);
+  }
+
+  ReleaseLock(history.lock);
+  free(live.chunks);
+  return ok;
+}
+
+// 
+// Archive
+// 
+// A whole store streamed into one file, to back it up or move it. Every
+// note becomes an ArchiveEntry with its window as the geometry table has
+// it, followed by its current LF text. The stream of entries is cut into blocks of ARCHIVE_BLOCK_SIZE
+// bytes, LZ compressed on worker threads while the next notes are read,
+// and written in order, each behind a frame. A fixed ring of blocks is in
+// flight, so memory grows with the largest note and not with their
+// number. Import decodes one frame at a time and writes every note not in
+// the store yet.
+// 
+
+#define ARCHIVE_MAGIC 0x43524148 // "HARC"
+#define ARCHIVE_FRAME_MAGIC 0x4D524641 // "AFRM"
+#define ARCHIVE_VERSION 2
+#define ARCHIVE_VERSION_UNSTACKED 1     // Entries without zOrder, still imported
+#define ARCHIVE_BLOCK_SIZE BODY_BLOCK_SIZE
+#define ARCHIVE_BLOCKS_PER_WORKER 4
+
+typedef struct ArchiveHeader {
+  unsigned int magic;
+  unsigned int version;
+} ArchiveHeader;
+
+// Precedes every block of the entry stream
+typedef struct ArchiveFrame {
+  unsigned int magic;
+  unsigned int rawLength;
+  unsigned int storedLength;            // Less than rawLength if compressed
+  unsigned int checksum;                // Of the stored bytes
+} ArchiveFrame;
+
+// Starts every note in the entry stream, followed by header.bodyLength
+// bytes of text. An entry without a filename ends the archive. The header
+// holds the window of the note as the geometry table had it.
+typedef struct ArchiveEntry {
+  char filename[FILENAME_SIZE + 2];
+  NoteHeader header;
+  unsigned int zOrder;                  // Stacking of the window, 0 if unknown
+} ArchiveEntry;
+
+static_assert(sizeof(ArchiveFrame) == 16, "archive frame must stay fixed size");
+static_assert(sizeof(ArchiveEntry) == 56, "archive entry must stay fixed size");
+
+typedef struct ArchiveBlock {
+  ArchiveFrame frame;
+  int compressed;                       // A worker is done with it
+  unsigned char raw[ARCHIVE_BLOCK_SIZE];
+  unsigned char stored[ARCHIVE_BLOCK_SIZE];
+} ArchiveBlock;
+
+// Blocks move from being filled to the workers to the file in the order
+// of the three counts, a block's slot in the ring is its count modulo
+// blockCount
+static struct Archive {
+  Lock* lock;
+  Condition *filled, *compressed;
+  ArchiveBlock* blocks;
+  size_t blockCount;
+  unsigned long long filledCount;       // Handed to the workers
+  unsigned long long takenCount;        // Taken by a worker
+  unsigned long long writtenCount;      // In the file
+  size_t fill;                          // Bytes in the block being filled
+  int stop;
+  Thread* workers[LOAD_MAX_WORKERS];
+  int workerCount;
+  FileHandle file;
+  unsigned long long end;
+  unsigned long notes;
+  int ok;
+} archive = {0};
+
+static void CompressArchiveBlock(ArchiveBlock* block) {
+  size_t length = block->frame.rawLength;
+  size_t packed = LzCompressBlock(block->raw,length,block->stored,length - length / 8);
+
+  block->frame.storedLength = packed && packed < length ? packed : length;
+  block->frame.checksum = PackChecksum(packed && packed < length ? block->stored : block->raw,block->frame.storedLength);
+}
+
+static int ArchiveWorker(void* param) {
+  AcquireLock(archive.lock);
+  for(;;) {
+    while(archive.takenCount == archive.filledCount && !archive.stop)
+      WaitCondition(archive.filled,archive.lock,WAIT_FOREVER);
+    if(archive.takenCount == archive.filledCount) break;
+
+    ArchiveBlock* block = &archive.blocks[archive.takenCount++ % archive.blockCount];
+    ReleaseLock(archive.lock);
+    CompressArchiveBlock(block);
+    AcquireLock(archive.lock);
+
+    block->compressed = 1;
+    WakeAllCondition(archive.compressed);
+  }
+  ReleaseLock(archive.lock);
+  return 0;
+}
+
+// Writes the oldest block once it is compressed. Caller holds the lock,
+// which is let go while writing.
+static int WriteArchiveBlock() {
+  ArchiveBlock* block = &archive.blocks[archive.writtenCount % archive.blockCount];
+  while(!block->compressed) WaitCondition(archive.compressed,archive.lock,WAIT_FOREVER);
+  ReleaseLock(archive.lock);
+
+  const unsigned char* data = block->frame.storedLength < block->frame.rawLength ? block->stored : block->raw;
+  int ok = FileWriteAt(archive.file,archive.end,&block->frame,sizeof(block->frame)) &&
+           FileWriteAt(archive.file,archive.end + sizeof(block->frame),data,block->frame.storedLength);
+  archive.end += sizeof(block->frame) + block->frame.storedLength;
+
+  AcquireLock(archive.lock);
+  archive.writtenCount++;
+  return ok;
+}
+
+// Hands the block being filled to the workers, then writes finished
+// blocks until the slot of the next one is free
+static int PublishArchiveBlock() {
+  ArchiveBlock* block = &archive.blocks[archive.filledCount % archive.blockCount];
+  block->frame = (ArchiveFrame){.magic = ARCHIVE_FRAME_MAGIC, .rawLength = archive.fill};
+  block->compressed = 0;
+  archive.fill = 0;
+
+  AcquireLock(archive.lock);
+  archive.filledCount++;
+  if(archive.workerCount) WakeCondition(archive.filled);
+  else {
+    // No worker could be started, compress right here
+    archive.takenCount++;
+    CompressArchiveBlock(block);
+    block->compressed = 1;
+  }
+
+  int ok = 1;
+  while(ok && archive.filledCount - archive.writtenCount >= archive.blockCount) ok = WriteArchiveBlock();
+  ReleaseLock(archive.lock);
+  return ok;
+}
+
+static int AppendArchiveBytes(const void* data, size_t size) {
+  const char* bytes = data;
+  while(size) {
+    size_t room = ARCHIVE_BLOCK_SIZE - archive.fill;
+    size_t n = size < room ? size : room;
+    memcpy(archive.blocks[archive.filledCount % archive.blockCount].raw + archive.fill,bytes,n);
+    archive.fill += n;
+    bytes += n;
+    size -= n;
+
+    if(archive.fill == ARCHIVE_BLOCK_SIZE && !PublishArchiveBlock()) return 0;
+  }
+  return 1;
+}
+
+// Adds a note from its stored header and body, with its journal applied.
+// A note that cannot be decoded is left out, it would not load either.
+static int ArchiveNote(const char* filename, const NoteHeader* stored, const char* body) {
+  long length = 0;
+  int records;
+  char* text = DecodeBody(stored,body,&length);
+  if(text) ReplayNoteJournal(filename,&text,&length,&records);
+  if(!text) return 1;
+
+  ArchiveEntry entry = {
+    .header = {
+      .magic = NOTE_MAGIC,
+      .version = NOTE_VERSION_PLAIN,
+      .headerSize = sizeof(NoteHeader),
+      .opened = stored->opened,
+      .x = stored->x,
+      .y = stored->y,
+      .width = stored->width,
+      .height = stored->height,
+      .bodyLength = length
+    }
+  };
+  snprintf(entry.filename,sizeof(entry.filename),"%s",filename);
+  entry.zOrder = ApplyStoredGeometry(filename,&entry.header);
+
+  int ok = AppendArchiveBytes(&entry,sizeof(entry)) && AppendArchiveBytes(text,length);
+  free(text);
+  if(ok) archive.notes++;
+  return ok;
+}
+
+static void ArchivePackedNote(const char* filename, const NoteHeader* header, const char* body, unsigned long long offset, void* context) {
+  if(archive.ok) archive.ok = ArchiveNote(filename,header,body);
+}
+
+static int ArchiveNoteFile(const char* name, unsigned long long size, unsigned long long mtime, void* context) {
+  if(size > LONG_MAX) return 1;
+
+  char fullpath[MAX_PATH + 1];
+  NotePath(fullpath,sizeof(fullpath),name,"");
+
+  FileHandle file = FileOpen(fullpath,FILE_READ);
+  if(!file) return 1;
+
+  size = FileSize(file);
+  unsigned char* data = size <= LONG_MAX ? malloc(size ? size : 1) : NULL;
+  int read = data && FileReadAt(file,0,data,size);
+  FileClose(file);
+
+  NoteHeader header;
+  long bodyOffset = read ? ParseNoteHeader(data,size,(long)size,&header) : -1;
+  if(bodyOffset >= 0) archive.ok = ArchiveNote(name,&header,(const char*)data + bodyOffset);
+
+  free(data);
+  return archive.ok;
+}
+
+// Streams every note into a new archive at path, run before the UI
+// starts. Returns 0 if the archive could not be written completely.
+int ExportArchive(const char* path, unsigned long* exported) {
+  *exported = 0;
+
+  int workers = ProcessorCount();
+  if(workers < 1) workers = 1;
+  if(workers > LOAD_MAX_WORKERS) workers = LOAD_MAX_WORKERS;
+
+  archive.blockCount = (size_t)workers * ARCHIVE_BLOCKS_PER_WORKER;
+  archive.blocks = malloc(sizeof(ArchiveBlock) * archive.blockCount);
+  archive.file = archive.blocks ? FileOpen(path,FILE_CREATE) : NULL;
+  if(!archive.file) {
+    free(archive.blocks);
+    archive.blocks = NULL;
+    return 0;
+  }
+
+  archive.filledCount = archive.takenCount = archive.writtenCount = 0;
+  archive.fill = 0;
+  archive.stop = 0;
+  archive.notes = 0;
+  archive.workerCount = 0;
+
+  ArchiveHeader header = {.magic = ARCHIVE_MAGIC, .version = ARCHIVE_VERSION};
+  archive.ok = FileWriteAt(archive.file,0,&header,sizeof(header));
+  archive.end = sizeof(header);
+
+  for(int i = 0; i < workers; ++i)
+    if((archive.workers[archive.workerCount] = StartThread(ArchiveWorker,NULL))) archive.workerCount++;
+
+  BeginGeometryLookups();
+  if(archive.ok && !OpenPack(ArchivePackedNote,NULL))
+    archive.ok = ListNoteFiles(ArchiveNoteFile,NULL) && archive.ok;
+  EndGeometryLookups();
+
+  ArchiveEntry last = {0};
+  if(archive.ok) archive.ok = AppendArchiveBytes(&last,sizeof(last));
+  if(archive.ok && archive.fill) archive.ok = PublishArchiveBlock();
+
+  AcquireLock(archive.lock);
+  while(archive.ok && archive.writtenCount < archive.filledCount) archive.ok = WriteArchiveBlock();
+  archive.stop = 1;
+  WakeAllCondition(archive.filled);
+  ReleaseLock(archive.lock);
+
+  for(int i = 0; i < archive.workerCount; ++i) JoinThread(archive.workers[i],WAIT_FOREVER);
+
+  int ok = archive.ok && FileFlush(archive.file);
+  FileClose(archive.file);
+  archive.file = NULL;
+  free(archive.blocks);
+  archive.blocks = NULL;
+
+  *exported = archive.notes;
+  if(!ok) FileDelete(path);
+  return ok;
+}
+
+// An entry read from an archive names a note file right in the notes
+// directory, never the pack, index or catalog next to them
+static int ValidArchiveEntry(const ArchiveEntry* entry) {
+  if(entry->filename[FILENAME_SIZE] || entry->filename[FILENAME_SIZE + 1]) return 0;
+  if(entry->filename[0] == '.' || strpbrk(entry->filename,"/\\:")) return 0;
+
+  size_t length = strlen(entry->filename), suffix = strlen(NOTE_EXTENSION);
+  if(length <= suffix || strcmp(entry->filename + length - suffix,NOTE_EXTENSION) != 0) return 0;
+  return entry->header.magic == NOTE_MAGIC && entry->header.bodyLength <= INT_MAX;
+}
+
+static int NoteExists(const char* filename) {
+  if(packStore.enabled)
+    return packStore.entryCapacity && FindPackSlot(packStore.entries,packStore.entryCapacity,filename,0)->state == 1;
+
+  char fullpath[MAX_PATH + 1];
+  NotePath(fullpath,sizeof(fullpath),filename,"");
+
+  unsigned long long size, mtime;
+  return FileStamp(fullpath,&size,&mtime);
+}
+
+// Stores a note from an archive like a save would. Notes for the pack are
+// only flushed once the import is done.
+static int WriteArchivedNote(const ArchiveEntry* entry, const char* text) {
+  NoteHeader header = entry->header;
+  header.version = NOTE_VERSION_PLAIN;
+  header.headerSize = sizeof(NoteHeader);
+  header.flags = 0;
+
+  char* packed = CompressForStore(&header,text);
+  const char* body = packed ? packed : text;
+
+  int ok;
+  if(packStore.enabled) ok = AppendNoteToPack(entry->filename,&header,body);
+  else {
+    char fullpath[MAX_PATH + 1];
+    NotePath(fullpath,sizeof(fullpath),entry->filename,"");
+
+    unsigned long long mtime;
+    ok = WriteNoteFileAtomically(fullpath,&header,body,&mtime);
+  }
+
+  free(packed);
+  return ok;
+}
+
+// Reads an archive front to back and adds every note whose name is not in
+// the store yet, run before the UI starts. Returns 0 if the archive is
+// damaged or cut short, the notes before that point are imported anyway.
+int ImportArchive(const char* path, unsigned long* imported, unsigned long* skipped) {
+  *imported = *skipped = 0;
+
+  FileHandle file = FileOpen(path,FILE_READ);
+  if(!file) return 0;
+
+  unsigned long long size = FileSize(file), at = sizeof(ArchiveHeader);
+  unsigned char* stored = malloc(ARCHIVE_BLOCK_SIZE);
+  unsigned char* raw = malloc(ARCHIVE_BLOCK_SIZE);
+
+  ArchiveHeader header;
+  int ok = stored && raw && size >= sizeof(header) && FileReadAt(file,0,&header,sizeof(header)) &&
+           header.magic == ARCHIVE_MAGIC && (header.version == ARCHIVE_VERSION || header.version == ARCHIVE_VERSION_UNSTACKED) &&
+           PrepareNoteShards();
+
+  // Indexes the pack if there is one, so existing notes are found there,
+  // and the geometry table, which gets the windows of imported notes
+  OpenPack(NULL,NULL);
+  BeginGeometryLookups();
+  unsigned int zBase = topZOrder;
+
+  ArchiveEntry entry = {0};
+  size_t entrySize = ok && header.version == ARCHIVE_VERSION_UNSTACKED ? offsetof(ArchiveEntry,zOrder) : sizeof(entry);
+  size_t entryFill = 0, bodyFill = 0;
+  int inBody = 0, ended = 0;
+  char* text = NULL;                    // Body of the current note, NULL when it is skipped
+
+  while(ok && !ended && at < size) {
+    ArchiveFrame frame;
+    ok = size - at >= sizeof(frame) && FileReadAt(file,at,&frame,sizeof(frame)) && frame.magic == ARCHIVE_FRAME_MAGIC &&
+         frame.rawLength <= ARCHIVE_BLOCK_SIZE && frame.storedLength <= frame.rawLength &&
+         frame.storedLength <= size - at - sizeof(frame);
+    if(!ok) break;
+
+    unsigned char* data = frame.storedLength < frame.rawLength ? stored : raw;
+    ok = FileReadAt(file,at + sizeof(frame),data,frame.storedLength) && PackChecksum(data,frame.storedLength) == frame.checksum;
+    if(ok && data == stored) ok = LzDecodeBlock(stored,frame.storedLength,raw,frame.rawLength) == frame.rawLength;
+    at += sizeof(frame) + frame.storedLength;
+
+    for(size_t used = 0; ok && !ended && used < frame.rawLength;) {
+      if(!inBody) {
+        size_t n = entrySize - entryFill < frame.rawLength - used ? entrySize - entryFill : frame.rawLength - used;
+        memcpy((char*)&entry + entryFill,raw + used,n);
+        entryFill += n;
+        used += n;
+        if(entryFill < entrySize) break;
+
+        entryFill = 0;
+        if(!entry.filename[0]) {
+          ended = 1;
+          break;
+        }
+        if(!(ok = ValidArchiveEntry(&entry))) break;
+
+        inBody = 1;
+        bodyFill = 0;
+        if(NoteExists(entry.filename)) (*skipped)++;
+        else if(!(text = malloc((size_t)entry.header.bodyLength + 1))) ok = 0;
+      }
+
+      size_t n = entry.header.bodyLength - bodyFill < frame.rawLength - used ? entry.header.bodyLength - bodyFill : frame.rawLength - used;
+      if(text) memcpy(text + bodyFill,raw + used,n);
+      bodyFill += n;
+      used += n;
+      if(bodyFill < entry.header.bodyLength) continue;
+
+      inBody = 0;
+      if(text) {
+        text[bodyFill] = '\0';
+        ok = ok && WriteArchivedNote(&entry,text);
+        if(ok) {
+          SetStoredGeometry(entry.filename,&entry.header,entry.zOrder ? zBase + entry.zOrder : 0);
+          (*imported)++;
+        }
+        free(text);
+        text = NULL;
+      }
+    }
+  }
+
+  free(text);
+  free(stored);
+  free(raw);
+  FileClose(file);
+
+  // One flush for every note that went into the pack
+  ClosePack();
+  EndGeometryLookups();
+  return ok && ended;
+}
+
+// 
+// Note order
+// 
+// The main list shows its notes in one of the NOTE_ORDER_ orders, kept by
+// a treap threaded through the notes themselves. Every node counts the
+// listed notes below it, so the row of a note and the note in a row are
+// both found in O(log n), and a save moves exactly one note without
+// sorting anything. Links are slot indexes + 1, 0 ends a branch. The
+// fields an order compares are only changed while the note is out of the
+// treap, see TouchNote.
+// 
+
+static struct NoteOrder {
+  unsigned int root;
+  int key;                         // NOTE_ORDER_
+  unsigned int seed;
+  unsigned long long clock;        // Newest modified stamp so far
+  unsigned long long created;      // Newest creation time handed out or loaded
+} noteOrder = {.seed = 2463534242u};
+
+static inline Note* OrderNode(unsigned int link) {
+  return &SlotAt(link - 1)->note;
+}
+
+static inline unsigned int OrderCount(unsigned int link) {
+  return link ? OrderNode(link)->order.count : 0;
+}
+
+static inline void RecountOrderNode(Note* note) {
+  note->order.count = OrderCount(note->order.left) + OrderCount(note->order.right) + (note->listed != 0);
+}
+
+static int CompareTitles(const char* a, const char* b) {
+  for(;; ++a, ++b) {
+    int x = *a >= 'A' && *a <= 'Z' ? *a + 32 : (unsigned char)*a;
+    int y = *b >= 'A' && *b <= 'Z' ? *b + 32 : (unsigned char)*b;
+    if(x != y || !x) return (x > y) - (x < y);
+  }
+}
+
+// Negative if a comes before b. Ties go by slot so no two notes are equal.
+static int CompareNoteOrder(const Note* a, const Note* b) {
+  int c = 0;
+  if(noteOrder.key == NOTE_ORDER_TITLE) c = CompareTitles(a->preview,b->preview);
+  else if(noteOrder.key == NOTE_ORDER_SIZE) c = (a->bodyLength < b->bodyLength) - (a->bodyLength > b->bodyLength);
+  else {
+    // Newest first, notes of unknown age after all others by modified
+    if(noteOrder.key == NOTE_ORDER_CREATED) c = (a->created < b->created) - (a->created > b->created);
+    if(!c) c = (a->modified < b->modified) - (a->modified > b->modified);
+  }
+  if(c) return c;
+
+  NoteId x = a->id & NOTE_SLOT_MASK, y = b->id & NOTE_SLOT_MASK;
+  return (x > y) - (x < y);
+}
+
+static unsigned int RotateOrderRight(unsigned int link) {
+  Note* node = OrderNode(link);
+  unsigned int top = node->order.left;
+  Note* left = OrderNode(top);
+  node->order.left = left->order.right;
+  left->order.right = link;
+  RecountOrderNode(node);
+  RecountOrderNode(left);
+  return top;
+}
+
+static unsigned int RotateOrderLeft(unsigned int link) {
+  Note* node = OrderNode(link);
+  unsigned int top = node->order.right;
+  Note* right = OrderNode(top);
+  node->order.right = right->order.left;
+  right->order.left = link;
+  RecountOrderNode(node);
+  RecountOrderNode(right);
+  return top;
+}
+
+static unsigned int InsertOrderNode(unsigned int link, Note* note) {
+  if(!link) return (note->id & NOTE_SLOT_MASK) + 1;
+
+  Note* node = OrderNode(link);
+  if(CompareNoteOrder(note,node) < 0) {
+    node->order.left = InsertOrderNode(node->order.left,note);
+    if(OrderNode(node->order.left)->order.priority > node->order.priority) return RotateOrderRight(link);
+  }
+  else {
+    node->order.right = InsertOrderNode(node->order.right,note);
+    if(OrderNode(node->order.right)->order.priority > node->order.priority) return RotateOrderLeft(link);
+  }
+  RecountOrderNode(node);
+  return link;
+}
+
+// Joins two subtrees where everything in a comes before everything in b
+static unsigned int MergeOrderNodes(unsigned int a, unsigned int b) {
+  if(!a) return b;
+  if(!b) return a;
+
+  Note* x = OrderNode(a);
+  Note* y = OrderNode(b);
+  if(x->order.priority > y->order.priority) {
+    x->order.right = MergeOrderNodes(x->order.right,b);
+    RecountOrderNode(x);
+    return a;
+  }
+  y->order.left = MergeOrderNodes(a,y->order.left);
+  RecountOrderNode(y);
+  return b;
+}
+
+static unsigned int RemoveOrderNode(unsigned int link, const Note* note) {
+  if(!link) return 0;
+
+  Note* node = OrderNode(link);
+  int c = CompareNoteOrder(note,node);
+  if(!c) return MergeOrderNodes(node->order.left,node->order.right);
+
+  if(c < 0) node->order.left = RemoveOrderNode(node->order.left,note);
+  else node->order.right = RemoveOrderNode(node->order.right,note);
+  RecountOrderNode(node);
+  return link;
+}
+
+// Adds a note to the order, listed or not. Does nothing if it is in already.
+void OrderNote(Note* note) {
+  if(note->order.priority) return;
+
+  // xorshift32, never 0 since 0 marks a note that is not in the order
+  noteOrder.seed ^= noteOrder.seed << 13;
+  noteOrder.seed ^= noteOrder.seed >> 17;
+  noteOrder.seed ^= noteOrder.seed << 5;
+  note->order = (NoteOrderNode){.priority = noteOrder.seed, .count = note->listed != 0};
+  noteOrder.root = InsertOrderNode(noteOrder.root,note);
+
+  // Loaded notes carry their own stamps, later ones have to be newer
+  if(note->modified > noteOrder.clock) noteOrder.clock = note->modified;
+  if(note->created > noteOrder.created) noteOrder.created = note->created;
+}
+
+// Takes a note out of the order. Returns whether it was in.
+int UnorderNote(Note* note) {
+  if(!note->order.priority) return 0;
+
+  noteOrder.root = RemoveOrderNode(noteOrder.root,note);
+  note->order = (NoteOrderNode){0};
+  return 1;
+}
+
+// Marks a note as just modified, which moves it to the top of the
+// modified order
+void TouchNote(Note* note) {
+  int ordered = UnorderNote(note);
+  note->modified = ++noteOrder.clock;
+  if(ordered) OrderNote(note);
+}
+
+// Shows or hides a note in the list without moving anything else
+void ListNote(Note* note, int listed) {
+  listed = listed != 0;
+  if(note->listed == listed) return;
+  note->listed = listed;
+  if(!note->order.priority) return;
+
+  for(unsigned int link = noteOrder.root; link;) {
+    Note* node = OrderNode(link);
+    node->order.count += listed ? 1 : -1;
+
+    int c = CompareNoteOrder(note,node);
+    if(!c) break;
+    link = c < 0 ? node->order.left : node->order.right;
+  }
+}
+
+size_t ListedNoteCount() {
+  return OrderCount(noteOrder.root);
+}
+
+// Row of a note among the listed ones, -1 if it is not listed
+int NoteRow(const Note* note) {
+  if(!note || !note->listed || !note->order.priority) return -1;
+
+  size_t row = 0;
+  for(unsigned int link = noteOrder.root; link;) {
+    Note* node = OrderNode(link);
+    int c = CompareNoteOrder(note,node);
+    if(!c) return (int)(row + OrderCount(node->order.left));
+
+    if(c < 0) link = node->order.left;
+    else {
+      row += OrderCount(node->order.left) + (node->listed != 0);
+      link = node->order.right;
+    }
+  }
+  return -1;
+}
+
+// Listed note in a row, NULL past the end
+Note* NoteAtRow(int row) {
+  if(row < 0) return NULL;
+
+  size_t rest = row;
+  for(unsigned int link = noteOrder.root; link;) {
+    Note* node = OrderNode(link);
+    size_t before = OrderCount(node->order.left);
+
+    if(rest < before) link = node->order.left;
+    else if(rest == before && node->listed) return node;
+    else {
+      rest -= before + (node->listed != 0);
+      link = node->order.right;
+    }
+  }
+  return NULL;
+}
+
+int GetNoteOrder() {
+  return noteOrder.key;
+}
+
+// Switches to another order, the only time every note is placed anew
+void SetNoteOrder(int key) {
+  if(key == noteOrder.key) return;
+
+  noteOrder.key = key;
+  noteOrder.root = 0;
+  for(size_t i = 0; i < noteRegistry.slotCount; ++i) {
+    Note* note = NoteAtSlot(i);
+    if(!note || !note->order.priority) continue;
+
+    note->order.left = note->order.right = 0;
+    note->order.count = note->listed != 0;
+    noteOrder.root = InsertOrderNode(noteOrder.root,note);
+  }
+}
+
+// Writes a free name for a new note into filename, FILENAME_SIZE + 1
+// bytes, and returns the creation time it stands for. Notes created within
+// the same second get the following seconds.
+unsigned long long NewNoteFilename(char* filename) {
+  unsigned long long created = (unsigned long long)time(NULL);
+  if(created <= noteOrder.created) created = noteOrder.created + 1;
+
+  for(;; ++created) {
+    unsigned long long rest = created;
+    filename[0] = 'c';
+    for(int i = 7; i >= 1; --i) {
+      filename[i] = createdDigits[rest % 36];
+      rest /= 36;
+    }
+    memcpy(filename + 8,NOTE_EXTENSION,sizeof(NOTE_EXTENSION));
+    if(!NoteExists(filename)) break;
+  }
+
+  noteOrder.created = created;
+  return created;
+}
+
+// 
+// Background writer
+// 
+// Saves and deletes are handed to a single writer thread as immutable
+// jobs. A pending save of a note is replaced by a newer one, so a note is
+// never written twice in a row, and jobs of the same note keep their order.
+// Edits of notes too large to keep a copy of on the UI thread reach the
+// journal through the writer, which keeps the text it wrote last.
+// 
+
+// Search index, below. The writer indexes what it saves.
+static unsigned long long NextSearchStamp();
+static void IndexStoredText(NoteId id, const char* text, size_t len, unsigned long long stamp);
+
+enum { SAVEJOB_WRITE, SAVEJOB_DELETE, SAVEJOB_CATALOG, SAVEJOB_JOURNAL, SAVEJOB_DELETE_BATCH, SAVEJOB_EXPORT_BATCH, SAVEJOB_GEOMETRY, SAVEJOB_EDIT };
+
+// Note named in a batch job, the job body holds an array of them
+typedef struct BatchNote {
+  NoteId id;
+  int catalogSlot;
+  int geometryRecord;
+  char filename[FILENAME_SIZE + 1];
+} BatchNote;
+
+typedef struct SaveJob {
+  int kind;
+  NoteId id;
+  int catalogSlot;
+  int geometryRecord;        // Record + 1 of the geometry table to write, 0 if none
+  char filepath[MAX_PATH + 1];
+  char filename[FILENAME_SIZE + 1];
+  char preview[PREVIEW_SIZE + 1];
+  NoteHeader header;
+  char* body;                // bodyLength bytes owned by the job
+  unsigned long long indexStamp; // Search index order of body, see IndexNoteText
+  unsigned long long journalOffset;
+  size_t journalSize;        // Bytes of body to append to the journal instead
+  size_t batchCount;         // BatchNotes in body of a batch job
+  void (*done)(size_t exported, size_t count, void* context);  // Of an export batch, see ExportNotes
+  void* context;
+} SaveJob;
+
+static struct SaveQueue {
+  Lock* lock;
+  Condition *notEmpty, *notFull, *progress;
+  SaveJob jobs[SAVE_QUEUE_SIZE];
+  size_t head, count;
+  int busy;                  // A job is being executed
+  NoteId busyId;             // Note of that job
+  int stop;
+  Thread* thread;
+  unsigned long completed, merged, failed;
+} saveQueue = {0};
+
+// Writer thread: the text last written of the note whose edits it
+// journals, with the journal that text is, one note at a time
+static struct EditBase {
+  NoteId id;                 // INVALID_NOTEID if none is kept
+  char* text;
+  size_t length;
+  long journalLength;
+  int journalRecords;
+} editBase = {0};
+
+static void DropEditBase(NoteId id) {
+  if(editBase.id != id) return;
+
+  free(editBase.text);
+  memset(&editBase,0,sizeof(editBase));
+}
+
+// Keeps the text of job, which now owns none, as the base of the next edit
+static void KeepEditBase(SaveJob* job, long journalLength, int journalRecords) {
+  free(editBase.text);
+  editBase.id = job->id;
+  editBase.text = job->body;
+  editBase.length = job->header.bodyLength;
+  editBase.journalLength = journalLength;
+  editBase.journalRecords = journalRecords;
+  job->body = NULL;
+}
+
+// Writes a job's note with the header and body it is stored with
+static int WriteNoteVersion(const SaveJob* job, const NoteHeader* header, const char* body) {
+  if(packStore.enabled) {
+    if(!WriteNoteToPack(job->filename,header,body)) return 0;
+    DeleteNoteJournal(job->filename);
+    return 1;
+  }
+
+  unsigned long long mtime;
+  if(!WriteNoteFileAtomically(job->filepath,header,body,&mtime)) return 0;
+  DeleteNoteJournal(job->filename);
+
+  SetCatalogRecord(job->catalogSlot,job->filename,sizeof(NoteHeader) + header->bodyLength,mtime,header,sizeof(NoteHeader),job->preview);
+  WriteCatalogRecord(job->catalogSlot);
+  return 1;
+}
+
+// Writer thread: deletes the files of a batch of notes, tombstoning all of
+// them in one append to the pack when it is enabled
+static int DeleteNoteBatch(const BatchNote* notes, size_t count) {
+  for(size_t i = 0; i < count; ++i) {
+    DropEditBase(notes[i].id);
+    DeleteNoteJournal(notes[i].filename);
+    DeleteNoteHistory(notes[i].filename);
+    WriteGeometryRecord(notes[i].geometryRecord - 1);
+  }
+
+  if(packStore.enabled) {
+    const char** filenames = malloc(sizeof(char*) * (count ? count : 1));
+    if(!filenames) return 0;
+
+    for(size_t i = 0; i < count; ++i) filenames[i] = notes[i].filename;
+    int ok = DeleteNotesFromPack(filenames,count);
+    free(filenames);
+    return ok;
+  }
+
+  char path[MAX_PATH + 1];
+  for(size_t i = 0; i < count; ++i) {
+    NotePath(path,sizeof(path),notes[i].filename,"");
+    FileDelete(path);
+    FreeCatalogSlot(notes[i].catalogSlot);
+  }
+  return 1;
+}
+
+// Writer thread: writes the text of each note to <dir>/<name>.txt with
+// CRLF line endings. Returns the number of notes written.
+static size_t ExportNoteBatch(const char* dir, const BatchNote* notes, size_t count) {
+  if(!DirCreate(dir)) return 0;
+
+  size_t exported = 0;
+  char path[MAX_PATH + 1];
+  for(size_t i = 0; i < count; ++i) {
+    long length = 0;
+    char* text = ReadNoteBody(notes[i].filename,&length);
+    text = text ? ToEditText(text,length) : NULL;
+    if(!text) continue;
+
+    size_t nameLength = strlen(notes[i].filename);
+    if(nameLength > sizeof(NOTE_EXTENSION) - 1) nameLength -= sizeof(NOTE_EXTENSION) - 1;
+    snprintf(path,sizeof(path),"%s" PATH_SEPARATOR "%.*s.txt",dir,(int)nameLength,notes[i].filename);
+
+    FileHandle file = FileOpen(path,FILE_CREATE);
+    if(file && FileWriteAt(file,0,text,strlen(text))) exported++;
+    FileClose(file);
+    free(text);
+  }
+  return exported;
+}
+
+static int WriteWholeNote(const SaveJob* job) {
+  NoteHeader header = job->header;
+  char* packed = CompressForStore(&header,job->body);
+
+  int ok = WriteNoteVersion(job,&header,packed ? packed : job->body);
+  free(packed);
+
+  // The save stands even if its version could not be kept
+  if(ok && KEEPHISTORY) RecordNoteVersion(job->filename,job->body,job->header.bodyLength);
+
+  // Indexed here rather than by SaveNote, large notes take a while
+  IndexStoredText(job->id,job->body,job->header.bodyLength,job->indexStamp);
+  return ok;
+}
+
+// Journals the change from the text last written of the note to that of
+// job as one record. Writes the note whole when there is nothing stored
+// to journal against or the journal has grown too large.
+static int JournalEditedNote(SaveJob* job) {
+  if(editBase.id != job->id) {
+    DropEditBase(editBase.id);
+
+    long length = 0;
+    char* text = ReadStoredBody(job->filename,&length);
+    if(text) {
+      editBase.journalLength = ReplayNoteJournal(job->filename,&text,&length,&editBase.journalRecords);
+      editBase.id = job->id;
+      editBase.text = text;
+      editBase.length = length;
+    }
+  }
+
+  size_t length = job->header.bodyLength, prefix = 0, suffix = 0, size = 0;
+  if(editBase.id == job->id) {
+    prefix = MatchTextEnds(editBase.text,editBase.length,job->body,length,&suffix);
+    if(editBase.length == length && prefix + suffix == length) return 1;
+    size = JournalEditSize(editBase.journalLength,length - prefix - suffix);
+  }
+
+  if(editBase.id != job->id || JournalIsFull(editBase.journalLength,editBase.journalRecords,size,length)) {
+    int ok = WriteWholeNote(job);
+    if(ok) KeepEditBase(job,0,0);
+    else DropEditBase(job->id);
+    return ok;
+  }
+
+  char path[MAX_PATH + 1];
+  JournalPath(path,sizeof(path),job->filename);
+  char* data = BuildJournalEdit(editBase.text,editBase.length,job->body,length,prefix,suffix,editBase.journalLength,size);
+  int ok = data && AppendNoteJournal(path,editBase.journalLength,data,size);
+  free(data);
+
+  // Read again for the next edit, the journal may be torn
+  if(!ok) DropEditBase(job->id);
+  else KeepEditBase(job,editBase.journalLength + size,editBase.journalRecords + 1);
+  return ok;
+}
+
+// Runs a job on the writer thread, or on the caller's without one. A job
+// whose text is kept as the base of the next edit is left without a body.
+static int ExecuteSaveJob(SaveJob* job) {
+  switch(job->kind) {
+    case SAVEJOB_WRITE: {
+      int ok = WriteWholeNote(job);
+      if(ok && editBase.id == job->id) KeepEditBase(job,0,0);
+      else DropEditBase(job->id);
+      return ok;
+    }
+
+    case SAVEJOB_EDIT: return JournalEditedNote(job);
+
+    case SAVEJOB_DELETE: {
+      DropEditBase(job->id);
+      DeleteNoteJournal(job->filename);
+      DeleteNoteHistory(job->filename);
+      WriteGeometryRecord(job->geometryRecord - 1);
+      if(packStore.enabled) return DeleteNoteFromPack(job->filename);
+
+      FileDelete(job->filepath);
+      FreeCatalogSlot(job->catalogSlot);
+    } return 1;
+
+    case SAVEJOB_CATALOG: {
+      if(!packStore.enabled && CatalogIsDirty()) RewriteCatalog();
+      if(GeometryIsDirty()) RewriteGeometry();
+    } return 1;
+
+    case SAVEJOB_JOURNAL: {
+      DropEditBase(job->id);
+      return AppendNoteJournal(job->filepath,job->journalOffset,job->body,job->journalSize);
+    }
+
+    case SAVEJOB_DELETE_BATCH: return DeleteNoteBatch((const BatchNote*)job->body,job->batchCount);
+
+    case SAVEJOB_EXPORT_BATCH: {
+      size_t exported = ExportNoteBatch(job->filepath,(const BatchNote*)job->body,job->batchCount);
+      if(job->done) job->done(exported,job->batchCount,job->context);
+      return exported == job->batchCount;
+    }
+
+    case SAVEJOB_GEOMETRY: return WriteGeometryRecord(job->geometryRecord - 1);
+  }
+  return 0;
+}
+
+static int SaveWriterThread(void* param) {
+  AcquireLock(saveQueue.lock);
+  for(;;) {
+    while(!saveQueue.count && !saveQueue.stop)
+      WaitCondition(saveQueue.notEmpty,saveQueue.lock,WAIT_FOREVER);
+    if(!saveQueue.count) break;
+
+    SaveJob job = saveQueue.jobs[saveQueue.head];
+    saveQueue.head = (saveQueue.head + 1) % SAVE_QUEUE_SIZE;
+    saveQueue.count--;
+    saveQueue.busy = 1;
+    saveQueue.busyId = job.id;
+    WakeCondition(saveQueue.notFull);
+    ReleaseLock(saveQueue.lock);
+
+    TRACE_BEGIN(jobStart);
+    int ok = ExecuteSaveJob(&job);
+    TRACE_END(TRACE_SAVE_JOB,jobStart,job.kind,job.kind == SAVEJOB_JOURNAL ? job.journalSize : job.header.bodyLength);
+    free(job.body);
+
+    AcquireLock(saveQueue.lock);
+    saveQueue.busy = 0;
+    saveQueue.completed++;
+    if(!ok) saveQueue.failed++;
+    WakeAllCondition(saveQueue.progress);
+  }
+  ReleaseLock(saveQueue.lock);
+
+  DropEditBase(editBase.id);
+  ClosePack();
+  return 0;
+}
+
+void StartSaveWriter() {
+  saveQueue.stop = 0;
+  saveQueue.thread = StartThread(SaveWriterThread,NULL);
+}
+
+static inline SaveJob* QueuedJob(size_t i) {
+  return &saveQueue.jobs[(saveQueue.head + i) % SAVE_QUEUE_SIZE];
+}
+
+// Takes ownership of job->body
+void EnqueueSaveJob(SaveJob* job) {
+  // Without a writer thread fall back to doing the work right here
+  if(!saveQueue.thread) {
+    ExecuteSaveJob(job);
+    free(job->body);
+    return;
+  }
+
+  AcquireLock(saveQueue.lock);
+
+  // Only the last pending job of a note can be merged, anything before it
+  // must still run in order. Journal records extend whatever is before them.
+  // An edit carries the whole text, it replaces an edit and stays a write
+  // when it replaces one.
+  for(size_t i = saveQueue.count; job->kind != SAVEJOB_JOURNAL && i-- > 0;) {
+    SaveJob* pending = QueuedJob(i);
+    if(pending->id != job->id) continue;
+
+    if(pending->kind == SAVEJOB_WRITE || pending->kind == SAVEJOB_EDIT) {
+      int kind = job->kind == SAVEJOB_EDIT && pending->kind == SAVEJOB_WRITE ? SAVEJOB_WRITE : job->kind;
+      free(pending->body);
+      *pending = *job;
+      pending->kind = kind;
+      saveQueue.merged++;
+      ReleaseLock(saveQueue.lock);
+      return;
+    }
+    break;
+  }
+
+  while(saveQueue.count >= SAVE_QUEUE_SIZE)
+    WaitCondition(saveQueue.notFull,saveQueue.lock,WAIT_FOREVER);
+
+  *QueuedJob(saveQueue.count) = *job;
+  saveQueue.count++;
+  WakeCondition(saveQueue.notEmpty);
+
+  ReleaseLock(saveQueue.lock);
+}
+
+static int HasPendingJob(NoteId id) {
+  if(saveQueue.busy && saveQueue.busyId == id) return 1;
+  for(size_t i = 0; i < saveQueue.count; ++i)
+    if(QueuedJob(i)->id == id) return 1;
+  return 0;
+}
+
+// Blocks until all queued jobs of a note are on disk, used before the note
+// file is read again
+void WaitForPendingSaves(NoteId id) {
+  if(!saveQueue.thread) return;
+
+  AcquireLock(saveQueue.lock);
+  while(HasPendingJob(id))
+    WaitCondition(saveQueue.progress,saveQueue.lock,WAIT_FOREVER);
+  ReleaseLock(saveQueue.lock);
+}
+
+// Blocks until the queue is empty, the writer keeps running
+void WaitForAllSaves() {
+  if(!saveQueue.thread) return;
+
+  AcquireLock(saveQueue.lock);
+  while(saveQueue.count || saveQueue.busy)
+    WaitCondition(saveQueue.progress,saveQueue.lock,WAIT_FOREVER);
+  ReleaseLock(saveQueue.lock);
+}
+
+// Lets the writer finish the queue and stops it, reporting progress every
+// 100ms. Returns the number of jobs still unfinished on timeout.
+size_t DrainSaveQueue(void (*progress)(unsigned long completed, unsigned long total, void* context), void* context, unsigned int timeoutMs) {
+  if(!saveQueue.thread) return 0;
+
+  AcquireLock(saveQueue.lock);
+  saveQueue.stop = 1;
+  WakeCondition(saveQueue.notEmpty);
+
+  unsigned long total = saveQueue.completed + saveQueue.count + saveQueue.busy;
+  unsigned long long deadline = TickCount() + timeoutMs;
+  size_t remaining;
+
+  while((remaining = saveQueue.count + saveQueue.busy)) {
+    unsigned long long now = TickCount();
+    if(now >= deadline) break;
+
+    unsigned long completed = saveQueue.completed;
+    ReleaseLock(saveQueue.lock);
+    if(progress) progress(completed,total,context);
+    AcquireLock(saveQueue.lock);
+
+    unsigned int slice = deadline - now < 100 ? (unsigned int)(deadline - now) : 100;
+    WaitCondition(saveQueue.progress,saveQueue.lock,slice);
+  }
+  ReleaseLock(saveQueue.lock);
+
+  if(!remaining && JoinThread(saveQueue.thread,timeoutMs)) saveQueue.thread = NULL;
+  return remaining;
+}
+
+void DeleteNoteFromDisk(const char* path, Note* note) {
+  SaveJob job = {.kind = SAVEJOB_DELETE, .id = note->id, .catalogSlot = note->catalogSlot, .geometryRecord = ClearNoteGeometry(note) + 1};
+  NotePathIn(job.filepath,sizeof(job.filepath),path,note->filename,"");
+  memcpy(job.filename,note->filename,sizeof(job.filename));
+  EnqueueSaveJob(&job);
+
+  DropCachedBody(note);
+  note->catalogSlot = -1;
+}
+
+// Queues a batch job of the given kind naming every note. Returns 0 if
+// out of memory.
+static int EnqueueBatchJob(int kind, const char* path, Note** notes, size_t count, void (*done)(size_t exported, size_t count, void* context), void* context) {
+  BatchNote* batch = malloc(sizeof(BatchNote) * (count ? count : 1));
+  if(!batch) return 0;
+
+  for(size_t i = 0; i < count; ++i) {
+    batch[i].id = notes[i]->id;
+    batch[i].catalogSlot = notes[i]->catalogSlot;
+    batch[i].geometryRecord = kind == SAVEJOB_DELETE_BATCH ? ClearNoteGeometry(notes[i]) + 1 : 0;
+    memcpy(batch[i].filename,notes[i]->filename,sizeof(batch[i].filename));
+  }
+
+  SaveJob job = {.kind = kind, .catalogSlot = -1, .body = (char*)batch, .batchCount = count, .done = done, .context = context};
+  snprintf(job.filepath,sizeof(job.filepath),"%s",path);
+  EnqueueSaveJob(&job);
+  return 1;
+}
+
+// Deletes several notes with a single job for the writer. The notes stay
+// in the registry, like with DeleteNoteFromDisk.
+void DeleteNotesFromDisk(const char* path, Note** notes, size_t count) {
+  if(!count || !EnqueueBatchJob(SAVEJOB_DELETE_BATCH,path,notes,count,NULL,NULL)) return;
+
+  for(size_t i = 0; i < count; ++i) {
+    DropCachedBody(notes[i]);
+    notes[i]->catalogSlot = -1;
+  }
+}
+
+// Writes the stored text of several notes to dir as .txt files, on the
+// writer thread after any save of them that is still pending. done is
+// called there once the batch is through, with the number of notes
+// written, and right here if the batch could not be queued.
+void ExportNotes(const char* dir, Note** notes, size_t count, void (*done)(size_t exported, size_t count, void* context), void* context) {
+  if(!EnqueueBatchJob(SAVEJOB_EXPORT_BATCH,dir,notes,count,done,context) && done) done(0,count,context);
+}
+
+// A job writing body as the whole text of note with its current header,
+// always in the current version
+static SaveJob WholeNoteJob(Note* note, char* body, long length) {
+  if(!packStore.enabled && note->catalogSlot < 0) note->catalogSlot = AllocateCatalogSlot();
+
+  SaveJob job = {
+    .kind = SAVEJOB_WRITE,
+    .id = note->id,
+    .catalogSlot = note->catalogSlot,
+    .header = {
+      .magic = NOTE_MAGIC,
+      .version = NOTE_VERSION_PLAIN,
+      .headerSize = sizeof(NoteHeader),
+      .opened = note->opened,           // Opened during exit?
+      .x = note->x,                     // Coord X during exit
+      .y = note->y,                     // Coord Y during exit
+      .width = note->width,             // Window width during exit
+      .height = note->height,           // Window height during exit
+      .bodyLength = length
+    },
+    .body = body,
+    .indexStamp = NextSearchStamp()
+  };
+  NotePath(job.filepath,sizeof(job.filepath),note->filename,"");
+  memcpy(job.filename,note->filename,sizeof(job.filename));
+  memcpy(job.preview,note->preview,sizeof(job.preview));
+  return job;
+}
+
+// Hands the LF text of a note to the writer along with its current
+// header. Takes ownership of body.
+void SaveNote(Note* note, char* body, long length) {
+  SaveJob job = WholeNoteJob(note,body,length);
+
+  int ordered = UnorderNote(note);
+  note->bodyOffset = sizeof(NoteHeader);
+  note->bodyLength = length;
+  note->modified = ++noteOrder.clock;
+  if(ordered) OrderNote(note);
+  note->journalLength = 0;
+  note->journalRecords = 0;
+  CacheNoteBody(note,body,length,NULL);
+
+  EnqueueSaveJob(&job);
+}
+
+// Appends the change from before, the text as stored, to after to the
+// journal of the note as a single replaced range. Falls back to a full
+// save when the note was never stored or the journal has grown too large.
+// Both texts stay with the caller, after is cached as the body.
+void JournalNoteEdit(Note* note, const char* before, size_t beforeLength, const char* after, size_t afterLength) {
+  size_t prefix = 0, suffix = 0;
+  if(before) {
+    prefix = MatchTextEnds(before,beforeLength,after,afterLength,&suffix);
+    if(beforeLength == afterLength && prefix + suffix == afterLength) return;
+  }
+
+  size_t size = JournalEditSize(note->journalLength,afterLength - prefix - suffix);
+  if(!before || JournalIsFull(note->journalLength,note->journalRecords,size,afterLength)) {
+    char* body = malloc(afterLength + 1);
+    if(!body) return;
+
+    memcpy(body,after,afterLength);
+    body[afterLength] = '\0';
+    SaveNote(note,body,afterLength);
+    return;
+  }
+
+  char* data = BuildJournalEdit(before,beforeLength,after,afterLength,prefix,suffix,note->journalLength,size);
+  if(!data) return;
+
+  SaveJob job = {
+    .kind = SAVEJOB_JOURNAL,
+    .id = note->id,
+    .body = data,
+    .journalOffset = note->journalLength,
+    .journalSize = size
+  };
+  JournalPath(job.filepath,sizeof(job.filepath),note->filename);
+  memcpy(job.filename,note->filename,sizeof(job.filename));
+  EnqueueSaveJob(&job);
+
+  note->journalLength += size;
+  note->journalRecords++;
+  CacheNoteBody(note,after,afterLength,NULL);
+  TouchNote(note);
+}
+
+// Hands the whole LF text of a stored note to the writer, which journals
+// what changed since the text it wrote of the note last, so the caller
+// needs no copy of the stored text. Takes ownership of text. The journal
+// is the writer's then, the note is read again or saved whole before
+// JournalNoteEdit extends it.
+void JournalNoteText(Note* note, char* text, size_t length) {
+  SaveJob job = WholeNoteJob(note,text,(long)length);
+  job.kind = SAVEJOB_EDIT;
+  EnqueueSaveJob(&job);
+
+  DropCachedBody(note);
+  TouchNote(note);
+}
+
+// Writes where the window of a note is and whether it is open, a single
+// record of the geometry table. Does nothing if the record says that
+// already.
+void SaveNoteGeometry(Note* note) {
+  int slot = StoreNoteGeometry(note);
+  if(slot < 0) return;
+
+  // Not merged with a pending save of the note, which has to run anyway
+  SaveJob job = {.kind = SAVEJOB_GEOMETRY, .id = INVALID_NOTEID, .catalogSlot = -1, .geometryRecord = slot + 1};
+  EnqueueSaveJob(&job);
+}
+
+// Brings the catalog and the geometry table in line with the notes if
+// loading found them out of date, called once loading is done
+void SyncCatalog() {
+  FinishGeometryMatching();
+  if((packStore.enabled || !CatalogIsDirty()) && !GeometryIsDirty()) return;
+
+  SaveJob job = {.kind = SAVEJOB_CATALOG, .id = INVALID_NOTEID};
+  EnqueueSaveJob(&job);
+}
+
+// 
+// Search index
+// 
+// Inverted index from trigrams (three lower cased bytes, CRs left out) to
+// the slots of the notes containing them. A query intersects the postings
+// of its trigrams, which is exact up to three bytes. Longer queries can
+// turn up notes that have every trigram but not the query, those are
+// found by reading the notes again on a thread of their own, so the index
+// keeps no text. Queries shorter than a trigram have pair and byte keys.
+// Built on a background thread once loading is done, kept current by the
+// writer and while typing, and stored in search.hidx on exit so unchanged
+// notes are not read again on the next start. Every indexing has a stamp,
+// text older than what a note has indexed already is dropped.
+// 
+
+#define SEARCH_FILENAME "search.hidx"
+#define SEARCH_MAGIC 0x58495348 // "HSIX"
+#define SEARCH_VERSION 3               // Keys only again, without the folded text
+#define SEARCH_EMPTY_KEY UINT_MAX
+#define SEARCH_PAIR_KEY 0x1000000       // Or two bytes, trigrams stay below
+#define SEARCH_BYTE_KEY 0x2000000       // Or one byte
+#define SEARCH_BITMAP_MIN_SIZE (64 * 1024) // Longer texts find their trigrams in a bitmap
+
+typedef struct SearchPosting {
+  unsigned int key;                     // SEARCH_EMPTY_KEY if unused
+  unsigned int count, capacity;
+  unsigned int* slots;                  // Sorted note slots
+} SearchPosting;
+
+typedef struct SearchTerms {
+  NoteId id;                            // Note these trigrams belong to, kept once it is removed
+  unsigned long long stamp;             // Of the text indexed last
+  unsigned int count;
+  unsigned int* keys;                   // Sorted, unique
+} SearchTerms;
+
+typedef struct SearchFileNote {
+  char filename[FILENAME_SIZE + 2];
+  unsigned long long stamp[2];
+  unsigned int count;                   // Followed by count keys, padded to 8 bytes
+  unsigned int reserved;
+} SearchFileNote;
+
+static_assert(sizeof(SearchFileNote) == 40, "search file entry must stay fixed size");
+
+static struct SearchIndex {
+  RwLock* lock;
+  SearchPosting* postings;              // Open addressing by key
+  size_t postingCount, postingCapacity;
+  SearchTerms* terms;                   // By note slot
+  size_t termCapacity;
+  int complete;                         // Every note has been indexed once
+  int changed;                          // Differs from search.hidx
+  unsigned long long clock;             // Last stamp handed out
+} searchIndex = {0};
+
+static inline unsigned char LowerAscii(unsigned char c) {
+  return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+static int CompareKeys(const void* a, const void* b) {
+  unsigned int x = *(const unsigned int*)a, y = *(const unsigned int*)b;
+  return (x > y) - (x < y);
+}
+
+// Lower cases ASCII and drops carriage returns in place, so the edit
+// control's CRLF text and the saved LF text fold the same. Returns the
+// new length.
+static size_t FoldSearchText(char* text, size_t len) {
+  size_t n = 0;
+  for(size_t i = 0; i < len; ++i)
+    if(text[i] != '\r') text[n++] = LowerAscii(text[i]);
+  return n;
+}
+
+// Whether folded text contains the folded query
+static int ContainsFolded(const char* text, size_t length, const char* query, size_t queryLength) {
+  if(!queryLength) return 1;
+  if(queryLength > length) return 0;
+
+  const char* last = text + length - queryLength;
+  for(const char* at = text; at <= last && (at = memchr(at,query[0],last - at + 1)); ++at)
+    if(memcmp(at + 1,query + 1,queryLength - 1) == 0) return 1;
+  return 0;
+}
+
+// Sorted unique trigrams of a long text, marked in a bitmap of every
+// possible trigram and read back in order, so the memory needed follows
+// the distinct trigrams rather than the length. Leaves room for extra
+// keys after them.
+static unsigned int* ExtractBitmapTrigrams(const char* text, size_t len, size_t extra, unsigned int* count) {
+  *count = 0;
+  unsigned long long* seen = calloc((1 << 24) / 64,sizeof(unsigned long long));
+  if(!seen) return NULL;
+
+  unsigned int key = 0, unique = 0;
+  for(size_t i = 0, folded = 0; i < len; ++i) {
+    if(text[i] == '\r') continue;
+    key = ((key << 8) | LowerAscii(text[i])) & 0xFFFFFF;
+    unsigned long long bit = 1ull << (key % 64);
+    if(++folded < 3 || (seen[key / 64] & bit)) continue;
+
+    seen[key / 64] |= bit;
+    unique++;
+  }
+
+  unsigned int* keys = malloc(sizeof(unsigned int) * (unique + extra));
+  for(unsigned int word = 0, n = 0; keys && n < unique; ++word)
+    for(unsigned long long rest = seen[word]; rest; rest &= rest - 1) keys[n++] = word * 64 + __builtin_ctzll(rest);
+
+  free(seen);
+  *count = keys ? unique : 0;
+  return keys;
+}
+
+// Sorted unique search keys of text, folded as it is read: its trigrams
+// and, with shorter set, every pair and single byte of it, so a query of
+// one or two bytes has a posting of its own. Those keys sort after the
+// trigrams.
+static unsigned int* ExtractSearchKeys(const char* text, size_t len, int shorter, unsigned int* count) {
+  *count = 0;
+  size_t trigrams = len >= 3 ? len - 2 : 0;
+  if(!trigrams && !(shorter && len)) return NULL;
+
+  // Pairs and bytes are kept apart, at most this many of them
+  size_t extra = shorter ? (len < 65536 ? 2 * len : 65536 + 256) : 0;
+  unsigned int* keys;
+  unsigned int unique = 0;
+
+  if(len >= SEARCH_BITMAP_MIN_SIZE) {
+    keys = ExtractBitmapTrigrams(text,len,extra,&unique);
+    if(!keys) return NULL;
+  }
+  else {
+    keys = malloc(sizeof(unsigned int) * (trigrams + extra));
+    if(!keys) return NULL;
+
+    unsigned int key = 0, n = 0;
+    for(size_t i = 0, folded = 0; i < len; ++i) {
+      if(text[i] == '\r') continue;
+      key = ((key << 8) | LowerAscii(text[i])) & 0xFFFFFF;
+      if(++folded >= 3) keys[n++] = key;
+    }
+
+    qsort(keys,n,sizeof(unsigned int),CompareKeys);
+
+    for(unsigned int i = 0; i < n; ++i)
+      if(!unique || keys[unique - 1] != keys[i]) keys[unique++] = keys[i];
+  }
+
+  if(shorter) {
+    unsigned long long pairs[65536 / 64] = {0}, bytes[256 / 64] = {0};
+    unsigned int previous = 0;
+    for(size_t i = 0, folded = 0; i < len; ++i) {
+      if(text[i] == '\r') continue;
+      unsigned int byte = LowerAscii(text[i]);
+      bytes[byte / 64] |= 1ull << (byte % 64);
+      if(folded++) {
+        unsigned int pair = previous << 8 | byte;
+        pairs[pair / 64] |= 1ull << (pair % 64);
+      }
+      previous = byte;
+    }
+
+    for(unsigned int word = 0; word < 65536 / 64; ++word) {
+      unsigned int bit = word * 64;
+      for(unsigned long long rest = pairs[word]; rest; rest >>= 1, ++bit)
+        if(rest & 1) keys[unique++] = SEARCH_PAIR_KEY | bit;
+    }
+    for(unsigned int word = 0; word < 256 / 64; ++word) {
+      unsigned int bit = word * 64;
+      for(unsigned long long rest = bytes[word]; rest; rest >>= 1, ++bit)
+        if(rest & 1) keys[unique++] = SEARCH_BYTE_KEY | bit;
+    }
+  }
+
+  *count = unique;
+  return keys;
+}
+
+static SearchPosting* FindPosting(unsigned int key, int create) {
+  if(create && (searchIndex.postingCount + 1) * 4 >= searchIndex.postingCapacity * 3) {
+    size_t capacity = searchIndex.postingCapacity ? searchIndex.postingCapacity * 2 : 1024;
+    SearchPosting* postings = malloc(sizeof(SearchPosting) * capacity);
+    if(!postings) return NULL;
+
+    for(size_t i = 0; i < capacity; ++i) postings[i].key = SEARCH_EMPTY_KEY;
+    for(size_t i = 0; i < searchIndex.postingCapacity; ++i) {
+      SearchPosting* old = &searchIndex.postings[i];
+      if(old->key == SEARCH_EMPTY_KEY) continue;
+
+      size_t h = (old->key * 2654435761u) & (capacity - 1);
+      while(postings[h].key != SEARCH_EMPTY_KEY) h = (h + 1) & (capacity - 1);
+      postings[h] = *old;
+    }
+
+    free(searchIndex.postings);
+    searchIndex.postings = postings;
+    searchIndex.postingCapacity = capacity;
+  }
+  if(!searchIndex.postingCapacity) return NULL;
+
+  size_t mask = searchIndex.postingCapacity - 1;
+  for(size_t h = (key * 2654435761u) & mask;; h = (h + 1) & mask) {
+    SearchPosting* posting = &searchIndex.postings[h];
+    if(posting->key == key) return posting;
+    if(posting->key != SEARCH_EMPTY_KEY) continue;
+    if(!create) return NULL;
+
+    *posting = (SearchPosting){.key = key};
+    searchIndex.postingCount++;
+    return posting;
+  }
+}
+
+// First position in slots not less than slot
+static unsigned int LowerBound(const unsigned int* slots, unsigned int count, unsigned int slot) {
+  unsigned int lo = 0, hi = count;
+  while(lo < hi) {
+    unsigned int mid = lo + (hi - lo) / 2;
+    if(slots[mid] < slot) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+// LowerBound from position from on, stepping out in doubling strides
+// first. Costs the log of the distance moved, so walking a posting in
+// order costs about as much as merging it when it is dense and a search
+// per candidate when it is sparse.
+static unsigned int GallopTo(const unsigned int* slots, unsigned int from, unsigned int count, unsigned int slot) {
+  if(from >= count || slots[from] >= slot) return from;
+
+  unsigned int bound = 1;
+  while(bound < count - from && slots[from + bound] < slot) bound *= 2;
+
+  unsigned int lo = from + bound / 2 + 1;
+  unsigned int hi = bound < count - from ? from + bound : count;
+  return lo + LowerBound(slots + lo,hi - lo,slot);
+}
+
+static void PostingInsert(SearchPosting* posting, unsigned int slot) {
+  // Notes are mostly indexed in slot order, which makes this an append
+  unsigned int at = posting->count && posting->slots[posting->count - 1] < slot
+    ? posting->count : LowerBound(posting->slots,posting->count,slot);
+  if(at < posting->count && posting->slots[at] == slot) return;
+
+  if(posting->count >= posting->capacity) {
+    unsigned int capacity = posting->capacity ? posting->capacity * 2 : 4;
+    unsigned int* slots = realloc(posting->slots,sizeof(unsigned int) * capacity);
+    if(!slots) return;
+
+    posting->slots = slots;
+    posting->capacity = capacity;
+  }
+
+  memmove(posting->slots + at + 1,posting->slots + at,sizeof(unsigned int) * (posting->count - at));
+  posting->slots[at] = slot;
+  posting->count++;
+}
+
+static void PostingRemove(SearchPosting* posting, unsigned int slot) {
+  unsigned int at = LowerBound(posting->slots,posting->count,slot);
+  if(at >= posting->count || posting->slots[at] != slot) return;
+
+  memmove(posting->slots + at,posting->slots + at + 1,sizeof(unsigned int) * (posting->count - at - 1));
+  posting->count--;
+}
+
+// Replaces the trigrams of a note, touching only postings that differ,
+// unless the note has newer text indexed already. Takes ownership of keys.
+// Caller holds the lock exclusively.
+static void SetNoteTerms(NoteId id, unsigned int* keys, unsigned int count, unsigned long long stamp) {
+  unsigned int slot = id & NOTE_SLOT_MASK;
+  if(slot < searchIndex.termCapacity && searchIndex.terms[slot].id == id && searchIndex.terms[slot].stamp >= stamp) {
+    free(keys);
+    return;
+  }
+
+  if(slot >= searchIndex.termCapacity) {
+    size_t capacity = searchIndex.termCapacity ? searchIndex.termCapacity : 1024;
+    while(capacity <= slot) capacity *= 2;
+
+    SearchTerms* terms = realloc(searchIndex.terms,sizeof(SearchTerms) * capacity);
+    if(!terms) {
+      free(keys);
+      return;
+    }
+
+    memset(terms + searchIndex.termCapacity,0,sizeof(SearchTerms) * (capacity - searchIndex.termCapacity));
+    searchIndex.terms = terms;
+    searchIndex.termCapacity = capacity;
+  }
+
+  SearchTerms* terms = &searchIndex.terms[slot];
+  unsigned int i = 0, j = 0;
+
+  // The slot may still hold the trigrams of a removed note, those all go
+  unsigned int oldCount = terms->id == id ? terms->count : 0;
+  if(terms->id != id) {
+    for(unsigned int k = 0; k < terms->count; ++k) {
+      SearchPosting* posting = FindPosting(terms->keys[k],0);
+      if(posting) PostingRemove(posting,slot);
+    }
+  }
+
+  while(i < oldCount || j < count) {
+    if(j >= count || (i < oldCount && terms->keys[i] < keys[j])) {
+      SearchPosting* posting = FindPosting(terms->keys[i++],0);
+      if(posting) PostingRemove(posting,slot);
+    }
+    else if(i >= oldCount || keys[j] < terms->keys[i]) {
+      SearchPosting* posting = FindPosting(keys[j++],1);
+      if(posting) PostingInsert(posting,slot);
+    }
+    else {
+      i++;
+      j++;
+    }
+  }
+
+  free(terms->keys);
+  terms->id = id;
+  terms->stamp = stamp;
+  terms->keys = keys;
+  terms->count = count;
+  searchIndex.changed = 1;
+}
+
+// Orders the texts handed to the index. SaveNote takes one when it queues
+// the save the writer indexes later.
+static unsigned long long NextSearchStamp() {
+  AcquireExclusive(searchIndex.lock);
+  unsigned long long stamp = ++searchIndex.clock;
+  ReleaseExclusive(searchIndex.lock);
+  return stamp;
+}
+
+static void IndexStoredText(NoteId id, const char* text, size_t len, unsigned long long stamp) {
+  unsigned int count = 0;
+  unsigned int* keys = ExtractSearchKeys(text,len,1,&count);
+
+  AcquireExclusive(searchIndex.lock);
+  SetNoteTerms(id,keys,count,stamp);
+  ReleaseExclusive(searchIndex.lock);
+}
+
+void IndexNoteText(NoteId id, const char* text, size_t len) {
+  IndexStoredText(id,text,len,NextSearchStamp());
+}
+
+// The note keeps its slot in the index with nothing in it, so a save
+// queued before the removal does not bring it back. A slot another note
+// has trigrams in already is left alone.
+void RemoveNoteFromIndex(NoteId id) {
+  unsigned long long stamp = NextSearchStamp();
+
+  AcquireExclusive(searchIndex.lock);
+  unsigned int slot = id & NOTE_SLOT_MASK;
+  if(slot >= searchIndex.termCapacity || searchIndex.terms[slot].id == id || !searchIndex.terms[slot].count)
+    SetNoteTerms(id,NULL,0,stamp);
+  ReleaseExclusive(searchIndex.lock);
+}
+
+static int ComparePostingSize(const void* a, const void* b) {
+  unsigned int x = (*(SearchPosting* const*)a)->count, y = (*(SearchPosting* const*)b)->count;
+  return (x > y) - (x < y);
+}
+
+// Notes with every trigram of query, ignoring ASCII case. Up to three
+// bytes those are the notes containing it, CheckSearchResults finds the
+// ones a longer query turned up without containing it. Returns the number
+// of ids written to *ids, which the caller frees.
+size_t QuerySearchIndex(const char* query, NoteId** ids) {
+  TRACE_BEGIN(start);
+  *ids = NULL;
+
+  size_t queryLength = strlen(query);
+  unsigned int keyCount = 0;
+  char* folded = malloc(queryLength + 1);
+  if(folded) queryLength = FoldSearchText(memcpy(folded,query,queryLength),queryLength);
+  unsigned int* keys = NULL;
+  if(folded && queryLength >= 3) keys = ExtractSearchKeys(folded,queryLength,0,&keyCount);
+  else if(folded && queryLength && (keys = malloc(sizeof(unsigned int)))) {
+    keys[0] = queryLength == 1 ? SEARCH_BYTE_KEY | (unsigned char)folded[0]
+                               : SEARCH_PAIR_KEY | (unsigned char)folded[0] << 8 | (unsigned char)folded[1];
+    keyCount = 1;
+  }
+  SearchPosting** lists = keys ? malloc(sizeof(SearchPosting*) * keyCount) : NULL;
+
+  size_t found = 0;
+  AcquireShared(searchIndex.lock);
+
+  unsigned int listCount = 0;
+  for(unsigned int i = 0; lists && i < keyCount; ++i) {
+    SearchPosting* posting = FindPosting(keys[i],0);
+    if(!posting || !posting->count) {
+      listCount = 0;
+      break;
+    }
+    lists[listCount++] = posting;
+  }
+
+  unsigned int* candidates = NULL;
+  size_t candidateCount = 0;
+  if(listCount) {
+    // Intersect starting from the rarest key, the candidate set only shrinks
+    qsort(lists,listCount,sizeof(SearchPosting*),ComparePostingSize);
+
+    candidates = malloc(sizeof(unsigned int) * lists[0]->count);
+    if(candidates) {
+      candidateCount = lists[0]->count;
+      memcpy(candidates,lists[0]->slots,sizeof(unsigned int) * candidateCount);
+    }
+
+    for(unsigned int l = 1; l < listCount && candidateCount; ++l) {
+      const SearchPosting* posting = lists[l];
+      size_t kept = 0;
+      unsigned int from = 0;
+
+      for(size_t c = 0; c < candidateCount; ++c) {
+        from = GallopTo(posting->slots,from,posting->count,candidates[c]);
+        if(from >= posting->count) break;
+        if(posting->slots[from] == candidates[c]) candidates[kept++] = candidates[c];
+      }
+
+      // A list that barely thins the candidates means the rest, which are
+      // longer still, will not either. CheckSearchResults decides.
+      int thinned = kept < candidateCount - candidateCount / 32;
+      candidateCount = kept;
+      if(!thinned) break;
+    }
+  }
+
+  *ids = malloc(sizeof(NoteId) * (candidateCount ? candidateCount : 1));
+  for(size_t c = 0; *ids && c < candidateCount; ++c) (*ids)[found++] = searchIndex.terms[candidates[c]].id;
+
+  ReleaseShared(searchIndex.lock);
+  free(candidates);
+  free(lists);
+  free(keys);
+  free(folded);
+
+  TRACE_END(TRACE_SEARCH_QUERY,start,queryLength,found);
+  return found;
+}
+
+// The notes a query turned up are read again on a thread of their own,
+// and the ones without the query are handed back in batches. Starting a
+// check stops the one before.
+static struct SearchCheck {
+  Lock* lock;
+  unsigned int generation;              // Of the newest check
+} searchCheck = {0};
+
+typedef struct SearchCheckNote {
+  NoteId id;
+  char filename[FILENAME_SIZE + 1];
+} SearchCheckNote;
+
+typedef struct SearchCheckJob {
+  unsigned int check;
+  char* query;                          // Folded
+  size_t queryLength;
+  SearchCheckNote* notes;
+  size_t count;
+  void (*reject)(SearchRejects* rejects, void* context);
+  void* context;
+} SearchCheckJob;
+
+static int IsCurrentCheck(unsigned int check) {
+  AcquireLock(searchCheck.lock);
+  int current = searchCheck.generation == check;
+  ReleaseLock(searchCheck.lock);
+  return current;
+}
+
+static int SearchCheckThread(void* param) {
+  SearchCheckJob* job = param;
+  SearchRejects* rejects = NULL;
+
+  for(size_t i = 0; i < job->count && IsCurrentCheck(job->check); ++i) {
+    // The index has seen the saves still queued, the file has not
+    const SearchCheckNote* note = &job->notes[i];
+    WaitForPendingSaves(note->id);
+
+    // A note that cannot be read stays listed
+    long bodyLength = 0;
+    char* body = ReadNoteBody(note->filename,&bodyLength);
+    int contains = !body || ContainsFolded(body,FoldSearchText(body,bodyLength),job->query,job->queryLength);
+    free(body);
+    if(contains) continue;
+
+    if(!rejects && !(rejects = calloc(1,sizeof(SearchRejects)))) continue;
+    rejects->check = job->check;
+    rejects->ids[rejects->count++] = note->id;
+    if(rejects->count == SEARCH_REJECT_BATCH) {
+      job->reject(rejects,job->context);
+      rejects = NULL;
+    }
+  }
+
+  // Stopped or not, the last batch says the check is over
+  if(!rejects) rejects = calloc(1,sizeof(SearchRejects));
+  if(rejects) {
+    rejects->check = job->check;
+    rejects->done = 1;
+    job->reject(rejects,job->context);
+  }
+
+  free(job->notes);
+  free(job->query);
+  free(job);
+  return 0;
+}
+
+// Checks the ids QuerySearchIndex returned for query against the text of
+// their notes on a background thread, which hands reject every batch of
+// notes without the query, the last one with done set. reject owns the
+// batches. Stops the check started before. Returns the number of the
+// check, 0 if no note needs one and reject is not called. UI thread only.
+unsigned int CheckSearchResults(const char* query, const NoteId* ids, size_t count, void (*reject)(SearchRejects* rejects, void* context), void* context) {
+  AcquireLock(searchCheck.lock);
+  if(!++searchCheck.generation) ++searchCheck.generation;
+  unsigned int check = searchCheck.generation;
+  ReleaseLock(searchCheck.lock);
+
+  size_t queryLength = strlen(query);
+  if(queryLength <= 3 || !count) return 0;
+
+  SearchCheckJob* job = calloc(1,sizeof(SearchCheckJob));
+  char* folded = malloc(queryLength + 1);
+  SearchCheckNote* notes = malloc(sizeof(SearchCheckNote) * count);
+  if(!job || !folded || !notes) {
+    free(job);
+    free(folded);
+    free(notes);
+    return 0;
+  }
+
+  *job = (SearchCheckJob){.check = check, .query = folded, .notes = notes, .reject = reject, .context = context};
+  job->queryLength = FoldSearchText(memcpy(folded,query,queryLength),queryLength);
+  for(size_t i = 0; i < count; ++i) {
+    Note* note = Find(ids[i]);
+    if(!note) continue;
+
+    notes[job->count].id = note->id;
+    memcpy(notes[job->count++].filename,note->filename,sizeof(note->filename));
+  }
+
+  Thread* thread = job->queryLength > 3 && job->count ? StartThread(SearchCheckThread,job) : NULL;
+  if(!thread) {
+    free(notes);
+    free(folded);
+    free(job);
+    return 0;
+  }
+
+  DetachThread(thread);
+  return check;
+}
+
+typedef struct SearchBuildNote {
+  NoteId id;
+  int catalogSlot;
+  long bodyOffset, bodyLength;
+  char filename[FILENAME_SIZE + 1];
+} SearchBuildNote;
+
+static struct SearchBuild {
+  SearchBuildNote* notes;
+  size_t count;
+  void (*ready)(void* context);
+  void* context;
+} searchBuild = {0};
+
+static int SearchIndexThread(void* param) {
+  // Trigrams stored on the last exit, by file name
+  char path[MAX_PATH + 1];
+  snprintf(path,sizeof(path),"%s" PATH_SEPARATOR SEARCH_FILENAME,NOTESPATH);
+
+  unsigned char* stored = NULL;
+  size_t storedSize = 0;
+  FILE* f = fopen(path,"rb");
+  if(f) {
+    fseek(f,0,SEEK_END);
+    long size = ftell(f);
+    fseek(f,0,SEEK_SET);
+    if(size > 0 && (stored = malloc(size))) storedSize = fread(stored,1,size,f);
+    fclose(f);
+    TRACE_COUNT(TRACE_FILES_OPENED,1);
+    TRACE_COUNT(TRACE_BYTES_READ,storedSize);
+  }
+
+  const SearchFileNote** storedNotes = NULL;
+  size_t storedCount = 0, storedIndexSize = 0;
+  if(storedSize >= sizeof(unsigned int) * 4 && ((unsigned int*)stored)[0] == SEARCH_MAGIC && ((unsigned int*)stored)[1] == SEARCH_VERSION) {
+    storedIndexSize = 16;
+    while(storedIndexSize < searchBuild.count * 2) storedIndexSize *= 2;
+    storedNotes = calloc(storedIndexSize,sizeof(SearchFileNote*));
+
+    size_t offset = sizeof(unsigned int) * 4;
+    while(storedNotes && offset + sizeof(SearchFileNote) <= storedSize) {
+      const SearchFileNote* note = (const SearchFileNote*)(stored + offset);
+      size_t noteSize = ((size_t)note->count * sizeof(unsigned int) + 7) & ~(size_t)7;
+      if(noteSize > storedSize - offset - sizeof(SearchFileNote) || storedCount + 1 >= storedIndexSize) break;
+
+      size_t h = HashString(note->filename) & (storedIndexSize - 1);
+      while(storedNotes[h]) h = (h + 1) & (storedIndexSize - 1);
+      storedNotes[h] = note;
+      storedCount++;
+      offset += sizeof(SearchFileNote) + noteSize;
+    }
+  }
+
+  for(size_t i = 0; i < searchBuild.count; ++i) {
+    const SearchBuildNote* note = &searchBuild.notes[i];
+    unsigned int* keys = NULL;
+    unsigned int count = 0;
+    int have = 0;
+
+    unsigned long long stamp[2];
+    GetNoteStamp(note->filename,note->catalogSlot,stamp);
+
+    for(size_t h = storedNotes ? HashString(note->filename) & (storedIndexSize - 1) : 0; storedNotes && storedNotes[h]; h = (h + 1) & (storedIndexSize - 1)) {
+      const SearchFileNote* candidate = storedNotes[h];
+      if(strcmp(candidate->filename,note->filename) != 0) continue;
+
+      if(stamp[0] && candidate->stamp[0] == stamp[0] && candidate->stamp[1] == stamp[1]) {
+        keys = malloc(sizeof(unsigned int) * (candidate->count ? candidate->count : 1));
+        if(keys) {
+          memcpy(keys,candidate + 1,sizeof(unsigned int) * candidate->count);
+          count = candidate->count;
+          have = 1;
+        }
+      }
+      break;
+    }
+
+    if(!have) {
+      long bodyLength = 0;
+      char* body = ReadNoteBody(note->filename,&bodyLength);
+      if(body) keys = ExtractSearchKeys(body,bodyLength,1,&count);
+      free(body);
+    }
+
+    // Stamped older than anything, a save or edit while we were reading
+    // already indexed the newer text
+    AcquireExclusive(searchIndex.lock);
+    SetNoteTerms(note->id,keys,count,0);
+    ReleaseExclusive(searchIndex.lock);
+  }
+
+  AcquireExclusive(searchIndex.lock);
+  searchIndex.complete = 1;
+  searchIndex.changed = storedCount != searchBuild.count || searchIndex.changed;
+  ReleaseExclusive(searchIndex.lock);
+
+  free(storedNotes);
+  free(stored);
+  free(searchBuild.notes);
+  searchBuild.notes = NULL;
+
+  searchBuild.ready(searchBuild.context);
+  return 0;
+}
+
+// Indexes every loaded note in the background, called once loading is
+// done. ready is called on that thread when the index is complete.
+void StartSearchIndexing(void (*ready)(void* context), void* context) {
+  searchBuild.ready = ready;
+  searchBuild.context = context;
+  searchBuild.count = 0;
+  searchBuild.notes = malloc(sizeof(SearchBuildNote) * (noteRegistry.size + 1));
+  if(!searchBuild.notes) return;
+
+  for(size_t i = 0; i < noteRegistry.slotCount; ++i) {
+    Note* note = NoteAtSlot(i);
+    if(!note) continue;
+
+    SearchBuildNote* build = &searchBuild.notes[searchBuild.count++];
+    build->id = note->id;
+    build->catalogSlot = note->catalogSlot;
+    build->bodyOffset = note->bodyOffset;
+    build->bodyLength = note->bodyLength;
+    memcpy(build->filename,note->filename,sizeof(build->filename));
+  }
+
+  Thread* thread = StartThread(SearchIndexThread,NULL);
+  if(thread) DetachThread(thread);
+  else {
+    free(searchBuild.notes);
+    searchBuild.notes = NULL;
+  }
+}
+
+// Stores the trigrams of every note with the stamp of its stored version,
+// called on exit after all saves are on disk
+void SaveSearchIndex() {
+  AcquireShared(searchIndex.lock);
+  if(!searchIndex.complete || !searchIndex.changed) {
+    ReleaseShared(searchIndex.lock);
+    return;
+  }
+
+  char path[MAX_PATH + 1], tmppath[MAX_PATH + 8];
+  snprintf(path,sizeof(path),"%s" PATH_SEPARATOR SEARCH_FILENAME,NOTESPATH);
+  snprintf(tmppath,sizeof(tmppath),"%s.tmp",path);
+
+  FILE* f = fopen(tmppath,"wb");
+  int ok = f != NULL;
+  if(ok) {
+    unsigned int header[4] = {SEARCH_MAGIC,SEARCH_VERSION,0,0};
+    ok = fwrite(header,sizeof(header),1,f) == 1;
+  }
+
+  for(size_t i = 0; ok && i < searchIndex.termCapacity; ++i) {
+    const SearchTerms* terms = &searchIndex.terms[i];
+    Note* note = Find(terms->id);
+    if(!note) continue;
+
+    SearchFileNote entry = {.count = terms->count};
+    memcpy(entry.filename,note->filename,sizeof(note->filename));
+    GetNoteStamp(note->filename,note->catalogSlot,entry.stamp);
+    if(!entry.stamp[0]) continue;
+
+    static const char padding[8] = {0};
+    size_t paddingLength = (8 - terms->count * sizeof(unsigned int) % 8) % 8;
+    ok = fwrite(&entry,sizeof(entry),1,f) == 1 && (!terms->count || fwrite(terms->keys,sizeof(unsigned int),terms->count,f) == terms->count) &&
+         fwrite(padding,1,paddingLength,f) == paddingLength;
+  }
+  ReleaseShared(searchIndex.lock);
+
+  if(f) {
+    TRACE_COUNT(TRACE_FILES_OPENED,1);
+    TRACE_COUNT(TRACE_BYTES_WRITTEN,ftell(f));
+    ok = fclose(f) == 0 && ok;
+  }
+  if(!ok || !FileReplace(tmppath,path)) FileDelete(tmppath);
+}
+
+int ContainsIgnoreCase(const char* text, const char* query) {
+  for(; *text; ++text) {
+    size_t i = 0;
+    while(query[i] && text[i] && LowerAscii(text[i]) == LowerAscii(query[i])) ++i;
+    if(!query[i]) return 1;
+  }
+  return 0;
+}
+
+// 
+// Store state
+// 
+
+void InitNoteStore() {
+  if(catalog.lock) return;
+
+  catalog.lock = NewLock();
+  geometry.lock = NewLock();
+  packStore.lock = NewLock();
+  noteLoader.lock = NewLock();
+  noteLoader.available = NewCondition();
+  saveQueue.lock = NewLock();
+  saveQueue.notEmpty = NewCondition();
+  saveQueue.notFull = NewCondition();
+  saveQueue.progress = NewCondition();
+  searchIndex.lock = NewRwLock();
+  searchCheck.lock = NewLock();
+  history.lock = NewLock();
+  archive.lock = NewLock();
+  archive.filled = NewCondition();
+  archive.compressed = NewCondition();
+  InitGearTable();
+#ifdef TEXT_SIMD
+  InitCompactionTables();
+#endif
+}
+
+void ResetNoteStore() {
+  while(bodyCache.newest) {
+    CachedBody* entry = bodyCache.newest;
+    bodyCache.newest = entry->older;
+    free(entry);
+  }
+  memset(&bodyCache,0,sizeof(bodyCache));
+
+  for(size_t i = 0; i < noteRegistry.pageCount; ++i) free(noteRegistry.pages[i]);
+  free(noteRegistry.pages);
+  memset(&noteRegistry,0,sizeof(noteRegistry));
+  noteOrder.root = 0;
+  noteOrder.clock = noteOrder.created = 0;
+
+  ResetRecordTable(&catalog);
+  ResetRecordTable(&geometry);
+  topZOrder = 0;
+
+  FileClose(packStore.file);
+  free(packStore.entries);
+  Lock* packLock = packStore.lock;
+  memset(&packStore,0,sizeof(packStore));
+  packStore.lock = packLock;
+
+  AcquireLock(history.lock);
+  CloseChunkStore();
+  ReleaseLock(history.lock);
+
+  for(size_t i = 0; i < searchIndex.postingCapacity; ++i)
+    if(searchIndex.postings[i].key != SEARCH_EMPTY_KEY) free(searchIndex.postings[i].slots);
+  for(size_t i = 0; i < searchIndex.termCapacity; ++i) free(searchIndex.terms[i].keys);
+  free(searchIndex.postings);
+  free(searchIndex.terms);
+  RwLock* searchLock = searchIndex.lock;
+  memset(&searchIndex,0,sizeof(searchIndex));
+  searchIndex.lock = searchLock;
+}
@@ -0,0 +1,312 @@
+#ifndef HNOTE_H
+#define HNOTE_H
+
+// 
+// Note store
+// 
+// Everything about notes that does not need a window: the registry, the
+// .hnote format, text conversion, the catalog, the geometry table, the note
+// file layout, the pack store, version history, archives, loading, the
+// background writer and the search index.
+// Portable C on top of platform.h, the Win32 UI in whose.c and the
+// benchmarks in bench.c both link it.
+// 
+
+#include <assert.h>
+#include <stdio.h>
+#include <limits.h>
+#include <stddef.h>
+
+#include "platform.h"
+
+#define PREVIEW_SIZE 32
+#define FILENAME_SIZE 14
+
+// Notes written before the versioned header start with a 17 byte config
+// (opened, x, y, width, height) terminated by CONFIG_SEPARATOR.
+#define LEGACY_CONFIG_SIZE 17
+#define CONFIG_SEPARATOR UCHAR_MAX
+
+#define NOTE_MAGIC 0x544F4E48 // "HNOT"
+#define NOTE_VERSION 2        // Adds compressed bodies
+#define NOTE_VERSION_PLAIN 1  // Written for plain bodies, older builds read those
+
+#define NOTE_FLAG_COMPRESSED 1
+#define NOTE_COMPRESS_MIN_SIZE 1024
+#define NOTE_EXTENSION ".hnote"
+#define JOURNAL_EXTENSION ".hjnl"
+#define NOTE_SHARD_COUNT 256  // Subdirectories of NOTESPATH holding loose notes
+#define EMPTYNOTE_STRING "Empty Note"
+
+// On-disk header of a .hnote file, followed by bodyLength bytes of text
+typedef struct NoteHeader {
+  unsigned int magic;
+  unsigned short version;
+  unsigned short headerSize;
+  unsigned int flags;
+  int opened;
+  int x,y,width,height;
+  unsigned int bodyLength;
+} NoteHeader;
+
+static_assert(sizeof(NoteHeader) == 36, "note header must stay fixed size");
+
+// Header and the start of the body, enough to list a note with a single
+// read even when its preview comes out of a compressed block
+#define NOTE_PROBE_SIZE (sizeof(NoteHeader) + 128)
+
+// Generational handle of a note: slot index in the low bits, the slot's
+// generation above it. A handle of a removed note never resolves again, a
+// slot is retired once its generation is used up rather than wrap around.
+typedef unsigned int NoteId;
+
+#define NOTE_SLOT_BITS 22
+#define NOTE_SLOT_MASK ((1u << NOTE_SLOT_BITS) - 1)
+#define NOTE_GENERATION_MASK (UINT_MAX >> NOTE_SLOT_BITS)
+#define NOTE_PAGE_BITS 10
+#define NOTE_PAGE_SIZE (1 << NOTE_PAGE_BITS)
+#define INVALID_NOTEID 0
+
+// Orders of the main list
+enum { NOTE_ORDER_MODIFIED, NOTE_ORDER_CREATED, NOTE_ORDER_TITLE, NOTE_ORDER_SIZE };
+
+// Links of a note in the list order, see OrderNote. Links are slot
+// indexes + 1, priority is 0 while the note is not in the order.
+typedef struct NoteOrderNode {
+  unsigned int left, right;
+  unsigned int priority;
+  unsigned int count;        // Listed notes in this subtree
+} NoteOrderNode;
+
+typedef struct Note {
+  void* handle;              // Window of the note while it is open
+  NoteId id;
+  int opened;
+  int changes;
+  int x,y,width,height;
+  int listed;                // Shown in the main list, see ListNote
+  int catalogSlot;           // Record in the catalog, -1 if none yet
+  int geometryRecord;        // Record in the geometry table + 1, 0 if none yet
+  unsigned int zOrder;       // Stacking of open windows, larger is in front
+  long bodyOffset, bodyLength;
+  long journalLength;        // Bytes in the edit journal, 0 if there is none
+  int journalRecords;
+  struct CachedBody* cached; // Decoded body in the body cache, NULL if none
+  char filename[FILENAME_SIZE + 1];
+  unsigned long long created; // Seconds since 1970, 0 if unknown
+  unsigned long long modified; // Stamp of the last change, larger is newer
+  NoteOrderNode order;
+  char preview[PREVIEW_SIZE + 1];
+} Note;
+
+// A stored body mapped in place, see MapNoteBody
+typedef struct NoteMapping {
+  const void* data;
+  unsigned long long size;
+  void* handle;
+} NoteMapping;
+
+typedef struct NoteSlot {
+  Note note;
+  unsigned int generation;
+  unsigned int nextFree;     // Slot index + 1 of the next free slot, 0 ends the list
+  int live;
+} NoteSlot;
+
+// Slot map of all notes. Slots live in fixed size pages that are never
+// moved, so a Note* stays valid across inserts and removals of others.
+struct NoteRegistry {
+  size_t size;               // Live notes
+  size_t slotCount;          // Slots handed out so far
+  size_t pageCount, pageCapacity;
+  NoteSlot** pages;
+  unsigned int freeHead;     // Slot index + 1 of the first free slot, 0 if none
+  size_t retired;            // Slots whose generations are used up, never reused
+};
+
+// Result of reading one note file on a loader thread
+typedef struct LoadedNote {
+  char filename[FILENAME_SIZE + 1];
+  long fileSize;
+  unsigned long long mtime;
+  int catalogSlot;
+  int valid;
+  long bodyOffset;
+  NoteHeader header;
+  char preview[PREVIEW_SIZE + 1];
+} LoadedNote;
+
+#define LOAD_BATCH_SIZE 64
+#define LOAD_MAX_WORKERS 8
+#define LOAD_MAX_FINDERS 4  // Threads enumerating shards
+
+typedef struct LoadBatch {
+  struct LoadBatch* next;
+  size_t count;
+  LoadedNote notes[LOAD_BATCH_SIZE];
+} LoadBatch;
+
+#define SAVE_QUEUE_SIZE 64
+#define SAVE_DRAIN_TIMEOUT_MS 10000
+
+// A journal is folded into a full save once it holds more records than
+// this, or more bytes than the larger of this and half the note
+#define JOURNAL_FOLD_RECORDS 256
+#define JOURNAL_FOLD_MIN_BYTES (64 * 1024)
+
+// The pack is rewritten once its dead records take more than this and
+// more than the live ones
+#define PACK_COMPACT_MIN_BYTES (1 << 20)
+
+// Decoded bodies of recently read notes are kept up to this many bytes
+#define BODY_CACHE_BYTES (64 << 20)
+
+typedef struct BodyCacheStats {
+  unsigned long hits, misses;
+  unsigned long stale;       // Entries dropped because the file changed underneath
+  unsigned long evictions;
+  size_t entries, bytes;
+} BodyCacheStats;
+
+// A stored version of a note, see ListNoteVersions
+typedef struct NoteVersion {
+  unsigned int number;
+  unsigned int length;       // Bytes of LF text
+  unsigned long long time;   // Seconds since 1970
+} NoteVersion;
+
+extern char NOTESPATH[MAX_PATH + 1];
+extern int COMPRESSNOTES;  // Compress bodies on save where it pays off
+extern int TEXTKERNEL;     // Best text kernel allowed, tests lower it to reach the others
+extern size_t BODYCACHEBYTES;  // Budget of the body cache, 0 turns it off
+extern int KEEPHISTORY;    // Keep a version of every full save
+extern struct NoteRegistry noteRegistry;
+
+// Creates the locks of the store, once before anything else is used
+void InitNoteStore();
+
+// Forgets all notes, catalog records, pack and search index in memory.
+// Only while nothing is loading or being saved.
+void ResetNoteStore();
+
+// Registry
+Note* NoteAtSlot(size_t slot);
+Note* Insert(Note n);
+void Remove(NoteId id);
+Note* Find(NoteId id);
+
+// Note order of the main list. Notes stay sorted as they change: the
+// orders compare preview, bodyLength, created and modified, which are only
+// changed while a note is out of the order.
+void OrderNote(Note* note);
+int UnorderNote(Note* note);
+void TouchNote(Note* note);
+void ListNote(Note* note, int listed);
+size_t ListedNoteCount();
+int NoteRow(const Note* note);
+Note* NoteAtRow(int row);
+int GetNoteOrder();
+void SetNoteOrder(int key);
+unsigned long long NewNoteFilename(char* filename);
+
+// .hnote format
+long ParseNoteHeader(const unsigned char* data, size_t size, long fileSize, NoteHeader* header);
+int ReadNoteProbe(FILE* f, LoadedNote* loaded);
+Note* InitNoteFromLoaded(const LoadedNote* loaded);
+int WriteNoteFileAtomically(const char* filepath, const NoteHeader* header, const char* body, unsigned long long* mtime);
+
+// Edit journal. Both readers return the stored body with the journal of
+// the note applied, ReadNoteText also lets later edits extend that journal.
+char* ReadNoteBody(const char* filename, long* length);
+char* ReadNoteText(Note* note, long* length);
+const char* MapNoteBody(Note* note, size_t* length, NoteMapping* map);
+void UnmapNoteBody(NoteMapping* map);
+
+// Body cache, used by ReadNoteText and kept current by saves and deletes
+void DropCachedBody(Note* note);
+void GetBodyCacheStats(BodyCacheStats* stats);
+
+// Body compression
+char* CompressNoteBody(const char* body, size_t length, size_t* packedLength);
+void SetNotePreview(char* preview, const NoteHeader* header, const char* body, size_t available);
+
+// Line endings
+enum { TEXT_KERNEL_SCALAR, TEXT_KERNEL_SSE2, TEXT_KERNEL_AVX2 };
+size_t CrlfToLf(char* dst, const char* src, size_t len);
+size_t CountLoneLf(const char* src, size_t len);
+size_t LfToCrlf(char* dst, const char* src, size_t len);
+char* ToEditText(char* text, size_t len);
+size_t NextEditChunk(const char* body, size_t length, size_t at, size_t chunk, char* out);
+
+// Unicode. Text is UTF-8 in the store and UTF-16 in the window.
+int IsValidUtf8(const char* src, size_t len);
+size_t Utf8ToUtf16(unsigned short* dst, const char* src, size_t len);
+size_t Utf16ToUtf8(char* dst, const unsigned short* src, size_t len);
+size_t Utf8Prefix(const char* text, size_t len);
+
+// Geometry table, window state kept apart from the note files
+void MatchNoteGeometry(Note* note);
+void RaiseNote(Note* note);
+
+// Note files, loose notes live in shards of NOTESPATH
+void NotePath(char* buffer, size_t size, const char* filename, const char* suffix);
+int PrepareNoteShards();
+
+// Pack store
+int PackStoreEnabled();
+int OpenPack(void (*visit)(const char* filename, const NoteHeader* header, const char* body, unsigned long long offset, void* context), void* context);
+int CreatePack();
+void ClosePack();
+char* ReadPackBody(const char* filename, long* length);
+int ImportNotesToPack();
+int ExportPackToNotes();
+
+// Version history. Versions are numbered from 1 for each note.
+size_t NextChunkCut(const char* data, size_t length);
+size_t ListNoteVersions(const char* filename, NoteVersion** versions);
+char* ReadNoteVersion(const char* filename, unsigned int number, long* length);
+int CollectHistoryGarbage(unsigned long long* freed);
+
+// Archive
+int ExportArchive(const char* path, unsigned long* exported);
+int ImportArchive(const char* path, unsigned long* imported, unsigned long* skipped);
+
+// Loading. deliver is called on loader threads with each finished batch,
+// which it then owns, and once with NULL when everything is loaded.
+void StartLoadingNotes(void (*deliver)(LoadBatch* batch, void* context), void* context);
+void SyncCatalog();
+
+// Background writer
+void StartSaveWriter();
+void SaveNote(Note* note, char* body, long length);
+void JournalNoteEdit(Note* note, const char* before, size_t beforeLength, const char* after, size_t afterLength);
+void JournalNoteText(Note* note, char* text, size_t length);
+void DeleteNoteFromDisk(const char* path, Note* note);
+void DeleteNotesFromDisk(const char* path, Note** notes, size_t count);
+void SaveNoteGeometry(Note* note);
+void ExportNotes(const char* dir, Note** notes, size_t count, void (*done)(size_t exported, size_t count, void* context), void* context);
+void WaitForPendingSaves(NoteId id);
+void WaitForAllSaves();
+size_t DrainSaveQueue(void (*progress)(unsigned long completed, unsigned long total, void* context), void* context, unsigned int timeoutMs);
+
+// Search index
+int ContainsIgnoreCase(const char* text, const char* query);
+void IndexNoteText(NoteId id, const char* text, size_t len);
+void RemoveNoteFromIndex(NoteId id);
+size_t QuerySearchIndex(const char* query, NoteId** ids);
+
+#define SEARCH_REJECT_BATCH 256
+
+// Notes a query turned up that do not contain it after all
+typedef struct SearchRejects {
+  unsigned int check;                   // As returned by CheckSearchResults
+  int done;                             // Last batch of the check
+  size_t count;
+  NoteId ids[SEARCH_REJECT_BATCH];
+} SearchRejects;
+
+unsigned int CheckSearchResults(const char* query, const NoteId* ids, size_t count, void (*reject)(SearchRejects* rejects, void* context), void* context);
+void StartSearchIndexing(void (*ready)(void* context), void* context);
+void SaveSearchIndex();
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef PLATFORM_H
+#define PLATFORM_H
+
+// 
+// Platform layer
+// 
+// The few OS services the note store needs: files with positioned I/O,
+// directory listing, read only mappings, threads and locks. Implemented by
+// platform_win32.c for the application and by platform_posix.c for the
+// benchmarks on Linux build hosts.
+// 
+
+#include <stddef.h>
+
+#ifndef MAX_PATH
+#define MAX_PATH 260
+#endif
+
+#ifdef _WIN32
+#define PATH_SEPARATOR "\\"
+#else
+#define PATH_SEPARATOR "/"
+#endif
+
+// Files, NULL is never a valid handle
+typedef void* FileHandle;
+
+enum {
+  FILE_READ,                 // Existing file, read only
+  FILE_READWRITE,            // Created if missing, kept otherwise
+  FILE_CREATE                // Created or truncated, write only
+};
+
+FileHandle FileOpen(const char* path, int mode);
+void FileClose(FileHandle file);
+int FileReadAt(FileHandle file, unsigned long long offset, void* data, size_t size);
+int FileWriteAt(FileHandle file, unsigned long long offset, const void* data, size_t size);
+int FileFlush(FileHandle file);
+int FileTruncate(FileHandle file, unsigned long long size);
+unsigned long long FileSize(FileHandle file);
+
+// Sets the last write time to now and returns it in the same units
+// DirList reports, so a later listing can tell whether the file changed
+unsigned long long FileTouch(FileHandle file);
+
+// Renames from over to once everything written to from is on disk
+int FileReplace(const char* from, const char* to);
+int FileDelete(const char* path);
+
+// Size and last write time of a file, from its metadata alone. Returns 0
+// if the file does not exist.
+int FileStamp(const char* path, unsigned long long* size, unsigned long long* mtime);
+
+// Drops the cached contents of a file so the next read goes to the disk,
+// for cold start benchmarks. Returns 0 if the OS would not.
+int FileEvict(const char* path);
+int DirCreate(const char* path);
+
+// Calls visit for every regular file in dir whose name ends in suffix.
+// Stops early and returns 0 if visit returns 0.
+int DirList(const char* dir, const char* suffix, int (*visit)(const char* name, unsigned long long size, unsigned long long mtime, void* context), void* context);
+
+// Maps a whole file read only. Returns NULL for a missing or empty file,
+// *size is set either way (0 if missing).
+const void* FileMap(const char* path, unsigned long long* size, void** mapping);
+void FileUnmap(const void* data, unsigned long long size, void* mapping);
+
+// Threads
+typedef struct Thread Thread;
+
+Thread* StartThread(int (*run)(void* param), void* param);
+int JoinThread(Thread* thread, unsigned int timeoutMs);  // 1 once the thread has ended
+void DetachThread(Thread* thread);
+int ProcessorCount();
+long AtomicDecrement(volatile long* value);
+unsigned long long TickCount();                          // Milliseconds, monotonic
+unsigned long long ClockNanoseconds();                   // Monotonic, for timing
+
+// Calls handler once if the process crashes, before it goes down
+void OnCrash(void (*handler)(void));
+
+// Locks. Conditions wait on a Lock, timeouts are in milliseconds.
+#define WAIT_FOREVER 0xFFFFFFFFu
+
+typedef struct Lock Lock;
+typedef struct Condition Condition;
+typedef struct RwLock RwLock;
+
+Lock* NewLock();
+void AcquireLock(Lock* lock);
+void ReleaseLock(Lock* lock);
+
+Condition* NewCondition();
+int WaitCondition(Condition* condition, Lock* lock, unsigned int timeoutMs);  // 0 on timeout
+void WakeCondition(Condition* condition);
+void WakeAllCondition(Condition* condition);
+
+RwLock* NewRwLock();
+void AcquireShared(RwLock* lock);
+void ReleaseShared(RwLock* lock);
+void AcquireExclusive(RwLock* lock);
+void ReleaseExclusive(RwLock* lock);
+
+#endif
@@ -0,0 +1,333 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "platform.h"
+#include "trace.h"
+
+// File descriptors are stored off by one so that descriptor 0 is not NULL
+static inline int Fd(FileHandle file) {
+  return (int)(size_t)file - 1;
+}
+
+static inline unsigned long long TimespecToU64(struct timespec ts) {
+  return (unsigned long long)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+FileHandle FileOpen(const char* path, int mode) {
+  int flags = mode == FILE_READ ? O_RDONLY : mode == FILE_READWRITE ? O_RDWR | O_CREAT : O_WRONLY | O_CREAT | O_TRUNC;
+  int fd = open(path,flags | O_CLOEXEC,0644);
+  if(fd < 0) return NULL;
+
+  TRACE_COUNT(TRACE_FILES_OPENED,1);
+  return (FileHandle)(size_t)(fd + 1);
+}
+
+void FileClose(FileHandle file) {
+  if(file) close(Fd(file));
+}
+
+int FileReadAt(FileHandle file, unsigned long long offset, void* data, size_t size) {
+  while(size) {
+    ssize_t read = pread(Fd(file),data,size,offset);
+    if(read < 0 && errno == EINTR) continue;
+    if(read <= 0) return 0;
+    TRACE_COUNT(TRACE_BYTES_READ,read);
+
+    data = (char*)data + read;
+    offset += read;
+    size -= read;
+  }
+  return 1;
+}
+
+int FileWriteAt(FileHandle file, unsigned long long offset, const void* data, size_t size) {
+  while(size) {
+    ssize_t written = pwrite(Fd(file),data,size,offset);
+    if(written < 0 && errno == EINTR) continue;
+    if(written <= 0) return 0;
+    TRACE_COUNT(TRACE_BYTES_WRITTEN,written);
+
+    data = (const char*)data + written;
+    offset += written;
+    size -= written;
+  }
+  return 1;
+}
+
+int FileFlush(FileHandle file) {
+  return fdatasync(Fd(file)) == 0;
+}
+
+int FileTruncate(FileHandle file, unsigned long long size) {
+  return ftruncate(Fd(file),size) == 0;
+}
+
+unsigned long long FileSize(FileHandle file) {
+  struct stat st;
+  return fstat(Fd(file),&st) == 0 ? (unsigned long long)st.st_size : 0;
+}
+
+unsigned long long FileTouch(FileHandle file) {
+  struct timespec now[2];
+  clock_gettime(CLOCK_REALTIME,&now[0]);
+  now[1] = now[0];
+  if(futimens(Fd(file),now) != 0) return 0;
+
+  // Read it back, the file system may store it coarser than we set it
+  struct stat st;
+  if(fstat(Fd(file),&st) != 0) return 0;
+  return TimespecToU64(st.st_mtim);
+}
+
+int FileReplace(const char* from, const char* to) {
+  return rename(from,to) == 0;
+}
+
+int FileDelete(const char* path) {
+  return unlink(path) == 0;
+}
+
+int FileStamp(const char* path, unsigned long long* size, unsigned long long* mtime) {
+  struct stat st;
+  if(stat(path,&st) != 0) return 0;
+
+  *size = st.st_size;
+  *mtime = TimespecToU64(st.st_mtim);
+  return 1;
+}
+
+int FileEvict(const char* path) {
+  int fd = open(path,O_RDONLY | O_CLOEXEC);
+  if(fd < 0) return 0;
+
+  // Dirty pages are not dropped, they are written out first
+  int ok = fdatasync(fd) == 0 && posix_fadvise(fd,0,0,POSIX_FADV_DONTNEED) == 0;
+  close(fd);
+  return ok;
+}
+
+int DirCreate(const char* path) {
+  return mkdir(path,0755) == 0 || errno == EEXIST;
+}
+
+int DirList(const char* dir, const char* suffix, int (*visit)(const char* name, unsigned long long size, unsigned long long mtime, void* context), void* context) {
+  DIR* d = opendir(dir);
+  if(!d) return 1;
+
+  size_t suffixLength = strlen(suffix);
+  int ok = 1;
+
+  struct dirent* entry;
+  while(ok && (entry = readdir(d))) {
+    size_t length = strlen(entry->d_name);
+    if(length < suffixLength || strcmp(entry->d_name + length - suffixLength,suffix) != 0) continue;
+
+    struct stat st;
+    if(fstatat(dirfd(d),entry->d_name,&st,0) != 0 || !S_ISREG(st.st_mode)) continue;
+
+    ok = visit(entry->d_name,st.st_size,TimespecToU64(st.st_mtim),context);
+  }
+
+  closedir(d);
+  return ok;
+}
+
+const void* FileMap(const char* path, unsigned long long* size, void** mapping) {
+  *size = 0;
+  *mapping = NULL;
+
+  int fd = open(path,O_RDONLY | O_CLOEXEC);
+  if(fd < 0) return NULL;
+  TRACE_COUNT(TRACE_FILES_OPENED,1);
+
+  struct stat st;
+  if(fstat(fd,&st) == 0) *size = st.st_size;
+
+  void* data = *size ? mmap(NULL,*size,PROT_READ,MAP_PRIVATE,fd,0) : MAP_FAILED;
+  close(fd);
+  if(data == MAP_FAILED) return NULL;
+
+  // Pages are read as they are touched, the mapping stands in for them
+  TRACE_COUNT(TRACE_BYTES_MAPPED,*size);
+  return data;
+}
+
+void FileUnmap(const void* data, unsigned long long size, void* mapping) {
+  if(data) munmap((void*)data,size);
+}
+
+// 
+// Threads and locks
+// 
+
+struct Thread {
+  pthread_t handle;
+  int (*run)(void* param);
+  void* param;
+  int done;
+  volatile long owners;      // ThreadMain and whoever detaches, the last one frees
+  pthread_mutex_t lock;
+  pthread_cond_t ended;
+};
+
+static void FreeThread(Thread* thread) {
+  pthread_mutex_destroy(&thread->lock);
+  pthread_cond_destroy(&thread->ended);
+  free(thread);
+}
+
+static void* ThreadMain(void* param) {
+  Thread* thread = param;
+  thread->run(thread->param);
+  TraceThreadExit();
+
+  pthread_mutex_lock(&thread->lock);
+  thread->done = 1;
+  pthread_cond_broadcast(&thread->ended);
+  pthread_mutex_unlock(&thread->lock);
+
+  if(AtomicDecrement(&thread->owners) == 0) FreeThread(thread);
+  return NULL;
+}
+
+Thread* StartThread(int (*run)(void* param), void* param) {
+  Thread* thread = calloc(1,sizeof(Thread));
+  if(!thread) return NULL;
+
+  thread->run = run;
+  thread->param = param;
+  thread->owners = 2;
+  pthread_mutex_init(&thread->lock,NULL);
+  pthread_cond_init(&thread->ended,NULL);
+
+  if(pthread_create(&thread->handle,NULL,ThreadMain,thread) != 0) {
+    free(thread);
+    return NULL;
+  }
+  return thread;
+}
+
+static void DeadlineAfter(struct timespec* deadline, unsigned int timeoutMs) {
+  clock_gettime(CLOCK_REALTIME,deadline);
+  deadline->tv_sec += timeoutMs / 1000;
+  deadline->tv_nsec += (long)(timeoutMs % 1000) * 1000000;
+  if(deadline->tv_nsec >= 1000000000) {
+    deadline->tv_sec++;
+    deadline->tv_nsec -= 1000000000;
+  }
+}
+
+int JoinThread(Thread* thread, unsigned int timeoutMs) {
+  if(timeoutMs != WAIT_FOREVER) {
+    struct timespec deadline;
+    DeadlineAfter(&deadline,timeoutMs);
+
+    pthread_mutex_lock(&thread->lock);
+    while(!thread->done && pthread_cond_timedwait(&thread->ended,&thread->lock,&deadline) == 0);
+    int done = thread->done;
+    pthread_mutex_unlock(&thread->lock);
+    if(!done) return 0;
+  }
+
+  pthread_join(thread->handle,NULL);
+  FreeThread(thread);
+  return 1;
+}
+
+void DetachThread(Thread* thread) {
+  pthread_detach(thread->handle);
+  if(AtomicDecrement(&thread->owners) == 0) FreeThread(thread);
+}
+
+int ProcessorCount() {
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+  return count > 0 ? (int)count : 1;
+}
+
+long AtomicDecrement(volatile long* value) {
+  return __atomic_sub_fetch(value,1,__ATOMIC_SEQ_CST);
+}
+
+unsigned long long TickCount() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC,&now);
+  return (unsigned long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+unsigned long long ClockNanoseconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC,&now);
+  return TimespecToU64(now);
+}
+
+static void (*crashHandler)(void);
+
+static void CrashSignal(int signal) {
+  crashHandler();
+  raise(signal);  // SA_RESETHAND restored the default action
+}
+
+void OnCrash(void (*handler)(void)) {
+  crashHandler = handler;
+
+  struct sigaction action = {0};
+  action.sa_handler = CrashSignal;
+  action.sa_flags = SA_RESETHAND;
+  sigemptyset(&action.sa_mask);
+
+  const int signals[] = {SIGSEGV,SIGBUS,SIGILL,SIGFPE,SIGABRT};
+  for(size_t i = 0; i < sizeof(signals) / sizeof(signals[0]); ++i)
+    sigaction(signals[i],&action,NULL);
+}
+
+struct Lock { pthread_mutex_t mutex; };
+struct Condition { pthread_cond_t cond; };
+struct RwLock { pthread_rwlock_t rw; };
+
+Lock* NewLock() {
+  Lock* lock = malloc(sizeof(Lock));
+  if(lock) pthread_mutex_init(&lock->mutex,NULL);
+  return lock;
+}
+
+void AcquireLock(Lock* lock) { pthread_mutex_lock(&lock->mutex); }
+void ReleaseLock(Lock* lock) { pthread_mutex_unlock(&lock->mutex); }
+
+Condition* NewCondition() {
+  Condition* condition = malloc(sizeof(Condition));
+  if(condition) pthread_cond_init(&condition->cond,NULL);
+  return condition;
+}
+
+int WaitCondition(Condition* condition, Lock* lock, unsigned int timeoutMs) {
+  if(timeoutMs == WAIT_FOREVER) return pthread_cond_wait(&condition->cond,&lock->mutex) == 0;
+
+  struct timespec deadline;
+  DeadlineAfter(&deadline,timeoutMs);
+  return pthread_cond_timedwait(&condition->cond,&lock->mutex,&deadline) == 0;
+}
+
+void WakeCondition(Condition* condition) { pthread_cond_signal(&condition->cond); }
+void WakeAllCondition(Condition* condition) { pthread_cond_broadcast(&condition->cond); }
+
+RwLock* NewRwLock() {
+  RwLock* lock = malloc(sizeof(RwLock));
+  if(lock) pthread_rwlock_init(&lock->rw,NULL);
+  return lock;
+}
+
+void AcquireShared(RwLock* lock) { pthread_rwlock_rdlock(&lock->rw); }
+void ReleaseShared(RwLock* lock) { pthread_rwlock_unlock(&lock->rw); }
+void AcquireExclusive(RwLock* lock) { pthread_rwlock_wrlock(&lock->rw); }
+void ReleaseExclusive(RwLock* lock) { pthread_rwlock_unlock(&lock->rw); }
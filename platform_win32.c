@@ -0,0 +1,273 @@
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "platform.h"
+#include "trace.h"
+
+static inline unsigned long long FileTimeToU64(FILETIME ft) {
+  return ((unsigned long long)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+}
+
+FileHandle FileOpen(const char* path, int mode) {
+  HANDLE file;
+  switch(mode) {
+    case FILE_READ:
+      file = CreateFileA(path,GENERIC_READ,FILE_SHARE_READ | FILE_SHARE_WRITE,NULL,OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,NULL);
+      break;
+    case FILE_READWRITE:
+      file = CreateFileA(path,GENERIC_READ | GENERIC_WRITE,FILE_SHARE_READ,NULL,OPEN_ALWAYS,FILE_ATTRIBUTE_NORMAL,NULL);
+      break;
+    default:
+      file = CreateFileA(path,GENERIC_WRITE,0,NULL,CREATE_ALWAYS,FILE_ATTRIBUTE_NORMAL,NULL);
+      break;
+  }
+  if(file == INVALID_HANDLE_VALUE) return NULL;
+
+  TRACE_COUNT(TRACE_FILES_OPENED,1);
+  return file;
+}
+
+void FileClose(FileHandle file) {
+  if(file) CloseHandle(file);
+}
+
+int FileReadAt(FileHandle file, unsigned long long offset, void* data, size_t size) {
+  ULARGE_INTEGER at64 = {.QuadPart = offset};
+  OVERLAPPED at = {.Offset = at64.LowPart, .OffsetHigh = at64.HighPart};
+  DWORD read = 0;
+  BOOL ok = ReadFile(file,data,(DWORD)size,&read,&at);
+  TRACE_COUNT(TRACE_BYTES_READ,read);
+  return ok && read == size;
+}
+
+int FileWriteAt(FileHandle file, unsigned long long offset, const void* data, size_t size) {
+  ULARGE_INTEGER at64 = {.QuadPart = offset};
+  OVERLAPPED at = {.Offset = at64.LowPart, .OffsetHigh = at64.HighPart};
+  DWORD written = 0;
+  BOOL ok = WriteFile(file,data,(DWORD)size,&written,&at);
+  TRACE_COUNT(TRACE_BYTES_WRITTEN,written);
+  return ok && written == size;
+}
+
+int FileFlush(FileHandle file) {
+  return FlushFileBuffers(file) != 0;
+}
+
+int FileTruncate(FileHandle file, unsigned long long size) {
+  LARGE_INTEGER end = {.QuadPart = (LONGLONG)size};
+  return SetFilePointerEx(file,end,NULL,FILE_BEGIN) && SetEndOfFile(file);
+}
+
+unsigned long long FileSize(FileHandle file) {
+  LARGE_INTEGER size = {0};
+  GetFileSizeEx(file,&size);
+  return size.QuadPart;
+}
+
+unsigned long long FileTouch(FileHandle file) {
+  FILETIME now;
+  GetSystemTimeAsFileTime(&now);
+  if(!SetFileTime(file,NULL,NULL,&now)) return 0;
+  return FileTimeToU64(now);
+}
+
+int FileReplace(const char* from, const char* to) {
+  return MoveFileExA(from,to,MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+}
+
+int FileDelete(const char* path) {
+  return DeleteFileA(path) != 0;
+}
+
+int FileStamp(const char* path, unsigned long long* size, unsigned long long* mtime) {
+  WIN32_FILE_ATTRIBUTE_DATA data;
+  if(!GetFileAttributesExA(path,GetFileExInfoStandard,&data)) return 0;
+
+  *size = ((unsigned long long)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+  *mtime = FileTimeToU64(data.ftLastWriteTime);
+  return 1;
+}
+
+int FileEvict(const char* path) {
+  // Opening without buffering purges the cached pages of the file unless
+  // it is open elsewhere
+  HANDLE file = CreateFileA(path,GENERIC_READ,FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,NULL,OPEN_EXISTING,FILE_FLAG_NO_BUFFERING,NULL);
+  if(file == INVALID_HANDLE_VALUE) return 0;
+  CloseHandle(file);
+  return 1;
+}
+
+int DirCreate(const char* path) {
+  return CreateDirectoryA(path,NULL) || GetLastError() == ERROR_ALREADY_EXISTS;
+}
+
+int DirList(const char* dir, const char* suffix, int (*visit)(const char* name, unsigned long long size, unsigned long long mtime, void* context), void* context) {
+  char searchBuffer[MAX_PATH + 1];
+  snprintf(searchBuffer,sizeof(searchBuffer),"%s\\*%s",dir,suffix);
+
+  WIN32_FIND_DATAA fd;
+  HANDLE hfind = FindFirstFileA(searchBuffer,&fd);
+  if(hfind == INVALID_HANDLE_VALUE) return 1;
+
+  int ok = 1;
+  do {
+    if(fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) continue;
+
+    unsigned long long size = ((unsigned long long)fd.nFileSizeHigh << 32) | fd.nFileSizeLow;
+    ok = visit(fd.cFileName,size,FileTimeToU64(fd.ftLastWriteTime),context);
+  } while(ok && FindNextFileA(hfind,&fd));
+
+  FindClose(hfind);
+  return ok;
+}
+
+const void* FileMap(const char* path, unsigned long long* size, void** mapping) {
+  *size = 0;
+  *mapping = NULL;
+
+  HANDLE file = CreateFileA(path,GENERIC_READ,FILE_SHARE_READ | FILE_SHARE_WRITE,NULL,OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,NULL);
+  if(file == INVALID_HANDLE_VALUE) return NULL;
+  TRACE_COUNT(TRACE_FILES_OPENED,1);
+
+  LARGE_INTEGER length = {0};
+  GetFileSizeEx(file,&length);
+  *size = length.QuadPart;
+
+  HANDLE map = length.QuadPart ? CreateFileMappingA(file,NULL,PAGE_READONLY,0,0,NULL) : NULL;
+  const void* data = map ? MapViewOfFile(map,FILE_MAP_READ,0,0,0) : NULL;
+  CloseHandle(file);
+
+  if(!data && map) CloseHandle(map);
+  else *mapping = map;
+
+  // Pages are read as they are touched, the mapping stands in for them
+  if(data) TRACE_COUNT(TRACE_BYTES_MAPPED,*size);
+  return data;
+}
+
+void FileUnmap(const void* data, unsigned long long size, void* mapping) {
+  if(data) UnmapViewOfFile(data);
+  if(mapping) CloseHandle(mapping);
+}
+
+// 
+// Threads and locks
+// 
+
+struct Thread {
+  HANDLE handle;
+  int (*run)(void* param);
+  void* param;
+  volatile long owners;      // ThreadMain and whoever detaches, the last one frees
+};
+
+static DWORD WINAPI ThreadMain(LPVOID param) {
+  Thread* thread = param;
+  int result = thread->run(thread->param);
+  TraceThreadExit();
+  if(InterlockedDecrement(&thread->owners) == 0) free(thread);
+  return result;
+}
+
+Thread* StartThread(int (*run)(void* param), void* param) {
+  Thread* thread = calloc(1,sizeof(Thread));
+  if(!thread) return NULL;
+
+  thread->run = run;
+  thread->param = param;
+  thread->owners = 2;
+  thread->handle = CreateThread(NULL,0,ThreadMain,thread,0,NULL);
+  if(!thread->handle) {
+    free(thread);
+    return NULL;
+  }
+  return thread;
+}
+
+int JoinThread(Thread* thread, unsigned int timeoutMs) {
+  if(WaitForSingleObject(thread->handle,timeoutMs == WAIT_FOREVER ? INFINITE : timeoutMs) != WAIT_OBJECT_0) return 0;
+
+  CloseHandle(thread->handle);
+  free(thread);
+  return 1;
+}
+
+void DetachThread(Thread* thread) {
+  CloseHandle(thread->handle);
+  if(InterlockedDecrement(&thread->owners) == 0) free(thread);
+}
+
+int ProcessorCount() {
+  SYSTEM_INFO si;
+  GetSystemInfo(&si);
+  return si.dwNumberOfProcessors;
+}
+
+long AtomicDecrement(volatile long* value) {
+  return InterlockedDecrement(value);
+}
+
+unsigned long long TickCount() {
+  return GetTickCount64();
+}
+
+unsigned long long ClockNanoseconds() {
+  static LARGE_INTEGER frequency;
+  if(!frequency.QuadPart) QueryPerformanceFrequency(&frequency);
+
+  LARGE_INTEGER now;
+  QueryPerformanceCounter(&now);
+  unsigned long long f = frequency.QuadPart, c = now.QuadPart;
+  return c / f * 1000000000ull + c % f * 1000000000ull / f;
+}
+
+static void (*crashHandler)(void);
+
+static LONG WINAPI CrashFilter(EXCEPTION_POINTERS* exception) {
+  crashHandler();
+  return EXCEPTION_CONTINUE_SEARCH;
+}
+
+void OnCrash(void (*handler)(void)) {
+  crashHandler = handler;
+  SetUnhandledExceptionFilter(CrashFilter);
+}
+
+struct Lock { CRITICAL_SECTION cs; };
+struct Condition { CONDITION_VARIABLE cv; };
+struct RwLock { SRWLOCK srw; };
+
+Lock* NewLock() {
+  Lock* lock = malloc(sizeof(Lock));
+  if(lock) InitializeCriticalSection(&lock->cs);
+  return lock;
+}
+
+void AcquireLock(Lock* lock) { EnterCriticalSection(&lock->cs); }
+void ReleaseLock(Lock* lock) { LeaveCriticalSection(&lock->cs); }
+
+Condition* NewCondition() {
+  Condition* condition = malloc(sizeof(Condition));
+  if(condition) InitializeConditionVariable(&condition->cv);
+  return condition;
+}
+
+int WaitCondition(Condition* condition, Lock* lock, unsigned int timeoutMs) {
+  return SleepConditionVariableCS(&condition->cv,&lock->cs,timeoutMs == WAIT_FOREVER ? INFINITE : timeoutMs) != 0;
+}
+
+void WakeCondition(Condition* condition) { WakeConditionVariable(&condition->cv); }
+void WakeAllCondition(Condition* condition) { WakeAllConditionVariable(&condition->cv); }
+
+RwLock* NewRwLock() {
+  RwLock* lock = malloc(sizeof(RwLock));
+  if(lock) InitializeSRWLock(&lock->srw);
+  return lock;
+}
+
+void AcquireShared(RwLock* lock) { AcquireSRWLockShared(&lock->srw); }
+void ReleaseShared(RwLock* lock) { ReleaseSRWLockShared(&lock->srw); }
+void AcquireExclusive(RwLock* lock) { AcquireSRWLockExclusive(&lock->srw); }
+void ReleaseExclusive(RwLock* lock) { ReleaseSRWLockExclusive(&lock->srw); }
@@ -0,0 +1,1516 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "harness.h"
+
+//
+// Tests of the note store
+//
+// Saves, loads, looks up and deletes notes in a scratch directory for
+// plain and compressed loose files and for the pack store, and checks
+// that every note comes back as it was saved, also from edit journals,
+// packs and version history that were torn, damaged or compacted. Runs
+// each line ending and Unicode kernel against plain reference loops and
+// search queries against a plain scan of the texts. Exits with 1 if any
+// check fails.
+//
+// Usage: htest [-d scratchdir]
+//
+
+#define TEST_DEFAULT_DIR "htest-data"
+#define TEST_NOTES 300
+
+static int failures = 0;
+
+static void Fail(const char* file, int line, const char* format, ...) {
+  va_list args;
+  va_start(args,format);
+  fprintf(stderr,"%s:%d: ",file,line);
+  vfprintf(stderr,format,args);
+  fputc('\n',stderr);
+  va_end(args);
+  failures++;
+}
+
+#define CHECK(condition) do { if(!(condition)) Fail(__FILE__,__LINE__,"%s",#condition); } while(0)
+
+static unsigned int testSeed = 4242;
+
+static unsigned int NextRandom() {
+  testSeed = testSeed * 1103515245u + 12345u;
+  return testSeed >> 8;
+}
+
+// Text of length bytes, words and line breaks, with a few non-ASCII
+// characters so UTF-8 bodies are covered
+static char* NewText(size_t length) {
+  static const char* words[] = {"note ","list ","save ","load\n","caf\xC3\xA9 ","\xE2\x82\xAC ","line\n","x"};
+  char* text = malloc(length + 1);
+  if(!text) exit(1);
+
+  size_t at = 0;
+  while(at < length) {
+    const char* word = words[NextRandom() % (sizeof(words) / sizeof(words[0]))];
+    size_t wordLength = strlen(word);
+    if(at + wordLength > length) word = "x", wordLength = 1;
+    memcpy(text + at,word,wordLength);
+    at += wordLength;
+  }
+  text[length] = '\0';
+  return text;
+}
+
+// Copy of text with a random range of up to 20 bytes replaced by 1 to 30
+// new ones
+static char* EditText(const char* text, size_t length, size_t* edited) {
+  size_t at = length ? NextRandom() % length : 0;
+  size_t removed = NextRandom() % 21;
+  if(removed > length - at) removed = length - at;
+  size_t insertedLength = 1 + NextRandom() % 30;
+  char* inserted = NewText(insertedLength);
+
+  *edited = length - removed + insertedLength;
+  char* result = malloc(*edited + 1);
+  if(!result) exit(1);
+  memcpy(result,text,at);
+  memcpy(result + at,inserted,insertedLength);
+  memcpy(result + at + insertedLength,text + at + removed,length - at - removed + 1);
+  free(inserted);
+  return result;
+}
+
+// Whole file at path, NULL if it cannot be read
+static char* ReadTestFile(const char* path, size_t* size) {
+  FileHandle file = FileOpen(path,FILE_READ);
+  if(!file) return NULL;
+
+  *size = (size_t)FileSize(file);
+  char* data = malloc(*size + 1);
+  if(data && !FileReadAt(file,0,data,*size)) {
+    free(data);
+    data = NULL;
+  }
+  FileClose(file);
+  return data;
+}
+
+static int WriteTestFile(const char* path, const void* data, size_t size) {
+  FileHandle file = FileOpen(path,FILE_CREATE);
+  if(!file) return 0;
+
+  int ok = FileWriteAt(file,0,data,size);
+  FileClose(file);
+  return ok;
+}
+
+// Fails unless the stored text of filename with its journal applied is
+// text
+static void CheckNoteBody(const char* stage, const char* filename, const char* text, size_t length) {
+  long read = -1;
+  char* body = ReadNoteBody(filename,&read);
+  if(!body || (size_t)read != length || memcmp(body,text,length) != 0)
+    Fail(__FILE__,__LINE__,"%s: %s read back as %ld bytes, %zu expected",stage,filename,body ? read : -1L,length);
+  free(body);
+}
+
+//
+// Tests
+//
+
+// Ids of removed notes must not find the note that reuses their slot
+static void TestRegistry() {
+  ResetNoteStore();
+
+  Note* a = Insert((Note){.catalogSlot = -1, .x = 1});
+  NoteId first = a->id;
+  CHECK(Find(first) == a);
+
+  Remove(first);
+  CHECK(Find(first) == NULL);
+
+  Note* b = Insert((Note){.catalogSlot = -1, .x = 2});
+  CHECK(b->id != first);
+  CHECK(Find(b->id) == b && b->x == 2);
+  CHECK(Find(first) == NULL);
+  CHECK(Find(INVALID_NOTEID) == NULL);
+
+  NoteId ids[2000];
+  for(size_t i = 0; i < 2000; ++i) ids[i] = Insert((Note){.catalogSlot = -1, .x = (int)i})->id;
+  for(size_t i = 0; i < 2000; i += 2) Remove(ids[i]);
+  for(size_t i = 0; i < 2000; ++i) {
+    Note* note = Find(ids[i]);
+    CHECK(i % 2 ? note && note->x == (int)i : note == NULL);
+  }
+  ResetNoteStore();
+
+  // A slot reused until its generation is used up is retired, its first
+  // id must not come back with the note inserted after that
+  first = Insert((Note){.catalogSlot = -1})->id;
+  Remove(first);
+  int reused = 1;
+  for(unsigned int i = 1; i < NOTE_GENERATION_MASK; ++i) {
+    NoteId id = Insert((Note){.catalogSlot = -1})->id;
+    reused &= (id & NOTE_SLOT_MASK) == (first & NOTE_SLOT_MASK);
+    Remove(id);
+  }
+  CHECK(reused && noteRegistry.retired == 1);
+  Note* c = Insert((Note){.catalogSlot = -1, .x = 3});
+  CHECK(Find(first) == NULL && Find(c->id) == c);
+  CHECK((c->id & NOTE_SLOT_MASK) != (first & NOTE_SLOT_MASK));
+  ResetNoteStore();
+}
+
+// The key of the order qsort compares by in CompareReferenceOrder
+static int referenceOrder;
+
+// The list orders spelled out: newest or largest first, titles ignoring
+// ASCII case, notes of unknown age last, ties by slot
+static int CompareReferenceOrder(const void* a, const void* b) {
+  const Note* x = *(Note* const*)a;
+  const Note* y = *(Note* const*)b;
+  long long c = 0;
+
+  if(referenceOrder == NOTE_ORDER_TITLE) {
+    for(size_t i = 0; !c && (x->preview[i] || y->preview[i]); ++i) {
+      unsigned char p = x->preview[i], q = y->preview[i];
+      c = (long long)(p >= 'A' && p <= 'Z' ? p + 32 : p) - (q >= 'A' && q <= 'Z' ? q + 32 : q);
+    }
+  }
+  else if(referenceOrder == NOTE_ORDER_SIZE) c = (long long)y->bodyLength - x->bodyLength;
+  else {
+    if(referenceOrder == NOTE_ORDER_CREATED) c = x->created == y->created ? 0 : x->created < y->created ? 1 : -1;
+    if(!c) c = x->modified == y->modified ? 0 : x->modified < y->modified ? 1 : -1;
+  }
+  if(!c) c = (long long)(x->id & NOTE_SLOT_MASK) - (y->id & NOTE_SLOT_MASK);
+  return (c > 0) - (c < 0);
+}
+
+// Every row of every order against a sort of the listed notes. Leaves
+// the order switched to key.
+static void CheckOrder(const char* stage, int key) {
+  static const char* names[] = {"modified","created","title","size"};
+  SetNoteOrder(key);
+  referenceOrder = key;
+
+  Note** listed = malloc(sizeof(Note*) * (noteRegistry.slotCount + 1));
+  if(!listed) exit(1);
+
+  size_t count = 0;
+  for(size_t i = 0; i < noteRegistry.slotCount; ++i) {
+    Note* note = NoteAtSlot(i);
+    if(note && note->listed) listed[count++] = note;
+    else if(note && NoteRow(note) != -1) Fail(__FILE__,__LINE__,"%s: a note off the list has a row",stage);
+  }
+  qsort(listed,count,sizeof(Note*),CompareReferenceOrder);
+
+  if(ListedNoteCount() != count)
+    Fail(__FILE__,__LINE__,"%s: %zu notes listed by %s, %zu expected",stage,ListedNoteCount(),names[key],count);
+
+  size_t wrong = 0;
+  for(size_t row = 0; row < count; ++row)
+    wrong += NoteAtRow((int)row) != listed[row] || NoteRow(listed[row]) != (int)row;
+  if(wrong || NoteAtRow((int)count) || NoteAtRow(-1))
+    Fail(__FILE__,__LINE__,"%s: %zu of %zu rows differ by %s",stage,wrong,count,names[key]);
+  free(listed);
+}
+
+static void CheckOrders(const char* stage) {
+  CheckOrder(stage,NOTE_ORDER_CREATED);
+  CheckOrder(stage,NOTE_ORDER_TITLE);
+  CheckOrder(stage,NOTE_ORDER_SIZE);
+  CheckOrder(stage,NOTE_ORDER_MODIFIED);
+}
+
+// The list order against a sort of the listed notes as they are inserted,
+// touched, changed, filtered and removed under each order. Sizes, ages and
+// titles repeat so ties are common.
+static void TestOrder() {
+  static const char* titles[] = {"note","Note","NOTE list","list","","caf\xC3\xA9","Zebra","zebra 2","_x"};
+  ResetNoteStore();
+  SetNoteOrder(NOTE_ORDER_MODIFIED);
+
+  for(size_t i = 0; i < 600; ++i) {
+    Note* note = Insert((Note){.catalogSlot = -1, .bodyLength = NextRandom() % 40, .created = i % 5 ? 1700000000 + NextRandom() % 50 : 0});
+    snprintf(note->preview,sizeof(note->preview),"%s",titles[NextRandom() % (sizeof(titles) / sizeof(titles[0]))]);
+    TouchNote(note);
+    ListNote(note,1);
+    OrderNote(note);
+  }
+  CheckOrders("inserted");
+
+  // Saves touch notes and change what the other orders look at, under
+  // each order in turn
+  static const int keys[] = {NOTE_ORDER_SIZE,NOTE_ORDER_TITLE,NOTE_ORDER_CREATED,NOTE_ORDER_MODIFIED};
+  for(size_t k = 0; k < 4; ++k) {
+    SetNoteOrder(keys[k]);
+    for(size_t i = 0; i < 300; ++i) {
+      Note* note = NoteAtSlot(NextRandom() % noteRegistry.slotCount);
+      if(!note) continue;
+
+      if(i % 2) TouchNote(note);
+      else {
+        int ordered = UnorderNote(note);
+        note->bodyLength = NextRandom() % 40;
+        snprintf(note->preview,sizeof(note->preview),"%s",titles[NextRandom() % (sizeof(titles) / sizeof(titles[0]))]);
+        note->modified++;
+        if(ordered) OrderNote(note);
+      }
+    }
+    CheckOrders("changed");
+  }
+
+  // Filters under each order, then all listed again
+  for(size_t k = 0; k < 4; ++k) {
+    SetNoteOrder(keys[k]);
+    unsigned int every = 2 + k;
+    for(size_t i = 0; i < noteRegistry.slotCount; ++i)
+      if(NoteAtSlot(i)) ListNote(NoteAtSlot(i),i % every == 0);
+    CheckOrders("filtered");
+  }
+  for(size_t i = 0; i < noteRegistry.slotCount; ++i)
+    if(NoteAtSlot(i)) ListNote(NoteAtSlot(i),1);
+  CheckOrders("listed");
+
+  // Removed notes leave the order, new ones take their slots
+  for(size_t i = 0; i < noteRegistry.slotCount; i += 3)
+    if(NoteAtSlot(i)) Remove(NoteAtSlot(i)->id);
+  CheckOrders("removed");
+  for(size_t i = 0; i < 100; ++i) {
+    Note* note = Insert((Note){.catalogSlot = -1, .bodyLength = NextRandom() % 40, .created = 1700000000 + NextRandom() % 50});
+    snprintf(note->preview,sizeof(note->preview),"%s",titles[i % (sizeof(titles) / sizeof(titles[0]))]);
+    TouchNote(note);
+    ListNote(note,i % 2);
+    OrderNote(note);
+  }
+  CheckOrders("reinserted");
+
+  ResetNoteStore();
+  SetNoteOrder(NOTE_ORDER_MODIFIED);
+}
+
+// Reference conversions the kernels are checked against
+static size_t ReferenceCrlfToLf(char* dst, const char* src, size_t len) {
+  size_t j = 0;
+  for(size_t i = 0; i < len; ++i)
+    if(!(src[i] == '\r' && i + 1 < len && src[i + 1] == '\n')) dst[j++] = src[i];
+  return j;
+}
+
+static size_t ReferenceLfToCrlf(char* dst, const char* src, size_t len) {
+  size_t j = 0;
+  for(size_t i = 0; i < len; ++i) {
+    if(src[i] == '\n' && (i == 0 || src[i - 1] != '\r')) dst[j++] = '\r';
+    dst[j++] = src[i];
+  }
+  return j;
+}
+
+#define TEST_TEXT_MAX 320
+
+static void CheckLineEndings(const char* kernel, const char* src, size_t len) {
+  char expected[TEST_TEXT_MAX * 2], actual[TEST_TEXT_MAX * 2 + 1];
+
+  size_t expectedLength = ReferenceCrlfToLf(expected,src,len);
+  size_t actualLength = CrlfToLf(actual,src,len);
+  if(actualLength != expectedLength || memcmp(actual,expected,expectedLength) != 0)
+    Fail(__FILE__,__LINE__,"%s: CrlfToLf differs for %zu bytes",kernel,len);
+
+  memcpy(actual,src,len);
+  actualLength = CrlfToLf(actual,actual,len);
+  if(actualLength != expectedLength || memcmp(actual,expected,expectedLength) != 0)
+    Fail(__FILE__,__LINE__,"%s: CrlfToLf in place differs for %zu bytes",kernel,len);
+
+  expectedLength = ReferenceLfToCrlf(expected,src,len);
+  if(len + CountLoneLf(src,len) != expectedLength)
+    Fail(__FILE__,__LINE__,"%s: CountLoneLf differs for %zu bytes",kernel,len);
+
+  // The guard byte catches writes past the length CountLoneLf promised
+  memset(actual,'#',sizeof(actual));
+  actualLength = LfToCrlf(actual,src,len);
+  if(actualLength != expectedLength || memcmp(actual,expected,expectedLength) != 0 || actual[expectedLength] != '#')
+    Fail(__FILE__,__LINE__,"%s: LfToCrlf differs for %zu bytes",kernel,len);
+}
+
+// Every line ending kernel against the reference loops: all lengths up to
+// 65, lone CRs, LFs and CRLFs at every offset across the 16 and 32 byte
+// blocks, runs of one character and random mixes
+static void TestLineEndings() {
+  static const struct { int kernel; const char* name; } kernels[] = {
+    {TEXT_KERNEL_SCALAR,"scalar"}, {TEXT_KERNEL_SSE2,"sse2"}, {TEXT_KERNEL_AVX2,"avx2"}
+  };
+  static const char* marks[] = {"\r","\n","\r\n"};
+  char src[TEST_TEXT_MAX];
+
+  for(size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); ++k) {
+    TEXTKERNEL = kernels[k].kernel;
+    const char* name = kernels[k].name;
+
+    for(size_t len = 0; len <= 65; ++len) {
+      memset(src,'a',len);
+      CheckLineEndings(name,src,len);
+      memset(src,'\r',len);
+      CheckLineEndings(name,src,len);
+      memset(src,'\n',len);
+      CheckLineEndings(name,src,len);
+      for(size_t i = 0; i < len; ++i) src[i] = i % 2 ? '\n' : '\r';
+      CheckLineEndings(name,src,len);
+
+      for(size_t m = 0; m < sizeof(marks) / sizeof(marks[0]); ++m)
+        for(size_t at = 0; at + strlen(marks[m]) <= len; ++at) {
+          memset(src,'a',len);
+          memcpy(src + at,marks[m],strlen(marks[m]));
+          CheckLineEndings(name,src,len);
+        }
+    }
+
+    for(size_t round = 0; round < 2000; ++round) {
+      size_t len = NextRandom() % TEST_TEXT_MAX;
+      for(size_t i = 0; i < len; ++i) src[i] = "a\r\n"[NextRandom() % 3];
+      CheckLineEndings(name,src,len);
+    }
+  }
+  TEXTKERNEL = TEXT_KERNEL_AVX2;
+}
+
+// Code points of UTF-8 decoded one at a time, the checks spelled out.
+// Returns the count or -1 for ill formed text.
+static long ReferenceDecodeUtf8(unsigned int* dst, const unsigned char* src, size_t len) {
+  long n = 0;
+  for(size_t i = 0; i < len;) {
+    unsigned int c = src[i];
+    size_t extra = c < 0x80 ? 0 : c >= 0xC0 && c < 0xE0 ? 1 : c >= 0xE0 && c < 0xF0 ? 2 : c >= 0xF0 && c < 0xF8 ? 3 : 4;
+    if(extra == 4 || len - i <= extra) return -1;
+
+    if(extra) c &= 0x3F >> extra;
+    for(size_t k = 1; k <= extra; ++k) {
+      if((src[i + k] & 0xC0) != 0x80) return -1;
+      c = c << 6 | (src[i + k] & 0x3F);
+    }
+
+    static const unsigned int smallest[4] = {0,0x80,0x800,0x10000};
+    if(c < smallest[extra] || (c >= 0xD800 && c <= 0xDFFF) || c > 0x10FFFF) return -1;
+    dst[n++] = c;
+    i += extra + 1;
+  }
+  return n;
+}
+
+static size_t ReferenceUtf8ToUtf16(unsigned short* dst, const unsigned int* points, size_t count) {
+  size_t j = 0;
+  for(size_t i = 0; i < count; ++i) {
+    if(points[i] < 0x10000) dst[j++] = points[i];
+    else {
+      dst[j++] = 0xD800 + ((points[i] - 0x10000) >> 10);
+      dst[j++] = 0xDC00 + ((points[i] - 0x10000) & 0x3FF);
+    }
+  }
+  return j;
+}
+
+// A surrogate without its other half becomes U+FFFD
+static size_t ReferenceUtf16ToUtf8(char* dst, const unsigned short* src, size_t len) {
+  size_t j = 0;
+  for(size_t i = 0; i < len; ++i) {
+    unsigned int c = src[i];
+    if(c >= 0xD800 && c <= 0xDBFF && i + 1 < len && src[i + 1] >= 0xDC00 && src[i + 1] <= 0xDFFF)
+      c = 0x10000 + ((c - 0xD800) << 10) + (src[++i] - 0xDC00);
+    else if(c >= 0xD800 && c <= 0xDFFF) c = 0xFFFD;
+
+    if(c < 0x80) dst[j++] = c;
+    else if(c < 0x800) {
+      dst[j++] = 0xC0 | c >> 6;
+      dst[j++] = 0x80 | (c & 0x3F);
+    }
+    else if(c < 0x10000) {
+      dst[j++] = 0xE0 | c >> 12;
+      dst[j++] = 0x80 | (c >> 6 & 0x3F);
+      dst[j++] = 0x80 | (c & 0x3F);
+    }
+    else {
+      dst[j++] = 0xF0 | c >> 18;
+      dst[j++] = 0x80 | (c >> 12 & 0x3F);
+      dst[j++] = 0x80 | (c >> 6 & 0x3F);
+      dst[j++] = 0x80 | (c & 0x3F);
+    }
+  }
+  return j;
+}
+
+#define TEST_UNITS_MAX 320
+
+// Validation and conversion of UTF-8 against the reference, and back to
+// the same bytes when it is valid. Guards after the room each conversion
+// is given catch writes past it.
+static void CheckUtf8(const char* kernel, const char* src, size_t len) {
+  unsigned int points[TEST_UNITS_MAX];
+  unsigned short expected[TEST_UNITS_MAX], actual[TEST_UNITS_MAX + 1];
+  char back[3 * TEST_UNITS_MAX + 1];
+
+  long count = ReferenceDecodeUtf8(points,(const unsigned char*)src,len);
+  if(IsValidUtf8(src,len) != (count >= 0))
+    Fail(__FILE__,__LINE__,"%s: IsValidUtf8 says %d for %zu bytes",kernel,count < 0,len);
+
+  for(size_t i = 0; i <= len; ++i) actual[i] = 0xBEEF;
+  size_t units = Utf8ToUtf16(actual,src,len);
+  if(count < 0) {
+    int written = 0;
+    for(size_t i = 0; i <= len; ++i) written |= actual[i] != 0xBEEF;
+    if(units != (size_t)-1 || written) Fail(__FILE__,__LINE__,"%s: Utf8ToUtf16 takes %zu ill formed bytes",kernel,len);
+    return;
+  }
+
+  size_t expectedUnits = ReferenceUtf8ToUtf16(expected,points,count);
+  if(units != expectedUnits || memcmp(actual,expected,sizeof(unsigned short) * units) != 0 || actual[len] != 0xBEEF) {
+    Fail(__FILE__,__LINE__,"%s: Utf8ToUtf16 differs for %zu bytes",kernel,len);
+    return;
+  }
+
+  memset(back,'#',sizeof(back));
+  size_t bytes = Utf16ToUtf8(back,actual,units);
+  if(bytes != len || memcmp(back,src,len) != 0 || back[3 * units] != '#')
+    Fail(__FILE__,__LINE__,"%s: Utf16ToUtf8 does not give back %zu bytes",kernel,len);
+}
+
+static void CheckUtf16(const char* kernel, const unsigned short* src, size_t len) {
+  char expected[3 * TEST_UNITS_MAX], actual[3 * TEST_UNITS_MAX + 1];
+
+  size_t expectedLength = ReferenceUtf16ToUtf8(expected,src,len);
+  memset(actual,'#',sizeof(actual));
+  size_t actualLength = Utf16ToUtf8(actual,src,len);
+  if(actualLength != expectedLength || memcmp(actual,expected,expectedLength) != 0 || actual[3 * len] != '#')
+    Fail(__FILE__,__LINE__,"%s: Utf16ToUtf8 differs for %zu units",kernel,len);
+}
+
+// Random text of characters from every length class
+static size_t RandomUtf8(char* dst, size_t count) {
+  size_t j = 0;
+  for(size_t i = 0; i < count; ++i) {
+    unsigned int c;
+    switch(NextRandom() % 5) {
+      case 0: c = 0x80 + NextRandom() % 0x780; break;
+      case 1: c = 0x800 + NextRandom() % 0xF800; break;
+      case 2: c = 0x10000 + NextRandom() % 0x100000; break;
+      default: c = 0x20 + NextRandom() % 0x5F; break;
+    }
+    if(c >= 0xD800 && c <= 0xDFFF) c -= 0x1000;
+
+    unsigned short units[2];
+    j += ReferenceUtf16ToUtf8(dst + j,units,ReferenceUtf8ToUtf16(units,&c,1));
+  }
+  return j;
+}
+
+// Every Unicode kernel against the reference loops: ASCII of all lengths
+// up to 65, then well and ill formed sequences at every offset of texts
+// that long, so they cross the 16 and 32 byte blocks and run off the end,
+// random texts with and without a corrupted byte, and UTF-16 with lone,
+// reversed and split surrogates
+static void TestUnicode() {
+  static const struct { int kernel; const char* name; } kernels[] = {
+    {TEXT_KERNEL_SCALAR,"scalar"}, {TEXT_KERNEL_SSE2,"sse2"}, {TEXT_KERNEL_AVX2,"avx2"}
+  };
+  static const char* sequences[] = {
+    // Well formed: the first and last of each length, around the surrogates
+    "\xC2\x80","\xDF\xBF","\xE0\xA0\x80","\xED\x9F\xBF","\xEE\x80\x80","\xEF\xBF\xBF",
+    "\xF0\x90\x80\x80","\xF4\x8F\xBF\xBF",
+    // Overlong forms
+    "\xC0\x80","\xC1\xBF","\xE0\x80\x80","\xE0\x9F\xBF","\xF0\x80\x80\x80","\xF0\x8F\xBF\xBF",
+    // Surrogates
+    "\xED\xA0\x80","\xED\xBF\xBF","\xED\xA0\x80\xED\xB0\x80",
+    // Past U+10FFFF and bytes that never start a character
+    "\xF4\x90\x80\x80","\xF5\x80\x80\x80","\xF8\x88\x80\x80\x80","\xFF","\x80","\xBF\xBF",
+    // Cut short or broken off by another character
+    "\xC3","\xE2\x82","\xF0\x9F\x98","\xE2\x82" "a","\xF0\x9F" "\xC3\xA9"
+  };
+  static const unsigned short pairs[][2] = {
+    {0xD800,0xDC00},{0xDBFF,0xDFFF},{0xD800,0x0041},{0xDC00,0xD800},{0xDFFF,0xDFFF},{0xD83D,0xD83D}
+  };
+  char src[3 * TEST_UNITS_MAX];
+  unsigned short units[TEST_UNITS_MAX];
+
+  for(size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); ++k) {
+    TEXTKERNEL = kernels[k].kernel;
+    const char* name = kernels[k].name;
+
+    for(size_t len = 0; len <= 65; ++len) {
+      memset(src,'a',len);
+      CheckUtf8(name,src,len);
+
+      for(size_t q = 0; q < sizeof(sequences) / sizeof(sequences[0]); ++q)
+        for(size_t at = 0; at < len; ++at) {
+          size_t n = strlen(sequences[q]);
+          memset(src,'a',len);
+          memcpy(src + at,sequences[q],at + n <= len ? n : len - at);
+          CheckUtf8(name,src,len);
+        }
+
+      for(size_t i = 0; i < len; ++i) units[i] = 'a' + i % 26;
+      CheckUtf16(name,units,len);
+      for(size_t p = 0; p < sizeof(pairs) / sizeof(pairs[0]); ++p)
+        for(size_t at = 0; at < len; ++at) {
+          for(size_t i = 0; i < len; ++i) units[i] = i % 3 ? 'a' : 0x00E9 + i % 0x700;
+          units[at] = pairs[p][0];
+          if(at + 1 < len) units[at + 1] = pairs[p][1];
+          CheckUtf16(name,units,len);
+        }
+    }
+
+    for(size_t round = 0; round < 2000; ++round) {
+      size_t len = RandomUtf8(src,NextRandom() % (TEST_UNITS_MAX / 4));
+      CheckUtf8(name,src,len);
+      if(len && round % 2) {
+        src[NextRandom() % len] = (char)(0x80 + NextRandom() % 0x80);
+        CheckUtf8(name,src,len);
+      }
+
+      len = NextRandom() % TEST_UNITS_MAX;
+      for(size_t i = 0; i < len; ++i) {
+        unsigned int r = NextRandom() % 8;
+        units[i] = r < 3 ? 0x20 + NextRandom() % 0x60 : r < 5 ? 0x80 + NextRandom() % 0x780 : r < 6 ? 0xD800 + NextRandom() % 0x800 : NextRandom() % 0x10000;
+      }
+      CheckUtf16(name,units,len);
+    }
+  }
+  TEXTKERNEL = TEXT_KERNEL_AVX2;
+}
+
+// Saves TEST_NOTES notes, loads them back with and without a catalog,
+// reads every body and deletes them one by one and as a batch
+static void TestStore(const char* store, int packed, int compress) {
+  ClearScratchDir(0);
+  ResetNoteStore();
+  COMPRESSNOTES = compress;
+  if(packed && !CreatePack()) {
+    Fail(__FILE__,__LINE__,"%s: could not create a pack",store);
+    return;
+  }
+
+  char* texts[TEST_NOTES];
+  StartSaveWriter();
+  for(size_t i = 0; i < TEST_NOTES; ++i) {
+    // Empty, tiny, and a few above the compression and LZ block sizes
+    size_t length = i == 0 ? 0 : i % 50 == 1 ? 200000 + NextRandom() % 100000 : NextRandom() % 4000;
+    texts[i] = NewText(length);
+
+    SaveTestNote((Note){.x = (int)i, .y = 2, .width = 300, .height = 200, .catalogSlot = -1},"t",i,texts[i],length);
+  }
+  DrainSaveQueue(NULL,NULL,WAIT_FOREVER);
+  if(!packed) CHECK(CountNoteFiles() == TEST_NOTES);
+
+  for(int pass = 0; pass < (packed ? 1 : 2); ++pass) {
+    ResetNoteStore();
+    size_t loaded = LoadAllNotes();
+    if(loaded != TEST_NOTES) Fail(__FILE__,__LINE__,"%s: loaded %zu of %d notes",store,loaded,TEST_NOTES);
+
+    size_t intact = 0;
+    for(size_t i = 0; i < TEST_NOTES; ++i) {
+      char filename[FILENAME_SIZE + 1];
+      TestNoteName(filename,"t",i);
+      Note* note = FindByFilename(filename);
+      if(!note || Find(note->id) != note || note->x != (int)i || note->height != 200) continue;
+
+      long length = -1;
+      char* body = ReadNoteBody(filename,&length);
+      if(body && (size_t)length == strlen(texts[i]) && memcmp(body,texts[i],length) == 0) intact++;
+      free(body);
+    }
+    if(intact != TEST_NOTES) Fail(__FILE__,__LINE__,"%s: %zu of %d notes read back intact",store,intact,TEST_NOTES);
+
+    // The second pass loads from the catalog written here
+    StartSaveWriter();
+    SyncCatalog();
+    DrainSaveQueue(NULL,NULL,WAIT_FOREVER);
+  }
+
+  // Delete: half of the notes one by one, the rest as one batch
+  StartSaveWriter();
+  Note* batch[TEST_NOTES];
+  size_t batchCount = 0;
+  for(size_t i = 0; i < noteRegistry.slotCount; ++i) {
+    Note* note = NoteAtSlot(i);
+    if(!note) continue;
+    if(i % 2) batch[batchCount++] = note;
+    else {
+      NoteId id = note->id;
+      DeleteNoteFromDisk(NOTESPATH,note);
+      Remove(id);
+      CHECK(Find(id) == NULL);
+    }
+  }
+  DeleteNotesFromDisk(NOTESPATH,batch,batchCount);
+  for(size_t i = 0; i < batchCount; ++i) Remove(batch[i]->id);
+  DrainSaveQueue(NULL,NULL,WAIT_FOREVER);
+
+  if(!packed) CHECK(CountNoteFiles() == 0);
+  ResetNoteStore();
+  size_t left = LoadAllNotes();
+  if(left) Fail(__FILE__,__LINE__,"%s: %zu notes left after deleting",store,left);
+
+  for(size_t i = 0; i < TEST_NOTES; ++i) free(texts[i]);
+  ResetNoteStore();
+  ClosePack();
+}
+
+static void WriteFlatNote(const char* path, const char* text, size_t length) {
+  NoteHeader header = {.magic = NOTE_MAGIC, .version = NOTE_VERSION_PLAIN, .headerSize = sizeof(NoteHeader),
+                       .x = 10, .y = 10, .width = 300, .height = 300, .bodyLength = (unsigned int)length};
+  unsigned long long mtime;
+  if(!WriteNoteFileAtomically(path,&header,text,&mtime)) Fail(__FILE__,__LINE__,"could not write %s",path);
+}
+
+// Fails unless the loaded notes are texts, each read back exactly once
+static void CheckMigratedNotes(const char* stage, char** texts, const size_t* lengths, size_t count) {
+  size_t loaded = LoadAllNotes();
+  if(loaded != count) Fail(__FILE__,__LINE__,"%s: loaded %zu of %zu notes",stage,loaded,count);
+
+  unsigned char matched[32] = {0};
+  for(size_t slot = 0; slot < noteRegistry.slotCount; ++slot) {
+    Note* note = NoteAtSlot(slot);
+    if(!note) continue;
+
+    long length = -1;
+    char* body = ReadNoteBody(note->filename,&length);
+    size_t i = 0;
+    while(i < count && (matched[i] || !body || (size_t)length != lengths[i] || memcmp(body,texts[i],length) != 0)) i++;
+    if(i < count) matched[i] = 1;
+    else Fail(__FILE__,__LINE__,"%s: %s does not read back as any of the notes",stage,note->filename);
+    free(body);
+  }
+}
+
+// A flat store whose move into shards was cut short: some notes are in
+// their shards already, one only has its journal there, one is shadowed by
+// a note of the same name, and names too long for the store are left both
+// in the flat directory and in a shard. The next load finishes the move and
+// finds every note once, so does the load after it, and the import into a
+// pack renames a long name it comes across in a shard as well.
+static void TestMigration() {
+  ClearScratchDir(0);
+  ResetNoteStore();
+  COMPRESSNOTES = 0;
+
+  enum { flat = 6, moved = 4, count = flat + moved + 4 };
+  char* texts[count + 1];
+  size_t lengths[count + 1];
+  for(size_t i = 0; i <= count; ++i) texts[i] = NewText(lengths[i] = 100 + NextRandom() % 2000);
+
+  char filename[FILENAME_SIZE + 1], path[MAX_PATH + 1], to[MAX_PATH + 1];
+  for(size_t i = 0; i < flat + moved; ++i) {
+    TestNoteName(filename,"f",i);
+    if(i < flat) snprintf(path,sizeof(path),"%s" PATH_SEPARATOR "%s",NOTESPATH,filename);
+    else NotePath(path,sizeof(path),filename,"");
+    WriteFlatNote(path,texts[i],lengths[i]);
+  }
+
+  // A flat note under the name of one that was moved already
+  snprintf(path,sizeof(path),"%s" PATH_SEPARATOR "%s",NOTESPATH,filename);
+  WriteFlatNote(path,texts[flat + moved],lengths[flat + moved]);
+
+  snprintf(path,sizeof(path),"%s" PATH_SEPARATOR "long note name 0" NOTE_EXTENSION,NOTESPATH);
+  WriteFlatNote(path,texts[flat + moved + 1],lengths[flat + moved + 1]);
+  snprintf(path,sizeof(path),"%s" PATH_SEPARATOR "05" PATH_SEPARATOR "long note name 1" NOTE_EXTENSION,NOTESPATH);
+  WriteFlatNote(path,texts[flat + moved + 2],lengths[flat + moved + 2]);
+
+  // The move was cut short between the journal and the note
+  size_t edited;
+  StartSaveWriter();
+  Note* note = SaveTestNote((Note){.catalogSlot = -1},"g",0,texts[count - 1],lengths[count - 1]);
+  DrainSaveQueue(NULL,NULL,WAIT_FOREVER);
+  char* edit = EditText(texts[count - 1],lengths[count - 1],&edited);
+  JournalNoteEdit(note,texts[count - 1],lengths[count - 1],edit,edited);
+  DrainSaveQueue(NULL,NULL,WAIT_FOREVER);
+  free(texts[count - 1]);
+  texts[count - 1] = edit;
+  lengths[count - 1] = edited;
+
+  char journaled[FILENAME_SIZE + 1];
+  snprintf(journaled,sizeof(journaled),"%s",note->filename);
+  NotePath(path,sizeof(path),journaled,"");
+  snprintf(to,sizeof(to),"%s" PATH_SEPARATOR "%s",NOTESPATH,journaled);
+  CHECK(FileReplace(path,to));
+  ResetNoteStore();
+
+  CheckMigratedNotes("migrated",texts,lengths,count);
+  CHECK(CountNoteFiles() == count);
+  CheckNoteBody("journal moved first",journaled,texts[count - 1],lengths[count - 1]);
+  for(size_t i = 0; i < flat + moved; ++i) {
+    TestNoteName(filename,"f",i);
+    CheckNoteBody("migrated",filename,texts[i],lengths[i]);
+  }
+  ResetNoteStore();
+  CheckMigratedNotes("loaded again",texts,lengths,count);
+
+  ResetNoteStore();
+  snprintf(path,sizeof(path),"%s" PATH_SEPARATOR "a0" PATH_SEPARATOR "long note name 2" NOTE_EXTENSION,NOTESPATH);
+  WriteFlatNote(path,texts[count],lengths[count]);
+  CHECK(ImportNotesToPack());
+  CHECK(CountNoteFiles() == 0);
+  ResetNoteStore();
+  CheckMigratedNotes("imported",texts,lengths,count + 1);
+
+  for(size_t i = 0; i <= count; ++i) free(texts[i]);
+  ResetNoteStore();
+  ClearScratchDir(0);
+}
+
+// Replays the journal of a note after tearing and damaging it the way a
+// crash or a bad sector would, and folds journals into full saves once
+// they grow too large, on the UI thread and on the writer
+static void TestJournal() {
+  ClearScratchDir(0);
+  ResetNoteStore();
+  COMPRESSNOTES = 0;
+
+  enum { edits = 8 };
+  char* texts[edits + 1];
+  size_t lengths[edits + 1];
+  long ends[edits + 1];                 // Journal bytes after each edit
+  lengths[0] = 3000;
+  texts[0] = NewText(lengths[0]);
+
+  StartSaveWriter();
+  Note* note = SaveTestNote((Note){.catalogSlot = -1},"j",0,texts[0],lengths[0]);
+  DrainSaveQueue(NULL,NULL,WAIT_FOREVER);
+
+  ends[0] = 0;
+  for(size_t i = 1; i <= edits; ++i) {
+    texts[i] = EditText(texts[i - 1],lengths[i - 1],&lengths[i]);
+    JournalNoteEdit(note,texts[i - 1],lengths[i - 1],texts[i],lengths[i]);
+    ends[i] = note->journalLength;
+  }
+  DrainSaveQueue(NULL,NULL,WAIT_FOREVER);
+  CHECK(note->journalRecords == edits);
+  CheckNoteBody("journaled",note->filename,texts[edits],lengths[edits]);
+
+  char path[MAX_PATH + 1];
+  NotePath(path,sizeof(path),note->filename,JOURNAL_EXTENSION);
+  unsigned long long journalSize = 0, largest = 0, mtime;
+  size_t size = 0;
+  char* journal = ReadTestFile(path,&size);
+  CHECK(journal && size == (size_t)ends[edits]);
+  if(!journal) return;
+
+  // A crash while the last record was written leaves part of it
+  WriteTestFile(path,journal,ends[edits] - 1);
+  CheckNoteBody("torn record",note->filename,texts[edits - 1],lengths[edits - 1]);
+  WriteTestFile(path,journal,ends[edits - 1] + 7);
+  CheckNoteBody("torn record header",note->filename,texts[edits - 1],lengths[edits - 1]);
+
+  // A bad byte in the third record drops it and every record after it
+  journal[ends[3] - 1] ^= 0x40;
+  WriteTestFile(path,journal,size);
+  CheckNoteBody("bad checksum",note->filename,texts[2],lengths[2]);
+  journal[ends[3] - 1] ^= 0x40;
+
+  // A journal of another body is ignored, like one left behind by a
+  // completed save
+  journal[12] ^= 1;
+  WriteTestFile(path,journal,size);
+  CheckNoteBody("other base checksum",note->filename,texts[0],lengths[0]);
+  journal[12] ^= 1;
+
+  char* saved = NewText(2000);
+  char* body = malloc(2001);
+  if(!body) exit(1);
+  memcpy(body,saved,2001);
+  SaveNote(note,body,2000);
+  DrainSaveQueue(NULL,NULL,WAIT_FOREVER);
+  CHECK(FileStamp(path,&journalSize,&mtime) == 0);
+  WriteTestFile(path,journal,size);
+  CheckNoteBody("journal of an older save",note->filename,saved,2000);
+  FileDelete(path);
+
+  // An edit larger than the journal may grow saves the note whole
+  size_t grownLength = 2000 + JOURNAL_FOLD_MIN_BYTES + 1;
+  char* grown = malloc(grownLength + 1);
+  char* filler = NewText(JOURNAL_FOLD_MIN_BYTES + 1);
+  if(!grown) exit(1);
+  memcpy(grown,saved,2000);
+  memcpy(grown + 2000,filler,JOURNAL_FOLD_MIN_BYTES + 2);
+  JournalNoteEdit(note,saved,2000,grown,grownLength);
+  DrainSaveQueue(NULL,NULL,WAIT_FOREVER);
+  CHECK(note->journalLength == 0 && FileStamp(path,&journalSize,&mtime) == 0);
+  CheckNoteBody("large edit",note->filename,grown,grownLength);
+
+  // So does the edit after JOURNAL_FOLD_RECORDS of them, then the journal
+  // starts over
+  char* text = grown;
+  size_t length = grownLength;
+  int folded = 0, most = 0;
+  for(int i = 0; i < JOURNAL_FOLD_RECORDS + 10; ++i) {
+    size_t editedLength;
+    char* edited = EditText(text,length,&editedLength);
+    int records = note->journalRecords;
+    JournalNoteEdit(note,text,length,edited,editedLength);
+    if(note->journalRecords < records) folded++;
+    if(note->journalRecords > most) most = note->journalRecords;
+    free(text);
+    text = edited;
+    length = editedLength;
+  }
+  DrainSaveQueue(NULL,NULL,WAIT_FOREVER);
+  CHECK(folded == 1 && most == JOURNAL_FOLD_RECORDS && note->journalRecords == 9);
+  CheckNoteBody("folded journal",note->filename,text,length);
+
+  // The writer journals whole texts against the one it wrote last
+  Note* written = SaveTestNote((Note){.catalogSlot = -1},"j",1,text,length);
+  DrainSaveQueue(NULL,NULL,WAIT_FOREVER);
+  NotePath(path,sizeof(path),written->filename,JOURNAL_EXTENSION);
+  for(int i = 0; i < JOURNAL_FOLD_RECORDS + 10; ++i) {
+    size_t editedLength;
+    char* edited = EditText(text,length,&editedLength);
+    char* handed = malloc(editedLength + 1);
+    if(!handed) exit(1);
+    memcpy(handed,edited,editedLength + 1);
+    JournalNoteText(written,handed,editedLength);
+    DrainSaveQueue(NULL,NULL,WAIT_FOREVER);
+    if(FileStamp(path,&journalSize,&mtime) && journalSize > largest) largest = journalSize;
+    free(text);
+    text = edited;
+    length = editedLength;
+  }
+  CheckNoteBody("writer journal",written->filename,text,length);
+  long readLength = 0;
+  char* read = ReadNoteText(written,&readLength);
+  CHECK(read && written->journalRecords == 9 && written->journalLength == (long)journalSize);
+  CHECK(largest > journalSize);
+  free(read);
+
+  for(size_t i = 0; i <= edits; ++i) free(texts[i]);
+  free(journal);
+  free(saved);
+  free(filler);
+  free(text);
+  ResetNoteStore();
+  ClearScratchDir(0);
+}
+
+// Loads the notes of TestPack and checks that exactly those whose text is
+// not NULL are there and read back as texts
+static void CheckPackNotes(const char* stage, char** texts, const size_t* lengths, size_t count) {
+  ResetNoteStore();
+  size_t loaded = LoadAllNotes(), live = 0;
+
+  for(size_t i = 0; i < count; ++i) {
+    char filename[FILENAME_SIZE + 1];
+    TestNoteName(filename,"k",i);
+    Note* note = FindByFilename(filename);
+    if(!texts[i]) {
+      if(note) Fail(__FILE__,__LINE__,"%s: deleted %s came back",stage,filename);
+      continue;
+    }
+
+    live++;
+    if(!note) Fail(__FILE__,__LINE__,"%s: %s was not loaded",stage,filename);
+    else CheckNoteBody(stage,filename,texts[i],lengths[i]);
+  }
+  if(loaded != live) Fail(__FILE__,__LINE__,"%s: loaded %zu of %zu notes",stage,loaded,live);
+}
+
+// Saves a copy of text as the body of note
+static void SaveCopy(Note* note, const char* text, size_t length) {
+  char* body = malloc(length + 1);
+  if(!body) exit(1);
+  memcpy(body,text,length);
+  body[length] = '\0';
+  SaveNote(note,body,(long)length);
+}
+
+// Saves note i of TestPack with a new text of length bytes
+static void SavePackNote(char** texts, size_t* lengths, size_t i, size_t length) {
+  free(texts[i]);
+  texts[i] = NewText(length);
+  lengths[i] = length;
+
+  char filename[FILENAME_SIZE + 1];
+  TestNoteName(filename,"k",i);
+  SaveCopy(FindByFilename(filename),texts[i],length);
+}
+
+// Deletes notes from the pack with tombstones, rewrites notes until the
+// pack is compacted, and cuts the trailer and a record off the end the
+// way a crash would. Every live note has to read back intact each time.
+static void TestPack() {
+  ClearScratchDir(0);
+  ResetNoteStore();
+  COMPRESSNOTES = 0;
+  if(!CreatePack()) {
+    Fail(__FILE__,__LINE__,"could not create a pack");
+    return;
+  }
+
+  enum { count = 30, recordSize = 32 + sizeof(NoteHeader) };  // PackRecord and NoteHeader before each body
+  char* texts[count];
+  size_t lengths[count];
+  Note* deleted[10];
+  for(size_t i = 0; i < count; ++i) {
+    lengths[i] = 1000 + NextRandom() % 2000;
+    texts[i] = NewText(lengths[i]);
+    Note* note = SaveTestNote((Note){.catalogSlot = -1},"k",i,texts[i],lengths[i]);
+    if(i < 10) deleted[i] = note;
+  }
+  DeleteNotesFromDisk(NOTESPATH,deleted,10);
+  for(size_t i = 0; i < 10; ++i) {
+    Remove(deleted[i]->id);
+    free(texts[i]);
+    texts[i] = NULL;
+  }
+  CheckPackNotes("tombstones",texts,lengths,count);
+
+  // Rewriting a few notes with large texts piles up dead records until
+  // they pass PACK_COMPACT_MIN_BYTES and the live bytes, which compacts the
+  // pack on exactly that save. Past the 8 byte pack header, every byte
+  // not in a live record is dead.
+  char path[MAX_PATH + 1];
+  snprintf(path,sizeof(path),"%s" PATH_SEPARATOR "notes.hpack",NOTESPATH);
+  unsigned long long end = 0, size = 0, mtime, live = 0;
+  FileStamp(path,&end,&mtime);
+  for(size_t i = 0; i < count; ++i) if(texts[i]) live += recordSize + lengths[i];
+
+  int compactions = 0, mispredicted = 0;
+  for(size_t round = 0; round < 80; ++round) {
+    size_t i = 10 + round % 4, before = lengths[i];
+    SavePackNote(texts,lengths,i,40000 + NextRandom() % 20000);
+    live += lengths[i] - before;
+    end += recordSize + lengths[i];
+
+    unsigned long long dead = end - 8 - live;
+    int compact = dead > PACK_COMPACT_MIN_BYTES && dead > live;
+    FileStamp(path,&size,&mtime);
+    if(compact ? size >= end : size != end) mispredicted++;
+    compactions += compact;
+    end = size;
+  }
+  CHECK(!mispredicted && compactions >= 2);
+  for(size_t i = 10; i < count; ++i) {
+    char filename[FILENAME_SIZE + 1];
+    TestNoteName(filename,"k",i);
+    CheckNoteBody("compacted",filename,texts[i],lengths[i]);
+  }
+
+  // Loaded from the trailer of a clean close, then by a scan once the
+  // trailer is cut short
+  ClosePack();
+  CheckPackNotes("trailer",texts,lengths,count);
+  FileHandle file = FileOpen(path,FILE_READWRITE);
+  CHECK(file && FileStamp(path,&size,&mtime) && FileTruncate(file,size - 5));
+  FileClose(file);
+  CheckPackNotes("torn trailer",texts,lengths,count);
+
+  // A save cut short leaves the version before it, and the next save
+  // writes over the torn bytes
+  char* kept = texts[20];
+  size_t keptLength = lengths[20];
+  texts[20] = NULL;
+  SavePackNote(texts,lengths,20,5000);
+  free(texts[20]);
+  texts[20] = kept;
+  lengths[20] = keptLength;
+  file = FileOpen(path,FILE_READWRITE);
+  CHECK(file && FileStamp(path,&size,&mtime) && FileTruncate(file,size - 10));
+  FileClose(file);
+  CheckPackNotes("torn record",texts,lengths,count);
+  SavePackNote(texts,lengths,20,6000);
+  CheckPackNotes("after a torn record",texts,lengths,count);
+
+  for(size_t i = 0; i < count; ++i) free(texts[i]);
+  ClosePack();
+  ResetNoteStore();
+  ClearScratchDir(0);
+}
+
+// Fails unless filename has count versions numbered from 1 that restore
+// texts byte for byte. A version whose text is NULL must not be read.
+static void CheckVersions(const char* stage, const char* filename, char** texts, const size_t* lengths, size_t count) {
+  NoteVersion* versions;
+  size_t listed = ListNoteVersions(filename,&versions);
+  if(listed != count) Fail(__FILE__,__LINE__,"%s: %s has %zu versions, %zu expected",stage,filename,listed,count);
+
+  for(size_t i = 0; i < count && i < listed; ++i) {
+    long length = -1;
+    char* text = ReadNoteVersion(filename,(unsigned int)i + 1,&length);
+    if(!texts[i]) {
+      if(text) Fail(__FILE__,__LINE__,"%s: version %zu of %s was misread",stage,i + 1,filename);
+    }
+    else if(versions[i].number != i + 1 || versions[i].length != lengths[i] || !text || (size_t)length != lengths[i] || memcmp(text,texts[i],lengths[i]) != 0)
+      Fail(__FILE__,__LINE__,"%s: version %zu of %s did not come back",stage,i + 1,filename);
+    free(text);
+  }
+  free(versions);
+}
+
+// Restores every version of two notes that share chunks, collects the
+// garbage of one of them after it is deleted, and cuts a version file and
+// the chunk store short the way a crash would
+static void TestHistory() {
+  ClearScratchDir(0);
+  ResetNoteStore();
+  COMPRESSNOTES = 0;
+  KEEPHISTORY = 1;
+
+  // Versions of the second note start from the third of the first
+  enum { count = 6, shared = 2 };
+  char* texts[count];
+  size_t lengths[count];
+  char* others[count + 2];
+  size_t otherLengths[count + 2];
+  lengths[0] = 100000;
+  texts[0] = NewText(lengths[0]);
+  for(size_t i = 1; i < count; ++i) texts[i] = EditText(texts[i - 1],lengths[i - 1],&lengths[i]);
+  otherLengths[0] = lengths[shared];
+  others[0] = malloc(otherLengths[0] + 1);
+  if(!others[0]) exit(1);
+  memcpy(others[0],texts[shared],otherLengths[0] + 1);
+  for(size_t i = 1; i < count; ++i) others[i] = EditText(others[i - 1],otherLengths[i - 1],&otherLengths[i]);
+
+  Note* note = SaveTestNote((Note){.catalogSlot = -1},"h",0,texts[0],lengths[0]);
+  Note* other = SaveTestNote((Note){.catalogSlot = -1},"h",1,others[0],otherLengths[0]);
+  for(size_t i = 1; i < count; ++i) {
+    SaveCopy(note,texts[i],lengths[i]);
+    SaveCopy(other,others[i],otherLengths[i]);
+  }
+  SaveCopy(note,texts[count - 1],lengths[count - 1]);  // Same as the newest, no version
+  CheckVersions("saved",note->filename,texts,lengths,count);
+  CheckVersions("saved",other->filename,others,otherLengths,count);
+
+  // The chunks only the deleted note had go, the shared ones stay
+  char store[MAX_PATH + 1];
+  snprintf(store,sizeof(store),"%s" PATH_SEPARATOR "history" PATH_SEPARATOR "chunks.hchk",NOTESPATH);
+  unsigned long long before = 0, after = 0, mtime, freed = 0;
+  FileStamp(store,&before,&mtime);
+  char filename[FILENAME_SIZE + 1];
+  memcpy(filename,other->filename,sizeof(filename));
+  NoteId id = note->id;
+  DeleteNoteFromDisk(NOTESPATH,note);
+  Remove(id);
+  CHECK(CollectHistoryGarbage(&freed) && freed > 0);
+  CHECK(FileStamp(store,&after,&mtime) && after == before - freed);
+  CheckVersions("collected",filename,others,otherLengths,count);
+  ResetNoteStore();
+  CheckVersions("collected and reopened",filename,others,otherLengths,count);
+
+  // A torn version is cut off, the next one is written over it
+  char path[MAX_PATH + 1];
+  snprintf(path,sizeof(path),"%s" PATH_SEPARATOR "history" PATH_SEPARATOR "%s.hver",NOTESPATH,filename);
+  FileHandle file = FileOpen(path,FILE_READWRITE);
+  CHECK(file && FileStamp(path,&after,&mtime) && FileTruncate(file,after - 5));
+  FileClose(file);
+  CheckVersions("torn version",filename,others,otherLengths,count - 1);
+  long length = -1;
+  CHECK(ReadNoteVersion(filename,count,&length) == NULL);
+
+  LoadAllNotes();
+  other = FindByFilename(filename);
+  SaveCopy(other,others[count - 1],otherLengths[count - 1]);
+  CheckVersions("after a torn version",filename,others,otherLengths,count);
+
+  // A write torn by a crash can leave zeros at the end of the last chunk.
+  // The version using it is not read at all, the ones before it still
+  // are, and the chunk is cut off before the next one is stored.
+  otherLengths[count] = otherLengths[count + 1] = 50000;
+  others[count] = NewText(otherLengths[count]);
+  SaveCopy(other,others[count],otherLengths[count]);
+  ResetNoteStore();
+  static const char zeros[7] = {0};
+  file = FileOpen(store,FILE_READWRITE);
+  CHECK(file && FileStamp(store,&after,&mtime) && FileWriteAt(file,after - sizeof(zeros),zeros,sizeof(zeros)));
+  FileClose(file);
+  char* torn = others[count];
+  others[count] = NULL;
+  CheckVersions("torn chunk",filename,others,otherLengths,count + 1);
+
+  LoadAllNotes();
+  others[count + 1] = NewText(otherLengths[count + 1]);
+  SaveCopy(FindByFilename(filename),others[count + 1],otherLengths[count + 1]);
+  ResetNoteStore();
+  CheckVersions("after a torn chunk",filename,others,otherLengths,count + 2);
+
+  free(torn);
+  free(others[count + 1]);
+  for(size_t i = 0; i < count; ++i) {
+    free(texts[i]);
+    free(others[i]);
+  }
+  KEEPHISTORY = 0;
+  ResetNoteStore();
+  ClearScratchDir(0);
+}
+
+// Fails unless the body cache counted hits, misses and stale entries so
+// far and holds no more than its budget
+static void CheckCacheStats(const char* stage, unsigned long hits, unsigned long misses, unsigned long stale) {
+  BodyCacheStats stats;
+  GetBodyCacheStats(&stats);
+  if(stats.hits != hits || stats.misses != misses || stats.stale != stale)
+    Fail(__FILE__,__LINE__,"%s: %lu hits, %lu misses, %lu stale, expected %lu, %lu, %lu",stage,stats.hits,stats.misses,stats.stale,hits,misses,stale);
+  if(stats.bytes > BODYCACHEBYTES) Fail(__FILE__,__LINE__,"%s: %zu bytes cached, the budget is %zu",stage,stats.bytes,BODYCACHEBYTES);
+}
+
+// Fails unless ReadNoteText gives text for note
+static void CheckNoteText(const char* stage, Note* note, const char* text, size_t length) {
+  long read = -1;
+  char* body = ReadNoteText(note,&read);
+  if(!body || (size_t)read != length || memcmp(body,text,length) != 0)
+    Fail(__FILE__,__LINE__,"%s: %s read as %ld bytes, %zu expected",stage,note->filename,body ? read : -1L,length);
+  free(body);
+}
+
+// Reads notes through the body cache while they are saved, changed by
+// another program and deleted, and evicts them at the byte budget
+static void TestBodyCache() {
+  ClearScratchDir(0);
+  ResetNoteStore();
+  COMPRESSNOTES = 0;
+
+  // Five of the small bodies fit the budget, the last note is larger than
+  // the quarter of it one note may take
+  enum { count = 9 };
+  char* texts[count];
+  size_t lengths[count];
+  for(size_t i = 0; i < count; ++i) {
+    lengths[i] = i == count - 1 ? 20000 : 6000 + 10 * i;
+    texts[i] = NewText(lengths[i]);
+    SaveTestNote((Note){.catalogSlot = -1},"c",i,texts[i],lengths[i]);
+  }
+  ResetNoteStore();
+  LoadAllNotes();
+  BODYCACHEBYTES = 32 * 1024;
+
+  Note* notes[count];
+  for(size_t i = 0; i < count; ++i) {
+    char filename[FILENAME_SIZE + 1];
+    TestNoteName(filename,"c",i);
+    notes[i] = FindByFilename(filename);
+    if(!notes[i]) {
+      Fail(__FILE__,__LINE__,"%s was not loaded",filename);
+      return;
+    }
+  }
+
+  CheckNoteText("first read",notes[0],texts[0],lengths[0]);
+  CheckCacheStats("first read",0,1,0);
+  CheckNoteText("second read",notes[0],texts[0],lengths[0]);
+  CheckCacheStats("second read",1,1,0);
+
+  // A save keeps the saved text, which is current once the writer stored it
+  free(texts[0]);
+  lengths[0] = 6100;
+  texts[0] = NewText(lengths[0]);
+  SaveCopy(notes[0],texts[0],lengths[0]);
+  CheckNoteText("saved",notes[0],texts[0],lengths[0]);
+  CheckCacheStats("saved",2,1,0);
+
+  // Another program writes the file, the stamp of the file gives it away
+  char from[MAX_PATH + 1], to[MAX_PATH + 1];
+  NotePath(from,sizeof(from),notes[1]->filename,"");
+  NotePath(to,sizeof(to),notes[0]->filename,"");
+  size_t size = 0;
+  char* file = ReadTestFile(from,&size);
+  CHECK(file && WriteTestFile(to,file,size));
+  free(file);
+  CheckNoteText("changed on disk",notes[0],texts[1],lengths[1]);
+  CheckCacheStats("changed on disk",2,2,1);
+  CheckNoteText("read again",notes[0],texts[1],lengths[1]);
+  CheckCacheStats("read again",3,2,1);
+
+  BodyCacheStats stats;
+  CheckNoteText("before delete",notes[2],texts[2],lengths[2]);
+  GetBodyCacheStats(&stats);
+  size_t entries = stats.entries;
+  NoteId id = notes[2]->id;
+  DeleteNoteFromDisk(NOTESPATH,notes[2]);
+  Remove(id);
+  GetBodyCacheStats(&stats);
+  CHECK(stats.entries == entries - 1 && stats.entries == 1);
+
+  // Six bodies for room of five: the least recently read ones go
+  for(size_t i = 1; i < count - 1; ++i) if(i != 2) CheckNoteText("filled",notes[i],texts[i],lengths[i]);
+  CheckCacheStats("filled",3,9,1);
+  GetBodyCacheStats(&stats);
+  CHECK(stats.entries == 5 && stats.evictions == 2);
+  CheckNoteText("newest kept",notes[count - 2],texts[count - 2],lengths[count - 2]);
+  CheckNoteText("oldest evicted",notes[0],texts[1],lengths[1]);
+  CheckCacheStats("evicted",4,10,1);
+
+  CheckNoteText("too large",notes[count - 1],texts[count - 1],lengths[count - 1]);
+  CheckNoteText("too large",notes[count - 1],texts[count - 1],lengths[count - 1]);
+  CheckCacheStats("too large",4,12,1);
+  GetBodyCacheStats(&stats);
+  CHECK(stats.entries == 5);
+
+  for(size_t i = 0; i < count; ++i) free(texts[i]);
+  BODYCACHEBYTES = BODY_CACHE_BYTES;
+  ResetNoteStore();
+  ClearScratchDir(0);
+}
+
+// Every query must find exactly the notes whose text contains it once its
+// results are checked, texts[i] NULL for a removed note. Unless checked,
+// the index was given texts the files do not have and a query longer than
+// a trigram only has to find every note containing it.
+static void CheckQueries(const char* stage, char** texts, size_t count, int checked) {
+  static const char* queries[] = {
+    "n","X","e ","\n","\xC3\xA9","not","NOTE","note list","save load","load\nline","caf\xC3\xA9 \xE2\x82\xAC",
+    "xx","list save x","e\nl","aaaa","zzz"
+  };
+  unsigned char* expected = malloc(count);
+  if(!expected) exit(1);
+
+  for(size_t q = 0; q < sizeof(queries) / sizeof(queries[0]); ++q) {
+    for(size_t i = 0; i < count; ++i) expected[i] = texts[i] && ContainsIgnoreCase(texts[i],queries[q]);
+
+    NoteId* ids;
+    size_t found = checked ? QueryAndCheck(queries[q],&ids) : QuerySearchIndex(queries[q],&ids), wrong = 0;
+    int exact = checked || strlen(queries[q]) <= 3;
+    for(size_t k = 0; k < found; ++k) {
+      Note* note = Find(ids[k]);
+      size_t i = note ? strtoul(note->filename + 1,NULL,10) : count;
+      if(i < count && expected[i] == 1) expected[i] = 2;
+      else if(exact || i >= count || expected[i]) wrong++;
+    }
+    free(ids);
+    for(size_t i = 0; i < count; ++i) wrong += expected[i] == 1;
+    if(wrong) Fail(__FILE__,__LINE__,"%s: query \"%s\" is wrong for %zu notes",stage,queries[q],wrong);
+  }
+  free(expected);
+}
+
+// Search results against a plain scan of the texts: built from the notes,
+// built again from search.hidx, after edits in CRLF and removals, then
+// after saves the writer indexes racing newer edits and removals
+static void TestSearch() {
+  ClearScratchDir(0);
+  ResetNoteStore();
+  COMPRESSNOTES = 1;
+
+  enum { count = 300 };
+  char* texts[count];
+  StartSaveWriter();
+  for(size_t i = 0; i < count; ++i) {
+    // A few too short for a trigram, a few long enough for the bitmap
+    size_t length = i % 7 == 0 ? i % 3 : i % 50 == 3 ? 100000 : NextRandom() % 2000;
+    texts[i] = NewText(length);
+
+    SaveTestNote((Note){.catalogSlot = -1},"s",i,texts[i],length);
+  }
+  DrainSaveQueue(NULL,NULL,WAIT_FOREVER);
+
+  char path[MAX_PATH + 1];
+  snprintf(path,sizeof(path),"%s" PATH_SEPARATOR "search.hidx",NOTESPATH);
+  for(int pass = 0; pass < 2; ++pass) {
+    ResetNoteStore();
+    LoadAllNotes();
+    StartSaveWriter();
+    SyncCatalog();
+    DrainSaveQueue(NULL,NULL,WAIT_FOREVER);
+
+    IndexAllNotes();
+    CheckQueries(pass ? "stored index" : "built index",texts,count,1);
+    SaveSearchIndex();
+
+    unsigned long long size = 0, mtime;
+    CHECK(FileStamp(path,&size,&mtime) && size > 0);
+  }
+
+  for(size_t i = 0; i < count; i += 5) {
+    char filename[FILENAME_SIZE + 1];
+    TestNoteName(filename,"s",i);
+    Note* note = FindByFilename(filename);
+    if(!note) continue;
+
+    free(texts[i]);
+    texts[i] = NULL;
+    if(i % 10) RemoveNoteFromIndex(note->id);
+    else {
+      size_t length = NextRandom() % 1500;
+      texts[i] = NewText(length);
+      char* crlf = malloc(length + CountLoneLf(texts[i],length) + 1);
+      if(!crlf) exit(1);
+      IndexNoteText(note->id,crlf,LfToCrlf(crlf,texts[i],length));
+      free(crlf);
+    }
+  }
+  CheckQueries("edited index",texts,count,0);
+
+  StartSaveWriter();
+  for(size_t i = 1; i < count; i += 5) {
+    char filename[FILENAME_SIZE + 1];
+    TestNoteName(filename,"s",i);
+    Note* note = FindByFilename(filename);
+    if(!note) continue;
+
+    size_t length = NextRandom() % 1500;
+    char* body = malloc(length + 1);
+    if(!body) exit(1);
+    free(texts[i]);
+    texts[i] = NewText(length);
+    memcpy(body,texts[i],length + 1);
+    SaveNote(note,body,(long)length);
+
+    // Whatever the writer gets to first, the later text wins
+    if(i % 3 == 0) {
+      RemoveNoteFromIndex(note->id);
+      free(texts[i]);
+      texts[i] = NULL;
+    }
+    else if(i % 3 == 1) {
+      free(texts[i]);
+      texts[i] = NewText(NextRandom() % 1500);
+      IndexNoteText(note->id,texts[i],strlen(texts[i]));
+    }
+  }
+  DrainSaveQueue(NULL,NULL,WAIT_FOREVER);
+  CheckQueries("saved index",texts,count,0);
+
+  for(size_t i = 0; i < count; ++i) free(texts[i]);
+  ResetNoteStore();
+  ClearScratchDir(0);
+}
+
+// Loads the notes of TestConversions and checks bodies and windows. The
+// stacking is only checked while the geometry table is there.
+static void CheckConverted(const char* stage, char** texts, size_t count, int stacked) {
+  ResetNoteStore();
+  size_t loaded = LoadAllNotes();
+  if(loaded != count) Fail(__FILE__,__LINE__,"%s: loaded %zu of %zu notes",stage,loaded,count);
+
+  unsigned int zOrder = 0;
+  for(size_t i = 0; i < count; ++i) {
+    char filename[FILENAME_SIZE + 1];
+    TestNoteName(filename,"p",i);
+    Note* note = FindByFilename(filename);
+    long length = -1;
+    char* body = note ? ReadNoteBody(filename,&length) : NULL;
+    if(!note || !body || (size_t)length != strlen(texts[i]) || memcmp(body,texts[i],length) != 0)
+      Fail(__FILE__,__LINE__,"%s: %s did not come back",stage,filename);
+    else if(note->x != 1000 + (int)i || note->opened != (int)(i % 2) || (stacked && note->zOrder <= zOrder))
+      Fail(__FILE__,__LINE__,"%s: %s lost its window",stage,filename);
+    if(note) zOrder = note->zOrder;
+    free(body);
+  }
+}
+
+// Moves notes whose windows were moved after their last save into a pack,
+// back into loose files and through an archive. A file that is no note
+// must survive the pack import, only what went into the pack is deleted.
+static void CountExported(size_t exported, size_t count, void* context) {
+  size_t* result = context;
+  result[0] = exported;
+  result[1] = count;
+}
+
+static void TestConversions() {
+  ClearScratchDir(0);
+  ResetNoteStore();
+  COMPRESSNOTES = 1;
+
+  enum { count = 40 };
+  char* texts[count];
+  Note* notes[count];
+  StartSaveWriter();
+  for(size_t i = 0; i < count; ++i) {
+    size_t length = i % 10 == 1 ? 100000 : NextRandom() % 3000;
+    texts[i] = NewText(length);
+
+    notes[i] = SaveTestNote((Note){.x = (int)i, .y = 3, .width = 300, .height = 200, .catalogSlot = -1},"p",i,texts[i],length);
+  }
+  DrainSaveQueue(NULL,NULL,WAIT_FOREVER);
+
+  // Only the geometry table knows these windows, the headers do not
+  for(size_t i = 0; i < count; ++i) {
+    notes[i]->x = 1000 + (int)i;
+    notes[i]->opened = (int)(i % 2);
+    RaiseNote(notes[i]);
+    SaveNoteGeometry(notes[i]);
+  }
+  DrainSaveQueue(NULL,NULL,WAIT_FOREVER);
+
+  // An export is reported once the writer is through with it, a note
+  // without a stored text counts as not written
+  char path[MAX_PATH + 1];
+  size_t written[2] = {0};
+  Note* gone = Insert((Note){.catalogSlot = -1});
+  TestNoteName(gone->filename,"p",count);
+  Note* selected[3] = {notes[0],gone,notes[1]};
+  snprintf(path,sizeof(path),"%s" PATH_SEPARATOR "export",NOTESPATH);
+  StartSaveWriter();
+  ExportNotes(path,selected,3,CountExported,written);
+  DrainSaveQueue(NULL,NULL,WAIT_FOREVER);
+  CHECK(written[0] == 2 && written[1] == 3);
+  ResetNoteStore();
+
+  NotePath(path,sizeof(path),"junk" NOTE_EXTENSION,"");
+  FILE* junk = fopen(path,"wb");
+  if(junk) {
+    fputs("not a note",junk);
+    fclose(junk);
+  }
+
+  char archivePath[MAX_PATH + 1];
+  snprintf(archivePath,sizeof(archivePath),"%s.harc",NOTESPATH);
+  unsigned long exported = 0, imported = 0, skipped = 0;
+  CHECK(ExportArchive(archivePath,&exported) && exported == count);
+
+  CHECK(ImportNotesToPack());
+  CHECK(CountNoteFiles() == 1);
+  CheckConverted("pack import",texts,count,1);
+
+  // Without the table the windows come from the headers written back
+  ResetNoteStore();
+  CHECK(ExportPackToNotes());
+  CHECK(CountNoteFiles() == count + 1);
+  snprintf(path,sizeof(path),"%s" PATH_SEPARATOR "geometry.hgeo",NOTESPATH);
+  FileDelete(path);
+  CheckConverted("pack export",texts,count,0);
+
+  ClearScratchDir(0);
+  ResetNoteStore();
+  CHECK(ImportArchive(archivePath,&imported,&skipped) && imported == count && !skipped);
+  CheckConverted("archive",texts,count,1);
+  FileDelete(archivePath);
+
+  for(size_t i = 0; i < count; ++i) free(texts[i]);
+  ResetNoteStore();
+  ClearScratchDir(0);
+}
+
+int main(int argc, char** argv) {
+  const char* dir = TEST_DEFAULT_DIR;
+  for(int i = 1; i < argc; ++i)
+    if(strcmp(argv[i],"-d") == 0 && i + 1 < argc) dir = argv[++i];
+
+  snprintf(NOTESPATH,sizeof(NOTESPATH),"%s",dir);
+  if(!DirCreate(NOTESPATH) || !PrepareNoteShards()) {
+    fprintf(stderr,"could not create %s\n",NOTESPATH);
+    return 1;
+  }
+
+  InitNoteStore();
+  KEEPHISTORY = 0;
+  InitHarness();
+
+  TestRegistry();
+  TestOrder();
+  TestLineEndings();
+  TestUnicode();
+  TestStore("plain",0,0);
+  TestStore("files",0,1);
+  TestMigration();
+  TestJournal();
+  TestBodyCache();
+  TestConversions();
+  TestSearch();
+  TestStore("pack",1,1);
+  TestPack();
+  TestHistory();
+
+  ResetNoteStore();
+  ClearScratchDir(1);
+  remove(NOTESPATH);
+
+  if(failures) fprintf(stderr,"%d checks failed\n",failures);
+  else printf("all tests passed\n");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,410 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+#ifndef HOSE_NO_TRACE
+
+// Durations of one kind of event in ticks, the count is the sum of all
+// buckets. Only the thread of the ring adds to it, with plain stores the
+// stats dump may read at any time.
+typedef struct TraceHistogram {
+  unsigned long long sum, max;
+  unsigned long long buckets[TRACE_HISTOGRAM_BUCKETS];
+} TraceHistogram;
+
+typedef struct TraceRing {
+  TraceEvent events[TRACE_RING_SIZE];
+  unsigned long long head;         // Events ever written, only its thread moves it
+  unsigned long long folded;       // Events already added to the histograms
+  unsigned int thread;
+  int owned;                       // A running thread writes into it
+  TraceHistogram histograms[TRACE_EVENT_COUNT];
+} TraceRing;
+
+static const char* TRACE_NAMES[TRACE_EVENT_COUNT] = {
+  "load catalog","load batch","parse note","merge batch","save job",
+  "read body","preview update","search query","create window","open note",
+  "find notes","load notes","save note"
+};
+
+static const char* TRACE_COUNTER_NAMES[TRACE_COUNTER_COUNT] = {
+  "bytes read","bytes written","bytes mapped","files opened","notes loaded","list messages",
+  "preview changes","previews coalesced","previews unchanged","previews refreshed",
+  "notes renamed"
+};
+
+static unsigned long long traceCounters[TRACE_COUNTER_COUNT];
+
+static TraceRing* traceRings[TRACE_MAX_THREADS];
+static unsigned int traceRingCount;
+
+// Ticks and nanoseconds at the first event, the dump scales ticks to time
+// against a second pair taken when it runs
+static unsigned long long traceOriginTicks, traceOriginNs;
+
+static _Thread_local TraceRing* traceRing;
+static _Thread_local int traceNoRing;
+
+// Takes over the ring of a thread that has ended, or adds a new one
+static TraceRing* AdoptTraceRing() {
+  unsigned int count = __atomic_load_n(&traceRingCount,__ATOMIC_ACQUIRE);
+  if(count > TRACE_MAX_THREADS) count = TRACE_MAX_THREADS;
+
+  for(unsigned int i = 0; i < count; ++i) {
+    TraceRing* ring = __atomic_load_n(&traceRings[i],__ATOMIC_ACQUIRE);
+    if(ring && !__atomic_exchange_n(&ring->owned,1,__ATOMIC_ACQUIRE)) return ring;
+  }
+
+  unsigned int slot = __atomic_fetch_add(&traceRingCount,1,__ATOMIC_ACQ_REL);
+  if(slot >= TRACE_MAX_THREADS) return NULL;
+
+  TraceRing* ring = calloc(1,sizeof(TraceRing));
+  if(!ring) return NULL;
+
+  if(slot == 0) {
+    traceOriginTicks = TraceTicks();
+    traceOriginNs = ClockNanoseconds();
+  }
+
+  ring->thread = slot + 1;
+  ring->owned = 1;
+  __atomic_store_n(&traceRings[slot],ring,__ATOMIC_RELEASE);
+  return ring;
+}
+
+static unsigned int HistogramBucket(unsigned long long value) {
+  if(value < (1u << TRACE_HISTOGRAM_SUB_BITS)) return (unsigned int)value;
+
+  unsigned int exponent = 63 - __builtin_clzll(value);
+  unsigned int shift = exponent - TRACE_HISTOGRAM_SUB_BITS;
+  return ((shift + 1) << TRACE_HISTOGRAM_SUB_BITS) | (unsigned int)((value >> shift) & ((1u << TRACE_HISTOGRAM_SUB_BITS) - 1));
+}
+
+// Largest value that falls into a bucket
+static unsigned long long HistogramBucketTop(unsigned int bucket) {
+  if(bucket < (1u << TRACE_HISTOGRAM_SUB_BITS)) return bucket;
+
+  unsigned int shift = (bucket >> TRACE_HISTOGRAM_SUB_BITS) - 1;
+  unsigned long long low = (unsigned long long)((1u << TRACE_HISTOGRAM_SUB_BITS) | (bucket & ((1u << TRACE_HISTOGRAM_SUB_BITS) - 1))) << shift;
+  return low + ((1ull << shift) - 1);
+}
+
+// Adds a duration, only from the thread that owns the histogram
+static void HistogramAdd(TraceHistogram* histogram, unsigned long long value) {
+  unsigned long long* bucket = &histogram->buckets[HistogramBucket(value)];
+  __atomic_store_n(bucket,__atomic_load_n(bucket,__ATOMIC_RELAXED) + 1,__ATOMIC_RELAXED);
+  __atomic_store_n(&histogram->sum,__atomic_load_n(&histogram->sum,__ATOMIC_RELAXED) + value,__ATOMIC_RELAXED);
+  if(value > __atomic_load_n(&histogram->max,__ATOMIC_RELAXED)) __atomic_store_n(&histogram->max,value,__ATOMIC_RELAXED);
+}
+
+// Adds the timed events of a ring from folded up to head to its histograms.
+// Instant events have a duration of 0, timed ones at least 1.
+static void FoldTraceRing(TraceRing* ring, unsigned long long head) {
+  for(unsigned long long at = ring->folded; at < head; ++at) {
+    const TraceEvent* e = &ring->events[at & (TRACE_RING_SIZE - 1)];
+    if(e->duration && e->event < TRACE_EVENT_COUNT) HistogramAdd(&ring->histograms[e->event],e->duration);
+  }
+  __atomic_store_n(&ring->folded,head,__ATOMIC_RELEASE);
+}
+
+void TraceCount(unsigned int counter, unsigned long long n) {
+  __atomic_fetch_add(&traceCounters[counter],n,__ATOMIC_RELAXED);
+}
+
+// Only the ring entry is written here. The histograms are fed from the
+// ring a block at a time, long before the block is overwritten.
+void TraceRecord(unsigned int event, unsigned long long start, unsigned int a, unsigned long long b) {
+  unsigned long long now = TraceTicks();
+
+  TraceRing* ring = traceRing;
+  if(!ring) {
+    if(traceNoRing || !(ring = traceRing = AdoptTraceRing())) {
+      traceNoRing = 1;
+      return;
+    }
+  }
+
+  unsigned long long head = ring->head;
+  TraceEvent* e = &ring->events[head & (TRACE_RING_SIZE - 1)];
+  e->start = start ? start : now;
+  e->duration = start ? (now > start ? now - start : 1) : 0;
+  e->event = event;
+  e->a = a;
+  e->b = b;
+  __atomic_store_n(&ring->head,head + 1,__ATOMIC_RELEASE);
+  if(!((head + 1) & (TRACE_FOLD_SIZE - 1))) FoldTraceRing(ring,head + 1);
+}
+
+void TraceThreadExit() {
+  if(traceRing) __atomic_store_n(&traceRing->owned,0,__ATOMIC_RELEASE);
+  traceRing = NULL;
+  traceNoRing = 0;
+}
+
+// Nanoseconds per tick, 1 when ticks are nanoseconds already
+static double NanosecondsPerTick() {
+  double scale = 1.0;
+#ifdef TRACE_TSC
+  unsigned long long ticks = TraceTicks() - traceOriginTicks;
+  unsigned long long ns = ClockNanoseconds() - traceOriginNs;
+  if(traceOriginTicks && ticks && ns) scale = (double)ns / ticks;
+#endif
+  return scale;
+}
+
+// Output of WriteTrace, which a crash handler runs too: text goes through
+// a buffer on the stack into positioned writes, never through stdio or
+// the heap
+typedef struct TraceWriter {
+  FileHandle file;
+  unsigned long long offset;
+  size_t used;
+  int failed;
+  char buffer[4096];
+} TraceWriter;
+
+static void FlushTraceWriter(TraceWriter* w) {
+  if(w->used && !w->failed && !FileWriteAt(w->file,w->offset,w->buffer,w->used)) w->failed = 1;
+  w->offset += w->used;
+  w->used = 0;
+}
+
+static void WriteText(TraceWriter* w, const char* text) {
+  for(; *text; ++text) {
+    if(w->used == sizeof(w->buffer)) FlushTraceWriter(w);
+    w->buffer[w->used++] = *text;
+  }
+}
+
+static void WriteNumber(TraceWriter* w, unsigned long long n) {
+  char digits[24];
+  char* at = digits + sizeof(digits);
+  *--at = '\0';
+  do *--at = (char)('0' + n % 10); while(n /= 10);
+  WriteText(w,at);
+}
+
+// Ticks as microseconds with three decimals, like %.3f
+static void WriteMicroseconds(TraceWriter* w, unsigned long long ticks, double scale) {
+  unsigned long long ns = (unsigned long long)(ticks * scale + 0.5);
+  char decimals[5] = {'.',(char)('0' + ns / 100 % 10),(char)('0' + ns / 10 % 10),(char)('0' + ns % 10),'\0'};
+  WriteNumber(w,ns / 1000);
+  WriteText(w,decimals);
+}
+
+// Writes every ring to file from offset 0. Returns the number of events
+// written, or -1 if a write failed.
+static long WriteTrace(FileHandle file) {
+  TraceWriter w;
+  w.file = file;
+  w.offset = 0;
+  w.used = 0;
+  w.failed = 0;
+
+  unsigned int count = __atomic_load_n(&traceRingCount,__ATOMIC_ACQUIRE);
+  if(count > TRACE_MAX_THREADS) count = TRACE_MAX_THREADS;
+
+  double scale = NanosecondsPerTick();
+
+  // Time 0 is the oldest event still in a ring
+  unsigned long long first = ~0ull;
+  for(unsigned int i = 0; i < count; ++i) {
+    TraceRing* ring = __atomic_load_n(&traceRings[i],__ATOMIC_ACQUIRE);
+    if(!ring) continue;
+
+    unsigned long long head = __atomic_load_n(&ring->head,__ATOMIC_ACQUIRE);
+    unsigned long long from = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+    for(unsigned long long at = from; at < head; ++at) {
+      unsigned long long start = ring->events[at & (TRACE_RING_SIZE - 1)].start;
+      if(start < first) first = start;
+    }
+  }
+
+  long written = 0;
+  WriteText(&w,"{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+
+  for(unsigned int i = 0; i < count; ++i) {
+    TraceRing* ring = __atomic_load_n(&traceRings[i],__ATOMIC_ACQUIRE);
+    if(!ring) continue;
+
+    WriteText(&w,written ? ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" : "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":");
+    WriteNumber(&w,ring->thread);
+    WriteText(&w,",\"args\":{\"name\":\"thread ");
+    WriteNumber(&w,ring->thread);
+    WriteText(&w,"\"}}");
+    written++;
+
+    unsigned long long head = __atomic_load_n(&ring->head,__ATOMIC_ACQUIRE);
+    unsigned long long from = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+    for(unsigned long long at = from; at < head; ++at) {
+      TraceEvent e = ring->events[at & (TRACE_RING_SIZE - 1)];
+      if(e.event >= TRACE_EVENT_COUNT || e.start < first) continue;
+
+      WriteText(&w,",\n{\"name\":\"");
+      WriteText(&w,TRACE_NAMES[e.event]);
+      WriteText(&w,e.duration ? "\",\"ph\":\"X\",\"ts\":" : "\",\"ph\":\"i\",\"s\":\"t\",\"ts\":");
+      WriteMicroseconds(&w,e.start - first,scale);
+      if(e.duration) {
+        WriteText(&w,",\"dur\":");
+        WriteMicroseconds(&w,e.duration,scale);
+      }
+      WriteText(&w,",\"pid\":1,\"tid\":");
+      WriteNumber(&w,ring->thread);
+      WriteText(&w,",\"args\":{\"a\":");
+      WriteNumber(&w,e.a);
+      WriteText(&w,",\"b\":");
+      WriteNumber(&w,e.b);
+      WriteText(&w,"}}");
+      written++;
+    }
+  }
+
+  WriteText(&w,"\n]}\n");
+  FlushTraceWriter(&w);
+  return w.failed ? -1 : written;
+}
+
+long TraceDump(const char* path) {
+  FileHandle file = FileOpen(path,FILE_CREATE);
+  if(!file) return -1;
+
+  long written = WriteTrace(file);
+  FileClose(file);
+  return written;
+}
+
+// Smallest bucket top that at least fraction of the count values are at
+// or below, taken from a copy of the buckets
+static unsigned long long HistogramPercentile(const unsigned long long* buckets, unsigned long long count, double fraction) {
+  unsigned long long rank = (unsigned long long)(fraction * count + 0.5);
+  if(rank < 1) rank = 1;
+
+  unsigned long long seen = 0;
+  for(unsigned int i = 0; i < TRACE_HISTOGRAM_BUCKETS; ++i) {
+    seen += buckets[i];
+    if(seen >= rank) return HistogramBucketTop(i);
+  }
+  return ~0ull;
+}
+
+// Sums the histograms of all rings into histograms, along with the events
+// of each ring that are not folded in yet. Events a running thread folds
+// while this reads may be missed or counted twice.
+static void MergeTraceHistograms(TraceHistogram* histograms) {
+  unsigned int count = __atomic_load_n(&traceRingCount,__ATOMIC_ACQUIRE);
+  if(count > TRACE_MAX_THREADS) count = TRACE_MAX_THREADS;
+
+  for(unsigned int i = 0; i < count; ++i) {
+    TraceRing* ring = __atomic_load_n(&traceRings[i],__ATOMIC_ACQUIRE);
+    if(!ring) continue;
+
+    for(unsigned int event = 0; event < TRACE_EVENT_COUNT; ++event) {
+      const TraceHistogram* from = &ring->histograms[event];
+      TraceHistogram* to = &histograms[event];
+      for(unsigned int b = 0; b < TRACE_HISTOGRAM_BUCKETS; ++b) to->buckets[b] += __atomic_load_n(&from->buckets[b],__ATOMIC_RELAXED);
+      to->sum += __atomic_load_n(&from->sum,__ATOMIC_RELAXED);
+      unsigned long long max = __atomic_load_n(&from->max,__ATOMIC_RELAXED);
+      if(max > to->max) to->max = max;
+    }
+
+    unsigned long long head = __atomic_load_n(&ring->head,__ATOMIC_ACQUIRE);
+    unsigned long long at = __atomic_load_n(&ring->folded,__ATOMIC_ACQUIRE);
+    if(head - at > TRACE_RING_SIZE) at = head - TRACE_RING_SIZE;
+    for(; at < head; ++at) {
+      TraceEvent e = ring->events[at & (TRACE_RING_SIZE - 1)];
+      if(!e.duration || e.event >= TRACE_EVENT_COUNT) continue;
+      TraceHistogram* to = &histograms[e.event];
+      to->buckets[HistogramBucket(e.duration)]++;
+      to->sum += e.duration;
+      if(e.duration > to->max) to->max = e.duration;
+    }
+  }
+}
+
+long TraceStatsDump(const char* path) {
+  FILE* f = fopen(path,"w");
+  if(!f) return -1;
+
+  size_t length = strlen(path);
+  int json = length >= 5 && strcmp(path + length - 5,".json") == 0;
+
+  // Microseconds per tick
+  double scale = NanosecondsPerTick() / 1000.0;
+  static const double fractions[] = {0.5,0.9,0.99};
+
+  long written = 0;
+  if(json) fprintf(f,"{\"unit\":\"us\",\"operations\":{");
+  else fprintf(f,"%-16s %10s %12s %12s %12s %12s %12s\n","operation","count","mean us","p50 us","p90 us","p99 us","max us");
+
+  TraceHistogram* histograms = calloc(TRACE_EVENT_COUNT,sizeof(TraceHistogram));
+  if(!histograms) {
+    fclose(f);
+    return -1;
+  }
+  MergeTraceHistograms(histograms);
+
+  for(unsigned int i = 0; i < TRACE_EVENT_COUNT; ++i) {
+    const TraceHistogram* histogram = &histograms[i];
+    const unsigned long long* buckets = histogram->buckets;
+    unsigned long long count = 0;
+    for(unsigned int b = 0; b < TRACE_HISTOGRAM_BUCKETS; ++b) count += buckets[b];
+    if(!count) continue;
+
+    unsigned long long max = histogram->max;
+    double mean = (double)histogram->sum / count * scale;
+    double percentiles[3];
+    for(int p = 0; p < 3; ++p) {
+      unsigned long long top = HistogramPercentile(buckets,count,fractions[p]);
+      percentiles[p] = (top < max ? top : max) * scale;
+    }
+
+    if(json)
+      fprintf(f,"%s\n\"%s\":{\"count\":%llu,\"mean\":%.3f,\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"max\":%.3f}",
+              written ? "," : "",TRACE_NAMES[i],count,mean,percentiles[0],percentiles[1],percentiles[2],max * scale);
+    else
+      fprintf(f,"%-16s %10llu %12.1f %12.1f %12.1f %12.1f %12.1f\n",
+              TRACE_NAMES[i],count,mean,percentiles[0],percentiles[1],percentiles[2],max * scale);
+    written++;
+  }
+
+  free(histograms);
+
+  if(json) fprintf(f,"\n},\"counters\":{");
+  else fprintf(f,"\n%-18s %10s\n","counter","total");
+
+  for(unsigned int i = 0; i < TRACE_COUNTER_COUNT; ++i) {
+    unsigned long long total = __atomic_load_n(&traceCounters[i],__ATOMIC_RELAXED);
+    if(json) fprintf(f,"%s\n\"%s\":%llu",i ? "," : "",TRACE_COUNTER_NAMES[i],total);
+    else fprintf(f,"%-18s %10llu\n",TRACE_COUNTER_NAMES[i],total);
+  }
+  if(json) fprintf(f,"\n}}\n");
+
+  int ok = !ferror(f);
+  if(fclose(f) != 0) ok = 0;
+  return ok ? written : -1;
+}
+
+// Opened up front, a crash handler can neither open files nor allocate
+static FileHandle traceCrashFile;
+
+static void DumpTraceOnCrash() {
+  if(FileTruncate(traceCrashFile,0)) WriteTrace(traceCrashFile);
+}
+
+void TraceDumpOnCrash(const char* path) {
+  if(traceCrashFile || !(traceCrashFile = FileOpen(path,FILE_READWRITE))) return;
+  OnCrash(DumpTraceOnCrash);
+}
+
+#else
+
+void TraceRecord(unsigned int event, unsigned long long start, unsigned int a, unsigned long long b) {}
+void TraceThreadExit() {}
+long TraceDump(const char* path) { return 0; }
+void TraceDumpOnCrash(const char* path) {}
+void TraceCount(unsigned int counter, unsigned long long n) {}
+long TraceStatsDump(const char* path) { return 0; }
+
+#endif
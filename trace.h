@@ -0,0 +1,122 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// 
+// Tracing
+// 
+// Binary events in a fixed ring per thread, written without locks and
+// overwriting the oldest ones. TraceDump writes all rings as Chrome trace
+// JSON, which chrome://tracing and Perfetto open.
+//
+// Every timed event also goes into a latency histogram of its kind, which
+// its thread fills from the ring TRACE_FOLD_SIZE events at a time, and
+// TRACE_COUNT adds to a few totals like bytes read. Both are kept for the
+// whole run, and TraceStatsDump writes them with percentiles. Building
+// with -DHOSE_NO_TRACE compiles every TRACE_ macro away.
+// 
+
+#include "platform.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define TRACE_TSC 1
+#endif
+
+#define TRACE_RING_SIZE 8192       // Events kept per thread, a power of two
+#define TRACE_MAX_THREADS 64
+#define TRACE_FOLD_SIZE 1024       // Events a thread adds to its histograms at once
+
+// What a and b of each event hold is noted next to it
+enum {
+  TRACE_LOAD_CATALOG,              // a: records
+  TRACE_LOAD_BATCH,                // a: notes, b: notes read from disk
+  TRACE_PARSE_NOTE,                // a: 1 if valid, b: file size
+  TRACE_MERGE_BATCH,               // a: notes, b: notes in the registry
+  TRACE_SAVE_JOB,                  // a: job kind, b: body bytes
+  TRACE_READ_BODY,                 // a: note id, b: text bytes
+  TRACE_PREVIEW_UPDATE,            // a: note id, b: 1 if the row was redrawn
+  TRACE_SEARCH_QUERY,              // a: query length, b: notes found
+  TRACE_CREATE_WINDOW,             // a: 1 if taken from the pool
+  TRACE_OPEN_NOTE,                 // a: note id, b: 1 if restored
+  TRACE_FIND_NOTES,                // a: note files found
+  TRACE_LOAD_NOTES,                // a: notes loaded, from the start of loading to the last batch
+  TRACE_SAVE_NOTE,                 // a: note id, b: text bytes, taking the text out of the window
+  TRACE_EVENT_COUNT
+};
+
+// Totals of TRACE_COUNT
+enum {
+  TRACE_BYTES_READ,
+  TRACE_BYTES_WRITTEN,
+  TRACE_BYTES_MAPPED,
+  TRACE_FILES_OPENED,
+  TRACE_NOTES_LOADED,
+  TRACE_LIST_MESSAGES,
+  TRACE_PREVIEW_CHANGES,           // EN_CHANGE notifications of note windows
+  TRACE_PREVIEWS_COALESCED,        // Changes folded into a refresh that was already pending
+  TRACE_PREVIEWS_UNCHANGED,        // Refreshes skipped, the preview text was the same
+  TRACE_PREVIEWS_REFRESHED,        // Refreshes that redrew the list row
+  TRACE_NOTES_RENAMED,             // Note files given a new name, theirs too long or taken
+  TRACE_COUNTER_COUNT
+};
+
+// Histogram buckets are log-linear like HDR histograms: values below 16
+// ticks get a bucket each, larger ones 16 buckets per power of two, which
+// keeps every bucket within 6% of its values
+#define TRACE_HISTOGRAM_SUB_BITS 4
+#define TRACE_HISTOGRAM_BUCKETS ((64 - TRACE_HISTOGRAM_SUB_BITS + 1) << TRACE_HISTOGRAM_SUB_BITS)
+
+typedef struct TraceEvent {
+  unsigned long long start;        // Ticks of TraceTicks
+  unsigned long long duration;     // Ticks, 0 for an instant event
+  unsigned int event;
+  unsigned int a;
+  unsigned long long b;
+} TraceEvent;
+
+static inline unsigned long long TraceTicks() {
+#ifdef TRACE_TSC
+  return __rdtsc();
+#else
+  return ClockNanoseconds();
+#endif
+}
+
+// Adds an event to the ring of the calling thread, an instant one if
+// start is 0
+void TraceRecord(unsigned int event, unsigned long long start, unsigned int a, unsigned long long b);
+
+// Hands the ring of the calling thread to the next thread that starts.
+// Its events stay in the ring until they are overwritten.
+void TraceThreadExit();
+
+// Writes every ring to path. Returns the number of events written, or -1
+// if the file could not be written.
+long TraceDump(const char* path);
+
+// Dumps to path if the process crashes. The file is opened, and created
+// if missing, right away; the dump itself only writes to it.
+void TraceDumpOnCrash(const char* path);
+
+// Adds n to a counter, safe from any thread
+void TraceCount(unsigned int counter, unsigned long long n);
+
+// Writes count, p50, p90, p99 and max of every operation seen so far and
+// all counters to path, as JSON if it ends in .json and as text otherwise.
+// Returns the number of operations written, or -1 if the file could not
+// be written.
+long TraceStatsDump(const char* path);
+
+#ifndef HOSE_NO_TRACE
+#define TRACE_BEGIN(start) unsigned long long start = TraceTicks()
+#define TRACE_END(event,start,a,b) TraceRecord((event),(start),(unsigned int)(a),(unsigned long long)(b))
+#define TRACE_MARK(event,a,b) TraceRecord((event),0,(unsigned int)(a),(unsigned long long)(b))
+#define TRACE_COUNT(counter,n) TraceCount((counter),(unsigned long long)(n))
+#else
+#define TRACE_BEGIN(start) ((void)0)
+#define TRACE_END(event,start,a,b) ((void)sizeof(a),(void)sizeof(b))  // Used but never evaluated
+#define TRACE_MARK(event,a,b) ((void)sizeof(a),(void)sizeof(b))
+#define TRACE_COUNT(counter,n) ((void)sizeof(n))
+#endif
+
+#endif
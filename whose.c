@@ -1,493 +1,738 @@
 #include <windows.h>
 #include <stdio.h>
 #include <assert.h>
+#include <time.h>
 
-#define HOSE_ICON 0
-
-#define PREVIEW_SIZE 32
-#define FILENAME_SIZE 14
-#define CONFIG_LEAST_SIZE 17
-
-static const unsigned char CONFIG_SEPARATOR = UCHAR_MAX;
+#include "hnote.h"
+#include "trace.h"
 
-typedef struct Note {
-  HWND handle;
-  int id;
-  int opened;
-  int changes;
-  int x,y,width,height;
-  char filename[FILENAME_SIZE + 1];
-  char preview[PREVIEW_SIZE + 1];
-} Note;
-
-struct NoteArray {
-  size_t size, capacity;
-  Note* data;  
-};
+#define HOSE_ICON 0
 
 typedef struct {
   HWND handle;
   HWND textHandle;
   HWND deleteButtonHandle;
-  int id;
-  int positionalChanges;
+  HWND historyButtonHandle;
+  NoteId id;
+  int previewPending;
+  int journalPending;
+  int stored;                // The note is on disk
+  char* storedText;          // LF text as it is on disk, not kept for large notes
+  size_t storedLength;
+  NoteMapping stream;        // Body still being fed to the edit, see StartNoteStream
+  const char* streamBody;
+  size_t streamLength, streamAt;
+  char* streamChunk;
+  WCHAR* streamWide;         // streamChunk converted for the edit
   char filepath[MAX_PATH + 1];
 } WindowData;
 
-static char NOTESPATH[MAX_PATH + 1] = {0};
-
 static const char NOTESCLASSNAME[] = "Hose_NoteWindow";
 static const char MAINCLASSNAME[]  = "Hose_MainWindow";
-static char EMPTYNOTE_STRING[] = "Empty Note\0";
 
 static int STD_MAIN_WINDOWWIDTH = 500, STD_MAIN_WINDOWHEIGHT = 500;
 static int STD_NOTE_WINDOWWIDTH = 300, STD_NOTE_WINDOWHEIGHT = 300;
 static int STD_BUTTONWIDTH = 100, STD_BUTTONHEIGHT = 32;
+static int STD_SEARCHHEIGHT = 24;
+static int STD_SORTHEIGHT = 120;  // Including the drop down list
 
 static int FISSURE = 16;
 
-static HWND MAIN_CREATEBUTTON_HANDLE, MAIN_OPENBUTTON_HANDLE, MAIN_DELETEBUTTON_HANDLE, MAIN_NOTELIST_HANDLE;
+static HWND MAIN_CREATEBUTTON_HANDLE, MAIN_OPENBUTTON_HANDLE, MAIN_DELETEBUTTON_HANDLE, MAIN_CLOSEBUTTON_HANDLE, MAIN_EXPORTBUTTON_HANDLE, MAIN_NOTELIST_HANDLE, MAIN_SEARCH_HANDLE, MAIN_SORT_HANDLE;
 
-static int MAIN_CREATEBUTTON_ID = 1, MAIN_NOTELIST_ID = 2, NOTE_DELETEBUTTON_ID = 3, MAIN_OPENBUTTON_ID = 4, MAIN_DELETEBUTTON_ID = 5, NOTE_EDIT_ID = 6;
+static int MAIN_CREATEBUTTON_ID = 1, MAIN_NOTELIST_ID = 2, NOTE_DELETEBUTTON_ID = 3, MAIN_OPENBUTTON_ID = 4, MAIN_DELETEBUTTON_ID = 5, NOTE_EDIT_ID = 6, MAIN_SEARCH_ID = 7, MAIN_CLOSEBUTTON_ID = 8, MAIN_EXPORTBUTTON_ID = 9, NOTE_HISTORYBUTTON_ID = 10, MAIN_SORT_ID = 11;
 
-static int NOTEID = 0;
-static struct NoteArray noteArray = {.size = 0, .capacity = 0, .data = NULL};
+// Preview refreshes are deferred until typing pauses for this long
+#define PREVIEW_TIMER_ID 1
+#define PREVIEW_DELAY_MS 150
 
-LRESULT CALLBACK DEBUGPROC(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam) {
+// Edits reach the journal at most this long after they are made
+#define JOURNAL_TIMER_ID 3
+#define JOURNAL_DELAY_MS 1000
 
-  switch(uMsg) {
-    case WM_CLOSE: {
-      DestroyWindow(hwnd);
-    } return 0;
+// Notes from this size on are streamed into their window
+#define STREAM_MIN_SIZE (1 << 20)
+#define STREAM_CHUNK_SIZE (256 * 1024)
+#define STREAM_TIMER_ID 4
+#define STREAM_SLICE_MS 16
 
-    case WM_DESTROY: return 0;
-  }
+#define HISTORY_MENU_SIZE 20      // Newest versions offered by the History button
 
-  return DefWindowProc(hwnd,uMsg,wParam,lParam);
-}
+// Where TraceStatsDump writes, see WinMain
+static char statsPath[MAX_PATH + 1];
+static int statsOnExit;
+
+// Notes that were open on exit. They are listed like any other note and
+// get their window one at a time while the message queue is empty.
+static struct RestoreQueue {
+  size_t size, capacity;
+  NoteId* data;
+} restoreQueue = {0};
 
-char *strfmt(const char *fmt, ...) {
-  va_list args;
-  va_list args_copy;
-  char *buffer;
-  int needed;
+// Closed note windows, hidden and kept for the next note that opens
+#define WINDOW_POOL_SIZE 8
 
-  va_start(args, fmt);
-  va_copy(args_copy, args);
+static struct WindowPool {
+  size_t size;
+  WindowData* data[WINDOW_POOL_SIZE];
+} windowPool = {0};
 
-  needed = vsnprintf(NULL, 0, fmt, args);
-  if (needed < 0) {
-      va_end(args);
-      va_end(args_copy);
-      return NULL; // Encoding error
+void PrepareNotesPath() {
+  char userPath[MAX_PATH];
+  DWORD len = GetEnvironmentVariable("USERPROFILE",userPath,MAX_PATH);
+
+  if(len == 0 || len >= MAX_PATH) {    // Fall back to executable's directory
+    userPath[0] = '.';
+    userPath[1] = '\0';
   }
 
-  buffer = malloc((size_t)needed + 1);
-  if (!buffer) {
-      va_end(args);
-      va_end(args_copy);
-      return NULL;
+  // Default notes path: %USERPROFILE%/hose/
+  sprintf(NOTESPATH,"%s\\hose",userPath); // Appends null terminator
+
+  CreateDirectory(NOTESPATH,NULL); // Create dir if not exists
+  PrepareNoteShards();
+}
+
+void RetrieveNoteWindowPosition(HWND noteWindowHandle, Note* note) {
+  WINDOWPLACEMENT wp = { sizeof(wp) };
+
+  if(!GetWindowPlacement(noteWindowHandle,&wp)) {
+    note->x = CW_USEDEFAULT;
+    note->y = CW_USEDEFAULT;
+    note->width = STD_NOTE_WINDOWWIDTH;
+    note->height = STD_NOTE_WINDOWHEIGHT;
+    return;
   }
-  
-  vsnprintf(buffer, (size_t)needed + 1, fmt, args_copy);
 
-  va_end(args);
-  va_end(args_copy);
-  return buffer;
+  note->x = wp.rcNormalPosition.left;
+  note->y = wp.rcNormalPosition.top;
+  note->width = wp.rcNormalPosition.right - wp.rcNormalPosition.left;
+  note->height = wp.rcNormalPosition.bottom - wp.rcNormalPosition.top;
 }
 
-char *vstrfmt(const char *fmt, va_list args) {
-  va_list args_copy;
-  char *buffer;
-  int needed;
+// 
+// Note text is UTF-8 and edits are UTF-16, text crosses over here and
+// only here
+// 
+
+// Converts note text for the W APIs into out, NUL terminated. out needs
+// room for len + 1 units. Text that is not UTF-8 was written by an ANSI
+// build and is read in the ANSI code page.
+size_t ToWideText(WCHAR* out, const char* text, size_t len) {
+  size_t wide = Utf8ToUtf16((unsigned short*)out,text,len);
+  if(wide == (size_t)-1) wide = MultiByteToWideChar(CP_ACP,0,text,(int)len,out,(int)len);
+  out[wide] = 0;
+  return wide;
+}
 
-  va_copy(args_copy, args);
+WCHAR* NewWideText(const char* text, size_t len) {
+  WCHAR* wide = malloc((len + 1) * sizeof(WCHAR));
+  if(wide) ToWideText(wide,text,len);
+  return wide;
+}
 
-  needed = vsnprintf(NULL, 0, fmt, args_copy);
-  va_end(args_copy);
+// Reads the text of an edit as UTF-8, NUL terminated. NULL if it cannot
+// be read.
+char* GetEditText(HWND handle, size_t* length) {
+  int len = GetWindowTextLengthW(handle);
+
+  WCHAR* wide = malloc((len + 1) * sizeof(WCHAR));
+  char* text = malloc(3 * (size_t)len + 1);
+  if(!wide || !text) {
+    free(wide);
+    free(text);
+    return NULL;
+  }
 
-  if (needed < 0)
-      return NULL;
+  len = GetWindowTextW(handle,wide,len + 1);
+  *length = Utf16ToUtf8(text,(const unsigned short*)wide,len);
+  text[*length] = '\0';
+  free(wide);
 
-  buffer = malloc((size_t)needed + 1);
-  if (!buffer)
-      return NULL;
+  char* shrunk = realloc(text,*length + 1);
+  return shrunk ? shrunk : text;
+}
 
-  vsnprintf(buffer, (size_t)needed + 1, fmt, args);
-  return buffer;
+void SetEditText(HWND handle, const char* text, size_t len) {
+  WCHAR* wide = NewWideText(text,len);
+  if(wide) SetWindowTextW(handle,wide);
+  free(wide);
 }
 
-static int debug_registered = 0;
+void ReplaceEditSelection(HWND handle, const char* text, size_t len, BOOL undo) {
+  WCHAR* wide = NewWideText(text,len);
+  if(wide) SendMessageW(handle,EM_REPLACESEL,undo,(LPARAM)wide);
+  free(wide);
+}
 
-void DEBUGMSG(const char *fmt, ...) {
-  va_list args;
-  
-  va_start(args, fmt);
-  char* buffer = vstrfmt(fmt,args);
-  va_end(args);
-
-  if(!debug_registered) {
-    WNDCLASS wc = {0};
-    wc.lpfnWndProc = DEBUGPROC;
-    wc.hInstance = GetModuleHandle(NULL);
-    wc.lpszClassName = "custom_popup";
-    wc.hbrBackground = (HBRUSH)(COLOR_WINDOW + 1);
-    wc.hCursor = LoadCursor(NULL, IDC_ARROW);
-    RegisterClass(&wc);
-    debug_registered = 1;
-  }
-
-  HWND hwnd = CreateWindowExA(
-      WS_EX_TOPMOST,
-      "custom_popup",
-      buffer,
-      WS_OVERLAPPEDWINDOW,
-      100, 100,
-      300, 200,
-      NULL, NULL, GetModuleHandle(NULL), NULL
-    );
-
-  ShowWindow(hwnd,SW_SHOWNORMAL);
-  
-  free(buffer);
+void ReleaseNoteWindow(WindowData* wd);
+
+// Every message to the note list goes through here, so the stats show how
+// much a change costs the list
+LRESULT SendListMessage(HWND listHandle, UINT msg, WPARAM wParam, LPARAM lParam) {
+  TRACE_COUNT(TRACE_LIST_MESSAGES,1);
+  return SendMessage(listHandle,msg,wParam,lParam);
 }
 
-void DEBUGPRINTARRAY(const char* prefix) {
-  if(!debug_registered) {
-    WNDCLASS wc = {0};
-    wc.lpfnWndProc = DEBUGPROC;
-    wc.hInstance = GetModuleHandle(NULL);
-    wc.lpszClassName = "custom_popup";
-    wc.hbrBackground = (HBRUSH)(COLOR_WINDOW + 1);
-    wc.hCursor = LoadCursor(NULL, IDC_ARROW);
-    RegisterClass(&wc);
-    debug_registered = 1;
-  }
+// The list itself holds no data, rows are drawn on demand from the note
+// order, see NoteAtRow
+void AddNoteToList(Note* note, HWND listHandle) {
+  ListNote(note,1);
+  OrderNote(note);
+  SendListMessage(listHandle,LB_INSERTSTRING,NoteRow(note),0);
+}
+
+void RedrawNoteRow(Note* note, HWND listHandle) {
+  int row = NoteRow(note);
+  if(row < 0) return;
+
+  RECT rect;
+  if(SendListMessage(listHandle,LB_GETITEMRECT,row,(LPARAM)&rect) != LB_ERR)
+    InvalidateRect(listHandle,&rect,FALSE);
+}
 
-  char buffer[256];
-  DEBUGMSG("%s: ARRAY HAS %d ELEMENTS", prefix, noteArray.size);
-  for(int i = 0; i < noteArray.size; ++i) {
-    Note* note = &noteArray.data[i];
-    DEBUGMSG("%s: NOTE %i in %s", prefix, note->id, note->filename);
+// Moves the row of a note from where it was before a change to where the
+// order puts it now, taking its selection along. Only the rows in between
+// shift, nothing is sorted.
+void MoveNoteRow(Note* note, int from, HWND listHandle) {
+  int to = NoteRow(note);
+  if(from < 0 || to < 0) return;
+  if(from == to) {
+    RedrawNoteRow(note,listHandle);
+    return;
   }
+
+  BOOL selected = SendListMessage(listHandle,LB_GETSEL,from,0) > 0;
+  SendListMessage(listHandle,LB_DELETESTRING,from,0);
+  SendListMessage(listHandle,LB_INSERTSTRING,to,0);
+  if(selected) SendListMessage(listHandle,LB_SETSEL,TRUE,to);
 }
 
-Note* Push(Note n) {
-  if(noteArray.size >= noteArray.capacity) {
-    if(!noteArray.capacity) noteArray.capacity = 6;
-    else noteArray.capacity *= 2;
+void DrawNoteRow(const DRAWITEMSTRUCT* dis) {
+  if((int)dis->itemID < 0) {
+    if(dis->itemState & ODS_FOCUS) DrawFocusRect(dis->hDC,&dis->rcItem);
+    return;
+  }
 
-    Note* nArr = malloc(sizeof(Note) * noteArray.capacity);
-    if(noteArray.data){
-      memcpy(nArr,noteArray.data,noteArray.size * sizeof(Note));
-      free(noteArray.data);
-    }
-    noteArray.data = nArr;
+  Note* note = NoteAtRow(dis->itemID);
+  int selected = dis->itemState & ODS_SELECTED;
+
+  FillRect(dis->hDC,&dis->rcItem,GetSysColorBrush(selected ? COLOR_HIGHLIGHT : COLOR_WINDOW));
+  if(note) {
+    RECT textRect = dis->rcItem;
+    textRect.left += 2;
+
+    SetBkMode(dis->hDC,TRANSPARENT);
+    SetTextColor(dis->hDC,GetSysColor(selected ? COLOR_HIGHLIGHTTEXT : COLOR_WINDOWTEXT));
+    WCHAR preview[PREVIEW_SIZE + 1];
+    ToWideText(preview,note->preview,Utf8Prefix(note->preview,strlen(note->preview)));
+    DrawTextW(dis->hDC,preview,-1,&textRect,DT_LEFT | DT_VCENTER | DT_SINGLELINE | DT_NOPREFIX | DT_END_ELLIPSIS);
   }
-  noteArray.data[noteArray.size++] = n;
-  return &noteArray.data[noteArray.size-1];
+
+  if(dis->itemState & ODS_FOCUS) DrawFocusRect(dis->hDC,&dis->rcItem);
 }
 
-void SwapRemove(size_t i) {
-  if(i >= noteArray.size) return;
+// Loaded notes arrive at the main window as WM_NOTESLOADED
+#define WM_NOTESLOADED (WM_APP + 1)   // lParam: LoadBatch*, NULL once loading is done
 
-  noteArray.data[i] = noteArray.data[--noteArray.size];
+// Loader threads: hands a batch over to the UI thread
+void PostLoadedBatch(LoadBatch* batch, void* context) {
+  if(!PostMessage((HWND)context,WM_NOTESLOADED,0,(LPARAM)batch)) free(batch);
 }
 
-size_t IndexOf(int id) {
-  for(int i = 0; i < noteArray.size; ++i) {
-    if(noteArray.data[i].id == id) return i;
+void QueueNoteRestore(Note* note) {
+  if(restoreQueue.size == restoreQueue.capacity) {
+    size_t capacity = restoreQueue.capacity ? restoreQueue.capacity * 2 : 16;
+    NoteId* data = realloc(restoreQueue.data,capacity * sizeof(NoteId));
+    if(!data) return;
+
+    restoreQueue.data = data;
+    restoreQueue.capacity = capacity;
   }
-  return SIZE_MAX;
+  restoreQueue.data[restoreQueue.size++] = note->id;
 }
 
-Note* Find(int id) {
-  for(int i = 0; i < noteArray.size; ++i) {
-    if(noteArray.data[i].id == id) return &noteArray.data[i];
+// Adds a batch of loaded notes to the registry and the list with a single
+// list update. Notes that were open on exit are queued for RestoreNextNote.
+void MergeLoadedNotes(LoadBatch* batch, HWND listHandle) {
+  TRACE_BEGIN(start);
+  size_t count = batch->count;
+
+  SendListMessage(listHandle,WM_SETREDRAW,FALSE,0);
+
+  for(size_t i = 0; i < batch->count; ++i) {
+    if(!batch->notes[i].valid) continue;
+
+    Note* n = InitNoteFromLoaded(&batch->notes[i]);
+    if(!n) continue;
+
+    ListNote(n,1);
+    OrderNote(n);
+    if(n->opened) QueueNoteRestore(n);
   }
-  return NULL;
+
+  SendListMessage(listHandle,LB_SETCOUNT,ListedNoteCount(),0);
+  SendListMessage(listHandle,WM_SETREDRAW,TRUE,0);
+  InvalidateRect(listHandle,NULL,TRUE);
+
+  free(batch);
+  TRACE_END(TRACE_MERGE_BATCH,start,count,noteRegistry.size);
 }
 
-long GetSizeOfFile(FILE* f) {
-  fseek(f,0,SEEK_END);
-  long size = ftell(f);
-  fseek(f,0,SEEK_SET);
-  return size;
+// Writer thread progress in the title of the main window while exiting
+void ShowSaveProgress(unsigned long completed, unsigned long total, void* context) {
+  char title[64];
+  snprintf(title,sizeof(title),"Hose - saving notes (%lu of %lu)",completed,total);
+  SetWindowText((HWND)context,title);
 }
 
-static inline long ConfigLength(FILE* f) {
-  int c;
+// Live search index updates and the search box
+#define SEARCH_QUERY_SIZE 128
+#define SEARCH_TIMER_ID 2
+#define SEARCH_DELAY_MS 1000
+#define SEARCH_LIVE_INDEX_LIMIT (256 * 1024)  // Larger notes are indexed on save only
+#define WM_SEARCHREADY (WM_APP + 2)
+#define WM_SEARCHREJECTS (WM_APP + 3)  // lParam: SearchRejects*
 
-  fseek(f,0,SEEK_SET);
+static unsigned int searchCheck;  // Of the results listed now, 0 if they need none
 
-  while((c = fgetc(f)) != EOF && c != CONFIG_SEPARATOR); 
-  long len = ftell(f);
+// Indexing thread: lets the main window rerun the current search
+void PostSearchReady(void* context) {
+  PostMessage((HWND)context,WM_SEARCHREADY,0,0);
+}
 
-  fseek(f,0,SEEK_SET);
-  return len;
+// Check thread: hands the main window notes to take off the list
+void PostSearchRejects(SearchRejects* rejects, void* context) {
+  if(!PostMessage((HWND)context,WM_SEARCHREJECTS,0,(LPARAM)rejects)) free(rejects);
 }
 
-void PrepareNotesPath() {
-  char userPath[MAX_PATH];
-  DWORD len = GetEnvironmentVariable("USERPROFILE",userPath,MAX_PATH);
+// Lists only the notes matching the search box, or all notes if it is empty
+void ApplySearchFilter(HWND searchHandle, HWND listHandle) {
+  WCHAR wide[SEARCH_QUERY_SIZE] = {0};
+  int len = GetWindowTextW(searchHandle,wide,SEARCH_QUERY_SIZE);
 
-  if(len == 0 || len >= MAX_PATH) {    // Fall back to executable's directory
-    userPath[0] = '.';
-    userPath[1] = '\0';
+  char query[3 * SEARCH_QUERY_SIZE];
+  size_t queryLength = Utf16ToUtf8(query,(const unsigned short*)wide,len > 0 ? len : 0);
+  query[queryLength] = '\0';
+
+  // Listing a note only updates counts in the order, the rows keep their
+  // sorting through any filter
+  for(size_t i = 0; i < noteRegistry.slotCount; ++i) {
+    Note* note = NoteAtSlot(i);
+    if(note) ListNote(note,!queryLength);
   }
 
-  // Default notes path: %USERPROFILE%/hose/
-  sprintf(NOTESPATH,"%s\\hose",userPath); // Appends null terminator
+  // The candidates are listed at once, those a check finds without the
+  // query come off as it gets to them
+  NoteId* ids = NULL;
+  size_t count = queryLength ? QuerySearchIndex(query,&ids) : 0;
+  for(size_t i = 0; i < count; ++i) {
+    Note* note = Find(ids[i]);
+    if(note) ListNote(note,1);
+  }
+  searchCheck = CheckSearchResults(query,ids,count,PostSearchRejects,GetParent(listHandle));
+  free(ids);
 
-  CreateDirectory(NOTESPATH,NULL); // Create dir if not exists
+  SendListMessage(listHandle,WM_SETREDRAW,FALSE,0);
+  SendListMessage(listHandle,LB_SETCOUNT,ListedNoteCount(),0);
+  SendListMessage(listHandle,WM_SETREDRAW,TRUE,0);
+  InvalidateRect(listHandle,NULL,TRUE);
 }
 
-void RetrieveNoteWindowPosition(HWND noteWindowHandle, Note* note) {
-  WINDOWPLACEMENT wp = { sizeof(wp) };
-
-  if(!GetWindowPlacement(noteWindowHandle,&wp)) {
-    note->x = CW_USEDEFAULT;
-    note->y = CW_USEDEFAULT;
-    note->width = STD_NOTE_WINDOWWIDTH;
-    note->height = STD_NOTE_WINDOWHEIGHT;
-    return;
+// Takes notes the check of the current results rejected off the list.
+// Open notes stay, the index may have text of their window the check
+// does not see in the file.
+void RemoveSearchRejects(SearchRejects* rejects, HWND listHandle) {
+  size_t removed = 0;
+  for(size_t i = 0; rejects->check == searchCheck && i < rejects->count; ++i) {
+    Note* note = Find(rejects->ids[i]);
+    if(!note || note->handle || !note->listed) continue;
+
+    ListNote(note,0);
+    removed++;
   }
+  free(rejects);
+  if(!removed) return;
 
-  note->x = wp.rcNormalPosition.left;
-  note->y = wp.rcNormalPosition.top;
-  note->width = wp.rcNormalPosition.right - wp.rcNormalPosition.left;
-  note->height = wp.rcNormalPosition.bottom - wp.rcNormalPosition.top;
+  SendListMessage(listHandle,WM_SETREDRAW,FALSE,0);
+  SendListMessage(listHandle,LB_SETCOUNT,ListedNoteCount(),0);
+  SendListMessage(listHandle,WM_SETREDRAW,TRUE,0);
+  InvalidateRect(listHandle,NULL,TRUE);
 }
 
-Note* InitNoteWithConfigFromDisk(FILE* f) {
-  long filelen = GetSizeOfFile(f);
-  long configLength = ConfigLength(f);
-  if(configLength < CONFIG_LEAST_SIZE) assert(false && "config too small");
-  if(configLength == filelen)          assert(false && "config invalid");
+// Switches the list to the order picked in the sort box. Selections
+// belong to rows, they are cleared since every note may move.
+void SortNoteList(HWND sortHandle, HWND listHandle) {
+  int key = (int)SendMessage(sortHandle,CB_GETCURSEL,0,0);
+  if(key < NOTE_ORDER_MODIFIED || key > NOTE_ORDER_SIZE || key == GetNoteOrder()) return;
 
-  int opened,x,y,width,height;
-  fread(&opened,1,1,f);                 // Was open?
-  fread(&x,sizeof(int),1,f);            // Coord X
-  fread(&y,sizeof(int),1,f);            // Coord Y
-  fread(&width,sizeof(int),1,f);        // Window width
-  fread(&height,sizeof(int),1,f);       // Window height
+  SetNoteOrder(key);
 
-  Note* note = Push((Note){
-    .id = NOTEID++,
-    .opened = opened, 
-    .changes = 0, 
-    .x = x,
-    .y = y,
-    .width = width,
-    .height = height
-  });
-  return note;
+  SendListMessage(listHandle,WM_SETREDRAW,FALSE,0);
+  SendListMessage(listHandle,LB_SETCOUNT,ListedNoteCount(),0);
+  SendListMessage(listHandle,WM_SETREDRAW,TRUE,0);
+  InvalidateRect(listHandle,NULL,TRUE);
 }
 
-void OpenNoteFromList(const char* filepath, HINSTANCE hInstance, HWND listHandle, int index);
+// The rows below move up along with their selection, the list shifts
+// them itself on LB_DELETESTRING
+void RemoveNoteFromList(Note* note, HWND listHandle) {
+  if(!note) return;
 
-void FindNotesFromDisk(const char* path) {
-  char searchBuffer[MAX_PATH] = {0};
-  int written = snprintf(searchBuffer,MAX_PATH,"%s\\*.hnote",path); // Appends null terminator
-  if(written >= MAX_PATH) {
-    assert(false && "search path is longer than MAX_PATH");
-  }
+  int row = NoteRow(note);
+  UnorderNote(note);
+  ListNote(note,0);
+  if(row >= 0) SendListMessage(listHandle,LB_DELETESTRING,row,0);
+}
 
-  WIN32_FIND_DATAA fd;
+void DeleteNote(Note* note) {
+  if(!note) return;
 
-  HANDLE hfind = FindFirstFile(searchBuffer,&fd);
-  if(hfind == INVALID_HANDLE_VALUE) {
-    // Could not find valid files in path on disk
-    return;
+  if(note->handle) ReleaseNoteWindow((WindowData*)GetWindowLongPtr(note->handle,GWLP_USERDATA));
+  note->handle = NULL;
+
+  RemoveNoteFromList(note, MAIN_NOTELIST_HANDLE);
+  RemoveNoteFromIndex(note->id);
+
+  Remove(note->id);
+}
+
+// Returns 1 if the preview changed and its row was redrawn
+int UpdateNotePreview(Note* note, HWND textHandle, HWND listHandle) {
+  if(!note) return 0;
+  
+  // Only the first PREVIEW_SIZE characters are ever copied out of the edit,
+  // the preview keeps as many bytes of them as fit
+  WCHAR wide[PREVIEW_SIZE + 1] = {0};
+  int len = GetWindowTextW(textHandle,wide,PREVIEW_SIZE + 1);
+  if(len > 0 && wide[len - 1] >= 0xD800 && wide[len - 1] <= 0xDBFF) len--;  // Half a surrogate pair
+
+  char text[3 * PREVIEW_SIZE + 1];
+  size_t size = Utf16ToUtf8(text,(const unsigned short*)wide,len > 0 ? len : 0);
+  if(size > PREVIEW_SIZE) size = Utf8Prefix(text,PREVIEW_SIZE);
+  text[size] = '\0';
+  const char* preview = size ? text : EMPTYNOTE_STRING;
+
+  if(strcmp(preview,note->preview) == 0) {
+    TRACE_COUNT(TRACE_PREVIEWS_UNCHANGED,1);
+    return 0;
   }
 
-  char fullpath[MAX_PATH + 1];
-  do { 
+  // A new title can move the note in the title order
+  int from = NoteRow(note);
+  int ordered = UnorderNote(note);
+  strcpy(note->preview,preview);
+  if(ordered) OrderNote(note);
+  TRACE_COUNT(TRACE_PREVIEWS_REFRESHED,1);
 
-    sprintf(fullpath,"%s\\%s",NOTESPATH,fd.cFileName);
+  MoveNoteRow(note,from,listHandle);
+  return 1;
+}
 
-    size_t len = strlen(fd.cFileName);
-    if(len > FILENAME_SIZE) continue;
+// Restarts the preview timer, a burst of changes results in one refresh
+void SchedulePreviewUpdate(WindowData* wd) {
+  TRACE_COUNT(TRACE_PREVIEW_CHANGES,1);
+  if(wd->previewPending) TRACE_COUNT(TRACE_PREVIEWS_COALESCED,1);
 
-    FILE* file = fopen(fullpath,"rb");
-    if(!file) continue;
+  wd->previewPending = 1;
+  SetTimer(wd->handle,PREVIEW_TIMER_ID,PREVIEW_DELAY_MS,NULL);
+}
 
-    Note* n = InitNoteWithConfigFromDisk(file);
-    memcpy(n->filename,fd.cFileName,len);
-    n->filename[FILENAME_SIZE] = '\0';
+void FlushPreviewUpdate(WindowData* wd) {
+  if(!wd->previewPending) return;
 
-    long fileLength = GetSizeOfFile(file);
-    long configLength = ConfigLength(file);
+  TRACE_BEGIN(start);
 
-    fileLength = fileLength - configLength;
+  KillTimer(wd->handle,PREVIEW_TIMER_ID);
+  wd->previewPending = 0;
+  int refreshed = UpdateNotePreview(Find(wd->id),wd->textHandle,MAIN_NOTELIST_HANDLE);
 
-    // Read and set preview of note
-    if(fileLength == 0) memcpy(n->preview,EMPTYNOTE_STRING,sizeof(EMPTYNOTE_STRING));
-    else {
-      if(fileLength > PREVIEW_SIZE) fileLength = PREVIEW_SIZE;
-      fseek(file,configLength,SEEK_SET);
-      fread(n->preview,1,fileLength,file);
-      n->preview[PREVIEW_SIZE] = '\0';
-    }
+  TRACE_END(TRACE_PREVIEW_UPDATE,start,wd->id,refreshed);
+}
 
-     // Add preview to list and assign the custom id
-    int index = SendMessage(MAIN_NOTELIST_HANDLE,LB_ADDSTRING,0,(LPARAM)n->preview);
-    SendMessage(MAIN_NOTELIST_HANDLE,LB_SETITEMDATA,index,(LPARAM)n->id);
+// Indexes what is typed once typing pauses, so search finds it before
+// the note is saved. Very large notes wait for their save.
+void IndexNoteWindow(WindowData* wd) {
+  KillTimer(wd->handle,SEARCH_TIMER_ID);
 
-    fclose(file);
+  if(GetWindowTextLengthW(wd->textHandle) > SEARCH_LIVE_INDEX_LIMIT) return;
 
-    // If they were open, open them now
-    if(n->opened)
-      OpenNoteFromList(fullpath,GetModuleHandle(NULL),MAIN_NOTELIST_HANDLE,index);
+  size_t len;
+  char* text = GetEditText(wd->textHandle,&len);
+  if(!text) return;
 
-    
-  } while(FindNextFile(hfind,&fd));
+  IndexNoteText(wd->id,text,len);
+  free(text);
 
-  FindClose(hfind);
+  if(GetWindowTextLength(MAIN_SEARCH_HANDLE) > 0) ApplySearchFilter(MAIN_SEARCH_HANDLE,MAIN_NOTELIST_HANDLE);
 }
 
-void DeleteNoteFromDisk(const char* path, const char* filename) {
-  static char buffer[MAX_PATH + 1];
-  sprintf(buffer,"%s\\%s",path,filename);
-  DeleteFileA(buffer);
+// Reads the edit's text as LF text, NULL if it cannot be read
+char* GetNoteWindowText(HWND textHandle, size_t* length) {
+  char* buffer = GetEditText(textHandle,length);
+  if(!buffer) return NULL;
+
+  *length = CrlfToLf(buffer,buffer,*length);
+  buffer[*length] = '\0';
+  return buffer;
 }
 
-void RemoveNoteFromListById(Note* note, HWND listHandle) {
+// Hands what changed since the last timer to the journal, so it is on
+// disk within a second without rewriting the note
+void JournalNoteWindow(WindowData* wd) {
+  KillTimer(wd->handle,JOURNAL_TIMER_ID);
+  wd->journalPending = 0;
+
+  Note* note = Find(wd->id);
   if(!note) return;
 
-  int count = SendMessage(listHandle,LB_GETCOUNT,0,0);
-  for(int i = 0; i < count; ++i) {
-    int id_ = SendMessage(listHandle,LB_GETITEMDATA,i,0);
-    if(id_ == note->id) {
-      SendMessage(listHandle,LB_DELETESTRING,i,0);
-      break;
-    }
+  size_t len;
+  char* text = GetNoteWindowText(wd->textHandle,&len);
+  if(!text) return;
+  if(!wd->stored && len <= 1) {
+    free(text);  // Empty note, do not write to disk
+    return;
   }
-}
 
-void DeleteNote(Note* note) {
-  if(!note) return;
+  // Large notes keep no copy of their stored text, the writer compares
+  // with what it wrote last. A window stays with that once it started.
+  int from = NoteRow(note);
+  if(wd->stored && !wd->storedText) {
+    JournalNoteText(note,text,len);
+    MoveNoteRow(note,from,MAIN_NOTELIST_HANDLE);
+    return;
+  }
 
-  if(note->opened) DestroyWindow(note->handle);
+  JournalNoteEdit(note,wd->storedText,wd->storedLength,text,len);
+  MoveNoteRow(note,from,MAIN_NOTELIST_HANDLE);
+  free(wd->storedText);
+  wd->stored = 1;
 
-  RemoveNoteFromListById(note, MAIN_NOTELIST_HANDLE);
+  if(len >= STREAM_MIN_SIZE) {
+    free(text);
+    text = NULL;
+  }
+  wd->storedText = text;
+  wd->storedLength = len;
+}
 
-  size_t index = IndexOf(note->id);
-  if(index != SIZE_MAX) SwapRemove(index);
+// 
+// Large notes are shown from a mapping of their file a chunk at a time,
+// so the window has content at once and the body is never copied whole.
+// The edit stays read only until the last chunk is in.
+// 
+
+void StopNoteStream(WindowData* wd) {
+  if(!wd->streamBody) return;
+
+  KillTimer(wd->handle,STREAM_TIMER_ID);
+  UnmapNoteBody(&wd->stream);
+  free(wd->streamChunk);
+  free(wd->streamWide);
+  wd->streamChunk = NULL;
+  wd->streamWide = NULL;
+  wd->streamBody = NULL;
+  SendMessage(wd->textHandle,EM_SETREADONLY,FALSE,0);
 }
 
-void UpdateNotePreview(Note* note, HWND textHandle, HWND listHandle) {
-  if(!note) return;
-  
-  int len = GetWindowTextLength(textHandle);
-  if(len == 0) memcpy(note->preview,EMPTYNOTE_STRING,sizeof(EMPTYNOTE_STRING));
-  else {
-    if(len > PREVIEW_SIZE) len = PREVIEW_SIZE;
-    char text[PREVIEW_SIZE + 1] = {0};
-    GetWindowText(textHandle,text,len + 1);
-    memcpy(note->preview,text,len + 1);
-  }
-
-  int count = SendMessage(listHandle,LB_GETCOUNT,0,0);
-  for(int i = 0; i < count; ++i) {
-    int id_ = SendMessage(listHandle,LB_GETITEMDATA,i,0);
-    if(id_ == note->id) {
-      SendMessage(listHandle,LB_DELETESTRING,i,0);
-      int ni = SendMessage(listHandle,LB_INSERTSTRING,i,(LPARAM)note->preview);
-      SendMessage(listHandle,LB_SETITEMDATA,ni,(LPARAM)note->id);
-      break;
-    }
+// Maps the note and shows its first chunk. Returns 0 if the note is small
+// or cannot be mapped, it is then read the usual way.
+int StartNoteStream(WindowData* wd, Note* note) {
+  if(note->bodyLength < STREAM_MIN_SIZE) return 0;
+
+  size_t length;
+  const char* body = MapNoteBody(note,&length,&wd->stream);
+  if(!body) return 0;
+
+  wd->streamChunk = malloc(2 * STREAM_CHUNK_SIZE + 3);
+  wd->streamWide = malloc((2 * STREAM_CHUNK_SIZE + 3) * sizeof(WCHAR));
+  if(!wd->streamChunk || !wd->streamWide) {
+    free(wd->streamChunk);
+    free(wd->streamWide);
+    wd->streamChunk = NULL;
+    wd->streamWide = NULL;
+    UnmapNoteBody(&wd->stream);
+    return 0;
   }
+
+  wd->streamBody = body;
+  wd->streamLength = length;
+  wd->streamAt = NextEditChunk(body,length,0,STREAM_CHUNK_SIZE,wd->streamChunk);
+
+  SendMessage(wd->textHandle,EM_SETREADONLY,TRUE,0);
+  ToWideText(wd->streamWide,wd->streamChunk,strlen(wd->streamChunk));
+  SetWindowTextW(wd->textHandle,wd->streamWide);
+  if(wd->streamAt == length) StopNoteStream(wd);
+  return 1;
 }
 
-void WriteNoteToDisk(const char* filepath, HWND textHandle, Note* note) {
-  if(!filepath || !textHandle || !note) return;
+// Appends the next chunk without moving the caret or the view. Returns 0
+// once the whole body is in.
+int StreamNoteChunk(WindowData* wd) {
+  if(!wd->streamBody) return 0;
+
+  wd->streamAt += NextEditChunk(wd->streamBody,wd->streamLength,wd->streamAt,STREAM_CHUNK_SIZE,wd->streamChunk);
+  ToWideText(wd->streamWide,wd->streamChunk,strlen(wd->streamChunk));
+
+  DWORD start, end;
+  SendMessage(wd->textHandle,EM_GETSEL,(WPARAM)&start,(LPARAM)&end);
+  int firstLine = (int)SendMessage(wd->textHandle,EM_GETFIRSTVISIBLELINE,0,0);
+  int len = GetWindowTextLengthW(wd->textHandle);
+
+  SendMessage(wd->textHandle,WM_SETREDRAW,FALSE,0);
+  SendMessage(wd->textHandle,EM_SETSEL,len,len);
+  SendMessageW(wd->textHandle,EM_REPLACESEL,FALSE,(LPARAM)wd->streamWide);
+  SendMessage(wd->textHandle,EM_SETSEL,start,end);
+  SendMessage(wd->textHandle,EM_LINESCROLL,0,firstLine - (int)SendMessage(wd->textHandle,EM_GETFIRSTVISIBLELINE,0,0));
+  SendMessage(wd->textHandle,WM_SETREDRAW,TRUE,0);
+  InvalidateRect(wd->textHandle,NULL,FALSE);
+
+  if(wd->streamAt < wd->streamLength) return 1;
+  StopNoteStream(wd);
+  return 0;
+}
 
-  int len = GetWindowTextLength(textHandle);
-  if(len <= 1) return;  // Empty note, do not write to disk
+// Streams for one timer slice, input and painting go in between
+void ContinueNoteStream(WindowData* wd) {
+  unsigned long long deadline = GetTickCount64() + STREAM_SLICE_MS;
+  while(StreamNoteChunk(wd) && GetTickCount64() < deadline);
+}
 
-  FILE* f = fopen(filepath,"wb");
-  if(!f) return;
+// Brings in the rest at once, before the text is saved
+void FinishNoteStream(WindowData* wd) {
+  while(StreamNoteChunk(wd));
+}
 
-  char* buffer = malloc(len + 1); // + NT
-  GetWindowText(textHandle,buffer,len + 1);
+// Lists the newest saved versions of the note above its History button.
+// The one picked replaces the text as an edit that can be undone, and is
+// saved like typing.
+void ShowNoteHistory(WindowData* wd) {
+  Note* note = Find(wd->id);
+  if(!note) return;
 
-  // 
-  // Write config 
-  // 
-  fputc(note->opened,f);                    // Opened during exit?
-  fwrite(&note->x,sizeof(int),1,f);         // Coord X during exit
-  fwrite(&note->y,sizeof(int),1,f);         // Coord Y during exit
-  fwrite(&note->width,sizeof(int),1,f);     // Window width during exit
-  fwrite(&note->height,sizeof(int),1,f);    // Window height during exit
-  // End config with new line
-  fputc(CONFIG_SEPARATOR,f);
+  WaitForPendingSaves(note->id);
+  NoteVersion* versions;
+  size_t count = ListNoteVersions(note->filename,&versions);
 
-  // 
-  // Convert and write note text
-  // 
-  for(int i = 0, j = 0; i < len; ++i) {
-    if(buffer[i] == '\r' && buffer[i+1] == '\n') continue;
-    buffer[j++] = buffer[i];
+  HMENU menu = CreatePopupMenu();
+  if(!menu) {
+    free(versions);
+    return;
   }
 
-  fwrite(buffer,1,len,f);
+  if(!count) AppendMenu(menu,MF_STRING | MF_GRAYED,0,"No saved versions");
+  for(size_t i = 0; i < count && i < HISTORY_MENU_SIZE; ++i) {
+    const NoteVersion* version = &versions[count - 1 - i];
+    time_t saved = (time_t)version->time;
+    struct tm* local = localtime(&saved);
+
+    char when[32] = "", label[80];
+    if(local) strftime(when,sizeof(when),"%Y-%m-%d %H:%M",local);
+    snprintf(label,sizeof(label),"Version %u, %s, %u bytes",version->number,when,version->length);
+    AppendMenu(menu,MF_STRING,i + 1,label);
+  }
 
-  fclose(f);
-  free(buffer);
+  RECT rect;
+  GetWindowRect(wd->historyButtonHandle,&rect);
+  int picked = TrackPopupMenu(menu,TPM_RETURNCMD | TPM_LEFTALIGN | TPM_BOTTOMALIGN,rect.left,rect.top,0,wd->handle,NULL);
+  DestroyMenu(menu);
+
+  if(picked > 0 && (size_t)picked <= count) {
+    long length = 0;
+    char* text = ReadNoteVersion(note->filename,versions[count - picked].number,&length);
+    text = text ? ToEditText(text,length) : NULL;
+    if(text) {
+      FinishNoteStream(wd);
+      SendMessage(wd->textHandle,EM_SETSEL,0,-1);
+      ReplaceEditSelection(wd->textHandle,text,strlen(text),TRUE);
+      free(text);
+    }
+  }
+  free(versions);
 }
 
-void ReadNoteTextFromDisk(FILE* f, HWND textHandle, ssize_t offset) {
-  if(!f || !textHandle) return;
+// Saves the text of a window, unless it is empty or edits that were undone
+// left it as it is on disk
+void WriteNoteToDisk(WindowData* wd, Note* note) {
+  if(GetWindowTextLength(wd->textHandle) <= 1) return;  // Empty note, do not write to disk
 
-  long size = GetSizeOfFile(f) - offset;
-  fseek(f,offset,SEEK_SET);
+  TRACE_BEGIN(start);
+  size_t len;
+  char* buffer = GetNoteWindowText(wd->textHandle,&len);
+  if(!buffer) return;
 
-  char* buffer = malloc(size + 1);
-  fread(buffer,1,size,f);
-  buffer[size] = '\0';
-  fclose(f);
+  if(wd->storedText && !note->journalLength && len == wd->storedLength && memcmp(buffer,wd->storedText,len) == 0) {
+    free(buffer);
+    return;
+  }
 
-  SetWindowText(textHandle,buffer);
-  free(buffer);
+  int from = NoteRow(note);
+  SaveNote(note,buffer,len);
+  MoveNoteRow(note,from,MAIN_NOTELIST_HANDLE);
+  TRACE_END(TRACE_SAVE_NOTE,start,note->id,len);
 }
 
-void CloseNote(const char* filepath, HWND textHandle, Note* note) {
-  if(!note || !filepath || !textHandle) return;
-
-  if(note->changes) WriteNoteToDisk(filepath,textHandle,note);
+// Writes what changed of the note of a window: its text if that was
+// edited, its record in the geometry table if the window moved or the
+// note was opened or closed
+void SaveNoteWindow(WindowData* wd, Note* note) {
+  FlushPreviewUpdate(wd);
+  FinishNoteStream(wd);
 
+  if(note->changes) WriteNoteToDisk(wd,note);
   note->changes = 0;
+
+  RetrieveNoteWindowPosition(wd->handle,note);
+  if(wd->stored || note->bodyLength) SaveNoteGeometry(note);  // Not for a new note left empty
+}
+
+// Saves the note of a window along with where the window is and puts the
+// window back into the pool
+void CloseNoteWindow(WindowData* wd) {
+  Note* note = Find(wd->id);
+  if(!note) assert(false && "this should not have happened");
+
   note->opened = 0;
+  SaveNoteWindow(wd,note);
+  note->handle = NULL;
+  ReleaseNoteWindow(wd);
 }
 
 LRESULT CALLBACK NoteWindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam) {
   WindowData* wd = (WindowData*)GetWindowLongPtr(hwnd,GWLP_USERDATA);
 
   switch(uMsg) {
-    case WM_CLOSE: {
-      Note* note = Find(wd->id);
-      if(!note) assert(false && "this should not have happened");
-
-      if(wd->positionalChanges) { 
-        RetrieveNoteWindowPosition(wd->handle,note);
-        note->changes = 1; 
-        wd->positionalChanges = 0;
-      }
-
-      CloseNote(wd->filepath,wd->textHandle,note);
-      DestroyWindow(hwnd);
-    } return 0;
+    case WM_CLOSE: CloseNoteWindow(wd); return 0;
 
     case WM_DESTROY: {
+      if(wd) {
+        KillTimer(hwnd,PREVIEW_TIMER_ID);
+        KillTimer(hwnd,SEARCH_TIMER_ID);
+        KillTimer(hwnd,JOURNAL_TIMER_ID);
+        StopNoteStream(wd);
+        free(wd->storedText);
+      }
       free(wd);
       SetWindowLongPtr(hwnd,GWLP_USERDATA,0);
     } return 0;
 
+    case WM_TIMER: {
+      if(!wd) break;
+      if(wParam == PREVIEW_TIMER_ID) FlushPreviewUpdate(wd);
+      else if(wParam == SEARCH_TIMER_ID) IndexNoteWindow(wd);
+      else if(wParam == JOURNAL_TIMER_ID) JournalNoteWindow(wd);
+      else if(wParam == STREAM_TIMER_ID) ContinueNoteStream(wd);
+      else break;
+    } return 0;
+
+    case WM_ACTIVATE: {
+      Note* note = wd ? Find(wd->id) : NULL;
+      if(note && LOWORD(wParam) != WA_INACTIVE) RaiseNote(note);
+    } break;
+
     case WM_SIZE: {
       int width = LOWORD(lParam);
       int height = HIWORD(lParam);
-      wd->positionalChanges = 1;
 
       // Reposition text box
       SetWindowPos(
@@ -496,7 +741,7 @@ LRESULT CALLBACK NoteWindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lPar
         SWP_NOZORDER
       );
 
-      // Reposition button
+      // Reposition buttons
       if(wd->deleteButtonHandle) {
         SetWindowPos(
           wd->deleteButtonHandle,NULL,
@@ -504,6 +749,13 @@ LRESULT CALLBACK NoteWindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lPar
           SWP_NOZORDER
         );
       }
+      if(wd->historyButtonHandle) {
+        SetWindowPos(
+          wd->historyButtonHandle,NULL,
+          20 + STD_BUTTONWIDTH,height-STD_BUTTONHEIGHT,STD_BUTTONWIDTH,STD_BUTTONHEIGHT,
+          SWP_NOZORDER
+        );
+      }
     } return 0;
 
     case WM_COMMAND : {
@@ -514,13 +766,25 @@ LRESULT CALLBACK NoteWindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lPar
         Note* note = Find(wd->id);
         if(!note) assert(false && "this should not have happened");
 
-        DeleteNoteFromDisk(NOTESPATH,note->filename);
+        StopNoteStream(wd);  // The file cannot be deleted while it is mapped
+
+        DeleteNoteFromDisk(NOTESPATH,note);
         DeleteNote(note);
       }
+      else if(wmId == NOTE_HISTORYBUTTON_ID) ShowNoteHistory(wd);
       else if(wmId == NOTE_EDIT_ID && msg == EN_CHANGE) {
         Note* note = Find(wd->id);
-        UpdateNotePreview(note,wd->textHandle,MAIN_NOTELIST_HANDLE);
+        if(!note || wd->streamBody) break;
+
         note->changes = 1;
+        SchedulePreviewUpdate(wd);
+        SetTimer(hwnd,SEARCH_TIMER_ID,SEARCH_DELAY_MS,NULL);
+
+        // Not restarted by later changes, so steady typing is journaled too
+        if(!wd->journalPending) {
+          wd->journalPending = 1;
+          SetTimer(hwnd,JOURNAL_TIMER_ID,JOURNAL_DELAY_MS,NULL);
+        }
       }
     } break;
   }
@@ -540,14 +804,17 @@ void CreateStandardNoteComponents(WindowData* wd, HINSTANCE hInstance, int x, in
   if(wd->handle == NULL)
     return;
 
-  // Create text are of the window
-  wd->textHandle = CreateWindowEx(
-    0,"EDIT","",
+  // Create text are of the window, a Unicode edit whatever the build
+  wd->textHandle = CreateWindowExW(
+    0,L"EDIT",L"",
     WS_CHILD | WS_VISIBLE | WS_BORDER | ES_MULTILINE | ES_AUTOVSCROLL,
     0,0,width,height - STD_BUTTONHEIGHT,
     wd->handle,(HMENU)NOTE_EDIT_ID,hInstance,NULL
   );
 
+  // No 32K limit on typing, or on chunks appended while streaming
+  if(wd->textHandle) SendMessage(wd->textHandle,EM_SETLIMITTEXT,0,0);
+
   // Create delete button of the note
   wd->deleteButtonHandle = CreateWindowEx(
     0,"BUTTON","Delete",
@@ -555,78 +822,198 @@ void CreateStandardNoteComponents(WindowData* wd, HINSTANCE hInstance, int x, in
     10,width-STD_BUTTONHEIGHT,STD_BUTTONWIDTH,STD_BUTTONHEIGHT,
     wd->handle,(HMENU)NOTE_DELETEBUTTON_ID,hInstance,NULL
   );
+
+  // Create history button of the note
+  wd->historyButtonHandle = CreateWindowEx(
+    0,"BUTTON","History",
+    WS_CHILD | WS_VISIBLE | BS_PUSHBUTTON,
+    20 + STD_BUTTONWIDTH,width-STD_BUTTONHEIGHT,STD_BUTTONWIDTH,STD_BUTTONHEIGHT,
+    wd->handle,(HMENU)NOTE_HISTORYBUTTON_ID,hInstance,NULL
+  );
 }
 
-void OpenNoteFromList(const char* filepath, HINSTANCE hInstance, HWND listHandle, int index) {
-  WindowData* wd = malloc(sizeof(WindowData));
+// Hides a closed note window and puts it back into the pool, or destroys
+// it when the pool is full
+void ReleaseNoteWindow(WindowData* wd) {
   if(!wd) return;
 
-  int id = SendMessage(listHandle,LB_GETITEMDATA,index,0);
-  Note* note = Find(id);
-  if(!note) return;
+  if(windowPool.size == WINDOW_POOL_SIZE) {
+    DestroyWindow(wd->handle);
+    return;
+  }
+
+  KillTimer(wd->handle,PREVIEW_TIMER_ID);
+  KillTimer(wd->handle,SEARCH_TIMER_ID);
+  KillTimer(wd->handle,JOURNAL_TIMER_ID);
+  StopNoteStream(wd);
+  free(wd->storedText);
+
+  ShowWindow(wd->handle,SW_HIDE);
+  SendMessage(wd->textHandle,EM_SETREADONLY,FALSE,0);
+  SetWindowText(wd->textHandle,"");
+  SendMessage(wd->textHandle,EM_EMPTYUNDOBUFFER,0,0);
 
-  CreateStandardNoteComponents(wd,hInstance,note->x,note->y,note->width,note->height);
+  *wd = (WindowData){.handle = wd->handle, .textHandle = wd->textHandle, .deleteButtonHandle = wd->deleteButtonHandle,
+                     .historyButtonHandle = wd->historyButtonHandle};
+  windowPool.data[windowPool.size++] = wd;
+}
+
+// Takes a note window out of the pool and moves it into place, or creates
+// a new one. CW_USEDEFAULT for x keeps a pooled window where it was.
+WindowData* AcquireNoteWindow(HINSTANCE hInstance, int x, int y, int width, int height) {
+  TRACE_BEGIN(start);
+
+  if(windowPool.size) {
+    WindowData* wd = windowPool.data[--windowPool.size];
+    UINT flags = SWP_NOZORDER | SWP_NOACTIVATE | (x == CW_USEDEFAULT ? SWP_NOMOVE : 0);
+    SetWindowPos(wd->handle,NULL,x,y,width,height,flags);
+
+    TRACE_END(TRACE_CREATE_WINDOW,start,1,0);
+    return wd;
+  }
+
+  WindowData* wd = calloc(1,sizeof(WindowData));
+  if(!wd) return NULL;
+
+  CreateStandardNoteComponents(wd,hInstance,x,y,width,height);
   if(wd->handle == NULL) {
     free(wd);
-    return;
+    return NULL;
   }
   if(wd->textHandle == NULL) {
     // TODO
     // Delete window for now
     DestroyWindow(wd->handle);
+    return NULL;
+  }
+
+  SetWindowLongPtr(wd->handle,GWLP_USERDATA,(LONG_PTR)wd);
+
+  TRACE_END(TRACE_CREATE_WINDOW,start,0,0);
+  return wd;
+}
+
+// Opens the note in a window. A restored note is shown behind the window
+// in use instead of taking the focus.
+void OpenNoteFromList(const char* filepath, HINSTANCE hInstance, Note* note, int restore) {
+  if(!note) return;
+
+  // Already open, bring it up instead of opening it twice
+  if(note->handle) {
+    if(!restore) SetForegroundWindow(note->handle);
     return;
   }
 
-  FILE* f = fopen(filepath,"rb");
-  if(!f) return;
+  TRACE_BEGIN(start);
+  WindowData* wd = AcquireNoteWindow(hInstance,note->x,note->y,note->width,note->height);
+  if(!wd) return;
+
+  WaitForPendingSaves(note->id);
 
-  long configlen = ConfigLength(f);
-  ReadNoteTextFromDisk(f,wd->textHandle,configlen);
+  if(!StartNoteStream(wd,note)) {
+    long length = 0;
+    char* body = ReadNoteText(note,&length);
+    if(!body) {
+      ReleaseNoteWindow(wd);
+      return;
+    }
+
+    if(length < STREAM_MIN_SIZE) {
+      wd->storedText = malloc(length + 1);
+      if(wd->storedText) memcpy(wd->storedText,body,length + 1);
+      wd->storedLength = length;
+    }
+
+    body = ToEditText(body,length);
+    SetEditText(wd->textHandle,body,strlen(body));
+    free(body);
+  }
+  wd->stored = 1;
 
-  note->changes = 1;
   note->handle = wd->handle;
-  note->opened = 1;
-  wd->id = id;
+  wd->id = note->id;
+  if(!note->opened) {
+    note->opened = 1;
+    SaveNoteGeometry(note);  // Reopened on the next start even after a crash
+  }
 
   strcpy(wd->filepath,filepath);
 
-  SetWindowLongPtr(wd->handle,GWLP_USERDATA,(LONG_PTR)wd);
-  ShowWindow(wd->handle,SW_SHOWNORMAL);
-  SetForegroundWindow(wd->handle);
+  if(restore) ShowWindow(wd->handle,SW_SHOWNOACTIVATE);
+  else {
+    ShowWindow(wd->handle,SW_SHOWNORMAL);
+    SetForegroundWindow(wd->handle);
+  }
+
+  if(wd->streamBody) SetTimer(wd->handle,STREAM_TIMER_ID,USER_TIMER_MINIMUM,NULL);
+
+  TRACE_END(TRACE_OPEN_NOTE,start,note->id,restore);
 }
 
-void CreateNewNoteAndAddToList(const char* notePath, HINSTANCE hInstance, HWND listHandle) {
-  WindowData* wd = malloc(sizeof(WindowData));
-  if(!wd) return;
+// Whether any part of the note's window would be on a monitor
+int NoteOnScreen(const Note* note) {
+  RECT rect = {note->x,note->y,note->x + note->width,note->y + note->height};
+  return MonitorFromRect(&rect,MONITOR_DEFAULTTONULL) != NULL;
+}
 
-  CreateStandardNoteComponents(wd, hInstance, CW_USEDEFAULT, CW_USEDEFAULT, STD_NOTE_WINDOWWIDTH, STD_NOTE_WINDOWHEIGHT);
-  if(wd->handle == NULL) {
-    free(wd);
-    return;
-  }
-  if(wd->textHandle == NULL) {
-    // TODO
-    // Delete window for now
-    DestroyWindow(wd->handle);
-    return;
+// Gives the next queued note its window, notes on screen before those
+// that are not, and the backmost first so the stacking comes back as it
+// was. Returns 0 once nothing is left to restore.
+int RestoreNextNote() {
+  size_t pick = restoreQueue.size;
+  int pickOnScreen = 0;
+  unsigned int pickZOrder = 0;
+
+  for(size_t i = 0; i < restoreQueue.size;) {
+    Note* note = Find(restoreQueue.data[i]);
+
+    // Deleted, closed or opened from the list in the meantime
+    if(!note || !note->opened || note->handle) {
+      restoreQueue.size--;
+      memmove(restoreQueue.data + i,restoreQueue.data + i + 1,(restoreQueue.size - i) * sizeof(NoteId));
+      continue;
+    }
+
+    int onScreen = NoteOnScreen(note);
+    if(pick == restoreQueue.size || onScreen > pickOnScreen || (onScreen == pickOnScreen && note->zOrder < pickZOrder)) {
+      pick = i;
+      pickOnScreen = onScreen;
+      pickZOrder = note->zOrder;
+    }
+    ++i;
   }
+  if(pick >= restoreQueue.size) return 0;
+
+  Note* note = Find(restoreQueue.data[pick]);
+  restoreQueue.size--;
+  memmove(restoreQueue.data + pick,restoreQueue.data + pick + 1,(restoreQueue.size - pick) * sizeof(NoteId));
+
+  char fullpath[MAX_PATH + 1];
+  NotePath(fullpath,sizeof(fullpath),note->filename,"");
+  OpenNoteFromList(fullpath,GetModuleHandle(NULL),note,1);
+  return 1;
+}
+
+void CreateNewNoteAndAddToList(HINSTANCE hInstance, HWND listHandle) {
+  WindowData* wd = AcquireNoteWindow(hInstance,CW_USEDEFAULT,CW_USEDEFAULT,STD_NOTE_WINDOWWIDTH,STD_NOTE_WINDOWHEIGHT);
+  if(!wd) return;
 
   char filenameBuffer[FILENAME_SIZE + 1];
-  sprintf(filenameBuffer,"%lld.hnote",(long long)GetTickCount64());
-  filenameBuffer[FILENAME_SIZE] = '\0';
+  unsigned long long created = NewNoteFilename(filenameBuffer);
 
   // Set path and file name
-  sprintf(wd->filepath,"%s\\%s",notePath,filenameBuffer);
-
-  // Register user data pointer
-  SetWindowLongPtr(wd->handle,GWLP_USERDATA,(LONG_PTR)wd);
+  NotePath(wd->filepath,sizeof(wd->filepath),filenameBuffer,"");
 
   // Show and focus on new note
   ShowWindow(wd->handle,SW_SHOWNORMAL);
   SetForegroundWindow(wd->handle);
   SetFocus(wd->textHandle);
 
-  Note* n = Push((Note){.opened = 1, .changes = 1, .id = NOTEID++});
+  Note* n = Insert((Note){.opened = 1, .changes = 1, .catalogSlot = -1, .bodyOffset = sizeof(NoteHeader), .created = created});
+  if(!n) {
+    ReleaseNoteWindow(wd);
+    return;
+  }
   memcpy(n->filename,filenameBuffer,FILENAME_SIZE + 1);
   n->handle = wd->handle;
   memcpy(n->preview,EMPTYNOTE_STRING,sizeof(EMPTYNOTE_STRING));
@@ -634,60 +1021,204 @@ void CreateNewNoteAndAddToList(const char* notePath, HINSTANCE hInstance, HWND l
   RetrieveNoteWindowPosition(wd->handle,n);
 
   wd->id = n->id;
+  RaiseNote(n);
+
+  TouchNote(n);
+  AddNoteToList(n,listHandle);
+}
 
-  int index = SendMessage(listHandle,LB_ADDSTRING,0,(LPARAM)n->preview);
-  SendMessage(listHandle,LB_SETITEMDATA,index,(LPARAM)n->id);
+// Notes of all selected rows in list order, NULL if none is selected.
+// The caller frees the array.
+Note** GetSelectedNotes(HWND listHandle, size_t* count) {
+  *count = 0;
+  int selected = (int)SendListMessage(listHandle,LB_GETSELCOUNT,0,0);
+  if(selected <= 0) return NULL;
+
+  int* rows = malloc(sizeof(int) * selected);
+  Note** notes = malloc(sizeof(Note*) * selected);
+  if(!rows || !notes) {
+    free(rows);
+    free(notes);
+    return NULL;
+  }
+
+  selected = (int)SendListMessage(listHandle,LB_GETSELITEMS,selected,(LPARAM)rows);
+  for(int i = 0; i < selected; ++i) {
+    Note* note = NoteAtRow(rows[i]);
+    if(note) notes[(*count)++] = note;
+  }
+  free(rows);
+
+  if(!*count) {
+    free(notes);
+    return NULL;
+  }
+  return notes;
 }
 
 void OpenBySelection(HWND listHandle) {
-  int selectedIndex = (int)SendMessage(listHandle,LB_GETCURSEL,0,0);
-  if(selectedIndex == LB_ERR) return; // non selected
+  size_t count;
+  Note** notes = GetSelectedNotes(listHandle,&count);
+  if(!notes) return; // non selected
+
+  char fullPath[MAX_PATH + 1];
+  for(size_t i = 0; i < count; ++i) {
+    NotePath(fullPath,sizeof(fullPath),notes[i]->filename,"");
+    OpenNoteFromList(fullPath,GetModuleHandle(NULL),notes[i],0);
+  }
+  free(notes);
+}
 
-  int id = SendMessage(listHandle,LB_GETITEMDATA,selectedIndex,0);
-  Note* note = Find(id);
-  if(!note) return;
-  
-  char fullPath[MAX_PATH];
-  sprintf(fullPath,"%s\\%s\0",NOTESPATH,note->filename);
+void CloseSelectedNotes(HWND listHandle) {
+  size_t count;
+  Note** notes = GetSelectedNotes(listHandle,&count);
+  if(!notes) return;
+
+  for(size_t i = 0; i < count; ++i)
+    if(notes[i]->handle) CloseNoteWindow((WindowData*)GetWindowLongPtr(notes[i]->handle,GWLP_USERDATA));
+  free(notes);
+}
+
+// Deletes every selected note with one job for the writer and a single
+// list update, instead of one removal per note
+void DeleteSelectedNotes(HWND listHandle) {
+  size_t count;
+  Note** notes = GetSelectedNotes(listHandle,&count);
+  if(!notes) return;
+
+  // Windows go first, the file of a streaming note is still mapped
+  for(size_t i = 0; i < count; ++i) {
+    if(!notes[i]->handle) continue;
+    ReleaseNoteWindow((WindowData*)GetWindowLongPtr(notes[i]->handle,GWLP_USERDATA));
+    notes[i]->handle = NULL;
+  }
+
+  DeleteNotesFromDisk(NOTESPATH,notes,count);
+
+  for(size_t i = 0; i < count; ++i) {
+    RemoveNoteFromIndex(notes[i]->id);
+    Remove(notes[i]->id);
+  }
+  free(notes);
+
+  SendListMessage(listHandle,WM_SETREDRAW,FALSE,0);
+  SendListMessage(listHandle,LB_SETCOUNT,ListedNoteCount(),0);
+  SendListMessage(listHandle,WM_SETREDRAW,TRUE,0);
+  InvalidateRect(listHandle,NULL,TRUE);
+}
+
+// Finished exports arrive at the main window as WM_NOTESEXPORTED
+#define WM_NOTESEXPORTED (WM_APP + 4)  // wParam: notes written, lParam: notes selected
+
+void ExportFolder(char* buffer, size_t size) {
+  snprintf(buffer,size,"%s\\export",NOTESPATH);
+}
 
-  OpenNoteFromList(fullPath,GetModuleHandle(NULL),listHandle,selectedIndex);
+// Writer thread: tells the main window how the export went
+void PostNotesExported(size_t exported, size_t count, void* context) {
+  PostMessage((HWND)context,WM_NOTESEXPORTED,(WPARAM)exported,(LPARAM)count);
+}
+
+// Exports the stored text of every selected note to the export folder
+// next to the notes. Edits not journaled yet are journaled first. The
+// result is shown once the writer is through, see WM_NOTESEXPORTED.
+void ExportSelectedNotes(HWND listHandle, HWND mainHandle) {
+  size_t count;
+  Note** notes = GetSelectedNotes(listHandle,&count);
+  if(!notes) return;
+
+  for(size_t i = 0; i < count; ++i) {
+    if(!notes[i]->handle) continue;
+    WindowData* wd = (WindowData*)GetWindowLongPtr(notes[i]->handle,GWLP_USERDATA);
+    if(wd->journalPending) JournalNoteWindow(wd);
+  }
+
+  char dir[MAX_PATH + 1];
+  ExportFolder(dir,sizeof(dir));
+  ExportNotes(dir,notes,count,PostNotesExported,mainHandle);
+  free(notes);
+}
+
+// Shows how an export went once the writer is through with it
+void ShowExportResult(HWND mainHandle, size_t exported, size_t count) {
+  char dir[MAX_PATH + 1], message[MAX_PATH + 96];
+  ExportFolder(dir,sizeof(dir));
+  if(exported == count) {
+    snprintf(message,sizeof(message),"Exported %zu notes to %s",count,dir);
+    MessageBoxA(mainHandle,message,"Hose",MB_ICONINFORMATION);
+  }
+  else {
+    snprintf(message,sizeof(message),"Exported %zu of %zu notes to %s, the others could not be written.",exported,count,dir);
+    MessageBoxA(mainHandle,message,"Hose",MB_ICONWARNING);
+  }
 }
 
 /** Windows Event Handler  */
 LRESULT CALLBACK MainWindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam) {
   switch(uMsg) {
     case WM_CLOSE: {
-      // Write all open notes with changes to disk
-      for(int i = 0; i < noteArray.size; ++i) {
-        Note* note = &noteArray.data[i];
-        if(note->changes) {
-          WindowData* wd = (WindowData*)GetWindowLongPtr(note->handle,GWLP_USERDATA);
-
-          if(wd->positionalChanges) {
-            RetrieveNoteWindowPosition(wd->handle,note);
-            note->changes = 1;
-            wd->positionalChanges = 0;
-          }
-
-          CloseNote(wd->filepath,wd->textHandle,note);
-          DestroyWindow(note->handle);
-        }
+      // Write what changed of all open notes, they stay open for the next start
+      for(size_t i = 0; i < noteRegistry.slotCount; ++i) {
+        Note* note = NoteAtSlot(i);
+        if(note && note->handle)
+          SaveNoteWindow((WindowData*)GetWindowLongPtr(note->handle,GWLP_USERDATA),note);
       }
+
+      if(DrainSaveQueue(ShowSaveProgress,hwnd,SAVE_DRAIN_TIMEOUT_MS))
+        MessageBoxA(hwnd,"Some notes could not be saved in time.","Hose",MB_ICONWARNING);
+
+      SaveSearchIndex();
+      if(statsOnExit) TraceStatsDump(statsPath);
       DestroyWindow(hwnd);
     } return 0;
     case WM_DESTROY: PostQuitMessage(0); return 0;
 
+    case WM_NOTESLOADED: {
+      if(lParam) MergeLoadedNotes((LoadBatch*)lParam,MAIN_NOTELIST_HANDLE);
+      else {
+        // Loading is done, bring the catalog in line with the directory
+        SyncCatalog();
+        StartSearchIndexing(PostSearchReady,hwnd);
+      }
+    } return 0;
+
+    case WM_SEARCHREADY: {
+      if(GetWindowTextLength(MAIN_SEARCH_HANDLE) > 0) ApplySearchFilter(MAIN_SEARCH_HANDLE,MAIN_NOTELIST_HANDLE);
+    } return 0;
+
+    case WM_SEARCHREJECTS: {
+      RemoveSearchRejects((SearchRejects*)lParam,MAIN_NOTELIST_HANDLE);
+    } return 0;
+
+    case WM_NOTESEXPORTED: {
+      ShowExportResult(hwnd,(size_t)wParam,(size_t)lParam);
+    } return 0;
+
+    case WM_DRAWITEM: {
+      DRAWITEMSTRUCT* dis = (DRAWITEMSTRUCT*)lParam;
+      if(dis->CtlID != MAIN_NOTELIST_ID) break;
+
+      DrawNoteRow(dis);
+    } return TRUE;
+
     case WM_SIZE: { // Window resize event
       // Get new window dimensions
       int width = LOWORD(lParam);
       int height = HIWORD(lParam);
 
       // Reposition main components
+      int newWidth = width - STD_BUTTONWIDTH - FISSURE*2;
+      if(MAIN_SEARCH_HANDLE) {
+        SetWindowPos(
+          MAIN_SEARCH_HANDLE,NULL,
+          0,0,newWidth,STD_SEARCHHEIGHT,
+          SWP_NOZORDER
+        );
+      }
       if(MAIN_NOTELIST_HANDLE) {
-        int newWidth = width - STD_BUTTONWIDTH - FISSURE*2;
         SetWindowPos(
           MAIN_NOTELIST_HANDLE,NULL,
-          0,0,newWidth,STD_MAIN_WINDOWHEIGHT,
+          0,STD_SEARCHHEIGHT,newWidth,height - STD_SEARCHHEIGHT,
           SWP_NOZORDER
         );
       }
@@ -715,6 +1246,27 @@ LRESULT CALLBACK MainWindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lPar
           SWP_NOZORDER
         );
       }
+      if(MAIN_CLOSEBUTTON_HANDLE) {
+        SetWindowPos(
+          MAIN_CLOSEBUTTON_HANDLE,NULL,
+          newStart,(STD_BUTTONHEIGHT * 3) + (FISSURE * 3 / 2),STD_BUTTONWIDTH,STD_BUTTONHEIGHT,
+          SWP_NOZORDER
+        );
+      }
+      if(MAIN_EXPORTBUTTON_HANDLE) {
+        SetWindowPos(
+          MAIN_EXPORTBUTTON_HANDLE,NULL,
+          newStart,(STD_BUTTONHEIGHT * 4) + (FISSURE * 2),STD_BUTTONWIDTH,STD_BUTTONHEIGHT,
+          SWP_NOZORDER
+        );
+      }
+      if(MAIN_SORT_HANDLE) {
+        SetWindowPos(
+          MAIN_SORT_HANDLE,NULL,
+          newStart,(STD_BUTTONHEIGHT * 5) + (FISSURE * 5 / 2),STD_BUTTONWIDTH,STD_SORTHEIGHT,
+          SWP_NOZORDER
+        );
+      }
 
     } return 0;
 
@@ -722,22 +1274,28 @@ LRESULT CALLBACK MainWindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lPar
     {
       int wmId = LOWORD(wParam);
       if(wmId == MAIN_CREATEBUTTON_ID) {
-        CreateNewNoteAndAddToList(NOTESPATH,GetModuleHandle(NULL),MAIN_NOTELIST_HANDLE);
+        CreateNewNoteAndAddToList(GetModuleHandle(NULL),MAIN_NOTELIST_HANDLE);
         return 0;
       }
       else if(wmId == MAIN_OPENBUTTON_ID) {
         OpenBySelection(MAIN_NOTELIST_HANDLE);
       }
       else if(wmId == MAIN_DELETEBUTTON_ID) {
-        int selectedIndex = (int)SendMessage(MAIN_NOTELIST_HANDLE,LB_GETCURSEL,0,0);
-        if(selectedIndex == LB_ERR) break;
-        
-        int id = SendMessage(MAIN_NOTELIST_HANDLE,LB_GETITEMDATA,selectedIndex,0);
-        Note* note = Find(id);
-        if(!note) assert(false && "this should not have happened");
+        DeleteSelectedNotes(MAIN_NOTELIST_HANDLE);
+      }
+      else if(wmId == MAIN_CLOSEBUTTON_ID) {
+        CloseSelectedNotes(MAIN_NOTELIST_HANDLE);
+      }
+      else if(wmId == MAIN_EXPORTBUTTON_ID) {
+        ExportSelectedNotes(MAIN_NOTELIST_HANDLE,hwnd);
+      }
 
-        DeleteNoteFromDisk(NOTESPATH,note->filename);
-        DeleteNote(note);
+      if(wmId == MAIN_SEARCH_ID && HIWORD(wParam) == EN_CHANGE) {
+        ApplySearchFilter(MAIN_SEARCH_HANDLE,MAIN_NOTELIST_HANDLE);
+      }
+
+      if(wmId == MAIN_SORT_ID && HIWORD(wParam) == CBN_SELCHANGE) {
+        SortNoteList(MAIN_SORT_HANDLE,MAIN_NOTELIST_HANDLE);
       }
 
       if(wmId == MAIN_NOTELIST_ID && HIWORD(wParam) == LBN_DBLCLK) {
@@ -750,6 +1308,47 @@ LRESULT CALLBACK MainWindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lPar
   return DefWindowProc(hwnd,uMsg,wParam,lParam);
 }
 
+// Copies the path following flag on the command line into path, or the
+// file named fallback next to the notes if none follows. Returns 0 if flag
+// is not on the command line.
+int PathArgument(const char* cmdLine, const char* flag, const char* fallback, char* path, size_t size) {
+  const char* at = strstr(cmdLine,flag);
+  if(!at) return 0;
+
+  at += strlen(flag);
+  while(*at == ' ') at++;
+
+  size_t len;
+  if(*at == '"') {
+    const char* end = strchr(++at,'"');
+    len = end ? (size_t)(end - at) : strlen(at);
+  }
+  else len = strcspn(at," ");
+
+  if(len && *at != '-') snprintf(path,size,"%.*s",(int)len,at);
+  else snprintf(path,size,"%s\\%s",NOTESPATH,fallback);
+  return 1;
+}
+
+// Runs an archive export or import asked for on the command line and
+// tells how it went
+void RunArchiveCommand(const char* cmdLine) {
+  char path[MAX_PATH + 1], message[MAX_PATH + 128];
+  unsigned long exported, imported, skipped;
+
+  if(PathArgument(cmdLine,"-archive-export","hose-notes.harc",path,sizeof(path))) {
+    if(ExportArchive(path,&exported)) snprintf(message,sizeof(message),"Exported %lu notes to %s",exported,path);
+    else snprintf(message,sizeof(message),"Could not write %s",path);
+    MessageBoxA(NULL,message,"Hose",MB_ICONINFORMATION);
+  }
+  else if(PathArgument(cmdLine,"-archive-import","hose-notes.harc",path,sizeof(path))) {
+    int ok = ImportArchive(path,&imported,&skipped);
+    snprintf(message,sizeof(message),"Imported %lu notes from %s, %lu were there already%s",imported,path,skipped,
+             ok ? "" : ". The archive is damaged or incomplete.");
+    MessageBoxA(NULL,message,"Hose",MB_ICONINFORMATION);
+  }
+}
+
 void RegisterClasses(HINSTANCE hInstance) {
   // Register main window class
   WNDCLASS wcMain = {};
@@ -774,8 +1373,32 @@ void RegisterClasses(HINSTANCE hInstance) {
 
 int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine, int nCmdShow) {
 
+  InitNoteStore();
   PrepareNotesPath();
+
+  // Trace rings are written next to the notes on a crash and on Ctrl+F12
+  static char tracePath[MAX_PATH + 1];
+  snprintf(tracePath,sizeof(tracePath),"%s\\hose-trace.json",NOTESPATH);
+  TraceDumpOnCrash(tracePath);
+
+  // Latency stats go next to the notes on Ctrl+F11, and on exit when asked
+  // for with -stats [path], a path ending in .json gets JSON
+  statsOnExit = PathArgument(lpCmdLine,"-stats","hose-stats.txt",statsPath,sizeof(statsPath));
+  if(!statsOnExit) snprintf(statsPath,sizeof(statsPath),"%s\\hose-stats.txt",NOTESPATH);
+
+  // One-off conversions between loose .hnote files and the pack store
+  if(strstr(lpCmdLine,"-pack-import")) ImportNotesToPack();
+  else if(strstr(lpCmdLine,"-pack-export")) ExportPackToNotes();
+
+  // Drops stored chunks that no version of any note refers to any more
+  unsigned long long freed;
+  if(strstr(lpCmdLine,"-history-gc")) CollectHistoryGarbage(&freed);
+
+  // Whole store to or from a single archive
+  RunArchiveCommand(lpCmdLine);
+
   RegisterClasses(hInstance);
+  StartSaveWriter();
 
   // Create the main window
   HWND mainHandle = CreateWindowEx(
@@ -819,24 +1442,68 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
     mainHandle,(HMENU)MAIN_DELETEBUTTON_ID,hInstance,NULL
   );
 
+  // Close notes button
+  MAIN_CLOSEBUTTON_HANDLE = CreateWindowEx(
+    0,"BUTTON","Close Selected",
+    WS_TABSTOP | WS_VISIBLE | WS_CHILD | BS_PUSHBUTTON,
+    xStart,(STD_BUTTONHEIGHT * 3) + (FISSURE * 3 / 2),STD_BUTTONWIDTH,STD_BUTTONHEIGHT,
+    mainHandle,(HMENU)MAIN_CLOSEBUTTON_ID,hInstance,NULL
+  );
+
+  // Export notes button
+  MAIN_EXPORTBUTTON_HANDLE = CreateWindowEx(
+    0,"BUTTON","Export Selected",
+    WS_TABSTOP | WS_VISIBLE | WS_CHILD | BS_PUSHBUTTON,
+    xStart,(STD_BUTTONHEIGHT * 4) + (FISSURE * 2),STD_BUTTONWIDTH,STD_BUTTONHEIGHT,
+    mainHandle,(HMENU)MAIN_EXPORTBUTTON_ID,hInstance,NULL
+  );
+
+  // Order of the list, entries in NOTE_ORDER_ order
+  MAIN_SORT_HANDLE = CreateWindowEx(
+    0,"COMBOBOX",NULL,
+    WS_TABSTOP | WS_VISIBLE | WS_CHILD | WS_VSCROLL | CBS_DROPDOWNLIST,
+    xStart,(STD_BUTTONHEIGHT * 5) + (FISSURE * 5 / 2),STD_BUTTONWIDTH,STD_SORTHEIGHT,
+    mainHandle,(HMENU)MAIN_SORT_ID,hInstance,NULL
+  );
+  SendMessage(MAIN_SORT_HANDLE,CB_ADDSTRING,0,(LPARAM)"Last modified");
+  SendMessage(MAIN_SORT_HANDLE,CB_ADDSTRING,0,(LPARAM)"Created");
+  SendMessage(MAIN_SORT_HANDLE,CB_ADDSTRING,0,(LPARAM)"Title");
+  SendMessage(MAIN_SORT_HANDLE,CB_ADDSTRING,0,(LPARAM)"Size");
+  SendMessage(MAIN_SORT_HANDLE,CB_SETCURSEL,GetNoteOrder(),0);
+
+  // Search box, filters the list by note text
+  MAIN_SEARCH_HANDLE = CreateWindowExW(
+    0,L"EDIT",NULL,
+    WS_CHILD | WS_VISIBLE | WS_BORDER | WS_TABSTOP | ES_AUTOHSCROLL,
+    0,0,(STD_MAIN_WINDOWWIDTH-STD_BUTTONWIDTH-FISSURE*2),STD_SEARCHHEIGHT,
+    mainHandle,(HMENU)MAIN_SEARCH_ID,hInstance,NULL
+  );
+  SendMessage(MAIN_SEARCH_HANDLE,EM_SETLIMITTEXT,SEARCH_QUERY_SIZE - 1,0);
+
   // List of notes
   MAIN_NOTELIST_HANDLE = CreateWindowEx(
     0,"LISTBOX",NULL,
-    WS_CHILD | WS_VISIBLE | WS_BORDER | WS_VSCROLL | LBS_NOTIFY,
-    0,0,(STD_MAIN_WINDOWWIDTH-STD_BUTTONWIDTH-FISSURE*2),STD_MAIN_WINDOWHEIGHT,
+    WS_CHILD | WS_VISIBLE | WS_BORDER | WS_VSCROLL | LBS_NOTIFY | LBS_NODATA | LBS_OWNERDRAWFIXED | LBS_EXTENDEDSEL,
+    0,STD_SEARCHHEIGHT,(STD_MAIN_WINDOWWIDTH-STD_BUTTONWIDTH-FISSURE*2),STD_MAIN_WINDOWHEIGHT-STD_SEARCHHEIGHT,
     mainHandle,(HMENU)MAIN_NOTELIST_ID,hInstance,NULL
   );
 
-  FindNotesFromDisk(NOTESPATH);
-
+  // Show the window right away, notes fill in as they are loaded
   ShowWindow(mainHandle,nCmdShow);
+  StartLoadingNotes(PostLoadedBatch,mainHandle);
 
-  // Program loop
+  // Program loop. Restored notes get their windows whenever it runs dry.
   MSG msg = {0};
-  while(GetMessage(&msg,NULL,0,0)) {
-    TranslateMessage(&msg);
-    DispatchMessage(&msg); // Deliver message to event handler
-  }
+  for(;;) {
+    while(PeekMessage(&msg,NULL,0,0,PM_REMOVE)) {
+      if(msg.message == WM_QUIT) return 0;
+      if(msg.message == WM_KEYDOWN && msg.wParam == VK_F12 && GetKeyState(VK_CONTROL) < 0) TraceDump(tracePath);
+      if(msg.message == WM_KEYDOWN && msg.wParam == VK_F11 && GetKeyState(VK_CONTROL) < 0) TraceStatsDump(statsPath);
+
+      TranslateMessage(&msg);
+      DispatchMessage(&msg); // Deliver message to event handler
+    }
 
-  return 0;
+    if(!RestoreNextNote()) WaitMessage();
+  }
 }
\ No newline at end of file